@@ -0,0 +1,119 @@
+/**
+ * Aligned and huge page allocator and bump arena definitions
+ */
+
+#if defined(linux)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+
+#include "arena.h"
+
+
+static int huge_pages = HUGE_PAGES_TRANSPARENT;
+
+static const char* huge_page_modes[] = {"none", "transparent", "explicit"};
+
+/**
+ * Sets how the allocations made afterwards use huge pages.
+ */
+void arena_set_huge_pages(int mode) { huge_pages = mode; }
+
+/**
+ * Gets how the allocations use huge pages.
+ */
+int arena_huge_pages(void) { return huge_pages; }
+
+/**
+ * Finds a huge page mode by its name. Returns -1 if the name is not known.
+ */
+int arena_huge_pages_find(const char* name) {
+    for (int i = 0; i < (int)(sizeof(huge_page_modes)/sizeof(huge_page_modes[0])); i++) {
+        if (strcmp(huge_page_modes[i], name) == 0) { return i; }
+    }
+    return -1;
+}
+
+/**
+ * Asks for transparent huge pages for the whole huge pages within [p, p+bytes).
+ */
+static void __advise_huge(void* p, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    uintptr_t start = ((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)p + bytes) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start) { madvise((void*)start, end - start, MADV_HUGEPAGE); }
+#endif
+}
+
+/**
+ * Allocates bytes aligned to ARENA_ALIGNMENT, large ones aligned to a huge
+ * page. Free it with free(). Returns NULL if the memory cannot be allocated.
+ */
+void* arena_aligned_alloc(size_t bytes) {
+    bytes = bytes ? arena_bytes(bytes) : ARENA_ALIGNMENT;
+    if (bytes < HUGE_PAGE_SIZE || huge_pages == HUGE_PAGES_NONE) {
+        return aligned_alloc(ARENA_ALIGNMENT, bytes);
+    }
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void* p = aligned_alloc(HUGE_PAGE_SIZE, bytes);
+    if (p) { __advise_huge(p, bytes); }
+    return p;
+}
+
+/**
+ * Creates an arena of at least size bytes. Returns NULL if it cannot be
+ * mapped.
+ */
+Arena* arena_create(size_t size) {
+    Arena* A = (Arena*)malloc(sizeof(Arena));
+    if (!A) { return NULL; }
+    size = size ? arena_bytes(size) : ARENA_ALIGNMENT;
+    A->base = MAP_FAILED;
+    A->huge = false;
+#ifdef MAP_HUGETLB
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        // only works if enough huge pages are reserved, otherwise this falls
+        // back to normal pages
+        size_t huge_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        A->base = (char*)mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (A->base != MAP_FAILED) { size = huge_size; A->huge = true; }
+    }
+#endif
+    if (A->base == MAP_FAILED) {
+        A->base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (A->base == MAP_FAILED) { free(A); return NULL; }
+        if (huge_pages != HUGE_PAGES_NONE) { __advise_huge(A->base, size); }
+    }
+    A->size = size;
+    A->used = 0;
+    return A;
+}
+
+/**
+ * Unmaps an arena.
+ */
+void arena_free(Arena* A) {
+    munmap(A->base, A->size);
+    free(A);
+}
+
+/**
+ * Allocates bytes aligned to ARENA_ALIGNMENT from an arena. Returns NULL if
+ * the arena does not have enough room left.
+ */
+void* arena_alloc(Arena* A, size_t bytes) {
+    bytes = bytes ? arena_bytes(bytes) : ARENA_ALIGNMENT;
+    size_t offset = atomic_fetch_add(&A->used, bytes);
+    if (offset > A->size || bytes > A->size - offset) {
+        atomic_fetch_sub(&A->used, bytes);
+        return NULL;
+    }
+    return A->base + offset;
+}
@@ -0,0 +1,99 @@
+/**
+ * Declares the aligned and huge page allocators and the bump arenas (which
+ * are defined in arena.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+
+// Alignment of every allocation, a cache line and the widest SIMD vector
+#define ARENA_ALIGNMENT 64
+
+// Size of a (2 MB) huge page, allocations at least this big can use them
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// How the allocations use huge pages (see arena_set_huge_pages())
+#define HUGE_PAGES_NONE        0 // only normal pages
+#define HUGE_PAGES_TRANSPARENT 1 // large allocations are aligned to a huge page and madvise()d for transparent huge pages
+#define HUGE_PAGES_EXPLICIT    2 // arenas are mapped from the reserved huge pages (see /proc/sys/vm/nr_hugepages), falling back to transparent ones
+
+struct _Arena {
+    // A region of memory that allocations are cut from one after the other
+    // and that is only freed as a whole. The pages are only touched by the
+    // threads that use them, so they land on the NUMA node of those threads.
+    char* base;
+    size_t size;
+    _Atomic size_t used; // bytes allocated, every allocation is aligned
+    bool huge;           // if it is mapped from the explicit huge pages
+};
+typedef struct _Arena Arena;
+
+
+/**
+ * Sets how the allocations made afterwards use huge pages, one of the
+ * HUGE_PAGES_* values. The default is HUGE_PAGES_TRANSPARENT.
+ */
+void arena_set_huge_pages(int mode);
+
+/**
+ * Gets how the allocations use huge pages (from arena_set_huge_pages()).
+ */
+int arena_huge_pages(void);
+
+/**
+ * Finds a huge page mode by its name: none, transparent, or explicit. Returns
+ * -1 if the name is not known.
+ */
+int arena_huge_pages_find(const char* name);
+
+/**
+ * Allocates bytes aligned to ARENA_ALIGNMENT (rounding the length up to a
+ * multiple of it). Allocations of at least HUGE_PAGE_SIZE are aligned to a
+ * huge page and use transparent huge pages unless they are turned off (even
+ * with HUGE_PAGES_EXPLICIT, only arenas are mapped from the reserved huge
+ * pages). Free it with free(). Returns NULL if the memory cannot be allocated.
+ */
+void* arena_aligned_alloc(size_t bytes);
+
+/**
+ * Creates an arena of at least size bytes. The memory is mapped (so it starts
+ * as zeros) but not touched. Returns NULL if it cannot be mapped.
+ */
+Arena* arena_create(size_t size);
+
+/**
+ * Unmaps an arena, everything allocated from it is gone.
+ */
+void arena_free(Arena* A);
+
+/**
+ * Allocates bytes aligned to ARENA_ALIGNMENT from an arena. This can be
+ * called by many threads at once. Returns NULL if the arena does not have
+ * enough room left.
+ */
+void* arena_alloc(Arena* A, size_t bytes);
+
+/**
+ * Gets the number of bytes an allocation of bytes takes in an arena, use it to
+ * size an arena for a set of allocations.
+ */
+static inline size_t arena_bytes(size_t bytes) {
+    return (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+/**
+ * Gets the current position of an arena so that everything allocated after it
+ * can be released with arena_release().
+ */
+static inline size_t arena_mark(Arena* A) { return A->used; }
+
+/**
+ * Releases everything allocated from an arena since mark (from arena_mark()),
+ * or everything with a mark of 0. Nothing else may be allocating from it at
+ * the same time.
+ */
+static inline void arena_release(Arena* A, size_t mark) { A->used = mark; }
@@ -0,0 +1,196 @@
+/**
+ * Hierarchical block time-stepping definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "blockstep.h"
+#include "helper_functions.h"
+
+// Number of ticks in a step of the given level
+#define TICKS(level) ((size_t)1 << (BLOCKSTEP_MAX_LEVEL - (level)))
+
+
+/**
+ * Computes the acceleration and jerk of body i from the predicted positions
+ * and velocities of all of the bodies. Body i itself contributes nothing
+ * since both its offset and relative velocity are 0.
+ */
+static void __accel_jerk(const BlockStep* S, const double* m, size_t i,
+                         double* acc, double* jerk) {
+    double xi = S->px[i], yi = S->py[i], zi = S->pz[i];
+    double vxi = S->pvx[i], vyi = S->pvy[i], vzi = S->pvz[i];
+    double ax = 0, ay = 0, az = 0, jx = 0, jy = 0, jz = 0;
+    for (size_t j = 0; j < S->n; j++) {
+        double dx = S->px[j] - xi, dy = S->py[j] - yi, dz = S->pz[j] - zi;
+        double dvx = S->pvx[j] - vxi, dvy = S->pvy[j] - vyi, dvz = S->pvz[j] - vzi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double inv_r = 1 / sqrt(r2);
+        double mr3 = m[j] * inv_r * inv_r * inv_r;
+        double rv = 3 * (dx*dvx + dy*dvy + dz*dvz) / r2;
+        ax += mr3 * dx;
+        ay += mr3 * dy;
+        az += mr3 * dz;
+        jx += mr3 * (dvx - rv*dx);
+        jy += mr3 * (dvy - rv*dy);
+        jz += mr3 * (dvz - rv*dz);
+    }
+    acc[0] = G * ax; acc[1] = G * ay; acc[2] = G * az;
+    jerk[0] = G * jx; jerk[1] = G * jy; jerk[2] = G * jz;
+}
+
+/**
+ * Picks the level whose step is the largest one no more than eta*|a|/|j|.
+ */
+static unsigned char __choose_level(const BlockStep* S, const double* acc,
+                                    const double* jerk) {
+    double a = sqrt(acc[0]*acc[0] + acc[1]*acc[1] + acc[2]*acc[2]);
+    double j = sqrt(jerk[0]*jerk[0] + jerk[1]*jerk[1] + jerk[2]*jerk[2]);
+    double dt = S->eta * a;
+    unsigned char level = 0;
+    while (level < BLOCKSTEP_MAX_LEVEL && ldexp(S->time_step, -level) * j > dt) { level++; }
+    return level;
+}
+
+
+/**
+ * Creates the block time-stepping state for the bodies with a largest step of
+ * time_step, computing the initial accelerations, jerks, and steps of all of
+ * the bodies. Returns NULL if the memory cannot be allocated.
+ */
+BlockStep* blockstep_create(const Bodies* B, double time_step, double eta) {
+    BlockStep* S = (BlockStep*)malloc(sizeof(BlockStep));
+    if (!S) { return NULL; }
+    size_t n = B->n;
+    S->n = n;
+    S->time_step = time_step;
+    S->eta = eta;
+    S->now = 0;
+    S->num_active = 0;
+    S->evaluations = 0;
+    S->t = (size_t*)calloc(n, sizeof(size_t));
+    S->level = (unsigned char*)malloc(n);
+    S->active = (size_t*)malloc(n * sizeof(size_t));
+    S->ax = body_array_alloc(n); S->ay = body_array_alloc(n); S->az = body_array_alloc(n);
+    S->jx = body_array_alloc(n); S->jy = body_array_alloc(n); S->jz = body_array_alloc(n);
+    S->px = body_array_alloc(n); S->py = body_array_alloc(n); S->pz = body_array_alloc(n);
+    S->pvx = body_array_alloc(n); S->pvy = body_array_alloc(n); S->pvz = body_array_alloc(n);
+    if (!S->t || !S->level || !S->active || !S->ax || !S->ay || !S->az ||
+        !S->jx || !S->jy || !S->jz || !S->px || !S->py || !S->pz ||
+        !S->pvx || !S->pvy || !S->pvz) {
+        blockstep_free(S);
+        return NULL;
+    }
+
+    // Every body starts at time 0 so the prediction is just the initial state
+    blockstep_predict(S, B, 0, n);
+    for (size_t i = 0; i < n; i++) {
+        double acc[3], jerk[3];
+        __accel_jerk(S, B->mass, i, acc, jerk);
+        S->ax[i] = acc[0]; S->ay[i] = acc[1]; S->az[i] = acc[2];
+        S->jx[i] = jerk[0]; S->jy[i] = jerk[1]; S->jz[i] = jerk[2];
+        S->level[i] = __choose_level(S, acc, jerk);
+    }
+    return S;
+}
+
+/**
+ * Frees a block time-stepping state.
+ */
+void blockstep_free(BlockStep* S) {
+    free(S->t); free(S->level); free(S->active);
+    free(S->ax); free(S->ay); free(S->az);
+    free(S->jx); free(S->jy); free(S->jz);
+    free(S->px); free(S->py); free(S->pz);
+    free(S->pvx); free(S->pvy); free(S->pvz);
+    free(S);
+}
+
+/**
+ * Moves the clock to the next time that the step of any body ends and finds
+ * the active bodies. Returns the number of active bodies, or 0 once all of the
+ * bodies have reached the end of the current time_step (and the clock starts
+ * over for the next one).
+ */
+size_t blockstep_next(BlockStep* S) {
+    if (S->now == TICKS(0)) {
+        // every step ends at the end of time_step so all bodies are here
+        memset(S->t, 0, S->n * sizeof(size_t));
+        S->now = 0;
+        S->num_active = 0;
+        return 0;
+    }
+    size_t now = TICKS(0);
+    for (size_t i = 0; i < S->n; i++) {
+        size_t end = S->t[i] + TICKS(S->level[i]);
+        if (end < now) { now = end; }
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < S->n; i++) {
+        if (S->t[i] + TICKS(S->level[i]) == now) { S->active[count++] = i; }
+    }
+    S->now = now;
+    S->num_active = count;
+    S->evaluations += count;
+    return count;
+}
+
+/**
+ * Predicts the positions and velocities of bodies i..k-1 at the current time.
+ * All bodies must be predicted before any are updated.
+ */
+void blockstep_predict(BlockStep* S, const Bodies* B, size_t i, size_t k) {
+    double tick = ldexp(S->time_step, -BLOCKSTEP_MAX_LEVEL);
+    for (; i < k; i++) {
+        double dt = (S->now - S->t[i]) * tick;
+        double dt2 = dt*dt/2, dt3 = dt*dt*dt/6;
+        S->px[i] = B->x[i] + B->vx[i]*dt + S->ax[i]*dt2 + S->jx[i]*dt3;
+        S->py[i] = B->y[i] + B->vy[i]*dt + S->ay[i]*dt2 + S->jy[i]*dt3;
+        S->pz[i] = B->z[i] + B->vz[i]*dt + S->az[i]*dt2 + S->jz[i]*dt3;
+        S->pvx[i] = B->vx[i] + S->ax[i]*dt + S->jx[i]*dt2;
+        S->pvy[i] = B->vy[i] + S->ay[i]*dt + S->jy[i]*dt2;
+        S->pvz[i] = B->vz[i] + S->az[i]*dt + S->jz[i]*dt2;
+    }
+}
+
+/**
+ * Computes the accelerations and jerks of the active bodies a..b-1 (indices
+ * into the active list) from the predicted state, corrects their positions
+ * and velocities, and picks their next steps. Only the state of those bodies
+ * is written so different ranges can be updated concurrently.
+ */
+void blockstep_update(BlockStep* S, Bodies* B, size_t a, size_t b) {
+    double tick = ldexp(S->time_step, -BLOCKSTEP_MAX_LEVEL);
+    for (; a < b; a++) {
+        size_t i = S->active[a];
+        double acc[3], jerk[3];
+        __accel_jerk(S, B->mass, i, acc, jerk);
+
+        // Hermite corrector: the 2nd and 3rd derivatives of the acceleration
+        // that fit the old and new accelerations and jerks
+        double dt = (S->now - S->t[i]) * tick;
+        double a0[3] = {S->ax[i], S->ay[i], S->az[i]}, j0[3] = {S->jx[i], S->jy[i], S->jz[i]};
+        double p[3] = {S->px[i], S->py[i], S->pz[i]}, pv[3] = {S->pvx[i], S->pvy[i], S->pvz[i]};
+        for (int d = 0; d < 3; d++) {
+            double snap = (-6*(a0[d] - acc[d]) - dt*(4*j0[d] + 2*jerk[d])) / (dt*dt);
+            double crackle = (12*(a0[d] - acc[d]) + 6*dt*(j0[d] + jerk[d])) / (dt*dt*dt);
+            p[d] += snap*dt*dt*dt*dt/24 + crackle*dt*dt*dt*dt*dt/120;
+            pv[d] += snap*dt*dt*dt/6 + crackle*dt*dt*dt*dt/24;
+        }
+        B->x[i] = p[0]; B->y[i] = p[1]; B->z[i] = p[2];
+        B->vx[i] = pv[0]; B->vy[i] = pv[1]; B->vz[i] = pv[2];
+        S->ax[i] = acc[0]; S->ay[i] = acc[1]; S->az[i] = acc[2];
+        S->jx[i] = jerk[0]; S->jy[i] = jerk[1]; S->jz[i] = jerk[2];
+        S->t[i] = S->now;
+
+        // A smaller step always lines up with now but a larger one must start
+        // at a multiple of its length, so steps only grow by 2x at a time
+        unsigned char level = __choose_level(S, acc, jerk), old = S->level[i];
+        if (level < old) {
+            level = S->now % TICKS(old - 1) == 0 ? old - 1 : old;
+        }
+        S->level[i] = level;
+    }
+}
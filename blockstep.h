@@ -0,0 +1,76 @@
+/**
+ * Declares the hierarchical block time-stepping integrator (which is defined
+ * in blockstep.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "body.h"
+
+
+// The smallest step a body can take is time_step / 2^BLOCKSTEP_MAX_LEVEL
+#define BLOCKSTEP_MAX_LEVEL 20
+
+// Default accuracy parameter, each body steps about eta*|a|/|jerk|
+#define BLOCKSTEP_DEFAULT_ETA 0.02
+
+struct _BlockStep {
+    // Every body has its own step of time_step / 2^level and is integrated
+    // with a 4th order Hermite predictor-corrector. Times are counted in
+    // integer ticks of the smallest step from the start of the current
+    // time_step, so the steps of all bodies line up at the end of every
+    // time_step. On each substep only the "active" bodies whose step ends at
+    // the current time have their accelerations computed, from the positions
+    // of all bodies predicted to that time.
+    size_t n;
+    double time_step, eta;
+    size_t now;             // current time (in ticks)
+    size_t* t;              // time of the state of each body (in ticks)
+    unsigned char* level;   // the step of each body is time_step / 2^level
+    double *ax, *ay, *az;   // acceleration at t
+    double *jx, *jy, *jz;   // jerk (derivative of acceleration) at t
+    double *px, *py, *pz;   // positions predicted to now
+    double *pvx, *pvy, *pvz; // velocities predicted to now
+    size_t* active;         // the bodies whose step ends at now
+    size_t num_active;
+    size_t evaluations;     // total number of body force evaluations
+};
+typedef struct _BlockStep BlockStep;
+
+
+/**
+ * Creates the block time-stepping state for the bodies with a largest step of
+ * time_step, computing the initial accelerations, jerks, and steps of all of
+ * the bodies. Returns NULL if the memory cannot be allocated.
+ */
+BlockStep* blockstep_create(const Bodies* B, double time_step, double eta);
+
+/**
+ * Frees a block time-stepping state.
+ */
+void blockstep_free(BlockStep* S);
+
+/**
+ * Moves the clock to the next time that the step of any body ends and finds
+ * the active bodies. Returns the number of active bodies, or 0 once all of the
+ * bodies have reached the end of the current time_step (and the clock starts
+ * over for the next one).
+ */
+size_t blockstep_next(BlockStep* S);
+
+/**
+ * Predicts the positions and velocities of bodies i..k-1 at the current time.
+ * All bodies must be predicted before any are updated.
+ */
+void blockstep_predict(BlockStep* S, const Bodies* B, size_t i, size_t k);
+
+/**
+ * Computes the accelerations and jerks of the active bodies a..b-1 (indices
+ * into the active list) from the predicted state, corrects their positions
+ * and velocities, and picks their next steps. Only the state of those bodies
+ * is written so different ranges can be updated concurrently.
+ */
+void blockstep_update(BlockStep* S, Bodies* B, size_t a, size_t b);
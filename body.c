@@ -0,0 +1,840 @@
+/**
+ * Body state and pairwise force kernel definitions
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <unistd.h>
+
+#include "body.h"
+#include "helper_functions.h"
+
+#if BODY_SIMD_WIDTH > 1
+#include <immintrin.h>
+#endif
+
+
+//////////////////// Body Creation Functions ////////////////////
+
+// Number of arrays of doubles in a Bodies object
+#define BODY_ARRAYS 13
+
+/**
+ * Allocates an array of n doubles aligned to BODY_ALIGNMENT. The length is
+ * rounded up to a multiple of BODY_SIMD_WIDTH. Free it with free().
+ */
+double* body_array_alloc(size_t n) {
+    return (double*)arena_aligned_alloc(body_array_bytes(n));
+}
+
+/**
+ * Gets the bytes of an array of n doubles from body_array_alloc().
+ */
+size_t body_array_bytes(size_t n) {
+    size_t count = (n + BODY_SIMD_WIDTH - 1) / BODY_SIMD_WIDTH * BODY_SIMD_WIDTH;
+    return arena_bytes(count * sizeof(double));
+}
+
+/**
+ * Same as body_array_alloc() but the array is allocated from an arena. Returns
+ * NULL if the arena does not have enough room left.
+ */
+double* body_array_arena(Arena* A, size_t n) {
+    return (double*)arena_alloc(A, body_array_bytes(n));
+}
+
+/**
+ * Creates the state for n bodies. The data is NOT initialized. Returns NULL if
+ * the memory cannot be allocated.
+ */
+Bodies* bodies_create(size_t n) {
+    Bodies* B = (Bodies*)malloc(sizeof(Bodies));
+    if (!B) { return NULL; }
+    B->n = n;
+    B->fx = B->fy = B->fz = B->fgm = NULL;
+    B->order = NULL;
+    B->arena = NULL;
+    if (arena_huge_pages() == HUGE_PAGES_EXPLICIT) {
+        // only an arena is mapped from the reserved huge pages
+        B->arena = arena_create(BODY_ARRAYS * body_array_bytes(n));
+        if (!B->arena) { free(B); return NULL; }
+    }
+    double** arrays[BODY_ARRAYS] = {
+        &B->x, &B->y, &B->z, &B->vx, &B->vy, &B->vz, &B->mass,
+        &B->next_x, &B->next_y, &B->next_z, &B->next_vx, &B->next_vy, &B->next_vz,
+    };
+    for (size_t a = 0; a < BODY_ARRAYS; a++) {
+        *arrays[a] = B->arena ? body_array_arena(B->arena, n) : body_array_alloc(n);
+    }
+    if (!B->x || !B->y || !B->z || !B->vx || !B->vy || !B->vz || !B->mass ||
+        !B->next_x || !B->next_y || !B->next_z ||
+        !B->next_vx || !B->next_vy || !B->next_vz) {
+        bodies_free(B);
+        return NULL;
+    }
+    return B;
+}
+
+/**
+ * Creates the state for the bodies described by an n-by-7 input matrix with
+ * the columns mass, x, y, z, vx, vy, vz.
+ */
+Bodies* bodies_from_input(const Matrix* input) {
+    Bodies* B = bodies_create(input->rows);
+    if (!B) { return NULL; }
+    bodies_unpack(B, input, 0, B->n);
+    return B;
+}
+
+/**
+ * Copies bodies i..k-1 from an n-by-7 input matrix (like bodies_from_input())
+ * into a Bodies object from bodies_create(). The back buffers are filled in
+ * as well so every page of the bodies is first touched here.
+ */
+void bodies_unpack(Bodies* B, const Matrix* input, size_t i, size_t k) {
+    size_t icols = input->cols;
+    for (; i < k; i++) {
+        const double* row = &input->data[i*icols];
+        B->mass[i] = row[0];
+        B->x[i] = B->next_x[i] = row[1];
+        B->y[i] = B->next_y[i] = row[2];
+        B->z[i] = B->next_z[i] = row[3];
+        B->vx[i] = B->next_vx[i] = row[4];
+        B->vy[i] = B->next_vy[i] = row[5];
+        B->vz[i] = B->next_vz[i] = row[6];
+    }
+}
+
+/**
+ * Frees a Bodies object and all of its arrays.
+ */
+void bodies_free(Bodies* B) {
+    if (B->arena) {
+        arena_free(B->arena);
+    } else {
+        free(B->x); free(B->y); free(B->z);
+        free(B->vx); free(B->vy); free(B->vz);
+        free(B->mass);
+        free(B->next_x); free(B->next_y); free(B->next_z);
+        free(B->next_vx); free(B->next_vy); free(B->next_vz);
+    }
+    free(B->fx); free(B->fy); free(B->fz); free(B->fgm);
+    free(B->order);
+    free(B);
+}
+
+/**
+ * Copies the positions of all of the bodies into a row of output as x, y, z
+ * triples in the input order of the bodies. The row must have space for 3n
+ * values.
+ */
+void bodies_save_position(double* row, const Bodies* B) {
+    if (B->order) {
+        for (size_t i = 0; i < B->n; i++) {
+            double* r = &row[3*B->order[i]];
+            r[0] = B->x[i]; r[1] = B->y[i]; r[2] = B->z[i];
+        }
+        return;
+    }
+    for (size_t i = 0; i < B->n; i++) {
+        row[3*i] = B->x[i];
+        row[3*i+1] = B->y[i];
+        row[3*i+2] = B->z[i];
+    }
+}
+
+/**
+ * Makes the next state the current state by swapping the pointers of the
+ * current and back buffers. No data is copied.
+ */
+void bodies_swap(Bodies* B) {
+    double* tmp;
+    tmp = B->x; B->x = B->next_x; B->next_x = tmp;
+    tmp = B->y; B->y = B->next_y; B->next_y = tmp;
+    tmp = B->z; B->z = B->next_z; B->next_z = tmp;
+    tmp = B->vx; B->vx = B->next_vx; B->next_vx = tmp;
+    tmp = B->vy; B->vy = B->next_vy; B->next_vy = tmp;
+    tmp = B->vz; B->vz = B->next_vz; B->next_vz = tmp;
+}
+
+
+//////////////////// Checkpoint Functions ////////////////////
+
+// Number of columns in a checkpoint, and with the order of the bodies
+#define CHECKPOINT_COLS 10
+#define CHECKPOINT_ORDER_COLS 11
+
+/**
+ * Saves the full state of a run to a NPY file with n+1 rows of 10 columns
+ * (11 with the position in memory of every body if they were reordered).
+ * The first row has the step, outputs, time step, and has_accel of the
+ * checkpoint and the number of bodies, then there is a row per body (in the
+ * input order) with the mass, x, y, z, vx, vy, vz (like the input) and ax, ay,
+ * az. The accelerations are only saved if has_accel is true (otherwise they
+ * may be NULL) since the integrators which reuse them need them to continue.
+ * The file is written to a temporary file, synced, and renamed over path so
+ * there is always one complete checkpoint. Returns false if it cannot be
+ * written.
+ */
+bool bodies_save_checkpoint(const char* path, const Bodies* B,
+                            const double* ax, const double* ay,
+                            const double* az, const Checkpoint* info) {
+    size_t cols = B->order ? CHECKPOINT_ORDER_COLS : CHECKPOINT_COLS;
+    Matrix* C = matrix_zeros(B->n + 1, cols);
+    if (!C) { return false; }
+    C->data[0] = info->step;
+    C->data[1] = info->outputs;
+    C->data[2] = info->time_step;
+    C->data[3] = info->has_accel;
+    C->data[4] = B->n;
+    for (size_t i = 0; i < B->n; i++) {
+        double* row = &C->data[((B->order ? B->order[i] : i)+1)*cols];
+        row[0] = B->mass[i];
+        row[1] = B->x[i]; row[2] = B->y[i]; row[3] = B->z[i];
+        row[4] = B->vx[i]; row[5] = B->vy[i]; row[6] = B->vz[i];
+        if (info->has_accel) { row[7] = ax[i]; row[8] = ay[i]; row[9] = az[i]; }
+        if (B->order) { row[10] = i; }
+    }
+
+    // write everything to the temporary file before it replaces the old one
+    size_t len = strlen(path);
+    char* tmp = (char*)malloc(len + 5);
+    if (!tmp) { matrix_free(C); return false; }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    FILE* f = fopen(tmp, "wb");
+    bool ok = f && matrix_to_npy(f, C) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f) { ok = fclose(f) == 0 && ok; }
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) { remove(tmp); }
+    free(tmp);
+    matrix_free(C);
+    return ok;
+}
+
+/**
+ * Creates the state of the bodies from a checkpoint matrix (as loaded with
+ * matrix_from_npy_path()) and fills in info, restoring the order of the
+ * bodies if it was saved. Returns NULL if it is not a checkpoint or the memory
+ * cannot be allocated.
+ */
+Bodies* bodies_from_checkpoint(const Matrix* C, Checkpoint* info) {
+    if ((C->cols != CHECKPOINT_COLS && C->cols != CHECKPOINT_ORDER_COLS) ||
+        C->data[4] != C->rows - 1) { return NULL; }
+    Bodies* B = bodies_create(C->rows - 1);
+    if (!B) { return NULL; }
+    info->step = (size_t)C->data[0];
+    info->outputs = (size_t)C->data[1];
+    info->time_step = C->data[2];
+    info->has_accel = C->data[3] != 0;
+    if (C->cols == CHECKPOINT_ORDER_COLS) {
+        // SIZE_MAX marks the places no body was put in yet
+        B->order = (size_t*)malloc(B->n * sizeof(size_t));
+        if (!B->order) { bodies_free(B); return NULL; }
+        memset(B->order, 0xFF, B->n * sizeof(size_t));
+    }
+    for (size_t k = 0; k < B->n; k++) {
+        const double* row = &C->data[(k+1)*C->cols];
+        size_t i = k;
+        if (B->order) {
+            // every body must have its own place
+            if (!(row[10] >= 0 && row[10] < B->n) || B->order[(size_t)row[10]] != SIZE_MAX) {
+                bodies_free(B);
+                return NULL;
+            }
+            i = (size_t)row[10];
+            B->order[i] = k;
+        }
+        B->mass[i] = row[0];
+        B->x[i] = row[1]; B->y[i] = row[2]; B->z[i] = row[3];
+        B->vx[i] = row[4]; B->vy[i] = row[5]; B->vz[i] = row[6];
+    }
+    return B;
+}
+
+/**
+ * Copies the accelerations saved in a checkpoint matrix into ax, ay, and az
+ * (in the order of the bodies from bodies_from_checkpoint()).
+ */
+void bodies_checkpoint_accel(const Matrix* C, double* ax, double* ay, double* az) {
+    for (size_t k = 0; k < C->rows - 1; k++) {
+        const double* row = &C->data[(k+1)*C->cols];
+        size_t i = C->cols == CHECKPOINT_ORDER_COLS ? (size_t)row[10] : k;
+        ax[i] = row[7]; ay[i] = row[8]; az[i] = row[9];
+    }
+}
+
+
+//////////////////// Force Kernels ////////////////////
+// All of the kernels compute the acceleration G*m_j*d/|d|^3 where d is the
+// softened displacement from body i to body j. Rather than a divide for the
+// force and then a divide by the square root for the direction, 1/|d|^3 is
+// computed once per pair. With AVX-512 this starts from the hardware rsqrt
+// estimate and is refined with two Newton-Raphson steps, with AVX2 it is a
+// single divide of the cube.
+
+#if defined(__AVX512F__)
+
+/**
+ * Computes 1/r2^(1/2) for 8 squared distances.
+ */
+static inline __m512d __inv_sqrt_pd(__m512d r2) {
+    const __m512d half = _mm512_set1_pd(0.5), three_halves = _mm512_set1_pd(1.5);
+    __m512d y = _mm512_rsqrt14_pd(r2);
+    __m512d hr2 = _mm512_mul_pd(half, r2);
+    y = _mm512_mul_pd(y, _mm512_fnmadd_pd(hr2, _mm512_mul_pd(y, y), three_halves));
+    return _mm512_mul_pd(y, _mm512_fnmadd_pd(hr2, _mm512_mul_pd(y, y), three_halves));
+}
+
+/**
+ * Computes 1/r2^(3/2) for 8 squared distances.
+ */
+static inline __m512d __inv_cube_pd(__m512d r2) {
+    __m512d y = __inv_sqrt_pd(r2);
+    return _mm512_mul_pd(_mm512_mul_pd(y, y), y);
+}
+
+void accumulate_accel(double xi, double yi, double zi,
+                      const double* x, const double* y, const double* z,
+                      const double* m, size_t count, double* acc) {
+    const __m512d vxi = _mm512_set1_pd(xi), vyi = _mm512_set1_pd(yi), vzi = _mm512_set1_pd(zi);
+    const __m512d soft = _mm512_set1_pd(SOFTENING);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+    for (size_t j = 0; j < count; j += 8) {
+        __mmask8 mask = count - j >= 8 ? 0xFF : (__mmask8)((1u << (count - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x+j), vxi);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, y+j), vyi);
+        __m512d dz = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, z+j), vzi);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, soft)));
+        __m512d s = _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, m+j), __inv_cube_pd(r2));
+        ax = _mm512_fmadd_pd(s, dx, ax);
+        ay = _mm512_fmadd_pd(s, dy, ay);
+        az = _mm512_fmadd_pd(s, dz, az);
+    }
+    acc[0] += G * _mm512_reduce_add_pd(ax);
+    acc[1] += G * _mm512_reduce_add_pd(ay);
+    acc[2] += G * _mm512_reduce_add_pd(az);
+}
+
+void accumulate_accel_potential(double xi, double yi, double zi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* acc,
+                                double* phi) {
+    const __m512d vxi = _mm512_set1_pd(xi), vyi = _mm512_set1_pd(yi), vzi = _mm512_set1_pd(zi);
+    const __m512d soft = _mm512_set1_pd(SOFTENING);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+    __m512d p = _mm512_setzero_pd();
+    for (size_t j = 0; j < count; j += 8) {
+        __mmask8 mask = count - j >= 8 ? 0xFF : (__mmask8)((1u << (count - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x+j), vxi);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, y+j), vyi);
+        __m512d dz = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, z+j), vzi);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, soft)));
+        __m512d mj = _mm512_maskz_loadu_pd(mask, m+j), inv = __inv_sqrt_pd(r2);
+        __m512d s = _mm512_mul_pd(mj, _mm512_mul_pd(_mm512_mul_pd(inv, inv), inv));
+        ax = _mm512_fmadd_pd(s, dx, ax);
+        ay = _mm512_fmadd_pd(s, dy, ay);
+        az = _mm512_fmadd_pd(s, dz, az);
+        __mmask8 other = _mm512_mask_cmp_pd_mask(mask, r2, soft, _CMP_NEQ_UQ);
+        p = _mm512_mask3_fmadd_pd(mj, inv, p, other);
+    }
+    acc[0] += G * _mm512_reduce_add_pd(ax);
+    acc[1] += G * _mm512_reduce_add_pd(ay);
+    acc[2] += G * _mm512_reduce_add_pd(az);
+    *phi += _mm512_reduce_add_pd(p);
+}
+
+void accumulate_accel_symmetric(double xi, double yi, double zi, double mi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* ax,
+                                double* ay, double* az, double* acc) {
+    const __m512d vxi = _mm512_set1_pd(xi), vyi = _mm512_set1_pd(yi), vzi = _mm512_set1_pd(zi);
+    const __m512d soft = _mm512_set1_pd(SOFTENING), gmi = _mm512_set1_pd(G * mi);
+    __m512d sx = _mm512_setzero_pd(), sy = _mm512_setzero_pd(), sz = _mm512_setzero_pd();
+    for (size_t j = 0; j < count; j += 8) {
+        __mmask8 mask = count - j >= 8 ? 0xFF : (__mmask8)((1u << (count - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x+j), vxi);
+        __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, y+j), vyi);
+        __m512d dz = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, z+j), vzi);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, soft)));
+        __m512d inv = __inv_cube_pd(r2);
+        __m512d s = _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, m+j), inv);
+        __m512d r = _mm512_mul_pd(gmi, inv);
+        sx = _mm512_fmadd_pd(s, dx, sx);
+        sy = _mm512_fmadd_pd(s, dy, sy);
+        sz = _mm512_fmadd_pd(s, dz, sz);
+        _mm512_mask_storeu_pd(ax+j, mask, _mm512_fnmadd_pd(r, dx, _mm512_maskz_loadu_pd(mask, ax+j)));
+        _mm512_mask_storeu_pd(ay+j, mask, _mm512_fnmadd_pd(r, dy, _mm512_maskz_loadu_pd(mask, ay+j)));
+        _mm512_mask_storeu_pd(az+j, mask, _mm512_fnmadd_pd(r, dz, _mm512_maskz_loadu_pd(mask, az+j)));
+    }
+    acc[0] += G * _mm512_reduce_add_pd(sx);
+    acc[1] += G * _mm512_reduce_add_pd(sy);
+    acc[2] += G * _mm512_reduce_add_pd(sz);
+}
+
+#elif BODY_SIMD_WIDTH == 4
+
+/**
+ * Computes 1/r2^(3/2) for 4 squared distances.
+ */
+static inline __m256d __inv_cube_pd(__m256d r2) {
+    return _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(r2, _mm256_sqrt_pd(r2)));
+}
+
+/**
+ * Adds the 4 values of a register together.
+ */
+static inline double __hsum_pd(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+void accumulate_accel(double xi, double yi, double zi,
+                      const double* x, const double* y, const double* z,
+                      const double* m, size_t count, double* acc) {
+    const __m256d vxi = _mm256_set1_pd(xi), vyi = _mm256_set1_pd(yi), vzi = _mm256_set1_pd(zi);
+    const __m256d soft = _mm256_set1_pd(SOFTENING);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x+j), vxi);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y+j), vyi);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z+j), vzi);
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, soft)));
+        __m256d s = _mm256_mul_pd(_mm256_loadu_pd(m+j), __inv_cube_pd(r2));
+        ax = _mm256_fmadd_pd(s, dx, ax);
+        ay = _mm256_fmadd_pd(s, dy, ay);
+        az = _mm256_fmadd_pd(s, dz, az);
+    }
+    double sx = __hsum_pd(ax), sy = __hsum_pd(ay), sz = __hsum_pd(az);
+    for (; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double s = m[j] / (r2 * sqrt(r2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+}
+
+void accumulate_accel_potential(double xi, double yi, double zi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* acc,
+                                double* phi) {
+    const __m256d vxi = _mm256_set1_pd(xi), vyi = _mm256_set1_pd(yi), vzi = _mm256_set1_pd(zi);
+    const __m256d soft = _mm256_set1_pd(SOFTENING);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+    __m256d p = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x+j), vxi);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y+j), vyi);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z+j), vzi);
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, soft)));
+        __m256d mj = _mm256_loadu_pd(m+j), inv = __inv_cube_pd(r2);
+        __m256d s = _mm256_mul_pd(mj, inv);
+        ax = _mm256_fmadd_pd(s, dx, ax);
+        ay = _mm256_fmadd_pd(s, dy, ay);
+        az = _mm256_fmadd_pd(s, dz, az);
+        // r2/r2^(3/2) is 1/r, the body itself is left out
+        __m256d other = _mm256_cmp_pd(r2, soft, _CMP_NEQ_UQ);
+        p = _mm256_add_pd(p, _mm256_and_pd(other, _mm256_mul_pd(s, r2)));
+    }
+    double sx = __hsum_pd(ax), sy = __hsum_pd(ay), sz = __hsum_pd(az), sp = __hsum_pd(p);
+    for (; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double s = m[j] / (r2 * sqrt(r2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+        if (r2 != SOFTENING) { sp += s * r2; }
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+    *phi += sp;
+}
+
+void accumulate_accel_symmetric(double xi, double yi, double zi, double mi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* ax,
+                                double* ay, double* az, double* acc) {
+    const double gmi = G * mi;
+    const __m256d vxi = _mm256_set1_pd(xi), vyi = _mm256_set1_pd(yi), vzi = _mm256_set1_pd(zi);
+    const __m256d soft = _mm256_set1_pd(SOFTENING), vgmi = _mm256_set1_pd(gmi);
+    __m256d vsx = _mm256_setzero_pd(), vsy = _mm256_setzero_pd(), vsz = _mm256_setzero_pd();
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x+j), vxi);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y+j), vyi);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z+j), vzi);
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, soft)));
+        __m256d inv = __inv_cube_pd(r2);
+        __m256d s = _mm256_mul_pd(_mm256_loadu_pd(m+j), inv);
+        __m256d r = _mm256_mul_pd(vgmi, inv);
+        vsx = _mm256_fmadd_pd(s, dx, vsx);
+        vsy = _mm256_fmadd_pd(s, dy, vsy);
+        vsz = _mm256_fmadd_pd(s, dz, vsz);
+        _mm256_storeu_pd(ax+j, _mm256_fnmadd_pd(r, dx, _mm256_loadu_pd(ax+j)));
+        _mm256_storeu_pd(ay+j, _mm256_fnmadd_pd(r, dy, _mm256_loadu_pd(ay+j)));
+        _mm256_storeu_pd(az+j, _mm256_fnmadd_pd(r, dz, _mm256_loadu_pd(az+j)));
+    }
+    double sx = __hsum_pd(vsx), sy = __hsum_pd(vsy), sz = __hsum_pd(vsz);
+    for (; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double inv = 1.0 / (r2 * sqrt(r2));
+        double s = m[j] * inv, r = gmi * inv;
+        sx += s * dx; sy += s * dy; sz += s * dz;
+        ax[j] -= r * dx; ay[j] -= r * dy; az[j] -= r * dz;
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+}
+
+#else
+
+void accumulate_accel(double xi, double yi, double zi,
+                      const double* x, const double* y, const double* z,
+                      const double* m, size_t count, double* acc) {
+    double sx = 0, sy = 0, sz = 0;
+    for (size_t j = 0; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double s = m[j] / (r2 * sqrt(r2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+}
+
+void accumulate_accel_potential(double xi, double yi, double zi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* acc,
+                                double* phi) {
+    double sx = 0, sy = 0, sz = 0, sp = 0;
+    for (size_t j = 0; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double s = m[j] / (r2 * sqrt(r2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+        if (r2 != SOFTENING) { sp += s * r2; }
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+    *phi += sp;
+}
+
+void accumulate_accel_symmetric(double xi, double yi, double zi, double mi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* ax,
+                                double* ay, double* az, double* acc) {
+    const double gmi = G * mi;
+    double sx = 0, sy = 0, sz = 0;
+    for (size_t j = 0; j < count; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+        double inv = 1.0 / (r2 * sqrt(r2));
+        double s = m[j] * inv, r = gmi * inv;
+        sx += s * dx; sy += s * dy; sz += s * dz;
+        ax[j] -= r * dx; ay[j] -= r * dy; az[j] -= r * dz;
+    }
+    acc[0] += G * sx;
+    acc[1] += G * sy;
+    acc[2] += G * sz;
+}
+
+#endif
+
+/**
+ * Accumulates into acc[0..2] the acceleration of body i due to bodies j..k-1.
+ */
+void bodies_accumulate_accel(const Bodies* B, size_t i, size_t j, size_t k,
+                             double* acc) {
+    accumulate_accel(B->x[i], B->y[i], B->z[i],
+                     B->x+j, B->y+j, B->z+j, B->mass+j, k-j, acc);
+}
+
+/**
+ * Same as bodies_accumulate_accel() but also adds the sum of m_j/r over
+ * bodies j..k-1 (except body i) to phi.
+ */
+void bodies_accumulate_accel_potential(const Bodies* B, size_t i, size_t j,
+                                       size_t k, double* acc, double* phi) {
+    accumulate_accel_potential(B->x[i], B->y[i], B->z[i],
+                               B->x+j, B->y+j, B->z+j, B->mass+j, k-j, acc, phi);
+}
+
+/**
+ * Uses Newton's 3rd law to compute the interactions between body i and bodies
+ * j..k-1 only once, adding to the entries of both bodies of each pair.
+ */
+void bodies_accumulate_accel_symmetric(const Bodies* B, size_t i, size_t j,
+                                       size_t k, double* ax, double* ay,
+                                       double* az) {
+    double acc[3] = {0, 0, 0};
+    accumulate_accel_symmetric(B->x[i], B->y[i], B->z[i], B->mass[i],
+                               B->x+j, B->y+j, B->z+j, B->mass+j, k-j,
+                               ax+j, ay+j, az+j, acc);
+    ax[i] += acc[0];
+    ay[i] += acc[1];
+    az[i] += acc[2];
+}
+
+
+//////////////////// Mixed Precision Functions ////////////////////
+// The mixed precision kernels subtract, square, and take the reciprocal
+// square root of the positions in single precision, so twice as many pairs fit
+// in a SIMD register and half as many bytes are streamed per source body. The
+// positions are made relative to the center of the current bounding box in
+// double precision and scaled (by a power of 2, so exactly) to be about 1
+// before they are rounded, so they keep their resolution however far the
+// bodies drift and their squares and cubes stay in the range of a float even
+// for galaxy-sized systems. The softening is well below the resolution of the
+// scaled positions so it is left out and coincident bodies are skipped
+// instead. The products are summed in single precision with Kahan
+// compensation over blocks of a few hundred sources, then the compensated
+// block sums are added to double precision sums so the error does not grow
+// with the number of bodies.
+
+/**
+ * Allocates an array of n floats aligned to BODY_ALIGNMENT. The length is
+ * rounded up to a multiple of 2*BODY_SIMD_WIDTH. Free it with free().
+ */
+static float* __float_array_alloc(size_t n) {
+    size_t count = (n + 2*BODY_SIMD_WIDTH - 1) / (2*BODY_SIMD_WIDTH) * (2*BODY_SIMD_WIDTH);
+    return (float*)arena_aligned_alloc(count * sizeof(float));
+}
+
+/**
+ * Allocates the single precision copies of the bodies and picks their origin
+ * and scale with bodies_center_mixed(). The copies are filled with
+ * bodies_pack_mixed(). Returns false if the memory cannot be allocated.
+ */
+bool bodies_enable_mixed(Bodies* B) {
+    B->fx = __float_array_alloc(B->n);
+    B->fy = __float_array_alloc(B->n);
+    B->fz = __float_array_alloc(B->n);
+    B->fgm = __float_array_alloc(B->n);
+    if (!B->fx || !B->fy || !B->fz || !B->fgm) { return false; }
+    bodies_center_mixed(B);
+    return true;
+}
+
+/**
+ * Picks the origin and scale of the single precision copies from the current
+ * positions: the center and half the width of the bounding box.
+ */
+void bodies_center_mixed(Bodies* B) {
+    const double* pos[3] = {B->x, B->y, B->z};
+    double half_width = 0;
+    for (int d = 0; d < 3; d++) {
+        double lo = pos[d][0], hi = pos[d][0];
+        for (size_t i = 1; i < B->n; i++) {
+            if (pos[d][i] < lo) { lo = pos[d][i]; }
+            if (pos[d][i] > hi) { hi = pos[d][i]; }
+        }
+        B->origin[d] = (lo + hi) / 2;
+        if ((hi - lo) / 2 > half_width) { half_width = (hi - lo) / 2; }
+    }
+    B->scale = half_width > 0 ? exp2(ceil(log2(half_width))) : 1;
+}
+
+/**
+ * Updates the single precision copies of bodies i..k-1 from their current
+ * positions, relative to the origin in double precision and then rounded.
+ */
+void bodies_pack_mixed(Bodies* B, size_t i, size_t k) {
+    double inv_scale = 1 / B->scale, gm_scale = G * inv_scale * inv_scale;
+    for (; i < k; i++) {
+        B->fx[i] = (float)((B->x[i] - B->origin[0]) * inv_scale);
+        B->fy[i] = (float)((B->y[i] - B->origin[1]) * inv_scale);
+        B->fz[i] = (float)((B->z[i] - B->origin[2]) * inv_scale);
+        B->fgm[i] = (float)(B->mass[i] * gm_scale);
+    }
+}
+
+// Number of sources whose products are summed (with compensation) in single
+// precision before being added to the double precision sums
+#define MIXED_BLOCK 256
+
+#if defined(__AVX512F__)
+
+/**
+ * Computes 1/r2^(3/2) for 16 squared distances. One Newton-Raphson step takes
+ * the 14-bit rsqrt estimate to nearly full single precision.
+ */
+static inline __m512 __inv_cube_ps(__m512 r2) {
+    const __m512 half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+    __m512 y = _mm512_rsqrt14_ps(r2);
+    y = _mm512_mul_ps(y, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(y, y), three_halves));
+    return _mm512_mul_ps(_mm512_mul_ps(y, y), y);
+}
+
+/**
+ * Adds the product a*b to the 16 Kahan sums in sum with their compensations in
+ * c (the low order bits lost so far, to be subtracted).
+ */
+static inline void __kahan_fmadd_ps(__m512 a, __m512 b, __m512* sum, __m512* c) {
+    __m512 y = _mm512_fmsub_ps(a, b, *c);
+    __m512 t = _mm512_add_ps(*sum, y);
+    *c = _mm512_sub_ps(_mm512_sub_ps(t, *sum), y);
+    *sum = t;
+}
+
+/**
+ * Converts the 16 floats of v and of its compensation c to double and adds
+ * v - c to the 8 doubles of lo and hi.
+ */
+static inline void __add_ps_to_pd(__m512 v, __m512 c, __m512d* lo, __m512d* hi) {
+    __m256 vhi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+    __m256 chi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(c), 1));
+    *lo = _mm512_add_pd(*lo, _mm512_sub_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(v)),
+                                           _mm512_cvtps_pd(_mm512_castps512_ps256(c))));
+    *hi = _mm512_add_pd(*hi, _mm512_sub_pd(_mm512_cvtps_pd(vhi), _mm512_cvtps_pd(chi)));
+}
+
+void accumulate_accel_mixed(float xi, float yi, float zi,
+                            const float* x, const float* y, const float* z,
+                            const float* gm, size_t count, double* acc) {
+    const __m512 vxi = _mm512_set1_ps(xi), vyi = _mm512_set1_ps(yi), vzi = _mm512_set1_ps(zi);
+    const __m512 zero = _mm512_setzero_ps();
+    __m512d ax0 = _mm512_setzero_pd(), ay0 = _mm512_setzero_pd(), az0 = _mm512_setzero_pd();
+    __m512d ax1 = _mm512_setzero_pd(), ay1 = _mm512_setzero_pd(), az1 = _mm512_setzero_pd();
+    for (size_t b = 0; b < count; b += MIXED_BLOCK) {
+        size_t end = count - b < MIXED_BLOCK ? count : b + MIXED_BLOCK;
+        __m512 ax = zero, ay = zero, az = zero, cx = zero, cy = zero, cz = zero;
+        for (size_t j = b; j < end; j += 16) {
+            __mmask16 mask = end - j >= 16 ? 0xFFFF : (__mmask16)((1u << (end - j)) - 1);
+            __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x+j), vxi);
+            __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, y+j), vyi);
+            __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, z+j), vzi);
+            __m512 d2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+            __mmask16 live = _mm512_mask_cmp_ps_mask(mask, d2, zero, _CMP_NEQ_UQ);
+            __m512 s = _mm512_maskz_mul_ps(live, _mm512_maskz_loadu_ps(mask, gm+j), __inv_cube_ps(d2));
+            __kahan_fmadd_ps(s, dx, &ax, &cx);
+            __kahan_fmadd_ps(s, dy, &ay, &cy);
+            __kahan_fmadd_ps(s, dz, &az, &cz);
+        }
+        __add_ps_to_pd(ax, cx, &ax0, &ax1);
+        __add_ps_to_pd(ay, cy, &ay0, &ay1);
+        __add_ps_to_pd(az, cz, &az0, &az1);
+    }
+    acc[0] += _mm512_reduce_add_pd(_mm512_add_pd(ax0, ax1));
+    acc[1] += _mm512_reduce_add_pd(_mm512_add_pd(ay0, ay1));
+    acc[2] += _mm512_reduce_add_pd(_mm512_add_pd(az0, az1));
+}
+
+#elif BODY_SIMD_WIDTH == 4
+
+/**
+ * Computes 1/r2^(3/2) for 8 squared distances. One Newton-Raphson step takes
+ * the 12-bit rsqrt estimate to about 22 bits.
+ */
+static inline __m256 __inv_cube_ps(__m256 r2) {
+    const __m256 half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+    __m256 y = _mm256_rsqrt_ps(r2);
+    y = _mm256_mul_ps(y, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(y, y), three_halves));
+    return _mm256_mul_ps(_mm256_mul_ps(y, y), y);
+}
+
+/**
+ * Adds the product a*b to the 8 Kahan sums in sum with their compensations in
+ * c (the low order bits lost so far, to be subtracted).
+ */
+static inline void __kahan_fmadd_ps(__m256 a, __m256 b, __m256* sum, __m256* c) {
+    __m256 y = _mm256_fmsub_ps(a, b, *c);
+    __m256 t = _mm256_add_ps(*sum, y);
+    *c = _mm256_sub_ps(_mm256_sub_ps(t, *sum), y);
+    *sum = t;
+}
+
+/**
+ * Converts the 8 floats of v and of its compensation c to double and adds
+ * v - c to the 4 doubles of lo and hi.
+ */
+static inline void __add_ps_to_pd(__m256 v, __m256 c, __m256d* lo, __m256d* hi) {
+    *lo = _mm256_add_pd(*lo, _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)),
+                                           _mm256_cvtps_pd(_mm256_castps256_ps128(c))));
+    *hi = _mm256_add_pd(*hi, _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)),
+                                           _mm256_cvtps_pd(_mm256_extractf128_ps(c, 1))));
+}
+
+void accumulate_accel_mixed(float xi, float yi, float zi,
+                            const float* x, const float* y, const float* z,
+                            const float* gm, size_t count, double* acc) {
+    const __m256 vxi = _mm256_set1_ps(xi), vyi = _mm256_set1_ps(yi), vzi = _mm256_set1_ps(zi);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256d ax0 = _mm256_setzero_pd(), ay0 = _mm256_setzero_pd(), az0 = _mm256_setzero_pd();
+    __m256d ax1 = _mm256_setzero_pd(), ay1 = _mm256_setzero_pd(), az1 = _mm256_setzero_pd();
+    size_t j = 0;
+    while (j + 8 <= count) {
+        size_t end = count - j < MIXED_BLOCK ? count : j + MIXED_BLOCK;
+        __m256 ax = zero, ay = zero, az = zero, cx = zero, cy = zero, cz = zero;
+        for (; j + 8 <= end; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x+j), vxi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y+j), vyi);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z+j), vzi);
+            __m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+            __m256 live = _mm256_cmp_ps(d2, zero, _CMP_NEQ_UQ);
+            __m256 s = _mm256_and_ps(live, _mm256_mul_ps(_mm256_loadu_ps(gm+j), __inv_cube_ps(d2)));
+            __kahan_fmadd_ps(s, dx, &ax, &cx);
+            __kahan_fmadd_ps(s, dy, &ay, &cy);
+            __kahan_fmadd_ps(s, dz, &az, &cz);
+        }
+        __add_ps_to_pd(ax, cx, &ax0, &ax1);
+        __add_ps_to_pd(ay, cy, &ay0, &ay1);
+        __add_ps_to_pd(az, cz, &az0, &az1);
+    }
+    double sx = __hsum_pd(_mm256_add_pd(ax0, ax1));
+    double sy = __hsum_pd(_mm256_add_pd(ay0, ay1));
+    double sz = __hsum_pd(_mm256_add_pd(az0, az1));
+    for (; j < count; j++) {
+        float dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        float d2 = dx*dx + dy*dy + dz*dz;
+        if (d2 == 0) { continue; }
+        float s = gm[j] / (d2 * sqrtf(d2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+    }
+    acc[0] += sx;
+    acc[1] += sy;
+    acc[2] += sz;
+}
+
+#else
+
+void accumulate_accel_mixed(float xi, float yi, float zi,
+                            const float* x, const float* y, const float* z,
+                            const float* gm, size_t count, double* acc) {
+    double sx = 0, sy = 0, sz = 0;
+    for (size_t j = 0; j < count; j++) {
+        float dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        float d2 = dx*dx + dy*dy + dz*dz;
+        if (d2 == 0) { continue; }
+        float s = gm[j] / (d2 * sqrtf(d2));
+        sx += s * dx; sy += s * dy; sz += s * dz;
+    }
+    acc[0] += sx;
+    acc[1] += sy;
+    acc[2] += sz;
+}
+
+#endif
+
+/**
+ * Accumulates into acc[0..2] the acceleration of body i due to bodies j..k-1
+ * using the mixed precision kernel.
+ */
+void bodies_accumulate_accel_mixed(const Bodies* B, size_t i, size_t j, size_t k,
+                                   double* acc) {
+    accumulate_accel_mixed(B->fx[i], B->fy[i], B->fz[i],
+                           B->fx+j, B->fy+j, B->fz+j, B->fgm+j, k-j, acc);
+}
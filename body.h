@@ -0,0 +1,288 @@
+/**
+ * Declares the body state and pairwise force kernels (which are defined in
+ * body.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "matrix.h"
+
+
+struct _Bodies {
+    // The state of every body stored as a structure-of-arrays so that the
+    // force kernels can load several bodies into a single SIMD register. Every
+    // array is allocated with BODY_ALIGNMENT and padded to a multiple of
+    // BODY_SIMD_WIDTH elements.
+    size_t n;
+    double *x, *y, *z;    // position (in m)
+    double *vx, *vy, *vz; // velocity (in m/s)
+    double* mass;         // mass (in kg)
+    // The next position and velocity are written to these back buffers while
+    // the current state is only read and then bodies_swap() exchanges them.
+    // This way every body of a step sees the same positions.
+    double *next_x, *next_y, *next_z;
+    double *next_vx, *next_vy, *next_vz;
+    // Single precision copies of the positions and G*mass for the mixed
+    // precision kernels (NULL unless bodies_enable_mixed() was called). The
+    // positions are relative to origin and in units of scale (picked again
+    // from the current positions before every full pack), and the masses are
+    // G*mass/scale^2, so the float math stays in range and gives the
+    // acceleration in m/s^2 directly.
+    float *fx, *fy, *fz, *fgm;
+    double origin[3], scale;
+    // The index of each body in the input, NULL if the bodies were never
+    // reordered (see order.h). The output and checkpoints always use the
+    // input order.
+    size_t* order;
+    // The arena all of the arrays above (but not the single precision copies
+    // or the order) are cut from, NULL if each was allocated on its own
+    Arena* arena;
+};
+typedef struct _Bodies Bodies; // make type "struct _Bodies" just "Bodies"
+
+struct _Checkpoint {
+    // Where a run was when a checkpoint was saved
+    size_t step;      // the last step that was completed
+    size_t outputs;   // number of rows of output written by then
+    double time_step; // must be the same to resume
+    bool has_accel;   // if the accelerations at the current positions are saved
+};
+typedef struct _Checkpoint Checkpoint;
+
+// Alignment (in bytes) of every array in a Bodies object, one cache line
+#define BODY_ALIGNMENT ARENA_ALIGNMENT
+
+// Number of doubles processed at a time by the force kernels
+#if defined(__AVX512F__)
+#define BODY_SIMD_WIDTH 8
+#elif defined(__AVX2__) && defined(__FMA__)
+#define BODY_SIMD_WIDTH 4
+#else
+#define BODY_SIMD_WIDTH 1
+#endif
+
+
+//////////////////// Body Creation Functions ////////////////////
+
+/**
+ * Allocates an array of n doubles aligned to BODY_ALIGNMENT. The length is
+ * rounded up to a multiple of BODY_SIMD_WIDTH. Large arrays use huge pages
+ * (see arena_aligned_alloc()). Free it with free().
+ */
+double* body_array_alloc(size_t n);
+
+/**
+ * Gets the bytes of an array of n doubles from body_array_alloc(), to size an
+ * arena for a set of them.
+ */
+size_t body_array_bytes(size_t n);
+
+/**
+ * Same as body_array_alloc() but the array is allocated from an arena. Returns
+ * NULL if the arena does not have enough room left.
+ */
+double* body_array_arena(Arena* A, size_t n);
+
+/**
+ * Creates the state for n bodies. The data is NOT initialized. With
+ * HUGE_PAGES_EXPLICIT (see arena_set_huge_pages()) the arrays are cut from a
+ * single arena so they use the reserved huge pages. Returns NULL if the memory
+ * cannot be allocated.
+ */
+Bodies* bodies_create(size_t n);
+
+/**
+ * Creates the state for the bodies described by an n-by-7 input matrix with
+ * the columns mass, x, y, z, vx, vy, vz.
+ */
+Bodies* bodies_from_input(const Matrix* input);
+
+/**
+ * Copies bodies i..k-1 from an n-by-7 input matrix (like bodies_from_input())
+ * into a Bodies object from bodies_create(). The back buffers are filled in
+ * as well so every page of the bodies is first touched here. Different
+ * ranges can be unpacked by different threads so that each thread's bodies
+ * end up in memory local to it.
+ */
+void bodies_unpack(Bodies* B, const Matrix* input, size_t i, size_t k);
+
+/**
+ * Frees a Bodies object and all of its arrays.
+ */
+void bodies_free(Bodies* B);
+
+/**
+ * Copies the positions of all of the bodies into a row of output as x, y, z
+ * triples in the input order of the bodies. The row must have space for 3n
+ * values.
+ */
+void bodies_save_position(double* row, const Bodies* B);
+
+/**
+ * Makes the next state the current state by swapping the pointers of the
+ * current and back buffers. No data is copied.
+ */
+void bodies_swap(Bodies* B);
+
+/**
+ * Numerically integrates body i over one time step with the given
+ * acceleration, reading the current state and writing the next state.
+ */
+static inline void bodies_integrate(Bodies* B, size_t i, double ax, double ay,
+                                    double az, double time_step) {
+    // Numerically integrate acceleration to get velocity
+    double vx = B->vx[i] + ax * time_step;
+    double vy = B->vy[i] + ay * time_step;
+    double vz = B->vz[i] + az * time_step;
+    B->next_vx[i] = vx;
+    B->next_vy[i] = vy;
+    B->next_vz[i] = vz;
+
+    // Numerically integrate velocity to get position
+    B->next_x[i] = B->x[i] + vx * time_step;
+    B->next_y[i] = B->y[i] + vy * time_step;
+    B->next_z[i] = B->z[i] + vz * time_step;
+}
+
+
+//////////////////// Checkpoint Functions ////////////////////
+
+/**
+ * Saves the full state of a run to a NPY file with n+1 rows of 10 columns.
+ * The first row has the step, outputs, time step, and has_accel of the
+ * checkpoint and the number of bodies, then there is a row per body (in the
+ * input order) with the mass, x, y, z, vx, vy, vz (like the input) and ax, ay,
+ * az. The accelerations are only saved if has_accel is true (otherwise they
+ * may be NULL) since the integrators which reuse them need them to continue.
+ * If the bodies were reordered an 11th column has the position of each body
+ * in memory so the same order is restored (the sums of the forces then add
+ * up in the same order and a resumed run matches one that was not stopped).
+ * The file is written to a temporary file, synced, and renamed over path so
+ * there is always one complete checkpoint. Returns false if it cannot be
+ * written.
+ */
+bool bodies_save_checkpoint(const char* path, const Bodies* B,
+                            const double* ax, const double* ay,
+                            const double* az, const Checkpoint* info);
+
+/**
+ * Creates the state of the bodies from a checkpoint matrix (as loaded with
+ * matrix_from_npy_path()) and fills in info, restoring the order of the
+ * bodies if it was saved. Returns NULL if it is not a checkpoint or the memory
+ * cannot be allocated.
+ */
+Bodies* bodies_from_checkpoint(const Matrix* C, Checkpoint* info);
+
+/**
+ * Copies the accelerations saved in a checkpoint matrix into ax, ay, and az
+ * (in the order of the bodies from bodies_from_checkpoint()).
+ */
+void bodies_checkpoint_accel(const Matrix* C, double* ax, double* ay, double* az);
+
+
+//////////////////// Force Kernels ////////////////////
+
+/**
+ * Accumulates into acc[0..2] the acceleration that count bodies with the
+ * positions x, y, z and masses m exert on a body at (xi, yi, zi). A source
+ * body at the same position as the target contributes nothing due to the
+ * softening, so the target body may be one of the sources.
+ */
+void accumulate_accel(double xi, double yi, double zi,
+                      const double* x, const double* y, const double* z,
+                      const double* m, size_t count, double* acc);
+
+/**
+ * Same as accumulate_accel() but also adds to phi the sum of m/r over the
+ * sources (r being the softened distance) which gives the potential energy of
+ * the pairs. Sources at exactly the same position as the target (such as the
+ * target itself) are left out of phi. The accelerations are exactly the same
+ * as those of accumulate_accel().
+ */
+void accumulate_accel_potential(double xi, double yi, double zi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* acc,
+                                double* phi);
+
+/**
+ * Same as accumulate_accel() but uses Newton's 3rd law to also give the
+ * sources the opposite reaction: the acceleration that the target with mass
+ * mi exerts on source j is added to ax[j], ay[j], and az[j]. The target must
+ * not be one of the sources.
+ */
+void accumulate_accel_symmetric(double xi, double yi, double zi, double mi,
+                                const double* x, const double* y, const double* z,
+                                const double* m, size_t count, double* ax,
+                                double* ay, double* az, double* acc);
+
+/**
+ * Accumulates into acc[0..2] the acceleration of body i due to bodies j..k-1.
+ */
+void bodies_accumulate_accel(const Bodies* B, size_t i, size_t j, size_t k,
+                             double* acc);
+
+/**
+ * Same as bodies_accumulate_accel() but also adds the sum of m_j/r over
+ * bodies j..k-1 (except body i) to phi.
+ */
+void bodies_accumulate_accel_potential(const Bodies* B, size_t i, size_t j,
+                                       size_t k, double* acc, double* phi);
+
+/**
+ * Uses Newton's 3rd law to compute the interactions between body i and bodies
+ * j..k-1 only once. The acceleration of body i is added to ax[i], ay[i], and
+ * az[i] while the opposite reaction is added to the entries for bodies j..k-1.
+ * Body i must not be in j..k-1.
+ */
+void bodies_accumulate_accel_symmetric(const Bodies* B, size_t i, size_t j,
+                                       size_t k, double* ax, double* ay,
+                                       double* az);
+
+
+//////////////////// Mixed Precision Functions ////////////////////
+
+/**
+ * Allocates the single precision copies of the bodies and picks their origin
+ * and scale with bodies_center_mixed(). The copies are filled with
+ * bodies_pack_mixed(). Returns false if the memory cannot be allocated.
+ */
+bool bodies_enable_mixed(Bodies* B);
+
+/**
+ * Picks the origin and scale of the single precision copies from the current
+ * positions (the center of the bounding box and the power of 2 at or above
+ * half its width). This must be done by one thread before the bodies are
+ * packed, so that the rounded positions keep their resolution as the bodies
+ * drift.
+ */
+void bodies_center_mixed(Bodies* B);
+
+/**
+ * Updates the single precision copies of bodies i..k-1 from their current
+ * positions: the offset from the origin is formed in double precision and
+ * only then rounded to single precision. This must be done after the bodies
+ * move (and bodies_center_mixed() is called) and before the mixed precision
+ * kernels are used.
+ */
+void bodies_pack_mixed(Bodies* B, size_t i, size_t k);
+
+/**
+ * Like accumulate_accel() but the pair math is done in single precision on
+ * the packed positions and masses (see bodies_pack_mixed()) while the sum is
+ * accumulated with Kahan compensation in single precision over blocks of a
+ * few hundred sources and across the blocks in double precision. Sources at
+ * exactly the same position as the target contribute nothing.
+ */
+void accumulate_accel_mixed(float xi, float yi, float zi,
+                            const float* x, const float* y, const float* z,
+                            const float* gm, size_t count, double* acc);
+
+/**
+ * Accumulates into acc[0..2] the acceleration of body i due to bodies j..k-1
+ * using the mixed precision kernel.
+ */
+void bodies_accumulate_accel_mixed(const Bodies* B, size_t i, size_t j, size_t k,
+                                   double* acc);
@@ -0,0 +1,56 @@
+/**
+ * Conserved quantity diagnostics definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostics.h"
+#include "helper_functions.h"
+
+
+/**
+ * Adds body i to a row of diagnostics given the sum of m_j/r over all of the
+ * other bodies j (as computed by bodies_accumulate_accel_potential()). Each
+ * pair is seen from both of its bodies so each adds half of the potential
+ * energy.
+ */
+void diagnostics_add_body(double* row, const Bodies* B, size_t i, double phi) {
+    double m = B->mass[i], x = B->x[i], y = B->y[i], z = B->z[i];
+    double vx = B->vx[i], vy = B->vy[i], vz = B->vz[i];
+    row[DIAG_KINETIC] += 0.5 * m * (vx*vx + vy*vy + vz*vz);
+    row[DIAG_POTENTIAL] -= 0.5 * G * m * phi;
+    row[DIAG_PX] += m * vx; row[DIAG_PX+1] += m * vy; row[DIAG_PX+2] += m * vz;
+    row[DIAG_LX] += m * (y*vz - z*vy);
+    row[DIAG_LX+1] += m * (z*vx - x*vz);
+    row[DIAG_LX+2] += m * (x*vy - y*vx);
+    row[DIAG_CX] += m * x; row[DIAG_CX+1] += m * y; row[DIAG_CX+2] += m * z;
+    row[DIAG_MASS] += m;
+}
+
+/**
+ * Adds bodies i..k-1 to a row of diagnostics, computing their potentials with
+ * a separate pass over all of the bodies. This is for when the diagnostics
+ * cannot be gathered in the force calculation of a step.
+ */
+void diagnostics_add(double* row, const Bodies* B, size_t i, size_t k) {
+    for (; i < k; i++) {
+        double acc[3] = {0, 0, 0}, phi = 0;
+        bodies_accumulate_accel_potential(B, i, 0, B->n, acc, &phi);
+        diagnostics_add_body(row, B, i, phi);
+    }
+}
+
+/**
+ * Finishes a row of diagnostics of the state at the given time, appends it to
+ * a diagnostics file, and clears the row for the next one.
+ */
+void diagnostics_push(NpyWriter* W, double* row, double time) {
+    double* out = npy_writer_row(W);
+    memcpy(out, row, DIAG_COLS * sizeof(double));
+    out[DIAG_TIME] = time;
+    out[DIAG_ENERGY] = out[DIAG_KINETIC] + out[DIAG_POTENTIAL];
+    for (int d = 0; d < 3; d++) { out[DIAG_CX+d] /= out[DIAG_MASS]; }
+    npy_writer_push(W);
+    memset(row, 0, DIAG_COLS * sizeof(double));
+}
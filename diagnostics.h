@@ -0,0 +1,48 @@
+/**
+ * Declares the conserved quantity diagnostics (which are defined in
+ * diagnostics.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+#include "body.h"
+#include "matrix.h"
+
+
+// The columns of a row of diagnostics. While the bodies are being added the
+// row holds sums: the kinetic and potential energies, momenta, and total mass
+// are already totals but the centre of mass is the sum of mass*position until
+// diagnostics_push() divides it by the total mass.
+#define DIAG_TIME      0  // time of the state (in s)
+#define DIAG_KINETIC   1  // total kinetic energy (in J)
+#define DIAG_POTENTIAL 2  // total potential energy (in J)
+#define DIAG_ENERGY    3  // their sum
+#define DIAG_PX        4  // linear momentum (in kg m/s), 3 columns
+#define DIAG_LX        7  // angular momentum about the origin (in kg m^2/s), 3 columns
+#define DIAG_CX        10 // centre of mass (in m), 3 columns
+#define DIAG_MASS      13 // total mass (in kg)
+#define DIAG_COLS      14
+
+
+/**
+ * Adds body i to a row of diagnostics given the sum of m_j/r over all of the
+ * other bodies j (as computed by bodies_accumulate_accel_potential()). Each
+ * pair is seen from both of its bodies so each adds half of the potential
+ * energy.
+ */
+void diagnostics_add_body(double* row, const Bodies* B, size_t i, double phi);
+
+/**
+ * Adds bodies i..k-1 to a row of diagnostics, computing their potentials with
+ * a separate pass over all of the bodies. This is for when the diagnostics
+ * cannot be gathered in the force calculation of a step.
+ */
+void diagnostics_add(double* row, const Bodies* B, size_t i, size_t k);
+
+/**
+ * Finishes a row of diagnostics of the state at the given time, appends it to
+ * a diagnostics file, and clears the row for the next one.
+ */
+void diagnostics_push(NpyWriter* W, double* row, double time);
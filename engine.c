@@ -0,0 +1,324 @@
+/**
+ * Force engine registry definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+
+#include <omp.h>
+
+#include "engine.h"
+#include "force.h"
+#include "util.h"
+
+
+//////////////////// Engines ////////////////////
+
+static double __all_pairs(size_t n) { return (double)n * n; }
+static double __unique_pairs(size_t n) { return (double)n * (n-1) / 2; }
+static double __unknown_pairs(size_t n) { (void)n; return 0; }
+
+static bool __no_init(EngineState* S) { (void)S; return true; }
+
+/**
+ * Computes the accelerations with force_naive(), each thread getting one
+ * chunk of the bodies.
+ */
+static void __naive_accel(EngineState* S, size_t tid, Profile* P) {
+    #pragma omp for schedule(static, 1) nowait
+    for (size_t i = 0; i < S->B->n; i += S->chunk) {
+        size_t k = i + S->chunk < S->B->n ? i + S->chunk : S->B->n;
+        force_naive(S->B, i, k, S->ax, S->ay, S->az);
+    }
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+}
+
+/**
+ * Picks the tile sizes, every thread needs at least one block.
+ */
+static bool __tiled_init(EngineState* S) {
+    size_t n = S->B->n, num_threads = S->num_threads;
+    S->source_tile = S->options.tile;
+    force_tile_sizes(&S->target_block, &S->source_tile);
+    size_t per_thread = (n + num_threads - 1) / num_threads;
+    if (S->target_block > per_thread) { S->target_block = per_thread; }
+    size_t num_blocks = (n + S->target_block - 1) / S->target_block;
+    S->tile_chunk = (num_blocks + num_threads - 1) / num_threads;
+    return true;
+}
+
+/**
+ * Computes the accelerations with force_tiled(), each thread getting one
+ * contiguous range of blocks.
+ */
+static void __tiled_accel(EngineState* S, size_t tid, Profile* P) {
+    size_t n = S->B->n, block = S->target_block;
+    #pragma omp for schedule(static, S->tile_chunk) nowait
+    for (size_t i = 0; i < n; i += block) {
+        size_t k = i + block < n ? i + block : n;
+        force_tiled(S->B, i, k, S->source_tile, S->ax, S->ay, S->az);
+    }
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+}
+
+/**
+ * Allocates the accelerations of every thread, the first ones are shared with
+ * the state.
+ */
+static bool __symmetric_init(EngineState* S) {
+    S->bx = (double**)calloc(S->num_threads, sizeof(double*));
+    S->by = (double**)calloc(S->num_threads, sizeof(double*));
+    S->bz = (double**)calloc(S->num_threads, sizeof(double*));
+    if (!S->bx || !S->by || !S->bz) { return false; }
+    S->bx[0] = S->ax; S->by[0] = S->ay; S->bz[0] = S->az;
+    for (size_t t = 1; t < S->num_threads; t++) {
+        // first touched by the thread that uses them
+        S->bx[t] = body_array_alloc(S->B->n);
+        S->by[t] = body_array_alloc(S->B->n);
+        S->bz[t] = body_array_alloc(S->B->n);
+        if (!S->bx[t] || !S->by[t] || !S->bz[t]) { return false; }
+    }
+    return true;
+}
+
+/**
+ * Computes the pairs of the bodies of this thread (about the same number of
+ * pairs for every thread) into its own accelerations, then reduces this
+ * thread's block of the bodies into the first ones. Both splits are fixed so
+ * the results are reproducible.
+ */
+static void __symmetric_accel(EngineState* S, size_t tid, Profile* P) {
+    size_t n = S->B->n, nthreads = S->num_threads;
+    size_t first = force_symmetric_split(n, tid, nthreads);
+    size_t last = force_symmetric_split(n, tid+1, nthreads);
+    size_t lo = n * tid / nthreads, hi = n * (tid+1) / nthreads;
+    memset(S->bx[tid], 0, n * sizeof(double));
+    memset(S->by[tid], 0, n * sizeof(double));
+    memset(S->bz[tid], 0, n * sizeof(double));
+    force_symmetric(S->B, first, last, S->bx[tid], S->by[tid], S->bz[tid]);
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+    force_reduce(S->bx, nthreads, lo, hi);
+    force_reduce(S->by, nthreads, lo, hi);
+    force_reduce(S->bz, nthreads, lo, hi);
+    PROFILE_BARRIER(P, tid, PROFILE_REDUCE);
+}
+
+/**
+ * Allocates the single precision copies of the bodies.
+ */
+static bool __mixed_init(EngineState* S) { return bodies_enable_mixed(S->B); }
+
+/**
+ * Picks the origin of the single precision copies again, packs the bodies
+ * moved since the last call, and computes the accelerations with
+ * force_mixed().
+ */
+static void __mixed_accel(EngineState* S, size_t tid, Profile* P) {
+    size_t n = S->B->n;
+    #pragma omp single
+    bodies_center_mixed(S->B);
+    #pragma omp for schedule(static, 1) nowait
+    for (size_t i = 0; i < n; i += S->chunk) {
+        bodies_pack_mixed(S->B, i, i + S->chunk < n ? i + S->chunk : n);
+    }
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+    #pragma omp for schedule(static, 1) nowait
+    for (size_t i = 0; i < n; i += S->chunk) {
+        force_mixed(S->B, i, i + S->chunk < n ? i + S->chunk : n, S->ax, S->ay, S->az);
+    }
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+}
+
+/**
+ * Creates the octree.
+ */
+static bool __tree_init(EngineState* S) {
+    S->tree = octree_create(S->options.theta);
+    return S->tree != NULL;
+}
+
+/**
+ * Rebuilds the octree from the current positions and walks it.
+ */
+static void __tree_accel(EngineState* S, size_t tid, Profile* P) {
+    #pragma omp single nowait
+    S->ok = octree_build(S->tree, S->B);
+    PROFILE_BARRIER(P, tid, PROFILE_TREE);
+    if (!S->ok) { return; }
+    octree_accel(S->tree, S->ax, S->ay, S->az); // ends at a barrier
+    profile_mark(P, tid, PROFILE_FORCE);
+}
+
+/**
+ * Copies the bodies to the offload device. Fails with ENODEV if there is no
+ * device (the engine would then run on a single host thread).
+ */
+static bool __offload_init(EngineState* S) {
+    if (!offload_available()) { errno = ENODEV; return false; }
+    S->offload = offload_create(S->B, S->ax, S->ay, S->az);
+    return S->offload != NULL;
+}
+
+/**
+ * Copies the positions (and masses) to the device, computes the accelerations there with
+ * offload_accel(), and copies them back. The other threads wait.
+ */
+static void __offload_accel(EngineState* S, size_t tid, Profile* P) {
+    #pragma omp single nowait
+    {
+        offload_positions_to_device(S->offload);
+        offload_accel(S->offload);
+        offload_accel_to_host(S->offload);
+    }
+    PROFILE_BARRIER(P, tid, PROFILE_FORCE);
+}
+
+static const Engine engines[] = {
+    {"naive", "all pairs", true, PROFILE_PAIR_FLOPS,
+     __no_init, __naive_accel, __all_pairs},
+    {"tiled", "cache-blocked all pairs", true, PROFILE_PAIR_FLOPS,
+     __tiled_init, __tiled_accel, __all_pairs},
+    {"symmetric", "Newton's 3rd law", true, PROFILE_SYMMETRIC_PAIR_FLOPS,
+     __symmetric_init, __symmetric_accel, __unique_pairs},
+    {"mixed", "mixed precision all pairs", false, PROFILE_PAIR_FLOPS,
+     __mixed_init, __mixed_accel, __all_pairs},
+    {"tree", "Barnes-Hut", false, 0,
+     __tree_init, __tree_accel, __unknown_pairs},
+    {"offload", "all pairs on an offload device", true, PROFILE_PAIR_FLOPS,
+     __offload_init, __offload_accel, __all_pairs},
+};
+
+/**
+ * Finds an engine by name. Returns NULL if the name is not known.
+ */
+const Engine* engine_find(const char* name) {
+    for (size_t i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, name) == 0) { return &engines[i]; }
+    }
+    return NULL;
+}
+
+
+//////////////////// Engine States ////////////////////
+
+/**
+ * Sets up an engine for the bodies and num_threads threads, allocating the
+ * accelerations. Returns NULL if the memory cannot be allocated.
+ */
+EngineState* engine_create(const Engine* E, Bodies* B, size_t num_threads,
+                           const EngineOptions* options) {
+    EngineState* S = (EngineState*)calloc(1, sizeof(EngineState));
+    if (!S) { return NULL; }
+    S->engine = E;
+    S->B = B;
+    S->num_threads = num_threads;
+    S->options = *options;
+    S->ok = true;
+    // every thread gets a contiguous block of bodies that starts on a cache
+    // line of each of the arrays so no two threads write the same line
+    size_t line = BODY_ALIGNMENT / sizeof(double);
+    S->chunk = ((B->n + num_threads - 1) / num_threads + line - 1) / line * line;
+    S->ax = body_array_alloc(B->n);
+    S->ay = body_array_alloc(B->n);
+    S->az = body_array_alloc(B->n);
+    if (!S->ax || !S->ay || !S->az || !E->init(S)) { engine_free(S); return NULL; }
+    return S;
+}
+
+/**
+ * Frees an engine state and its accelerations.
+ */
+void engine_free(EngineState* S) {
+    for (size_t t = 1; t < S->num_threads; t++) {
+        if (S->bx) { free(S->bx[t]); }
+        if (S->by) { free(S->by[t]); }
+        if (S->bz) { free(S->bz[t]); }
+    }
+    free(S->bx); free(S->by); free(S->bz);
+    if (S->tree) { octree_free(S->tree); }
+    if (S->offload) { offload_free(S->offload); }
+    free(S->ax); free(S->ay); free(S->az);
+    free(S);
+}
+
+
+//////////////////// Calibration ////////////////////
+
+/**
+ * Gets the number of threads to try after p (doubling up to max), 0 after max.
+ */
+static size_t __next_threads(size_t p, size_t max) {
+    return p >= max ? 0 : p*2 < max ? p*2 : max;
+}
+
+/**
+ * Times up to ENGINE_CALIBRATION_RUNS force calculations of an engine state
+ * and gives the fastest. The runs stop early once one is slower than limit.
+ */
+static double __time_engine(EngineState* S, const Topology* topo, double limit) {
+    bool pin = topo && topology_should_pin(topo);
+    double best = -1;
+    #pragma omp parallel default(none) shared(S, topo, pin, limit, best) num_threads(S->num_threads)
+    {
+        size_t tid = omp_get_thread_num();
+        if (pin) { topology_pin(topo, tid, S->num_threads); }
+        struct timespec start, end;
+        for (int r = 0; r < ENGINE_CALIBRATION_RUNS; r++) {
+            #pragma omp barrier
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            engine_accel(S, tid, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            // the threads all end at the barrier of the engine so the time of
+            // any one of them will do
+            double time = get_time_diff(&start, &end);
+            #pragma omp single
+            if (best < 0 || time < best) { best = time; }
+            if (best > limit || !S->ok) { break; }
+        }
+    }
+    return best;
+}
+
+/**
+ * Picks the fastest exact engine and number of threads for the bodies by
+ * timing a few force calculations of each combination.
+ */
+const Engine* engine_calibrate(Bodies* B, const EngineOptions* options,
+                               const Topology* topo, size_t max_threads,
+                               bool fixed, bool verbose, size_t* num_threads,
+                               double* seconds) {
+    const Engine* best = NULL;
+    double best_time = 0;
+    for (size_t e = 0; e < sizeof(engines)/sizeof(engines[0]); e++) {
+        const Engine* E = &engines[e];
+        if (!E->exact) { continue; }
+        double engine_best = 0;
+        for (size_t p = fixed ? max_threads : 1; p; p = __next_threads(p, max_threads)) {
+            EngineState* S = engine_create(E, B, p, options);
+            if (!S) { continue; }
+            // a run that is twice as slow as the best one so far is not
+            // worth repeating
+            double time = __time_engine(S, topo, best ? 2 * best_time : INFINITY);
+            engine_free(S);
+            if (verbose) {
+                printf("  %-9s %3zu threads: ", E->name, p);
+                print_time(time);
+                printf(" per force calculation\n");
+            }
+            if (!best || time < best_time) {
+                best = E;
+                best_time = time;
+                *num_threads = p;
+            }
+            // more threads will not help an engine that already stopped scaling
+            if (engine_best && time > engine_best) { break; }
+            if (!engine_best || time < engine_best) { engine_best = time; }
+        }
+    }
+    *seconds = best_time;
+    return best;
+}
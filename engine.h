@@ -0,0 +1,137 @@
+/**
+ * Declares the registry of force engines used by the unified driver (which
+ * is defined in engine.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "body.h"
+#include "octree.h"
+#include "offload.h"
+#include "profile.h"
+#include "topology.h"
+
+
+// Number of force calculations timed for each candidate of engine_calibrate(),
+// the fastest of them is kept
+#define ENGINE_CALIBRATION_RUNS 3
+
+// Default opening angle of the tree engine
+#define ENGINE_DEFAULT_THETA 0.5
+
+struct _EngineOptions {
+    size_t tile;  // source bodies per tile of the tiled engine (0 picks it from the caches)
+    double theta; // opening angle of the tree engine
+};
+typedef struct _EngineOptions EngineOptions;
+
+typedef struct _EngineState EngineState;
+
+struct _Engine {
+    // A way of computing the acceleration of every body. Every engine is run
+    // by all of the threads of an OpenMP parallel region so that the driver
+    // can use any of them with the same loop.
+    const char* name;
+    const char* description;
+    // true if the accelerations are the exact ones (up to rounding), only
+    // these are considered by engine_calibrate()
+    bool exact;
+    // floating point operations per pair interaction (see profile.h)
+    double pair_flops;
+    // sets up the parts of a state the engine needs, returns false if the
+    // memory cannot be allocated
+    bool (*init)(EngineState* S);
+    // computes the accelerations, see engine_accel()
+    void (*accel)(EngineState* S, size_t tid, Profile* P);
+    // pair interactions of one force calculation on n bodies (0 if unknown)
+    double (*pairs)(size_t n);
+};
+typedef struct _Engine Engine;
+
+struct _EngineState {
+    // An engine set up for the bodies and a number of threads
+    const Engine* engine;
+    Bodies* B;
+    size_t num_threads;
+    EngineOptions options;
+    double *ax, *ay, *az; // the acceleration of every body
+    size_t chunk;         // bodies per thread of the loops, a multiple of a cache line
+    // tiled: source bodies per tile, target bodies per block, blocks per thread
+    size_t source_tile, target_block, tile_chunk;
+    // symmetric: the accelerations of every thread, the first ones are ax, ay,
+    // and az which the others are reduced into
+    double **bx, **by, **bz;
+    // tree: the octree and if it could be built
+    Octree* tree;
+    bool ok;
+    // offload: the bodies and accelerations on the device
+    Offload* offload;
+};
+
+
+/**
+ * Finds an engine by name, one of:
+ *   - naive: every pair is computed twice, once for each body
+ *   - tiled: like naive but blocked for the caches (see force_tiled())
+ *   - symmetric: every pair is computed once using Newton's 3rd law, the
+ *     reactions are reduced from per-thread accelerations
+ *   - mixed: like naive but the pair math is single precision
+ *   - tree: the Barnes-Hut approximation with the opening angle theta
+ *   - offload: like tiled but on an offload device such as a GPU (see
+ *     offload_accel()), the positions are copied to it and the accelerations
+ *     back for every force calculation
+ * Returns NULL if the name is not known.
+ */
+const Engine* engine_find(const char* name);
+
+/**
+ * Sets up an engine for the bodies and num_threads threads, allocating the
+ * accelerations. The accelerations are not initialized. Returns NULL if the
+ * memory cannot be allocated.
+ */
+EngineState* engine_create(const Engine* E, Bodies* B, size_t num_threads,
+                           const EngineOptions* options);
+
+/**
+ * Frees an engine state and its accelerations.
+ */
+void engine_free(EngineState* S);
+
+/**
+ * Computes the acceleration of every body at the current positions into
+ * S->ax, S->ay, and S->az. This must be called by every thread of a parallel
+ * region of S->num_threads threads (tid being the thread number) after the
+ * bodies have stopped moving and it ends at a barrier so all of the
+ * accelerations are available to every thread afterwards. The time of each
+ * thread is charged to the phases of P. If the tree engine cannot allocate
+ * its nodes S->ok is set to false and the accelerations are not computed.
+ */
+static inline void engine_accel(EngineState* S, size_t tid, Profile* P) {
+    S->engine->accel(S, tid, P);
+}
+
+/**
+ * Gets the number of pair interactions of one force calculation (0 if it is
+ * not known, like for the tree engine).
+ */
+static inline double engine_pairs(const EngineState* S) {
+    return S->engine->pairs(S->B->n);
+}
+
+/**
+ * Picks the fastest exact engine and number of threads for the bodies by
+ * timing a few force calculations of each combination on the bodies as they
+ * are (which are not changed). The thread counts tried are the powers of two
+ * below max_threads and max_threads itself, or only max_threads if fixed is
+ * true. The threads are pinned with topo (if it is not NULL and
+ * topology_should_pin()). Gives the number of threads and the time of a force
+ * calculation with them and prints every candidate if verbose. Returns NULL if
+ * no engine could be set up.
+ */
+const Engine* engine_calibrate(Bodies* B, const EngineOptions* options,
+                               const Topology* topo, size_t max_threads,
+                               bool fixed, bool verbose, size_t* num_threads,
+                               double* seconds);
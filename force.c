@@ -0,0 +1,165 @@
+/**
+ * Force engine definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "force.h"
+#include "util.h"
+
+
+//////////////////// Naive All-Pairs Engine ////////////////////
+
+/**
+ * Computes the accelerations of the target bodies i..k-1 due to all of the
+ * bodies, overwriting ax[i..k-1], ay[i..k-1], and az[i..k-1].
+ */
+void force_naive(const Bodies* B, size_t i, size_t k,
+                 double* ax, double* ay, double* az) {
+    for (; i < k; i++) {
+        double acc[3] = {0, 0, 0};
+        bodies_accumulate_accel(B, i, 0, B->n, acc);
+        ax[i] = acc[0]; ay[i] = acc[1]; az[i] = acc[2];
+    }
+}
+
+
+//////////////////// Tiled All-Pairs Engine ////////////////////
+
+// Cache sizes to assume if the machine does not report them
+#define DEFAULT_L1_SIZE (32*1024)
+#define DEFAULT_L2_SIZE (256*1024)
+
+// Bytes touched per source body (x, y, z, mass) and per target body (x, y, z,
+// ax, ay, az)
+#define SOURCE_BYTES (4*sizeof(double))
+#define TARGET_BYTES (6*sizeof(double))
+
+/**
+ * Rounds the number of bodies down to a multiple of the SIMD width (but at
+ * least one SIMD register worth).
+ */
+static size_t __round_tile(size_t bodies) {
+    bodies -= bodies % BODY_SIMD_WIDTH;
+    return bodies < BODY_SIMD_WIDTH ? BODY_SIMD_WIDTH : bodies;
+}
+
+/**
+ * Picks the tile sizes (in bodies) for force_tiled() from the cache sizes of
+ * the machine.
+ */
+void force_tile_sizes(size_t* target_block, size_t* source_tile) {
+    size_t l1 = get_cache_size(1), l2 = get_cache_size(2);
+    if (l1 == 0) { l1 = DEFAULT_L1_SIZE; }
+    if (l2 == 0) { l2 = DEFAULT_L2_SIZE; }
+    *source_tile = __round_tile(*source_tile ? *source_tile : l1/2/SOURCE_BYTES);
+    *target_block = __round_tile(l2/2/TARGET_BYTES);
+}
+
+/**
+ * Computes the accelerations of the target bodies i..k-1 due to all of the
+ * bodies, overwriting ax[i..k-1], ay[i..k-1], and az[i..k-1].
+ */
+void force_tiled(const Bodies* B, size_t i, size_t k, size_t source_tile,
+                 double* ax, double* ay, double* az) {
+    memset(ax+i, 0, (k-i)*sizeof(double));
+    memset(ay+i, 0, (k-i)*sizeof(double));
+    memset(az+i, 0, (k-i)*sizeof(double));
+    for (size_t j = 0; j < B->n; j += source_tile) {
+        size_t count = B->n - j < source_tile ? B->n - j : source_tile;
+        for (size_t t = i; t < k; t++) {
+            double acc[3] = {ax[t], ay[t], az[t]};
+            accumulate_accel(B->x[t], B->y[t], B->z[t],
+                             B->x+j, B->y+j, B->z+j, B->mass+j, count, acc);
+            ax[t] = acc[0]; ay[t] = acc[1]; az[t] = acc[2];
+        }
+    }
+}
+
+
+//////////////////// Newton's 3rd Law Engine ////////////////////
+
+/**
+ * Gets the first target body of part p (of num_parts) when splitting the
+ * bodies for force_symmetric().
+ */
+size_t force_symmetric_split(size_t n, size_t p, size_t num_parts) {
+    // bodies 0..i-1 have about i*i/2 pairs so split i*i evenly
+    if (p >= num_parts) { return n; }
+    return (size_t)(n * sqrt((double)p / num_parts));
+}
+
+/**
+ * Computes the interaction of each of the target bodies i..k-1 with all of the
+ * bodies before it only once, adding the acceleration to both bodies of the
+ * pair in ax, ay, and az.
+ */
+void force_symmetric(const Bodies* B, size_t i, size_t k,
+                     double* ax, double* ay, double* az) {
+    for (; i < k; i++) {
+        bodies_accumulate_accel_symmetric(B, i, 0, i, ax, ay, az);
+    }
+}
+
+/**
+ * Sums entries i..k-1 of num_bufs buffers into the first buffer, combining
+ * them pairwise as a tree.
+ */
+void force_reduce(double** bufs, size_t num_bufs, size_t i, size_t k) {
+    for (size_t stride = 1; stride < num_bufs; stride *= 2) {
+        for (size_t b = 0; b + stride < num_bufs; b += 2*stride) {
+            double* restrict dst = bufs[b];
+            const double* restrict src = bufs[b + stride];
+            for (size_t j = i; j < k; j++) { dst[j] += src[j]; }
+        }
+    }
+}
+
+
+//////////////////// Mixed Precision Engine ////////////////////
+
+/**
+ * Like force_naive() but with the single precision pair math of
+ * accumulate_accel_mixed(). The bodies must have been packed with
+ * bodies_pack_mixed() since they last moved.
+ */
+void force_mixed(const Bodies* B, size_t i, size_t k,
+                 double* ax, double* ay, double* az) {
+    for (; i < k; i++) {
+        double acc[3] = {0, 0, 0};
+        bodies_accumulate_accel_mixed(B, i, 0, B->n, acc);
+        ax[i] = acc[0]; ay[i] = acc[1]; az[i] = acc[2];
+    }
+}
+
+/**
+ * Measures the accuracy of the mixed precision engine at the current
+ * positions by comparing it to the double precision one for up to samples
+ * evenly spaced target bodies. Gives the largest and the root-mean-square
+ * relative error of the acceleration vectors. The bodies are packed again so
+ * they must have been set up with bodies_enable_mixed().
+ */
+void force_mixed_error(Bodies* B, size_t samples, double* max_err, double* rms_err) {
+    bodies_center_mixed(B);
+    bodies_pack_mixed(B, 0, B->n);
+    if (samples > B->n) { samples = B->n; }
+    double max = 0, sum = 0;
+    size_t count = 0;
+    for (size_t s = 0; s < samples; s++) {
+        size_t i = s * B->n / samples;
+        double exact[3] = {0, 0, 0}, mixed[3] = {0, 0, 0};
+        bodies_accumulate_accel(B, i, 0, B->n, exact);
+        bodies_accumulate_accel_mixed(B, i, 0, B->n, mixed);
+        double dx = mixed[0] - exact[0], dy = mixed[1] - exact[1], dz = mixed[2] - exact[2];
+        double norm = sqrt(exact[0]*exact[0] + exact[1]*exact[1] + exact[2]*exact[2]);
+        if (norm == 0) { continue; } // e.g. a single body
+        double err = sqrt(dx*dx + dy*dy + dz*dz) / norm;
+        if (err > max) { max = err; }
+        sum += err * err;
+        count++;
+    }
+    *max_err = max;
+    *rms_err = count ? sqrt(sum / count) : 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * Declares the force engines that compute the acceleration of every body
+ * (which are defined in force.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+
+#include "body.h"
+
+
+//////////////////// Naive All-Pairs Engine ////////////////////
+
+/**
+ * Computes the accelerations of the target bodies i..k-1 due to all of the
+ * bodies, overwriting ax[i..k-1], ay[i..k-1], and az[i..k-1].
+ */
+void force_naive(const Bodies* B, size_t i, size_t k,
+                 double* ax, double* ay, double* az);
+
+
+//////////////////// Tiled All-Pairs Engine ////////////////////
+
+/**
+ * Picks the tile sizes (in bodies) for force_tiled() from the cache sizes of
+ * the machine. The source tile is sized to stay in half of the L1 data cache
+ * while it is swept by every target. The target block is sized so that its
+ * positions and accelerations stay in half of the L2 cache while every source
+ * tile is applied to it. If source_tile is already non-zero it is kept (only
+ * rounded to the SIMD width).
+ */
+void force_tile_sizes(size_t* target_block, size_t* source_tile);
+
+/**
+ * Computes the accelerations of the target bodies i..k-1 due to all of the
+ * bodies, overwriting ax[i..k-1], ay[i..k-1], and az[i..k-1]. The sources are
+ * processed in tiles of source_tile bodies which are each applied to all of
+ * the targets before moving on to the next tile. For the best cache reuse
+ * k-i should be at most the target block from force_tile_sizes().
+ */
+void force_tiled(const Bodies* B, size_t i, size_t k, size_t source_tile,
+                 double* ax, double* ay, double* az);
+
+
+//////////////////// Newton's 3rd Law Engine ////////////////////
+
+/**
+ * Gets the first target body of part p (of num_parts) when splitting the
+ * bodies for force_symmetric(). Since body i interacts with the i bodies
+ * before it, the parts are sized to have about the same number of pairs
+ * rather than the same number of bodies. Part p covers the bodies from
+ * force_symmetric_split(n, p, num_parts) up to force_symmetric_split(n, p+1,
+ * num_parts).
+ */
+size_t force_symmetric_split(size_t n, size_t p, size_t num_parts);
+
+/**
+ * Computes the interaction of each of the target bodies i..k-1 with all of the
+ * bodies before it only once, adding the acceleration to both bodies of the
+ * pair in ax, ay, and az. Only entries 0..k-1 are written. Since the reactions
+ * go to bodies that other targets may also react with, threads must use
+ * separate accelerations which are then combined with force_reduce().
+ */
+void force_symmetric(const Bodies* B, size_t i, size_t k,
+                     double* ax, double* ay, double* az);
+
+/**
+ * Sums entries i..k-1 of num_bufs buffers into the first buffer. The buffers
+ * are combined pairwise as a tree (0+1, 2+3, ... then 0+2, ...) so the
+ * rounding is always the same for a given number of buffers and different
+ * threads can reduce different ranges of entries at the same time.
+ */
+void force_reduce(double** bufs, size_t num_bufs, size_t i, size_t k);
+
+
+//////////////////// Mixed Precision Engine ////////////////////
+
+// Number of target bodies sampled by force_mixed_error()
+#define FORCE_ERROR_SAMPLES 1024
+
+/**
+ * Like force_naive() but with the single precision pair math of
+ * accumulate_accel_mixed(). The bodies must have been packed with
+ * bodies_pack_mixed() since they last moved.
+ */
+void force_mixed(const Bodies* B, size_t i, size_t k,
+                 double* ax, double* ay, double* az);
+
+/**
+ * Measures the accuracy of the mixed precision engine at the current
+ * positions by comparing it to the double precision one for up to samples
+ * evenly spaced target bodies. Gives the largest and the root-mean-square
+ * relative error of the acceleration vectors. The bodies are packed again so
+ * they must have been set up with bodies_enable_mixed().
+ */
+void force_mixed_error(Bodies* B, size_t samples, double* max_err, double* rms_err);
@@ -0,0 +1,298 @@
+/**
+ * Deterministic initial condition generator definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "generate.h"
+#include "helper_functions.h"
+
+// Mass of the central body of generate_disk() relative to the disk
+#define DISK_CENTRAL_MASS 10
+
+
+//////////////////// Random Numbers ////////////////////
+
+/**
+ * Starts a random number generator from a seed.
+ */
+Rng rng_seed(uint64_t seed) {
+    Rng R = {seed};
+    return R;
+}
+
+/**
+ * Gets the next random 64-bit integer.
+ */
+uint64_t rng_next(Rng* R) {
+    uint64_t z = (R->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Gets a random double uniformly distributed in [0.0, 1.0).
+ */
+double rng_uniform(Rng* R) {
+    return (rng_next(R) >> 11) * (1.0 / 9007199254740992.0); // 53 random bits
+}
+
+/**
+ * Gets a random double from the standard normal distribution.
+ */
+double rng_normal(Rng* R) {
+    // Box-Muller, 1-u is in (0, 1] so the log is finite
+    double u = 1 - rng_uniform(R), v = rng_uniform(R);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/**
+ * Fills v[0..2] with a random direction (a unit vector uniformly distributed
+ * over the sphere) times length.
+ */
+void rng_direction(Rng* R, double length, double* v) {
+    double z = 2 * rng_uniform(R) - 1, phi = 2 * M_PI * rng_uniform(R);
+    double s = sqrt(1 - z*z);
+    v[0] = length * s * cos(phi);
+    v[1] = length * s * sin(phi);
+    v[2] = length * z;
+}
+
+
+//////////////////// Generators ////////////////////
+
+/**
+ * Sets body i of an input matrix.
+ */
+static void __set_body(Matrix* M, size_t i, double m, const double* pos, const double* vel) {
+    double* row = &M->data[i*7];
+    row[0] = m;
+    row[1] = pos[0]; row[2] = pos[1]; row[3] = pos[2];
+    row[4] = vel[0]; row[5] = vel[1]; row[6] = vel[2];
+}
+
+/**
+ * Moves the bodies of an input matrix to the center of mass frame.
+ */
+static void __center(Matrix* M) {
+    double total = 0, sum[6] = {0, 0, 0, 0, 0, 0};
+    for (size_t i = 0; i < M->rows; i++) {
+        const double* row = &M->data[i*7];
+        total += row[0];
+        for (int d = 0; d < 6; d++) { sum[d] += row[0] * row[d+1]; }
+    }
+    for (size_t i = 0; i < M->rows; i++) {
+        for (int d = 0; d < 6; d++) { M->data[i*7+d+1] -= sum[d] / total; }
+    }
+}
+
+/**
+ * Gets a random point uniformly distributed in a sphere of radius r.
+ */
+static void __in_sphere(Rng* R, double r, double* v) {
+    do {
+        for (int d = 0; d < 3; d++) { v[d] = r * (2 * rng_uniform(R) - 1); }
+    } while (v[0]*v[0] + v[1]*v[1] + v[2]*v[2] > r*r);
+}
+
+/**
+ * Gets a random mass between 0.5 and 1.5 GENERATE_MASS.
+ */
+static double __mass(Rng* R) { return GENERATE_MASS * (0.5 + rng_uniform(R)); }
+
+/**
+ * Creates n bodies uniformly distributed in a sphere of GENERATE_RADIUS with
+ * masses between 0.5 and 1.5 GENERATE_MASS and random velocities that put the
+ * sphere in virial equilibrium.
+ */
+Matrix* generate_uniform(size_t n, uint64_t seed) {
+    Matrix* M = matrix_create_raw(n, 7);
+    if (M == NULL) { return NULL; }
+    Rng R = rng_seed(seed);
+    // a uniform sphere has 2K = -W = 3/5 G M^2 / R, so each velocity
+    // component has a variance of G M / (5 R)
+    double sigma = sqrt(G * n * GENERATE_MASS / (5 * GENERATE_RADIUS));
+    for (size_t i = 0; i < n; i++) {
+        double pos[3], vel[3];
+        __in_sphere(&R, GENERATE_RADIUS, pos);
+        for (int d = 0; d < 3; d++) { vel[d] = sigma * rng_normal(&R); }
+        __set_body(M, i, __mass(&R), pos, vel);
+    }
+    __center(M);
+    return M;
+}
+
+/**
+ * Creates n bodies of GENERATE_MASS sampled from a Plummer sphere in virial
+ * equilibrium whose virial radius is GENERATE_RADIUS (Aarseth, Hénon, and
+ * Wielen 1974). The farthest 1% of the distribution is left out.
+ */
+Matrix* generate_plummer(size_t n, uint64_t seed) {
+    Matrix* M = matrix_create_raw(n, 7);
+    if (M == NULL) { return NULL; }
+    Rng R = rng_seed(seed);
+    double a = 3 * M_PI / 16 * GENERATE_RADIUS; // scale length of the sphere
+    double gm = G * n * GENERATE_MASS;
+    for (size_t i = 0; i < n; i++) {
+        // the radius holding a uniformly random fraction of the mass
+        double f;
+        do { f = rng_uniform(&R); } while (f == 0 || f > 0.99);
+        double r = a / sqrt(pow(f, -2.0/3) - 1);
+
+        // the speed as a fraction of the escape speed, from the distribution
+        // q^2 (1-q^2)^(7/2) by rejection (its maximum is below 0.1)
+        double q, g;
+        do {
+            q = rng_uniform(&R);
+            g = 0.1 * rng_uniform(&R);
+        } while (g > q*q * pow(1 - q*q, 3.5));
+        double v = q * sqrt(2 * gm) * pow(r*r + a*a, -0.25);
+
+        double pos[3], vel[3];
+        rng_direction(&R, r, pos);
+        rng_direction(&R, v, vel);
+        __set_body(M, i, GENERATE_MASS, pos, vel);
+    }
+    __center(M);
+    return M;
+}
+
+/**
+ * Creates a central body ten times as massive as all of the others together
+ * and n-1 bodies in a thin exponential disk around it with a scale length of
+ * a third of GENERATE_RADIUS, orbiting on nearly circular orbits. The central
+ * mass keeps the disk from being torn up by close encounters.
+ */
+Matrix* generate_disk(size_t n, uint64_t seed) {
+    Matrix* M = matrix_create_raw(n, 7);
+    if (M == NULL || n == 0) { return M; }
+    Rng R = rng_seed(seed);
+    double scale = GENERATE_RADIUS / 3;
+    double disk_mass = 0;
+    for (size_t i = 1; i < n; i++) {
+        // the radius of an exponential disk follows a gamma distribution with
+        // a shape of 2, leaving a hole in the middle and cutting off the tail
+        double r;
+        do { r = -scale * log((1 - rng_uniform(&R)) * (1 - rng_uniform(&R))); } while (r < 0.5*scale || r > 10*scale);
+        double theta = 2 * M_PI * rng_uniform(&R), c = cos(theta), s = sin(theta);
+        double m = __mass(&R);
+        double pos[3] = {r * c, r * s, 0.05 * scale * rng_normal(&R)};
+        M->data[i*7] = m; // the speeds need the total mass first
+        memcpy(&M->data[i*7+1], pos, sizeof(pos));
+        disk_mass += m;
+    }
+    for (size_t i = 1; i < n; i++) {
+        // circular speed around the central body and the part of the disk
+        // inside the orbit (as if it was spherical) with a 10% dispersion
+        double* row = &M->data[i*7];
+        double r = sqrt(row[1]*row[1] + row[2]*row[2]), x = r / scale;
+        double inside = disk_mass * (1 - (1 + x) * exp(-x));
+        double v = sqrt(G * (DISK_CENTRAL_MASS * disk_mass + inside) / r);
+        double vel[3] = {-v * row[2] / r, v * row[1] / r, 0};
+        for (int d = 0; d < 3; d++) { vel[d] += 0.1 * v * rng_normal(&R); }
+        memcpy(&row[4], vel, sizeof(vel));
+    }
+    double origin[3] = {0, 0, 0};
+    __set_body(M, 0, n > 1 ? DISK_CENTRAL_MASS * disk_mass : GENERATE_MASS, origin, origin);
+    __center(M);
+    return M;
+}
+
+/**
+ * Creates n/2 circular binaries with separations of about GENERATE_RADIUS/100
+ * (and a single body if n is odd) whose centers of mass are distributed like
+ * generate_uniform().
+ */
+Matrix* generate_binaries(size_t n, uint64_t seed) {
+    Matrix* M = matrix_create_raw(n, 7);
+    if (M == NULL) { return NULL; }
+    Rng R = rng_seed(seed);
+    double sigma = sqrt(G * n * GENERATE_MASS / (5 * GENERATE_RADIUS));
+    for (size_t i = 0; i < n; i += 2) {
+        double center[3], drift[3];
+        __in_sphere(&R, GENERATE_RADIUS, center);
+        for (int d = 0; d < 3; d++) { drift[d] = sigma * rng_normal(&R); }
+        double m1 = __mass(&R);
+        if (i + 1 == n) { __set_body(M, i, m1, center, drift); break; }
+        double m2 = __mass(&R), total = m1 + m2;
+
+        // a random orbital plane: the separation along u and the relative
+        // velocity along w, which is perpendicular to it
+        double sep = GENERATE_RADIUS / 100 * (0.5 + rng_uniform(&R));
+        double speed = sqrt(G * total / sep);
+        double u[3], t[3], w[3];
+        rng_direction(&R, 1, u);
+        rng_direction(&R, 1, t);
+        w[0] = u[1]*t[2] - u[2]*t[1];
+        w[1] = u[2]*t[0] - u[0]*t[2];
+        w[2] = u[0]*t[1] - u[1]*t[0];
+        double len = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+        double p1[3], p2[3], v1[3], v2[3];
+        for (int d = 0; d < 3; d++) {
+            p1[d] = center[d] + m2 / total * sep * u[d];
+            p2[d] = center[d] - m1 / total * sep * u[d];
+            v1[d] = drift[d] + m2 / total * speed * w[d] / len;
+            v2[d] = drift[d] - m1 / total * speed * w[d] / len;
+        }
+        __set_body(M, i, m1, p1, v1);
+        __set_body(M, i+1, m2, p2, v2);
+    }
+    __center(M);
+    return M;
+}
+
+/**
+ * Gets the orbital time sqrt(r^3/(G M)) of the innermost bodies of the disk,
+ * at half of the scale length around the central body.
+ */
+static double __disk_time_unit(size_t n) {
+    if (n < 2) { return generate_time_unit(n); }
+    double r = 0.5 * GENERATE_RADIUS / 3;
+    return sqrt(r * r * r / (G * DISK_CENTRAL_MASS * (n-1) * GENERATE_MASS));
+}
+
+/**
+ * Gets the orbital time sqrt(a^3/(G M)) of the tightest and heaviest binary,
+ * half the typical separation and twice the most massive bodies.
+ */
+static double __binaries_time_unit(size_t n) {
+    if (n < 2) { return generate_time_unit(n); }
+    double a = 0.5 * GENERATE_RADIUS / 100;
+    return sqrt(a * a * a / (G * 3 * GENERATE_MASS));
+}
+
+static const Generator generators[] = {
+    {"uniform", generate_uniform, generate_time_unit},
+    {"plummer", generate_plummer, generate_time_unit},
+    {"disk", generate_disk, __disk_time_unit},
+    {"binaries", generate_binaries, __binaries_time_unit},
+};
+
+/**
+ * Finds a generator by name. Returns NULL if the name is not known.
+ */
+const Generator* generator_find(const char* name) {
+    for (size_t i = 0; i < sizeof(generators)/sizeof(generators[0]); i++) {
+        if (strcmp(generators[i].name, name) == 0) { return &generators[i]; }
+    }
+    return NULL;
+}
+
+/**
+ * Gets the dynamical time sqrt(R^3/(G M)) of n generated bodies (in s).
+ */
+double generate_time_unit(size_t n) {
+    return sqrt(GENERATE_RADIUS * GENERATE_RADIUS * GENERATE_RADIUS / (G * (n ? n : 1) * GENERATE_MASS));
+}
+
+/**
+ * Gets a suggested time step for n bodies from a generator, a thousandth of
+ * the shortest timescale of the system.
+ */
+double generate_time_step(const Generator* generator, size_t n) {
+    double t = generator->time_unit(n), whole = generate_time_unit(n);
+    return (t < whole ? t : whole) / 1000;
+}
@@ -0,0 +1,114 @@
+/**
+ * Declares the deterministic initial condition generators (which are defined
+ * in generate.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "matrix.h"
+
+
+// The scales of the generated systems: bodies of about a solar mass in a
+// cluster with a radius of about a parsec
+#define GENERATE_MASS   1.98847e30 // mean mass of a body (in kg)
+#define GENERATE_RADIUS 3.0857e16  // size of the system (in m)
+
+struct _Rng {
+    // A splitmix64 generator, unlike rand() it gives the same sequence on
+    // every platform so a seed always gives the same input
+    uint64_t state;
+};
+typedef struct _Rng Rng;
+
+struct _Generator {
+    const char* name;
+    // creates the n-by-7 input matrix (mass, x, y, z, vx, vy, vz) of n bodies
+    Matrix* (*create)(size_t n, uint64_t seed);
+    // gets the shortest timescale of the motion of n bodies (in s)
+    double (*time_unit)(size_t n);
+};
+typedef struct _Generator Generator;
+
+
+//////////////////// Random Numbers ////////////////////
+
+/**
+ * Starts a random number generator from a seed.
+ */
+Rng rng_seed(uint64_t seed);
+
+/**
+ * Gets the next random 64-bit integer.
+ */
+uint64_t rng_next(Rng* R);
+
+/**
+ * Gets a random double uniformly distributed in [0.0, 1.0).
+ */
+double rng_uniform(Rng* R);
+
+/**
+ * Gets a random double from the standard normal distribution.
+ */
+double rng_normal(Rng* R);
+
+/**
+ * Fills v[0..2] with a random direction (a unit vector uniformly distributed
+ * over the sphere) times length.
+ */
+void rng_direction(Rng* R, double length, double* v);
+
+
+//////////////////// Generators ////////////////////
+
+/**
+ * Creates n bodies uniformly distributed in a sphere of GENERATE_RADIUS with
+ * masses between 0.5 and 1.5 GENERATE_MASS and random velocities that put the
+ * sphere in virial equilibrium.
+ */
+Matrix* generate_uniform(size_t n, uint64_t seed);
+
+/**
+ * Creates n bodies of GENERATE_MASS sampled from a Plummer sphere in virial
+ * equilibrium whose virial radius is GENERATE_RADIUS (Aarseth, Hénon, and
+ * Wielen 1974). The farthest 1% of the distribution is left out.
+ */
+Matrix* generate_plummer(size_t n, uint64_t seed);
+
+/**
+ * Creates a central body ten times as massive as all of the others together
+ * and n-1 bodies in a thin exponential disk around it with a scale length of
+ * a third of GENERATE_RADIUS, orbiting on nearly circular orbits. The central
+ * mass keeps the disk from being torn up by close encounters.
+ */
+Matrix* generate_disk(size_t n, uint64_t seed);
+
+/**
+ * Creates n/2 circular binaries with separations of about GENERATE_RADIUS/100
+ * (and a single body if n is odd) whose centers of mass are distributed like
+ * generate_uniform().
+ */
+Matrix* generate_binaries(size_t n, uint64_t seed);
+
+/**
+ * Finds a generator by name, one of uniform, plummer, disk, or binaries.
+ * Returns NULL if the name is not known.
+ */
+const Generator* generator_find(const char* name);
+
+/**
+ * Gets the dynamical time sqrt(R^3/(G M)) of n generated bodies (in s), the
+ * timescale of the uniform and Plummer spheres.
+ */
+double generate_time_unit(size_t n);
+
+/**
+ * Gets a suggested time step for n bodies from a generator, a thousandth of
+ * the shortest timescale of the system: the dynamical time of the whole
+ * system, the orbital time of the tightest binary, or that of the innermost
+ * orbit of the disk.
+ */
+double generate_time_step(const Generator* generator, size_t n);
@@ -40,11 +40,3 @@ inline static double gravitation(double mass_body_1, double mass_body_2, double*
 inline static double get_acceleration(double force, double mass) {
     return force / mass;
 }
-
-inline static void save_position(Matrix* output, double* position, size_t output_row, size_t n) {
-    for (size_t i = 0; i < n; i++) {
-        output->data[output_row*3*n + 3*i] = position[3*i];
-        output->data[output_row*3*n + 3*i+1] = position[3*i+1];
-        output->data[output_row*3*n + 3*i+2] = position[3*i+2];
-    }
-}
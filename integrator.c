@@ -0,0 +1,38 @@
+/**
+ * Time integrator definitions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "integrator.h"
+
+// Yoshida's 4th order coefficients: w1 = 1/(2-2^(1/3)), w0 = -2^(1/3)*w1
+#define YOSHIDA_W1 1.3512071919596578
+#define YOSHIDA_W0 -1.7024143839193155
+
+static const Integrator integrators[] = {
+    {"euler", 3, {{OP_FORCE, 0}, {OP_KICK, 1}, {OP_DRIFT, 1}}, true},
+    {"leapfrog", 5, {{OP_FORCE, 0}, {OP_KICK, 0.5}, {OP_DRIFT, 1},
+                     {OP_FORCE, 0}, {OP_KICK, 0.5}}, false},
+    // x += v*Δt + a*Δt^2/2 then v += (a+a')*Δt/2 is exactly kick-drift-kick
+    {"verlet", 5, {{OP_FORCE, 0}, {OP_KICK, 0.5}, {OP_DRIFT, 1},
+                   {OP_FORCE, 0}, {OP_KICK, 0.5}}, false},
+    {"yoshida", 10, {{OP_DRIFT, YOSHIDA_W1/2},
+                     {OP_FORCE, 0}, {OP_KICK, YOSHIDA_W1},
+                     {OP_DRIFT, (YOSHIDA_W0+YOSHIDA_W1)/2},
+                     {OP_FORCE, 0}, {OP_KICK, YOSHIDA_W0},
+                     {OP_DRIFT, (YOSHIDA_W0+YOSHIDA_W1)/2},
+                     {OP_FORCE, 0}, {OP_KICK, YOSHIDA_W1},
+                     {OP_DRIFT, YOSHIDA_W1/2}}, false},
+};
+
+/**
+ * Finds an integrator by name. Returns NULL if the name is not known.
+ */
+const Integrator* integrator_find(const char* name) {
+    for (size_t i = 0; i < sizeof(integrators)/sizeof(integrators[0]); i++) {
+        if (strcmp(integrators[i].name, name) == 0) { return &integrators[i]; }
+    }
+    return NULL;
+}
@@ -0,0 +1,74 @@
+/**
+ * Declares the time integrators (which are defined in integrator.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "body.h"
+
+
+// The kinds of operations that make up a step of an integrator
+#define OP_FORCE 1 // compute the accelerations at the current positions
+#define OP_KICK  2 // advance the velocities by coef*Δt using the accelerations
+#define OP_DRIFT 3 // advance the positions by coef*Δt using the velocities
+
+#define INTEGRATOR_MAX_OPS 10
+
+struct _IntegratorOp {
+    char type; // one of OP_FORCE, OP_KICK, or OP_DRIFT
+    double coef;
+};
+typedef struct _IntegratorOp IntegratorOp;
+
+struct _Integrator {
+    // A step of every integrator is a fixed sequence of force calculations,
+    // kicks, and drifts. A force calculation with no drift since the previous
+    // one gives the same accelerations so drivers should skip it, this makes
+    // the kick-drift-kick schemes need only a single force calculation per
+    // step.
+    const char* name;
+    size_t num_ops;
+    IntegratorOp ops[INTEGRATOR_MAX_OPS];
+    // true if the step is a force calculation followed by a kick and drift by
+    // the full Δt, which the drivers fuse into a single pass over the bodies
+    bool single_pass;
+};
+typedef struct _Integrator Integrator;
+
+
+/**
+ * Finds an integrator by name, one of:
+ *   - euler: semi-implicit Euler (1st order, the default)
+ *   - leapfrog: kick-drift-kick leapfrog (2nd order, symplectic)
+ *   - verlet: velocity Verlet (same steps as kick-drift-kick leapfrog)
+ *   - yoshida: 4th order Yoshida (symplectic, 3 force calculations per step)
+ * Returns NULL if the name is not known.
+ */
+const Integrator* integrator_find(const char* name);
+
+/**
+ * Advances the velocities of bodies i..k-1 by h times their accelerations.
+ */
+static inline void integrator_kick(Bodies* B, size_t i, size_t k,
+                                   const double* ax, const double* ay,
+                                   const double* az, double h) {
+    for (; i < k; i++) {
+        B->vx[i] += ax[i] * h;
+        B->vy[i] += ay[i] * h;
+        B->vz[i] += az[i] * h;
+    }
+}
+
+/**
+ * Advances the positions of bodies i..k-1 by h times their velocities.
+ */
+static inline void integrator_drift(Bodies* B, size_t i, size_t k, double h) {
+    for (; i < k; i++) {
+        B->x[i] += B->vx[i] * h;
+        B->y[i] += B->vy[i] * h;
+        B->z[i] += B->vz[i] * h;
+    }
+}
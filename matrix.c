@@ -6,13 +6,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
 #include <math.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "matrix.h"
 #include "matrix_io_helpers.h"
@@ -20,6 +24,17 @@
 #define DATA_MALLOCED   1 // data is from malloc(), needs free()
 #define DATA_MEMMAPPED  2 // data is from mmap(), needs munmap()
 #define DATA_BORROWED   3 // data is from elsewhere and should not be freed
+#define DATA_ARENA      4 // data is from an Arena, freed with the arena
+
+// The element-wise functions and the multiplication use OpenMP when this is
+// compiled with it, otherwise these directives are left out and everything
+// runs on the calling thread
+#ifdef _OPENMP
+#include <omp.h>
+#define __OMP(directive) _Pragma(directive)
+#else
+#define __OMP(directive)
+#endif
 
 
 //////////////////// Matrix Creation Functions //////////////////// 
@@ -43,7 +58,25 @@ Matrix* matrix_alloc(size_t rows, size_t cols, double* data, char data_source) {
  */
 Matrix* matrix_create_raw(size_t rows, size_t cols) {
     return matrix_alloc(rows, cols,
-        (double*)malloc(rows*cols*sizeof(double)), DATA_MALLOCED);
+        (double*)arena_aligned_alloc(rows*cols*sizeof(double)), DATA_MALLOCED);
+}
+
+/**
+ * Creates a new matrix of the given rows and columns with its data allocated
+ * from an arena. The data is NOT initialized. Returns NULL if the arena does
+ * not have enough room.
+ */
+Matrix* matrix_create_arena(Arena* A, size_t rows, size_t cols) {
+    double* data = (double*)arena_alloc(A, rows*cols*sizeof(double));
+    return data ? matrix_alloc(rows, cols, data, DATA_ARENA) : NULL;
+}
+
+/**
+ * Creates a matrix of the given rows and columns over existing data that is
+ * not freed with it.
+ */
+Matrix* matrix_borrow(size_t rows, size_t cols, double* data) {
+    return matrix_alloc(rows, cols, data, DATA_BORROWED);
 }
 
 /**
@@ -114,14 +147,80 @@ Matrix* matrix_copy(const Matrix* M) {
     return out;
 }
 
+// Files smaller than this many bytes are read and written by a single thread
+#define CSV_PARALLEL_MIN (1 << 20)
+
+// Pieces of a file given to each thread, more than one to even out the lines
+// that are slower to parse or format
+#define CSV_CHUNKS_PER_THREAD 4
+
+// About how many bytes of rows are formatted at a time by matrix_to_csv()
+#define CSV_WRITE_BLOCK (64 << 10)
+
 /**
- * Creates a new matrix by loading the data from the given CSV file. It is
- * assumed that every row in the file has the same number of values. If any
- * row has more values than the first row, those extra values are ignored. If
- * any row has less than the first row, the missing data is filled with 0s. If
- * there is a problem reading from the file, NULL is returned.
+ * Parses the memory-mapped contents of a CSV file. The file is split into
+ * chunks on line boundaries, then the lines of every chunk are counted and
+ * then parsed directly into their rows of the matrix, both split between the
+ * OpenMP threads.
  */
-Matrix* matrix_from_csv(FILE* file) {
+static Matrix* __csv_parse(const char* data, size_t size) {
+    const char* end = data + size;
+    const char* eol = (const char*)memchr(data, '\n', size);
+    size_t cols = __csv_count_vals(data, eol ? eol : end);
+    if (cols == 0) { return NULL; }
+
+    size_t num_chunks = 1;
+#ifdef _OPENMP
+    if (size >= CSV_PARALLEL_MIN) { num_chunks = omp_get_max_threads() * CSV_CHUNKS_PER_THREAD; }
+#endif
+    size_t* starts = (size_t*)malloc((2*num_chunks + 1) * sizeof(size_t));
+    if (!starts) { return NULL; }
+    size_t* first_row = starts + num_chunks + 1;
+    starts[0] = 0;
+    for (size_t k = 1; k < num_chunks; k++) {
+        size_t pos = size / num_chunks * k;
+        if (pos < starts[k-1]) { pos = starts[k-1]; }
+        const char* nl = (const char*)memchr(data + pos, '\n', size - pos);
+        starts[k] = nl ? (size_t)(nl - data) + 1 : size;
+    }
+    starts[num_chunks] = size;
+
+    // count the lines of each chunk (the last one may not end with a newline)
+    __OMP("omp parallel for schedule(dynamic, 1)")
+    for (size_t k = 0; k < num_chunks; k++) {
+        size_t lines = 0;
+        for (const char *s = data + starts[k], *e = data + starts[k+1]; s < e; lines++) {
+            const char* nl = (const char*)memchr(s, '\n', e - s);
+            s = nl ? nl + 1 : e;
+        }
+        first_row[k] = lines;
+    }
+    size_t rows = 0;
+    for (size_t k = 0; k < num_chunks; k++) {
+        size_t lines = first_row[k];
+        first_row[k] = rows;
+        rows += lines;
+    }
+
+    double* values = (double*)malloc(rows*cols*sizeof(double));
+    if (!values) { free(starts); return NULL; }
+    __OMP("omp parallel for schedule(dynamic, 1)")
+    for (size_t k = 0; k < num_chunks; k++) {
+        double* row = &values[first_row[k]*cols];
+        for (const char *s = data + starts[k], *e = data + starts[k+1]; s < e; row += cols) {
+            const char* nl = (const char*)memchr(s, '\n', e - s);
+            __csv_parse_line(s, nl ? nl : e, row, cols);
+            s = nl ? nl + 1 : e;
+        }
+    }
+    free(starts);
+    return matrix_alloc(rows, cols, values, DATA_MALLOCED);
+}
+
+/**
+ * Reads a CSV file one line at a time, for files that cannot be mapped.
+ */
+static Matrix* __csv_read_stream(FILE* file) {
     // Get the first line from the file
     char* line = NULL;
     size_t len = 0;
@@ -153,11 +252,37 @@ Matrix* matrix_from_csv(FILE* file) {
         (double*)realloc(data, rows*cols*sizeof(double)), DATA_MALLOCED);
 }
 
+/**
+ * Creates a new matrix by loading the data from the given CSV file. It is
+ * assumed that every row in the file has the same number of values. If any
+ * row has more values than the first row, those extra values are ignored. If
+ * any row has less than the first row, the missing data is filled with 0s. If
+ * there is a problem reading from the file, NULL is returned.
+ *
+ * Regular files are memory-mapped and parsed in parallel (see __csv_parse()),
+ * anything else is read one line at a time.
+ */
+Matrix* matrix_from_csv(FILE* file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && ftell(file) == 0) {
+        if (st.st_size == 0) { return NULL; }
+        void* x = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (x != MAP_FAILED) {
+            madvise(x, st.st_size, MADV_WILLNEED);
+            Matrix* M = __csv_parse((const char*)x, st.st_size);
+            munmap(x, st.st_size);
+            fseek(file, 0, SEEK_END);
+            return M;
+        }
+    }
+    return __csv_read_stream(file);
+}
+
 /**
  * Same as matrix_from_csv() but takes a file path instead.
  */
 Matrix* matrix_from_csv_path(const char* path) {
-    FILE* f = fopen(path, "r+");
+    FILE* f = fopen(path, "r");
     if (!f) { return NULL; }
     Matrix* M = matrix_from_csv(f);
     fclose(f);
@@ -165,18 +290,39 @@ Matrix* matrix_from_csv_path(const char* path) {
 }
 
 /**
- * Saves a matrix to a CSV file.
+ * Saves a matrix to a CSV file. Blocks of rows are formatted into their own
+ * buffers, split between the OpenMP threads, and then written in order.
+ * Returns false if it cannot be written.
  * 
  * If the file argument is given as stdout, this will print it to the terminal.
  */
-void matrix_to_csv(FILE* file, const Matrix* M) {
-    if (M->rows < 1 || M->cols < 1) { return; }
-    for (size_t i = 0, ind = 0; i < M->rows; i++, ind++) {
-        for (size_t j = 0; j < M->cols-1; j++, ind++) {
-            fprintf(file, "%f,", M->data[ind]);
+bool matrix_to_csv(FILE* file, const Matrix* M) {
+    if (M->rows < 1 || M->cols < 1) { return true; }
+    size_t block_rows = CSV_WRITE_BLOCK / (M->cols * 12); // about 12 bytes per value
+    if (block_rows == 0) { block_rows = 1; }
+    size_t num_blocks = 1;
+#ifdef _OPENMP
+    if (M->size * 12 >= CSV_PARALLEL_MIN) { num_blocks = omp_get_max_threads() * CSV_CHUNKS_PER_THREAD; }
+#endif
+    char** bufs = (char**)calloc(num_blocks, sizeof(char*));
+    size_t* caps = (size_t*)calloc(num_blocks, sizeof(size_t));
+    ssize_t* lens = (ssize_t*)calloc(num_blocks, sizeof(ssize_t));
+    bool ok = bufs && caps && lens;
+    for (size_t first = 0; ok && first < M->rows; first += num_blocks * block_rows) {
+        __OMP("omp parallel for schedule(dynamic, 1)")
+        for (size_t b = 0; b < num_blocks; b++) {
+            size_t lo = first + b*block_rows, hi = lo + block_rows;
+            if (lo > M->rows) { lo = M->rows; }
+            if (hi > M->rows) { hi = M->rows; }
+            lens[b] = __csv_format_rows(M, lo, hi, &bufs[b], &caps[b], 0);
+        }
+        for (size_t b = 0; ok && b < num_blocks; b++) {
+            ok = lens[b] >= 0 && fwrite(bufs[b], 1, lens[b], file) == (size_t)lens[b];
         }
-        fprintf(file, "%f\n", M->data[ind]);
     }
+    if (bufs) { for (size_t b = 0; b < num_blocks; b++) { free(bufs[b]); } }
+    free(bufs); free(caps); free(lens);
+    return ok;
 }
 
 /**
@@ -185,37 +331,46 @@ void matrix_to_csv(FILE* file, const Matrix* M) {
 bool matrix_to_csv_path(const char* path, const Matrix* M) {
     FILE* f = fopen(path, "w");
     if (!f) { return false; }
-    matrix_to_csv(f, M);
-    fclose(f);
-    return true;
+    bool ok = matrix_to_csv(f, M);
+    return fclose(f) == 0 && ok;
 }
 
 /**
- * Creates a new matrix by loading the data from the given NPY file. This is
- * a file format used by the numpy library. This function only supports arrays
- * that are little-endian doubles, c-contiguous, and 1 or 2 dimensional. The
- * file is loaded as memory-mapped so it is backed by the file and loaded
- * on-demand. The file should be opened for reading or reading and writing.
- * 
- * This will return NULL if the data cannot be read, the file format is not
- * recognized, there are memory allocation issues, or the array is not a
- * supported shape or data type.
+ * Memory maps the data of a NPY file with the given protection and flags. The
+ * pages are marked as being read sequentially so the kernel reads far ahead
+ * of the first use.
  */
-Matrix* matrix_from_npy(FILE* file) {
+static Matrix* __npy_map(FILE* file, int prot, int flags) {
     // Read the header, check it, and get the shape of the matrix
     size_t sh[2], offset;
     if (!__npy_read_header(file, sh, &offset)) { return NULL; }
 
     // Get the memory mapped data
-    void* x = (void*)mmap(NULL, sh[0]*sh[1]*sizeof(double) + offset,
-                          PROT_READ|PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    size_t length = sh[0]*sh[1]*sizeof(double) + offset;
+    void* x = (void*)mmap(NULL, length, prot, flags, fileno(file), 0);
     if (x == MAP_FAILED) { return NULL; }
+    madvise(x, length, MADV_SEQUENTIAL);
 
     // Make the matrix itself
     double* data = (double*)(((char*)x) + offset);
     return matrix_alloc(sh[0], sh[1], data, DATA_MEMMAPPED);
 }
 
+/**
+ * Creates a new matrix by loading the data from the given NPY file. This is
+ * a file format used by the numpy library. This function only supports arrays
+ * that are little-endian doubles, c-contiguous, and 1 or 2 dimensional. The
+ * file is loaded as memory-mapped so it is backed by the file and loaded
+ * on-demand. The file should be opened for reading or reading and writing.
+ * 
+ * This will return NULL if the data cannot be read, the file format is not
+ * recognized, there are memory allocation issues, or the array is not a
+ * supported shape or data type.
+ */
+Matrix* matrix_from_npy(FILE* file) {
+    return __npy_map(file, PROT_READ|PROT_WRITE, MAP_SHARED);
+}
+
 /**
  * Same as matrix_from_npy() but takes a file path instead.
  */
@@ -228,23 +383,51 @@ Matrix* matrix_from_npy_path(const char* path) {
 }
 
 /**
- * Saves a matrix to a NPY file. This is a file format used by the numpy
- * library. This will return false if the data cannot be written.
+ * Same as matrix_from_npy_path() but chooses how the file is mapped with one
+ * of the NPY_MAP_* modes. Only NPY_MAP_SHARED needs write access to the file.
  */
-bool matrix_to_npy(FILE* file, const Matrix* M) {
-    // create the header
-    char header[128];
-    size_t len = snprintf(header, sizeof(header), "\x93NUMPY\x01   "
+Matrix* matrix_from_npy_path_mapped(const char* path, int mode) {
+    if (mode == NPY_MAP_SHARED) { return matrix_from_npy_path(path); }
+    if (mode != NPY_MAP_READONLY && mode != NPY_MAP_PRIVATE) { errno = EINVAL; return NULL; }
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+    Matrix* M = mode == NPY_MAP_READONLY ? __npy_map(f, PROT_READ, MAP_SHARED) :
+        __npy_map(f, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+    fclose(f);
+    return M;
+}
+
+/**
+ * Fills in the NPY_HEADER_SIZE byte header of a NPY file for a rows-by-cols
+ * matrix of doubles.
+ */
+void matrix_npy_header(char* header, size_t rows, size_t cols) {
+    size_t len = snprintf(header, NPY_HEADER_SIZE, "\x93NUMPY\x01   "
         "{'descr': '<f8', 'fortran_order': False, 'shape': (%zu, %zu), }",
-        M->rows, M->cols);
-    if (len < 0) { return false; }
+        rows, cols);
     header[7] = 0; // have to after the string is written
-    *(unsigned short*)&header[8] = sizeof(header) - 10;
-    memset(header + len, ' ', sizeof(header)-len-1);
-    header[sizeof(header)-1] = '\n';
+    *(unsigned short*)&header[8] = NPY_HEADER_SIZE - 10;
+    memset(header + len, ' ', NPY_HEADER_SIZE-len-1);
+    header[NPY_HEADER_SIZE-1] = '\n';
+}
+
+/**
+ * Writes the header of a NPY file for a rows-by-cols matrix of doubles.
+ * Returns false if it cannot be written.
+ */
+static bool __npy_write_header(FILE* file, size_t rows, size_t cols) {
+    char header[NPY_HEADER_SIZE];
+    matrix_npy_header(header, rows, cols);
+    return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
 
+/**
+ * Saves a matrix to a NPY file. This is a file format used by the numpy
+ * library. This will return false if the data cannot be written.
+ */
+bool matrix_to_npy(FILE* file, const Matrix* M) {
     // write the header and the data
-    return fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+    return __npy_write_header(file, M->rows, M->cols) &&
         fwrite(M->data, sizeof(double), M->size, file) == M->size;
 }
 
@@ -260,6 +443,377 @@ bool matrix_to_npy_path(const char* path, const Matrix* M) {
 }
 
 
+/**
+ * Encodes and writes the chunks of the rows collected by a chunked writer and
+ * records where they are in the index.
+ */
+static void __chunk_write_row(NpyWriter* W) {
+    size_t cols_chunks = (W->cols + W->chunk_cols - 1) / W->chunk_cols;
+    for (size_t cc = 0; cc < cols_chunks; cc++) {
+        size_t c0 = cc*W->chunk_cols;
+        size_t nc = W->cols - c0 < W->chunk_cols ? W->cols - c0 : W->chunk_cols;
+        size_t size = __chunk_encode(W->chunk + c0, W->cols, W->chunk_filled, nc,
+                                     W->encoding, W->scratch, W->packed);
+        uint64_t entry[2] = {(uint64_t)ftell(W->file), size};
+        long index = sizeof(struct __ChunkHeader) + (W->chunk_row*cols_chunks + cc)*CHUNK_INDEX_ENTRY;
+        if (fwrite(W->packed, 1, size, W->file) != size || fseek(W->file, index, SEEK_SET) != 0 ||
+            fwrite(entry, 1, sizeof(entry), W->file) != sizeof(entry) ||
+            fseek(W->file, 0, SEEK_END) != 0) {
+            atomic_store(&W->failed, true);
+        }
+    }
+    W->chunk_row++;
+    W->chunk_filled = 0;
+}
+
+/**
+ * Writes count contiguous rows to the file of a NPY writer, for a chunked
+ * file they are collected until there are enough for a row of chunks.
+ */
+static void __npy_writer_put(NpyWriter* W, const double* rows, size_t count) {
+    if (!W->encoding) {
+        if (fwrite(rows, sizeof(double)*W->cols, count, W->file) != count) {
+            atomic_store(&W->failed, true);
+        }
+        return;
+    }
+    for (size_t r = 0; r < count; r++) {
+        memcpy(&W->chunk[W->chunk_filled*W->cols], &rows[r*W->cols], sizeof(double)*W->cols);
+        if (++W->chunk_filled == W->chunk_rows) { __chunk_write_row(W); }
+    }
+}
+
+/**
+ * Writes out the rows of a NPY writer from its tail up to the given head
+ * (which wrap around the ring at most once) and, every sync_rows rows,
+ * flushes them all the way to the disk. Afterwards the slots are free again.
+ */
+static void __npy_writer_drain(NpyWriter* W, size_t head) {
+    size_t tail = atomic_load_explicit(&W->tail, memory_order_relaxed);
+    size_t count = head - tail, start = tail % W->ring_rows;
+    size_t first = count < W->ring_rows - start ? count : W->ring_rows - start;
+    __npy_writer_put(W, &W->buffer[start*W->cols], first);
+    __npy_writer_put(W, W->buffer, count - first);
+    W->unsynced += count;
+    if (W->sync_rows && W->unsynced >= W->sync_rows) {
+        if (fflush(W->file) != 0 || fsync(fileno(W->file)) != 0) { atomic_store(&W->failed, true); }
+        W->unsynced = 0;
+    }
+    atomic_store_explicit(&W->tail, head, memory_order_release);
+}
+
+/**
+ * Briefly sleeps while waiting for the other side of a background writer.
+ */
+static inline void __npy_writer_wait() {
+    struct timespec ts = {0, 50000};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * The background writer thread, drains the ring until the writer is closed.
+ */
+static void* __npy_writer_thread(void* arg) {
+    NpyWriter* W = (NpyWriter*)arg;
+    while (true) {
+        // closing has to be read first so no row pushed before it is missed
+        bool closing = atomic_load(&W->closing);
+        size_t head = atomic_load_explicit(&W->head, memory_order_acquire);
+        if (head != atomic_load_explicit(&W->tail, memory_order_relaxed)) { __npy_writer_drain(W, head); }
+        else if (closing) { break; }
+        else { __npy_writer_wait(); }
+    }
+    return NULL;
+}
+
+/**
+ * Allocates a NPY writer for the given path and shape with everything but the
+ * header set up. Returns NULL if it cannot be created.
+ */
+static NpyWriter* __npy_writer_create(const char* path, const char* mode,
+                                      size_t rows, size_t cols,
+                                      size_t ring_rows, size_t sync_rows,
+                                      bool background) {
+    if (ring_rows == 0) { ring_rows = NPY_WRITER_BUFFER / (cols*sizeof(double) + 1) + 1; }
+    if (sync_rows && ring_rows > sync_rows) { ring_rows = sync_rows; }
+    if (background && ring_rows < 2) { ring_rows = 2; } // one to fill while one is written
+    if (ring_rows > rows) { ring_rows = rows ? rows : 1; }
+    NpyWriter* W = (NpyWriter*)malloc(sizeof(NpyWriter));
+    if (!W) { return NULL; }
+    W->rows = rows; W->cols = cols;
+    W->written = W->unsynced = 0;
+    W->ring_rows = ring_rows;
+    W->sync_rows = sync_rows;
+    atomic_init(&W->head, 0);
+    atomic_init(&W->tail, 0);
+    atomic_init(&W->closing, false);
+    atomic_init(&W->failed, false);
+    W->background = background;
+    W->encoding = 0;
+    W->chunk = NULL;
+    W->scratch = W->packed = NULL;
+    W->buffer = (double*)malloc((ring_rows+1)*cols*sizeof(double)); // +1 for the scratch row
+    W->file = fopen(path, mode);
+    if (!W->buffer || !W->file) {
+        if (W->file) { fclose(W->file); }
+        free(W->buffer);
+        free(W);
+        return NULL;
+    }
+    return W;
+}
+
+/**
+ * Closes the file (if it is still open) and frees a NPY writer whose thread is
+ * not running. Always returns NULL.
+ */
+static NpyWriter* __npy_writer_destroy(NpyWriter* W) {
+    if (W->file) { fclose(W->file); }
+    free(W->buffer);
+    free(W->chunk);
+    free(W->scratch);
+    free(W->packed);
+    free(W);
+    return NULL;
+}
+
+/**
+ * Creates a NPY file for a rows-by-cols matrix whose rows are appended one at
+ * a time. The header with the final shape is written immediately. The rows
+ * go through a ring of ring_rows pre-allocated rows (0 picks about
+ * NPY_WRITER_BUFFER bytes worth) and the data is fsync()ed to the disk every
+ * sync_rows rows (0 only syncs when the writer is closed).
+ * 
+ * If background is true the ring is drained to the file by a separate thread
+ * so writing overlaps with producing the next rows. When that thread falls
+ * behind npy_writer_row() waits for a free row instead of allocating more.
+ * 
+ * Returns NULL if the file cannot be created.
+ */
+NpyWriter* npy_writer_open(const char* path, size_t rows, size_t cols,
+                           size_t ring_rows, size_t sync_rows, bool background) {
+    NpyWriter* W = __npy_writer_create(path, "wb", rows, cols, ring_rows, sync_rows, background);
+    if (!W) { return NULL; }
+    if (!__npy_write_header(W->file, rows, cols) ||
+        (background && pthread_create(&W->thread, NULL, __npy_writer_thread, W) != 0)) {
+        return __npy_writer_destroy(W);
+    }
+    return W;
+}
+
+/**
+ * Same as npy_writer_open() but continues an existing NPY file of the same
+ * shape after its first written rows, which are kept. Anything after them is
+ * overwritten. Returns NULL if the file cannot be opened or is not a NPY file
+ * of that shape.
+ */
+NpyWriter* npy_writer_resume(const char* path, size_t rows, size_t cols,
+                             size_t written, size_t sync_rows, bool background) {
+    NpyWriter* W = __npy_writer_create(path, "r+b", rows, cols, 0, sync_rows, background);
+    if (!W) { return NULL; }
+    size_t sh[2], offset;
+    if (!__npy_read_header(W->file, sh, &offset) || sh[0] != rows || sh[1] != cols || written > rows ||
+        fseek(W->file, (long)(offset + written*cols*sizeof(double)), SEEK_SET) != 0) {
+        errno = EINVAL;
+        return __npy_writer_destroy(W);
+    }
+    W->written = written;
+    if (background && pthread_create(&W->thread, NULL, __npy_writer_thread, W) != 0) {
+        return __npy_writer_destroy(W);
+    }
+    return W;
+}
+
+/**
+ * Same as npy_writer_open() but creates a chunked matrix file. The matrix is
+ * split into chunk_rows-by-chunk_cols blocks (0 picks MATRIX_CHUNK_ROWS or
+ * MATRIX_CHUNK_COLS) which are compressed separately with one of the
+ * MATRIX_CHUNK_* encodings and an index of them is kept at the start of the
+ * file, so any block of the matrix can be read back with
+ * matrix_from_chunked_path() without reading the rest. A row of chunks is
+ * written once all of its rows are pushed.
+ */
+NpyWriter* npy_writer_open_chunked(const char* path, size_t rows, size_t cols,
+                                   size_t chunk_rows, size_t chunk_cols,
+                                   int encoding, size_t sync_rows,
+                                   bool background) {
+    if (encoding != MATRIX_CHUNK_DELTA && encoding != MATRIX_CHUNK_FLOAT32) { errno = EINVAL; return NULL; }
+    if (chunk_rows == 0) { chunk_rows = MATRIX_CHUNK_ROWS; }
+    if (chunk_cols == 0) { chunk_cols = MATRIX_CHUNK_COLS; }
+    if (chunk_rows > rows) { chunk_rows = rows ? rows : 1; }
+    if (chunk_cols > cols) { chunk_cols = cols ? cols : 1; }
+    NpyWriter* W = __npy_writer_create(path, "wb", rows, cols, 0, sync_rows, background);
+    if (!W) { return NULL; }
+    W->encoding = encoding;
+    W->chunk_rows = chunk_rows;
+    W->chunk_cols = chunk_cols;
+    W->chunk_filled = W->chunk_row = 0;
+    W->chunk = (double*)malloc(chunk_rows*cols*sizeof(double));
+    W->scratch = (unsigned char*)malloc(chunk_rows*chunk_cols*sizeof(double));
+    W->packed = (unsigned char*)malloc(RLE_BOUND(chunk_rows*chunk_cols*sizeof(double)));
+    if (!W->chunk || !W->scratch || !W->packed) { return __npy_writer_destroy(W); }
+
+    // write the header and an empty index that is filled in as chunks are
+    // written
+    struct __ChunkHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHUNK_MAGIC, sizeof(header.magic));
+    header.rows = rows; header.cols = cols;
+    header.chunk_rows = chunk_rows; header.chunk_cols = chunk_cols;
+    header.encoding = encoding;
+    size_t num_chunks = (rows + chunk_rows - 1) / chunk_rows * ((cols + chunk_cols - 1) / chunk_cols);
+    uint64_t empty[2] = {0, 0};
+    bool ok = fwrite(&header, sizeof(header), 1, W->file) == 1;
+    for (size_t i = 0; i < num_chunks && ok; i++) { ok = fwrite(empty, sizeof(empty), 1, W->file) == 1; }
+    if (!ok || (background && pthread_create(&W->thread, NULL, __npy_writer_thread, W) != 0)) {
+        return __npy_writer_destroy(W);
+    }
+    return W;
+}
+
+/**
+ * Returns the space for the next row of a NPY writer. Once it is filled in
+ * with cols values npy_writer_push() must be called before asking for another
+ * row. Rows beyond the shape given when it was opened are discarded and make
+ * closing the writer fail.
+ */
+double* npy_writer_row(NpyWriter* W) {
+    if (W->written == W->rows) {
+        atomic_store(&W->failed, true);
+        return &W->buffer[W->ring_rows*W->cols]; // scratch row
+    }
+    size_t head = atomic_load_explicit(&W->head, memory_order_relaxed);
+    if (W->background) {
+        // backpressure: wait for the writer thread to free a row
+        while (head - atomic_load_explicit(&W->tail, memory_order_acquire) == W->ring_rows) {
+            __npy_writer_wait();
+        }
+    } else if (head - atomic_load_explicit(&W->tail, memory_order_relaxed) == W->ring_rows) {
+        __npy_writer_drain(W, head);
+    }
+    return &W->buffer[(head % W->ring_rows)*W->cols];
+}
+
+/**
+ * Adds the row last returned by npy_writer_row() to the file.
+ */
+void npy_writer_push(NpyWriter* W) {
+    if (W->written == W->rows) { return; } // was the scratch row
+    W->written++;
+    size_t head = atomic_load_explicit(&W->head, memory_order_relaxed);
+    atomic_store_explicit(&W->head, head + 1, memory_order_release);
+}
+
+/**
+ * Waits for all of the pushed rows of a NPY file to be written and syncs them
+ * to the disk. Returns false if anything so far could not be written. This
+ * is not supported for chunked files since part of a row of chunks may still
+ * be in memory.
+ */
+bool npy_writer_sync(NpyWriter* W) {
+    if (W->encoding) { return false; }
+    size_t head = atomic_load_explicit(&W->head, memory_order_relaxed);
+    if (W->background) {
+        // once the thread has caught up it does not touch the file until the
+        // next row is pushed
+        while (atomic_load_explicit(&W->tail, memory_order_acquire) != head) { __npy_writer_wait(); }
+    } else {
+        __npy_writer_drain(W, head);
+    }
+    return !atomic_load(&W->failed) && fflush(W->file) == 0 && fsync(fileno(W->file)) == 0;
+}
+
+/**
+ * Writes out any remaining rows of a NPY writer, syncs the file to the disk,
+ * closes it, and frees the writer. Returns false if anything could not be
+ * written or the number of rows does not match the shape.
+ */
+bool npy_writer_close(NpyWriter* W) {
+    if (W->background) {
+        atomic_store(&W->closing, true);
+        pthread_join(W->thread, NULL);
+    } else {
+        __npy_writer_drain(W, atomic_load(&W->head));
+    }
+    if (W->encoding && W->chunk_filled) { __chunk_write_row(W); } // the last, short, row of chunks
+    bool ok = !atomic_load(&W->failed) && W->written == W->rows &&
+        fflush(W->file) == 0 && fsync(fileno(W->file)) == 0;
+    ok = fclose(W->file) == 0 && ok;
+    W->file = NULL;
+    __npy_writer_destroy(W);
+    return ok;
+}
+
+/**
+ * Creates a new matrix from rows row_start..row_end-1 and columns
+ * col_start..col_end-1 of a chunked matrix file written by a NpyWriter. Ends
+ * past the shape of the file are cut to it, so the whole matrix can be read
+ * with ends of SIZE_MAX. Only the chunks that overlap the block are read and
+ * decoded.
+ * 
+ * This will return NULL if the file cannot be read, is not a chunked matrix
+ * file, the block is empty, or a chunk the block needs was never written.
+ */
+Matrix* matrix_from_chunked_path(const char* path,
+                                 size_t row_start, size_t row_end,
+                                 size_t col_start, size_t col_end) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+    struct __ChunkHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, CHUNK_MAGIC, sizeof(header.magic)) != 0 ||
+        header.chunk_rows == 0 || header.chunk_cols == 0) {
+        fclose(f);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (row_end > header.rows) { row_end = header.rows; }
+    if (col_end > header.cols) { col_end = header.cols; }
+    if (row_start >= row_end || col_start >= col_end) { fclose(f); errno = EINVAL; return NULL; }
+
+    size_t cr = header.chunk_rows, cc = header.chunk_cols;
+    size_t cols_chunks = (header.cols + cc - 1) / cc;
+    Matrix* M = matrix_create_raw(row_end - row_start, col_end - col_start);
+    double* block = (double*)malloc(cr*cc*sizeof(double));
+    unsigned char* scratch = (unsigned char*)malloc(cr*cc*sizeof(double));
+    unsigned char* packed = (unsigned char*)malloc(RLE_BOUND(cr*cc*sizeof(double)));
+    bool ok = M && block && scratch && packed;
+
+    // go through every chunk that overlaps the block
+    for (size_t rc = row_start / cr; ok && rc*cr < row_end; rc++) {
+        size_t r0 = rc*cr, nr = header.rows - r0 < cr ? header.rows - r0 : cr;
+        for (size_t c = col_start / cc; ok && c*cc < col_end; c++) {
+            size_t c0 = c*cc, nc = header.cols - c0 < cc ? header.cols - c0 : cc;
+            uint64_t entry[2];
+            long index = sizeof(header) + (rc*cols_chunks + c)*CHUNK_INDEX_ENTRY;
+            ok = fseek(f, index, SEEK_SET) == 0 && fread(entry, sizeof(entry), 1, f) == 1 &&
+                entry[1] != 0 && entry[1] <= RLE_BOUND(cr*cc*sizeof(double)) &&
+                fseek(f, (long)entry[0], SEEK_SET) == 0 &&
+                fread(packed, 1, entry[1], f) == entry[1] &&
+                __chunk_decode(packed, entry[1], nr, nc, header.encoding, scratch, block);
+            if (!ok) { break; }
+
+            // copy the part of the chunk that is in the block
+            size_t i0 = r0 > row_start ? r0 : row_start, i1 = r0 + nr < row_end ? r0 + nr : row_end;
+            size_t j0 = c0 > col_start ? c0 : col_start, j1 = c0 + nc < col_end ? c0 + nc : col_end;
+            for (size_t i = i0; i < i1; i++) {
+                memcpy(&MATRIX_AT(M, i - row_start, j0 - col_start), &block[(i - r0)*nc + (j0 - c0)],
+                       (j1 - j0)*sizeof(double));
+            }
+        }
+    }
+    free(block);
+    free(scratch);
+    free(packed);
+    fclose(f);
+    if (!ok) {
+        if (M) { matrix_free(M); }
+        errno = EINVAL;
+        return NULL;
+    }
+    return M;
+}
+
 //////////////////// Matrix Comparison Functions //////////////////// 
 
 /**
@@ -293,11 +847,109 @@ bool matrix_allclose(const Matrix* A, const Matrix* B, double rtol, double atol)
 
 //////////////////// Basic Matrix Functions //////////////////// 
 
+// The built-in unary and binary functions (see matrix.h) get their own loops
+// that the compiler can inline and vectorize, anything else is called through
+// the pointer once per element. The built-in ones are recognized by their
+// address, which is the same in every file since they are defined here.
+#define MATRIX_UNARY_OPS(X) X(reciprocal) X(positive) X(negative) X(fabs)
+#define MATRIX_BINARY_OPS(X) X(add) X(subtract) X(multiply) X(divide)
+
+extern inline double reciprocal(double a);
+extern inline double positive(double a);
+extern inline double negative(double a);
+extern inline double add(double a, double b);
+extern inline double subtract(double a, double b);
+extern inline double multiply(double a, double b);
+extern inline double divide(double a, double b);
+
+// Element-wise passes over fewer elements than this are not split between
+// threads
+#define MATRIX_PARALLEL_MIN (1 << 16)
+
+// The kernels of the built-in functions work on n elements, they allow out to
+// be the same as an input (but not to partially overlap one) so that they
+// also work in-place
+typedef void (*unary_kernel)(double* out, const double* a, size_t n);
+typedef void (*matrix_matrix_kernel)(double* out, const double* a, const double* b, size_t n);
+typedef void (*matrix_scalar_kernel)(double* out, const double* a, double b, size_t n);
+typedef void (*scalar_matrix_kernel)(double* out, double a, const double* b, size_t n);
+
+#define __UNARY_KERNEL(name) \
+    static void __unary_##name(double* out, const double* a, size_t n) { \
+        _Pragma("GCC ivdep") \
+        for (size_t i = 0; i < n; i++) { out[i] = name(a[i]); } \
+    }
+#define __BINARY_KERNELS(name) \
+    static void __matrix_matrix_##name(double* out, const double* a, const double* b, size_t n) { \
+        _Pragma("GCC ivdep") \
+        for (size_t i = 0; i < n; i++) { out[i] = name(a[i], b[i]); } \
+    } \
+    static void __matrix_scalar_##name(double* out, const double* a, double b, size_t n) { \
+        _Pragma("GCC ivdep") \
+        for (size_t i = 0; i < n; i++) { out[i] = name(a[i], b); } \
+    } \
+    static void __scalar_matrix_##name(double* out, double a, const double* b, size_t n) { \
+        _Pragma("GCC ivdep") \
+        for (size_t i = 0; i < n; i++) { out[i] = name(a, b[i]); } \
+    }
+MATRIX_UNARY_OPS(__UNARY_KERNEL)
+MATRIX_BINARY_OPS(__BINARY_KERNELS)
+
+/**
+ * Finds the kernel of a built-in unary function. Returns NULL if func is not
+ * one of them.
+ */
+static unary_kernel __unary_kernel(unary_func func) {
+    #define __FIND(name) if (func == name) { return __unary_##name; }
+    MATRIX_UNARY_OPS(__FIND)
+    #undef __FIND
+    return NULL;
+}
+
+/**
+ * Finds the kernels of a built-in binary function, one for each kind of
+ * arguments. Return NULL if func is not one of them.
+ */
+static matrix_matrix_kernel __matrix_matrix_kernel(binary_func func) {
+    #define __FIND(name) if (func == name) { return __matrix_matrix_##name; }
+    MATRIX_BINARY_OPS(__FIND)
+    #undef __FIND
+    return NULL;
+}
+static matrix_scalar_kernel __matrix_scalar_kernel(binary_func func) {
+    #define __FIND(name) if (func == name) { return __matrix_scalar_##name; }
+    MATRIX_BINARY_OPS(__FIND)
+    #undef __FIND
+    return NULL;
+}
+static scalar_matrix_kernel __scalar_matrix_kernel(binary_func func) {
+    #define __FIND(name) if (func == name) { return __scalar_matrix_##name; }
+    MATRIX_BINARY_OPS(__FIND)
+    #undef __FIND
+    return NULL;
+}
+
+// Runs statement for blocks [i, i+len) of n elements, split between the
+// threads if there are enough of them
+#define __ELEMENTWISE_BLOCKS(size, statement) { \
+    const size_t __n = (size); \
+    __OMP("omp parallel for if(__n >= MATRIX_PARALLEL_MIN) schedule(static)") \
+    for (size_t i = 0; i < __n; i += MATRIX_PARALLEL_MIN) { \
+        size_t len = __n - i < MATRIX_PARALLEL_MIN ? __n - i : MATRIX_PARALLEL_MIN; \
+        statement; \
+    } \
+}
+
 /**
  * Apply a unary function to every element of a matrix replacing the value with
  * the return value of the function. This operates in-place.
  */
 void matrix_apply(Matrix* M, unary_func func) {
+    unary_kernel kernel = __unary_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(M->size, kernel(M->data + i, M->data + i, len));
+        return;
+    }
     for (size_t i = 0; i < M->size; i++) { M->data[i] = func(M->data[i]); }
 }
 
@@ -307,6 +959,11 @@ void matrix_apply(Matrix* M, unary_func func) {
  */
 Matrix* matrix_map(const Matrix* M, unary_func func) {
     Matrix* out = matrix_create_raw(M->rows, M->cols);
+    unary_kernel kernel = __unary_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(M->size, kernel(out->data + i, M->data + i, len));
+        return out;
+    }
     for (size_t i = 0; i < M->size; i++) { out->data[i] = func(M->data[i]); }
     return out;
 }
@@ -319,6 +976,11 @@ Matrix* matrix_map(const Matrix* M, unary_func func) {
  */
 bool matrix_matrix_apply(Matrix* A, const Matrix* B, binary_func func) {
     if (A->rows != B->rows || A->cols != B->cols) { return false; }
+    matrix_matrix_kernel kernel = __matrix_matrix_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(A->size, kernel(A->data + i, A->data + i, B->data + i, len));
+        return true;
+    }
     for (size_t i = 0; i < A->size; i++) {
         A->data[i] = func(A->data[i], B->data[i]);
     }
@@ -333,6 +995,11 @@ bool matrix_matrix_apply(Matrix* A, const Matrix* B, binary_func func) {
 Matrix* matrix_matrix_map(const Matrix* A, const Matrix* B, binary_func func) {
     if (A->rows != B->rows || A->cols != B->cols) { return NULL; }
     Matrix* out = matrix_create_raw(A->rows, A->cols);
+    matrix_matrix_kernel kernel = __matrix_matrix_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(A->size, kernel(out->data + i, A->data + i, B->data + i, len));
+        return out;
+    }
     for (size_t i = 0; i < A->size; i++) {
         out->data[i] = func(A->data[i], B->data[i]);
     }
@@ -345,6 +1012,11 @@ Matrix* matrix_matrix_map(const Matrix* A, const Matrix* B, binary_func func) {
  * with the return value of the function. This operates in-place.
  */
 void matrix_scalar_apply(Matrix* A, double b, binary_func func) {
+    matrix_scalar_kernel kernel = __matrix_scalar_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(A->size, kernel(A->data + i, A->data + i, b, len));
+        return;
+    }
     for (size_t i = 0; i < A->size; i++) { A->data[i] = func(A->data[i], b); }
 }
 
@@ -355,6 +1027,11 @@ void matrix_scalar_apply(Matrix* A, double b, binary_func func) {
  */
 Matrix* matrix_scalar_map(const Matrix* A, double b, binary_func func) {
     Matrix* out = matrix_create_raw(A->rows, A->cols);
+    matrix_scalar_kernel kernel = __matrix_scalar_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(A->size, kernel(out->data + i, A->data + i, b, len));
+        return out;
+    }
     for (size_t i = 0; i < A->size; i++) { out->data[i] = func(A->data[i], b); }
     return out;
 }
@@ -365,6 +1042,11 @@ Matrix* matrix_scalar_map(const Matrix* A, double b, binary_func func) {
  * with the return value of the function. This operates in-place.
  */
 void scalar_matrix_apply(double a, Matrix* B, binary_func func) {
+    scalar_matrix_kernel kernel = __scalar_matrix_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(B->size, kernel(B->data + i, a, B->data + i, len));
+        return;
+    }
     for (size_t i = 0; i < B->size; i++) { B->data[i] = func(a, B->data[i]); }
 }
 
@@ -375,18 +1057,134 @@ void scalar_matrix_apply(double a, Matrix* B, binary_func func) {
  */
 Matrix* scalar_matrix_map(double a, const Matrix* B, binary_func func) {
     Matrix* out = matrix_create_raw(B->rows, B->cols);
+    scalar_matrix_kernel kernel = __scalar_matrix_kernel(func);
+    if (kernel) {
+        __ELEMENTWISE_BLOCKS(B->size, kernel(out->data + i, a, B->data + i, len));
+        return out;
+    }
     for (size_t i = 0; i < B->size; i++) { out->data[i] = func(a, B->data[i]); }
     return out;
 }
 
+// The reductions with add, multiply, fmin, fmax, and hypot have their own
+// kernels that keep REDUCE_LANES partial results (which vectorize) and then
+// combine them in a fixed tree. The values are accumulated into partials with
+// step, partials are combined with combine, and finish gives the result, so
+// hypot sums the squares and takes the square root at the end. NAN is the
+// identity of fmin and fmax since they ignore NaNs.
+#define MATRIX_REDUCE_OPS(X) \
+    X(add,      0,   s + x,        s + t)        \
+    X(multiply, 1,   s * x,        s * t)        \
+    X(fmin,     NAN, __min(s, x),  __min(s, t))  \
+    X(fmax,     NAN, __max(s, x),  __max(s, t))  \
+    X(hypot,    0,   s + x*x,      s + t)
+#define REDUCE_LANES 16
+
+// Columns of a column reduction given to a thread at a time
+#define REDUCE_COL_BLOCK 512
+
+// The same as fmin() and fmax() (except maybe for the sign of zeros) but these
+// vectorize
+static inline double __min(double s, double x) { return x < s || s != s ? x : s; }
+static inline double __max(double s, double x) { return x > s || s != s ? x : s; }
+
+struct _ReduceKernel {
+    // The kernels of a built-in reduction (see MATRIX_REDUCE_OPS)
+    double identity;
+    double (*range)(const double* a, size_t n); // the partial of n values
+    void (*row)(double* acc, const double* a, size_t n); // steps n partials with a row
+    double (*combine)(double s, double t);
+};
+typedef struct _ReduceKernel ReduceKernel;
+
+#define __REDUCE_KERNELS(name, identity, step, combine) \
+    static double __reduce_combine_##name(double s, double t) { return combine; } \
+    static double __reduce_range_##name(const double* a, size_t n) { \
+        double lanes[REDUCE_LANES]; \
+        for (size_t l = 0; l < REDUCE_LANES; l++) { lanes[l] = identity; } \
+        size_t i = 0; \
+        for (; i + REDUCE_LANES <= n; i += REDUCE_LANES) { \
+            for (size_t l = 0; l < REDUCE_LANES; l++) { \
+                double s = lanes[l], x = a[i+l]; lanes[l] = step; \
+            } \
+        } \
+        for (size_t w = REDUCE_LANES/2; w > 0; w /= 2) { \
+            for (size_t l = 0; l < w; l++) { \
+                double s = lanes[l], t = lanes[l+w]; lanes[l] = combine; \
+            } \
+        } \
+        double s = lanes[0]; \
+        for (; i < n; i++) { double x = a[i]; s = step; } \
+        return s; \
+    } \
+    static void __reduce_row_##name(double* restrict acc, const double* restrict a, size_t n) { \
+        for (size_t i = 0; i < n; i++) { double s = acc[i], x = a[i]; acc[i] = step; } \
+    }
+MATRIX_REDUCE_OPS(__REDUCE_KERNELS)
+
+#define __REDUCE_KERNEL(name, identity, step, combine) \
+    {identity, __reduce_range_##name, __reduce_row_##name, __reduce_combine_##name},
+static const ReduceKernel reduce_kernels[] = { MATRIX_REDUCE_OPS(__REDUCE_KERNEL) };
+#define __REDUCE_FUNC(name, identity, step, combine) name,
+static const binary_func reduce_funcs[] = { MATRIX_REDUCE_OPS(__REDUCE_FUNC) };
+
+/**
+ * Finds the kernels of a built-in reduction. Returns NULL if func is not one
+ * of them.
+ */
+static const ReduceKernel* __reduce_kernel(binary_func func) {
+    for (size_t i = 0; i < sizeof(reduce_funcs)/sizeof(reduce_funcs[0]); i++) {
+        if (func == reduce_funcs[i]) { return &reduce_kernels[i]; }
+    }
+    return NULL;
+}
+
+/**
+ * Gets the result of a reduction from its partial.
+ */
+static inline double __reduce_finish(binary_func func, double s) {
+    return func == hypot ? sqrt(s) : s;
+}
+
 /**
  * Apply a binary function to every elements and the previous return value,
  * reducing down to a single value. Useful for things like fmax().
  */
 double matrix_reduce(const Matrix* A, binary_func func) {
-    double val = A->data[0];
-    for (size_t i = 1; i < A->size; i++) { val = func(A->data[i], val); }
-    return val;
+    const ReduceKernel* K = __reduce_kernel(func);
+    if (!K) {
+        double val = A->data[0];
+        for (size_t i = 1; i < A->size; i++) { val = func(A->data[i], val); }
+        return val;
+    }
+
+    // every thread gets one part, which only depends on the number of threads
+    size_t num_threads = 1;
+#ifdef _OPENMP
+    if (A->size >= MATRIX_PARALLEL_MIN) { num_threads = omp_get_max_threads(); }
+#endif
+    double partials[num_threads];
+    __OMP("omp parallel for num_threads(num_threads) schedule(static)")
+    for (size_t t = 0; t < num_threads; t++) {
+        size_t first = A->size * t / num_threads, last = A->size * (t+1) / num_threads;
+        partials[t] = K->range(A->data + first, last - first);
+    }
+    for (size_t w = 1; w < num_threads; w *= 2) {
+        for (size_t t = 0; t + w < num_threads; t += 2*w) {
+            partials[t] = K->combine(partials[t], partials[t+w]);
+        }
+    }
+    return __reduce_finish(func, partials[0]);
+}
+
+/**
+ * Makes a view of all of a const matrix for the view functions that only read
+ * the values (the reductions), so it must never be given to
+ * matrix_view_apply().
+ */
+static inline MatrixView __read_view(const Matrix* M) {
+    MatrixView V = {M->data, M->rows, M->cols, M->cols, 1};
+    return V;
 }
 
 /**
@@ -394,37 +1192,394 @@ double matrix_reduce(const Matrix* A, binary_func func) {
  * reducing down to a single value for each row. Useful for things like fmax().
  */
 Matrix* matrix_reduce_rows(const Matrix* A, binary_func func) {
-    Matrix* out = matrix_create_raw(A->rows, 1);
+    MatrixView V = __read_view(A);
+    return matrix_view_reduce_rows(&V, func);
+}
+
+/**
+ * Apply a binary function to every elements and the previous return value,
+ * reducing down to a single value for each column. Useful for things like
+ * fmax(). The rows are swept in order with a value for every column.
+ */
+Matrix* matrix_reduce_cols(const Matrix* A, binary_func func) {
+    MatrixView V = __read_view(A);
+    return matrix_view_reduce_cols(&V, func);
+}
+
+/**
+ * Reduces all of the elements (a 1 by 1 matrix), each row (a column vector),
+ * or each column (a row vector) of a matrix with a binary function.
+ */
+Matrix* matrix_reduce_axis(const Matrix* A, binary_func func, int axis) {
+    if (axis == MATRIX_AXIS_ROWS) { return matrix_reduce_rows(A, func); }
+    if (axis == MATRIX_AXIS_COLS) { return matrix_reduce_cols(A, func); }
+    if (axis != MATRIX_AXIS_ALL) { errno = EINVAL; return NULL; }
+    Matrix* out = matrix_create_raw(1, 1);
+    if (out) { out->data[0] = matrix_reduce(A, func); }
+    return out;
+}
+
+
+//////////////////// Matrix Views ////////////////////
+
+/**
+ * Makes a view of all of a matrix.
+ */
+MatrixView matrix_view(Matrix* M) {
+    MatrixView V = {M->data, M->rows, M->cols, M->cols, 1};
+    return V;
+}
+
+/**
+ * Makes a view of every row_step-th row of rows rows starting at row and every
+ * col_step-th column of cols columns starting at col of another view. Returns
+ * false if the steps are 0 or any of it is outside the view.
+ */
+bool matrix_view_slice(const MatrixView* V, size_t row, size_t rows, size_t row_step,
+                       size_t col, size_t cols, size_t col_step, MatrixView* out) {
+    if (row_step == 0 || col_step == 0 ||
+        (rows && (row >= V->rows || (rows-1) > (V->rows-1-row) / row_step)) ||
+        (cols && (col >= V->cols || (cols-1) > (V->cols-1-col) / col_step))) {
+        errno = EINVAL;
+        return false;
+    }
+    out->data = V->data + row*V->row_stride + col*V->col_stride;
+    out->rows = rows;
+    out->cols = cols;
+    out->row_stride = V->row_stride * row_step;
+    out->col_stride = V->col_stride * col_step;
+    return true;
+}
+
+/**
+ * Makes a new matrix with a copy of the values of a view.
+ */
+Matrix* matrix_view_copy(const MatrixView* V) {
+    Matrix* out = matrix_create_raw(V->rows, V->cols);
+    if (!out) { return NULL; }
+    for (size_t i = 0; i < V->rows; i++) {
+        const double* row = &V->data[i*V->row_stride];
+        if (V->col_stride == 1) {
+            memcpy(&MATRIX_AT(out, i, 0), row, V->cols * sizeof(double));
+        } else {
+            for (size_t j = 0; j < V->cols; j++) { MATRIX_AT(out, i, j) = row[j*V->col_stride]; }
+        }
+    }
+    return out;
+}
+
+/**
+ * Checks if two views are equal to within a tolerance (see matrix_allclose()).
+ */
+bool matrix_view_allclose(const MatrixView* A, const MatrixView* B, double rtol, double atol) {
+    if (A->rows != B->rows || A->cols != B->cols) { return false; }
     for (size_t i = 0; i < A->rows; i++) {
-        double val = MATRIX_AT(A, i, 0);
-        for (size_t j = 1; j < A->cols; j++) {
-            val = func(MATRIX_AT(A, i, j), val);
+        for (size_t j = 0; j < A->cols; j++) {
+            double a = MATRIX_VIEW_AT(A, i, j), b = MATRIX_VIEW_AT(B, i, j);
+            if (fabs(a - b) >= atol + rtol * fabs(b)) { return false; }
+        }
+    }
+    return true;
+}
+
+/**
+ * Apply a unary function to every element of a view, replacing the value in
+ * the matrix it is a view of.
+ */
+void matrix_view_apply(const MatrixView* V, unary_func func) {
+    unary_kernel kernel = V->col_stride == 1 ? __unary_kernel(func) : NULL;
+    if (kernel) {
+        __OMP("omp parallel for if(V->rows*V->cols >= MATRIX_PARALLEL_MIN) schedule(static)")
+        for (size_t i = 0; i < V->rows; i++) {
+            double* row = &V->data[i*V->row_stride];
+            kernel(row, row, V->cols);
+        }
+        return;
+    }
+    for (size_t i = 0; i < V->rows; i++) {
+        for (size_t j = 0; j < V->cols; j++) {
+            MATRIX_VIEW_AT(V, i, j) = func(MATRIX_VIEW_AT(V, i, j));
+        }
+    }
+}
+
+/**
+ * Apply a binary function to every elements of a view and the previous return
+ * value, reducing down to a single value (see matrix_reduce()).
+ */
+double matrix_view_reduce(const MatrixView* V, binary_func func) {
+    const ReduceKernel* K = V->col_stride == 1 ? __reduce_kernel(func) : NULL;
+    if (!K) {
+        double val = V->data[0];
+        for (size_t i = 0; i < V->rows; i++) {
+            for (size_t j = i == 0 ? 1 : 0; j < V->cols; j++) {
+                val = func(MATRIX_VIEW_AT(V, i, j), val);
+            }
+        }
+        return val;
+    }
+
+    // every thread gets a fixed part of the rows like matrix_reduce()
+    size_t num_threads = 1;
+#ifdef _OPENMP
+    if (V->rows*V->cols >= MATRIX_PARALLEL_MIN) { num_threads = omp_get_max_threads(); }
+#endif
+    double partials[num_threads];
+    __OMP("omp parallel for num_threads(num_threads) schedule(static)")
+    for (size_t t = 0; t < num_threads; t++) {
+        double val = K->identity;
+        for (size_t i = V->rows * t / num_threads; i < V->rows * (t+1) / num_threads; i++) {
+            val = K->combine(val, K->range(&V->data[i*V->row_stride], V->cols));
+        }
+        partials[t] = val;
+    }
+    for (size_t w = 1; w < num_threads; w *= 2) {
+        for (size_t t = 0; t + w < num_threads; t += 2*w) {
+            partials[t] = K->combine(partials[t], partials[t+w]);
         }
-        MATRIX_AT(out, i, 0) = val;
+    }
+    return __reduce_finish(func, partials[0]);
+}
+
+/**
+ * Reduces each row of a view down to a single value (see
+ * matrix_reduce_rows()).
+ */
+Matrix* matrix_view_reduce_rows(const MatrixView* V, binary_func func) {
+    Matrix* out = matrix_create_raw(V->rows, 1);
+    if (!out) { return NULL; }
+    const ReduceKernel* K = V->col_stride == 1 ? __reduce_kernel(func) : NULL;
+    if (K) {
+        __OMP("omp parallel for if(V->rows*V->cols >= MATRIX_PARALLEL_MIN) schedule(static)")
+        for (size_t i = 0; i < V->rows; i++) {
+            out->data[i] = __reduce_finish(func, K->range(&V->data[i*V->row_stride], V->cols));
+        }
+        return out;
+    }
+    for (size_t i = 0; i < V->rows; i++) {
+        double val = MATRIX_VIEW_AT(V, i, 0);
+        for (size_t j = 1; j < V->cols; j++) {
+            val = func(MATRIX_VIEW_AT(V, i, j), val);
+        }
+        out->data[i] = val;
     }
     return out;
 }
 
 /**
- * Apply a binary function to every elements and the previous return value,
- * reducing down to a single value for each column. Useful for things like
- * fmax().
+ * Reduces each column of a view down to a single value (see
+ * matrix_reduce_cols()).
  */
-Matrix* matrix_reduce_cols(const Matrix* A, binary_func func) {
-    Matrix* out = matrix_create_raw(1, A->cols);
-    for (size_t i = 0; i < A->cols; i++) {
-        double val = MATRIX_AT(A, 0, i);
-        for (size_t j = 1; j < A->rows; j++) {
-            val = func(MATRIX_AT(A, j, i), val);
+Matrix* matrix_view_reduce_cols(const MatrixView* V, binary_func func) {
+    Matrix* out = matrix_create_raw(1, V->cols);
+    if (!out) { return NULL; }
+    const ReduceKernel* K = V->col_stride == 1 ? __reduce_kernel(func) : NULL;
+    if (K) {
+        // every block of columns is independent so the order of each column
+        // does not depend on the threads
+        __OMP("omp parallel for if(V->rows*V->cols >= MATRIX_PARALLEL_MIN) schedule(static)")
+        for (size_t c = 0; c < V->cols; c += REDUCE_COL_BLOCK) {
+            size_t n = V->cols - c < REDUCE_COL_BLOCK ? V->cols - c : REDUCE_COL_BLOCK;
+            double* acc = &out->data[c];
+            for (size_t i = 0; i < n; i++) { acc[i] = K->identity; }
+            for (size_t j = 0; j < V->rows; j++) { K->row(acc, &V->data[j*V->row_stride + c], n); }
+            for (size_t i = 0; i < n; i++) { acc[i] = __reduce_finish(func, acc[i]); }
+        }
+        return out;
+    }
+    for (size_t i = 0; i < V->cols; i++) { out->data[i] = MATRIX_VIEW_AT(V, 0, i); }
+    for (size_t j = 1; j < V->rows; j++) {
+        for (size_t i = 0; i < V->cols; i++) {
+            out->data[i] = func(MATRIX_VIEW_AT(V, j, i), out->data[i]);
         }
-        MATRIX_AT(out, 0, i) = val;
     }
     return out;
 }
 
+/**
+ * Saves the values of a view to a NPY file. Returns false if the data cannot
+ * be written.
+ */
+bool matrix_view_to_npy(FILE* file, const MatrixView* V) {
+    if (!__npy_write_header(file, V->rows, V->cols)) { return false; }
+    if (V->col_stride == 1 && V->row_stride == V->cols) {
+        size_t size = V->rows * V->cols;
+        return fwrite(V->data, sizeof(double), size, file) == size;
+    }
+    double* row = V->col_stride == 1 ? NULL : (double*)malloc(V->cols * sizeof(double));
+    if (V->col_stride != 1 && !row) { return false; }
+    bool ok = true;
+    for (size_t i = 0; ok && i < V->rows; i++) {
+        const double* src = &V->data[i*V->row_stride];
+        if (row) {
+            for (size_t j = 0; j < V->cols; j++) { row[j] = src[j*V->col_stride]; }
+            src = row;
+        }
+        ok = fwrite(src, sizeof(double), V->cols, file) == V->cols;
+    }
+    free(row);
+    return ok;
+}
+
+/**
+ * Same as matrix_view_to_npy() but takes a file path instead.
+ */
+bool matrix_view_to_npy_path(const char* path, const MatrixView* V) {
+    FILE* f = fopen(path, "wb");
+    if (!f) { return false; }
+    bool ok = matrix_view_to_npy(f, V);
+    return fclose(f) == 0 && ok;
+}
+
 
 //////////////////// Matrix Functions ////////////////////
 
+// The multiplication is split into blocks like in BLIS: panels of NC columns
+// of B (kept in the L3 cache) times KC of its rows (one block of B packed into
+// contiguous NR column panels), blocks of MC rows of A (packed into MR row
+// panels and kept in the L2 cache), and a micro-kernel that keeps a MR-by-NR
+// block of C in registers while streaming a KC long panel of each from the L1
+// cache. The register block uses 2/3 of the SIMD registers.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define GEMM_MR 8
+#define GEMM_NR 16
+#define GEMM_MC 192
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define GEMM_MR 6
+#define GEMM_NR 8
+#define GEMM_MC 96
+#else
+#define GEMM_MR 4
+#define GEMM_NR 4
+#define GEMM_MC 64
+#endif
+#define GEMM_KC 256
+#define GEMM_NC 4096
+
+// Products with fewer multiply-adds than this are not split between threads
+#define GEMM_PARALLEL_MIN (64*64*64)
+
+/**
+ * Packs the mc-by-kc block of A at a (with element (i, k) at a[i*rs + k*cs])
+ * into panels of GEMM_MR rows stored column by column, padding the last panel
+ * with zeros.
+ */
+static void __gemm_pack_a(size_t mc, size_t kc, const double* a, size_t rs, size_t cs,
+                          double* restrict ap) {
+    for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+        size_t mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+        for (size_t k = 0; k < kc; k++) {
+            size_t i = 0;
+            for (; i < mr; i++) { ap[i] = a[(ir+i)*rs + k*cs]; }
+            for (; i < GEMM_MR; i++) { ap[i] = 0; }
+            ap += GEMM_MR;
+        }
+    }
+}
+
+/**
+ * Packs the kc-by-nc block of B at b (with element (k, j) at b[k*rs + j*cs])
+ * into panels of GEMM_NR columns stored row by row, padding the last panel
+ * with zeros.
+ */
+static void __gemm_pack_b(size_t kc, size_t nc, const double* b, size_t rs, size_t cs,
+                          double* restrict bp) {
+    for (size_t jr = 0; jr < nc; jr += GEMM_NR) {
+        size_t nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+        for (size_t k = 0; k < kc; k++) {
+            size_t j = 0;
+            for (; j < nr; j++) { bp[j] = b[k*rs + (jr+j)*cs]; }
+            for (; j < GEMM_NR; j++) { bp[j] = 0; }
+            bp += GEMM_NR;
+        }
+    }
+}
+
+/**
+ * Adds the product of a packed GEMM_MR-by-kc panel of A and a packed
+ * kc-by-GEMM_NR panel of B to the GEMM_MR-by-GEMM_NR block of C at c (whose
+ * rows are ldc apart).
+ */
+static void __gemm_kernel(size_t kc, const double* restrict a, const double* restrict b,
+                          double* restrict c, size_t ldc) {
+#if defined(__AVX512F__)
+    __m512d c0[GEMM_MR], c1[GEMM_MR];
+    #pragma GCC unroll 8
+    for (int i = 0; i < GEMM_MR; i++) { c0[i] = c1[i] = _mm512_setzero_pd(); }
+    for (size_t k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        __m512d b0 = _mm512_load_pd(b), b1 = _mm512_load_pd(b + 8);
+        #pragma GCC unroll 8
+        for (int i = 0; i < GEMM_MR; i++) {
+            __m512d ai = _mm512_set1_pd(a[i]);
+            c0[i] = _mm512_fmadd_pd(ai, b0, c0[i]);
+            c1[i] = _mm512_fmadd_pd(ai, b1, c1[i]);
+        }
+    }
+    #pragma GCC unroll 8
+    for (int i = 0; i < GEMM_MR; i++) {
+        _mm512_storeu_pd(c + i*ldc, _mm512_add_pd(_mm512_loadu_pd(c + i*ldc), c0[i]));
+        _mm512_storeu_pd(c + i*ldc + 8, _mm512_add_pd(_mm512_loadu_pd(c + i*ldc + 8), c1[i]));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    __m256d c0[GEMM_MR], c1[GEMM_MR];
+    #pragma GCC unroll 6
+    for (int i = 0; i < GEMM_MR; i++) { c0[i] = c1[i] = _mm256_setzero_pd(); }
+    for (size_t k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        __m256d b0 = _mm256_load_pd(b), b1 = _mm256_load_pd(b + 4);
+        #pragma GCC unroll 6
+        for (int i = 0; i < GEMM_MR; i++) {
+            __m256d ai = _mm256_broadcast_sd(&a[i]);
+            c0[i] = _mm256_fmadd_pd(ai, b0, c0[i]);
+            c1[i] = _mm256_fmadd_pd(ai, b1, c1[i]);
+        }
+    }
+    #pragma GCC unroll 6
+    for (int i = 0; i < GEMM_MR; i++) {
+        _mm256_storeu_pd(c + i*ldc, _mm256_add_pd(_mm256_loadu_pd(c + i*ldc), c0[i]));
+        _mm256_storeu_pd(c + i*ldc + 4, _mm256_add_pd(_mm256_loadu_pd(c + i*ldc + 4), c1[i]));
+    }
+#else
+    double acc[GEMM_MR][GEMM_NR] = {{0}};
+    for (size_t k = 0; k < kc; k++, a += GEMM_MR, b += GEMM_NR) {
+        for (int i = 0; i < GEMM_MR; i++) {
+            for (int j = 0; j < GEMM_NR; j++) { acc[i][j] += a[i] * b[j]; }
+        }
+    }
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < GEMM_NR; j++) { c[i*ldc + j] += acc[i][j]; }
+    }
+#endif
+}
+
+/**
+ * Adds the product of a packed mc-by-kc block of A and a packed kc-by-nc block
+ * of B to the mc-by-nc block of C at c (whose rows are ldc apart). The blocks
+ * of C at the edges that are smaller than the register block go through a
+ * temporary block.
+ */
+static void __gemm_macro_kernel(size_t mc, size_t nc, size_t kc, const double* ap,
+                                const double* bp, double* c, size_t ldc) {
+    _Alignas(64) double edge[GEMM_MR*GEMM_NR];
+    for (size_t jr = 0; jr < nc; jr += GEMM_NR) {
+        size_t nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+        for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+            size_t mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+            const double* a = ap + ir*kc, *b = bp + jr*kc;
+            if (mr == GEMM_MR && nr == GEMM_NR) {
+                __gemm_kernel(kc, a, b, c + ir*ldc + jr, ldc);
+            } else {
+                memset(edge, 0, sizeof(edge));
+                __gemm_kernel(kc, a, b, edge, GEMM_NR);
+                for (size_t i = 0; i < mr; i++) {
+                    for (size_t j = 0; j < nr; j++) { c[(ir+i)*ldc + jr+j] += edge[i*GEMM_NR + j]; }
+                }
+            }
+        }
+    }
+}
+
 /**
  * Matrix multiplication. https://en.wikipedia.org/wiki/Matrix_multiplication
  * Output is written to the third argument which must be the right size.
@@ -432,21 +1587,302 @@ Matrix* matrix_reduce_cols(const Matrix* A, binary_func func) {
  * returns false.
  */
 bool matrix_multiplication(const Matrix* A, const Matrix* B, Matrix* C) {
-    const size_t m = A->rows, n = A->cols, p = B->cols;
-    if (n != B->rows || m != C->rows || p != C->cols) {
+    return matrix_multiplication_transposed(A, false, B, false, C);
+}
+
+/**
+ * Matrix multiplication of A or its transpose (if trans_a) and B or its
+ * transpose (if trans_b) into C.
+ */
+bool matrix_multiplication_transposed(const Matrix* A, bool trans_a,
+                                      const Matrix* B, bool trans_b, Matrix* C) {
+    const size_t m = trans_a ? A->cols : A->rows, n = trans_a ? A->rows : A->cols;
+    const size_t p = trans_b ? B->rows : B->cols;
+    if (n != (trans_b ? B->cols : B->rows) || m != C->rows || p != C->cols ||
+        C->data == A->data || C->data == B->data) {
         errno = EINVAL;
         return false;
     }
+    memset(C->data, 0, C->size * sizeof(double));
+    if (m == 0 || n == 0 || p == 0) { return true; }
+
+    // strides of the elements (i, k) of A and (k, j) of B
+    const size_t a_rs = trans_a ? 1 : A->cols, a_cs = trans_a ? A->cols : 1;
+    const size_t b_rs = trans_b ? 1 : B->cols, b_cs = trans_b ? B->cols : 1;
 
-    for (size_t i = 0; i < m; i++) {
-        for (size_t j = 0; j < p; j++) {
-            double value = 0;
-            for (size_t k = 0; k < n; k++) {
-                value += MATRIX_AT(A, i, k) * MATRIX_AT(B, k, j);
+    // every thread gets at least one block of rows of A unless that makes the
+    // blocks smaller than the register block
+    size_t num_threads = 1;
+#ifdef _OPENMP
+    if ((double)m * n * p >= GEMM_PARALLEL_MIN) { num_threads = omp_get_max_threads(); }
+#endif
+    size_t mc = (m + num_threads - 1) / num_threads;
+    mc = (mc + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+    if (mc > GEMM_MC) { mc = GEMM_MC; }
+    size_t kc_max = n < GEMM_KC ? n : GEMM_KC;
+    size_t nc_max = (p < GEMM_NC ? p : GEMM_NC) + GEMM_NR - 1;
+    nc_max -= nc_max % GEMM_NR;
+
+    // the packed block of B is shared and each thread packs its own blocks of A
+    double* bp = (double*)aligned_alloc(64, nc_max * kc_max * sizeof(double));
+    double* ap = (double*)aligned_alloc(64, num_threads * mc * kc_max * sizeof(double));
+    if (!bp || !ap) { free(bp); free(ap); errno = ENOMEM; return false; }
+
+    __OMP("omp parallel num_threads(num_threads)")
+    {
+        size_t tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        double* my_ap = ap + tid * mc * kc_max;
+        for (size_t jc = 0; jc < p; jc += GEMM_NC) {
+            size_t nc = p - jc < GEMM_NC ? p - jc : GEMM_NC;
+            for (size_t pc = 0; pc < n; pc += GEMM_KC) {
+                size_t kc = n - pc < GEMM_KC ? n - pc : GEMM_KC;
+                const double* b = &B->data[pc*b_rs + jc*b_cs];
+                __OMP("omp for schedule(static)")
+                for (size_t jr = 0; jr < nc; jr += GEMM_NR) {
+                    __gemm_pack_b(kc, nc - jr < GEMM_NR ? nc - jr : GEMM_NR,
+                                  b + jr*b_cs, b_rs, b_cs, bp + jr*kc);
+                }
+                __OMP("omp for schedule(dynamic)")
+                for (size_t ic = 0; ic < m; ic += mc) {
+                    size_t mr = m - ic < mc ? m - ic : mc;
+                    __gemm_pack_a(mr, kc, &A->data[ic*a_rs + pc*a_cs], a_rs, a_cs, my_ap);
+                    __gemm_macro_kernel(mr, nc, kc, my_ap, bp, &MATRIX_AT(C, ic, jc), C->cols);
+                }
             }
-            MATRIX_AT(C, i, j) = value;
         }
     }
-    
+
+    free(bp);
+    free(ap);
+    return true;
+}
+
+
+//////////////////// Matrix Expressions ////////////////////
+
+// Elements of each node evaluated at a time, the temporaries of a whole
+// expression fit in the L2 cache
+#define MATRIX_EXPR_BLOCK 1024
+
+/**
+ * Creates an empty matrix expression. Returns NULL if it cannot be allocated.
+ */
+MatrixExpr* matrix_expr_create() {
+    return (MatrixExpr*)calloc(1, sizeof(MatrixExpr));
+}
+
+/**
+ * Frees a matrix expression and its temporaries.
+ */
+void matrix_expr_free(MatrixExpr* E) {
+    free(E->scratch);
+    free(E);
+}
+
+/**
+ * Removes all of the nodes of an expression, keeping its temporaries.
+ */
+void matrix_expr_clear(MatrixExpr* E) { E->count = 0; }
+
+/**
+ * Adds a node of the given kind to an expression. Returns NULL if it is full.
+ */
+static MatrixExprNode* __expr_node(MatrixExpr* E, char kind, size_t rows, size_t cols) {
+    if (E->count == MATRIX_EXPR_MAX_NODES) { return NULL; }
+    MatrixExprNode* node = &E->nodes[E->count++];
+    memset(node, 0, sizeof(MatrixExprNode));
+    node->kind = kind;
+    node->rows = rows;
+    node->cols = cols;
+    return node;
+}
+
+/**
+ * Adds a node with the values of a matrix.
+ */
+const MatrixExprNode* matrix_expr_matrix(MatrixExpr* E, const Matrix* M) {
+    if (!M) { return NULL; }
+    MatrixExprNode* node = __expr_node(E, MATRIX_EXPR_MATRIX, M->rows, M->cols);
+    if (node) { node->matrix = M; }
+    return node;
+}
+
+/**
+ * Adds a node with a single value for every element.
+ */
+const MatrixExprNode* matrix_expr_scalar(MatrixExpr* E, double value) {
+    MatrixExprNode* node = __expr_node(E, MATRIX_EXPR_SCALAR, 0, 0);
+    if (node) { node->scalar = value; }
+    return node;
+}
+
+/**
+ * Adds a node that applies a unary function to every element of another node.
+ */
+const MatrixExprNode* matrix_expr_unary(MatrixExpr* E, unary_func func,
+                                        const MatrixExprNode* a) {
+    if (!a) { return NULL; }
+    if (a->kind == MATRIX_EXPR_SCALAR) { return matrix_expr_scalar(E, func(a->scalar)); }
+    MatrixExprNode* node = __expr_node(E, MATRIX_EXPR_UNARY, a->rows, a->cols);
+    if (node) { node->unary = func; node->a = a; }
+    return node;
+}
+
+/**
+ * Adds a node that applies a binary function to every pair of elements of two
+ * other nodes, which must be the same shape unless one of them is a scalar.
+ */
+const MatrixExprNode* matrix_expr_binary(MatrixExpr* E, binary_func func,
+                                         const MatrixExprNode* a,
+                                         const MatrixExprNode* b) {
+    if (!a || !b) { return NULL; }
+    bool a_scalar = a->kind == MATRIX_EXPR_SCALAR, b_scalar = b->kind == MATRIX_EXPR_SCALAR;
+    if (a_scalar && b_scalar) { return matrix_expr_scalar(E, func(a->scalar, b->scalar)); }
+    if (!a_scalar && !b_scalar && (a->rows != b->rows || a->cols != b->cols)) { return NULL; }
+    const MatrixExprNode* shape = a_scalar ? b : a;
+    MatrixExprNode* node = __expr_node(E, MATRIX_EXPR_BINARY, shape->rows, shape->cols);
+    if (node) { node->binary = func; node->a = a; node->b = b; }
+    return node;
+}
+
+/**
+ * Evaluates n elements of a function node into out, using the kernel of a
+ * built-in function if there is one. The values of the arguments are in values
+ * (indexed like the nodes of E).
+ */
+static void __expr_func(const MatrixExpr* E, const MatrixExprNode* node,
+                        const double* const* values, double* out, size_t n) {
+    const double* a = values[node->a - E->nodes];
+    if (node->kind == MATRIX_EXPR_UNARY) {
+        unary_kernel kernel = __unary_kernel(node->unary);
+        if (kernel) { kernel(out, a, n); return; }
+        for (size_t i = 0; i < n; i++) { out[i] = node->unary(a[i]); }
+        return;
+    }
+    binary_func func = node->binary;
+    if (node->a->kind == MATRIX_EXPR_SCALAR) {
+        double x = node->a->scalar;
+        const double* b = values[node->b - E->nodes];
+        scalar_matrix_kernel kernel = __scalar_matrix_kernel(func);
+        if (kernel) { kernel(out, x, b, n); return; }
+        for (size_t i = 0; i < n; i++) { out[i] = func(x, b[i]); }
+    } else if (node->b->kind == MATRIX_EXPR_SCALAR) {
+        double y = node->b->scalar;
+        matrix_scalar_kernel kernel = __matrix_scalar_kernel(func);
+        if (kernel) { kernel(out, a, y, n); return; }
+        for (size_t i = 0; i < n; i++) { out[i] = func(a[i], y); }
+    } else {
+        const double* b = values[node->b - E->nodes];
+        matrix_matrix_kernel kernel = __matrix_matrix_kernel(func);
+        if (kernel) { kernel(out, a, b, n); return; }
+        for (size_t i = 0; i < n; i++) { out[i] = func(a[i], b[i]); }
+    }
+}
+
+/**
+ * Evaluates the elements [first, first+n) of the needed nodes up to root into
+ * out + first, the other function nodes go to their slot of scratch.
+ */
+static void __expr_block(const MatrixExpr* E, const MatrixExprNode* root,
+                         const bool* needed, double* scratch, double* out,
+                         size_t first, size_t n) {
+    const double* values[MATRIX_EXPR_MAX_NODES];
+    size_t last = root - E->nodes;
+    for (size_t k = 0; k <= last; k++) {
+        if (!needed[k]) { continue; }
+        const MatrixExprNode* node = &E->nodes[k];
+        if (node->kind == MATRIX_EXPR_MATRIX) {
+            values[k] = node->matrix->data + first;
+        } else if (node->kind == MATRIX_EXPR_SCALAR) {
+            values[k] = NULL;
+        } else {
+            double* dst = k == last ? out + first : scratch + node->slot * MATRIX_EXPR_BLOCK;
+            __expr_func(E, node, values, dst, n);
+            values[k] = dst;
+        }
+    }
+    // a root that is not a function is just copied or filled in
+    if (root->kind == MATRIX_EXPR_MATRIX && values[last] != out + first) {
+        memcpy(out + first, values[last], n * sizeof(double));
+    } else if (root->kind == MATRIX_EXPR_SCALAR) {
+        for (size_t i = 0; i < n; i++) { out[first + i] = root->scalar; }
+    }
+}
+
+/**
+ * Evaluates an expression into out, which must be the same shape as root
+ * (unless root is a scalar). Returns false if root is NULL, the shape does not
+ * match, or the temporaries cannot be allocated.
+ */
+bool matrix_expr_eval(MatrixExpr* E, const MatrixExprNode* root, Matrix* out) {
+    if (!root || root < E->nodes || root >= E->nodes + E->count ||
+        (root->kind != MATRIX_EXPR_SCALAR && (root->rows != out->rows || root->cols != out->cols))) {
+        return false;
+    }
+
+    // find the nodes root depends on (every node only refers to earlier ones)
+    // and give the functions other than root a temporary, the whole
+    // expression can only be split between threads if none of the functions
+    // are callbacks
+    bool needed[MATRIX_EXPR_MAX_NODES] = {false};
+    size_t last = root - E->nodes, slots = 0;
+    bool parallel = out->size >= MATRIX_PARALLEL_MIN;
+    needed[last] = true;
+    for (size_t k = last + 1; k-- > 0; ) {
+        MatrixExprNode* node = &E->nodes[k];
+        if (!needed[k]) { continue; }
+        if (node->a) { needed[node->a - E->nodes] = true; }
+        if (node->b) { needed[node->b - E->nodes] = true; }
+        if (node->kind == MATRIX_EXPR_UNARY && !__unary_kernel(node->unary)) { parallel = false; }
+        if (node->kind == MATRIX_EXPR_BINARY && !__matrix_matrix_kernel(node->binary)) { parallel = false; }
+        if ((node->kind == MATRIX_EXPR_UNARY || node->kind == MATRIX_EXPR_BINARY) && k != last) {
+            node->slot = slots++;
+        }
+    }
+
+    // the temporaries are only reallocated when they need to grow
+    size_t num_threads = 1;
+#ifdef _OPENMP
+    if (parallel) { num_threads = omp_get_max_threads(); }
+#else
+    (void)parallel;
+#endif
+    size_t scratch_size = num_threads * slots * MATRIX_EXPR_BLOCK;
+    if (scratch_size > E->scratch_size) {
+        double* scratch = (double*)aligned_alloc(64, scratch_size * sizeof(double));
+        if (!scratch) { errno = ENOMEM; return false; }
+        free(E->scratch);
+        E->scratch = scratch;
+        E->scratch_size = scratch_size;
+    }
+
+    __OMP("omp parallel num_threads(num_threads)")
+    {
+        size_t tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        double* scratch = E->scratch + tid * slots * MATRIX_EXPR_BLOCK;
+        __OMP("omp for schedule(static)")
+        for (size_t i = 0; i < out->size; i += MATRIX_EXPR_BLOCK) {
+            size_t n = out->size - i < MATRIX_EXPR_BLOCK ? out->size - i : MATRIX_EXPR_BLOCK;
+            __expr_block(E, root, needed, scratch, out->data, i, n);
+        }
+    }
     return true;
 }
+
+/**
+ * Evaluates an expression into a new matrix the shape of root. Returns NULL if
+ * root is NULL or a scalar or if memory cannot be allocated.
+ */
+Matrix* matrix_expr_map(MatrixExpr* E, const MatrixExprNode* root) {
+    if (!root || root->kind == MATRIX_EXPR_SCALAR) { return NULL; }
+    Matrix* out = matrix_create_raw(root->rows, root->cols);
+    if (!out) { return NULL; }
+    if (!matrix_expr_eval(E, root, out)) { matrix_free(out); return NULL; }
+    return out;
+}
@@ -11,33 +11,134 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "arena.h"
 
 
 struct _Matrix {
     // Our basic matrix structure
     size_t rows, cols, size; // size is simply rows*cols, but it comes up a lot
     double* data;
-    char data_source; // one of DATA_MALLOCED, DATA_MEMMAPPED, or DATA_BORROWED
+    char data_source; // one of DATA_MALLOCED, DATA_MEMMAPPED, DATA_BORROWED, or DATA_ARENA
 };
 typedef struct _Matrix Matrix; // make type "struct _Matrix" just "Matrix"
 
+struct _NpyWriter {
+    // A NPY file that is written one row at a time. The rows go through a
+    // single-producer single-consumer ring: the producer fills the row at head
+    // and the rows from tail to head are waiting to be written, either when
+    // the ring fills up or continuously by a background thread.
+    FILE* file;
+    size_t rows, cols;    // the final shape of the matrix
+    size_t written;       // number of rows pushed so far
+    double* buffer;       // ring_rows rows followed by a scratch row
+    size_t ring_rows;
+    _Atomic size_t head, tail; // rows pushed and rows written (ever increasing)
+    size_t sync_rows, unsynced; // rows between fsync()s and rows since the last
+    bool background;      // if the rows are written by a separate thread
+    pthread_t thread;
+    atomic_bool closing;  // tells the thread to finish up
+    atomic_bool failed;   // if anything could not be written
+    // Instead of a NPY file the rows can be written as a chunked matrix file
+    // (see npy_writer_open_chunked()), these are only used by the writer
+    int encoding;         // 0 for a NPY file, otherwise a MATRIX_CHUNK_* value
+    size_t chunk_rows, chunk_cols;
+    double* chunk;        // the rows of the current row of chunks
+    size_t chunk_filled, chunk_row; // rows in chunk and which row of chunks
+    unsigned char *scratch, *packed;
+};
+typedef struct _NpyWriter NpyWriter;
+
+// Default number of bytes of rows a NpyWriter keeps in memory
+#define NPY_WRITER_BUFFER (4 << 20)
+
+// The encodings of the values in a chunked matrix file
+#define MATRIX_CHUNK_DELTA   1 // exact doubles, XORed with the previous row
+#define MATRIX_CHUNK_FLOAT32 2 // rounded to floats, XORed with the previous row
+
+// Default shape of the chunks of a chunked matrix file
+#define MATRIX_CHUNK_ROWS 16
+#define MATRIX_CHUNK_COLS 3072
+
+struct _MatrixView {
+    // A window into the data of a matrix without copying it, element (i, j)
+    // of the view is data[i*row_stride + j*col_stride]
+    double* data;
+    size_t rows, cols;
+    size_t row_stride, col_stride; // in values, not bytes
+};
+typedef struct _MatrixView MatrixView;
+
 typedef double (*unary_func)(double);
 typedef double (*binary_func)(double, double);
 
+// The kinds of nodes of a matrix expression
+#define MATRIX_EXPR_MATRIX 1 // the values of a matrix
+#define MATRIX_EXPR_SCALAR 2 // a single value for every element
+#define MATRIX_EXPR_UNARY  3 // a unary function of another node
+#define MATRIX_EXPR_BINARY 4 // a binary function of two other nodes
+
+// Most nodes a single matrix expression can have
+#define MATRIX_EXPR_MAX_NODES 32
+
+struct _MatrixExprNode {
+    // One value of a matrix expression, it only refers to earlier nodes
+    char kind;            // one of the MATRIX_EXPR_* values
+    const Matrix* matrix; // matrix: its values
+    double scalar;        // scalar: its value
+    unary_func unary;     // unary: the function
+    binary_func binary;   // binary: the function
+    const struct _MatrixExprNode *a, *b; // the arguments of the function
+    size_t rows, cols;    // the shape, 0 by 0 for scalars
+    size_t slot;          // the temporary it is evaluated into
+};
+typedef struct _MatrixExprNode MatrixExprNode;
+
+struct _MatrixExpr {
+    // An element-wise expression of matrices and scalars that is evaluated
+    // in a single pass over blocks of the elements (see matrix_expr_eval())
+    MatrixExprNode nodes[MATRIX_EXPR_MAX_NODES];
+    size_t count;
+    // the temporaries of the threads, kept between evaluations so they are
+    // only allocated when an expression needs more than any before it
+    double* scratch;
+    size_t scratch_size;
+};
+typedef struct _MatrixExpr MatrixExpr;
+
 
 //////////////////// Matrix Creation Functions //////////////////// 
 
 /**
  * Creates a new matrix of the given rows and columns. The data is NOT
  * initialized. Returns the newly created matrix. The data_source attribute is
- * set to DATA_MALLOCED.
+ * set to DATA_MALLOCED. The data is aligned for SIMD and large matrices use
+ * huge pages (see arena_aligned_alloc()).
  */
 Matrix* matrix_create_raw(size_t rows, size_t cols);
 
+/**
+ * Creates a new matrix of the given rows and columns with its data allocated
+ * from an arena. The data is NOT initialized (but a new arena starts as
+ * zeros). The data_source attribute is set to DATA_ARENA and the data lives
+ * as long as the arena. Returns NULL if the arena does not have enough room.
+ */
+Matrix* matrix_create_arena(Arena* A, size_t rows, size_t cols);
+
+/**
+ * Creates a matrix of the given rows and columns over existing data, such as
+ * a block of rows of another matrix. The data_source attribute is set to
+ * DATA_BORROWED so matrix_free() leaves the data alone, it must outlive the
+ * matrix.
+ */
+Matrix* matrix_borrow(size_t rows, size_t cols, double* data);
+
 /**
  * Frees a Matrix object. Depending on the data_source, either the data is
- * free()ed, munmap()ed, or nothing is done to it. Afterwards the Matrix
- * variable itself is freed.
+ * free()ed, munmap()ed, or nothing is done to it (borrowed and arena data).
+ * Afterwards the Matrix variable itself is freed.
  */
 void matrix_free(Matrix* M);
 
@@ -79,6 +180,10 @@ Matrix* matrix_copy(const Matrix* M);
  * row has more values than the first row, those extra values are ignored. If
  * any row has less than the first row, the missing data is filled with 0s. If
  * there is a problem reading from the file, NULL is returned.
+ *
+ * Regular files are memory-mapped and split between the OpenMP threads on
+ * line boundaries, with a fast path for plain decimal values. Other files
+ * (like pipes) are read one line at a time.
  */
 Matrix* matrix_from_csv(FILE* file);
 
@@ -88,11 +193,13 @@ Matrix* matrix_from_csv(FILE* file);
 Matrix* matrix_from_csv_path(const char* path);
 
 /**
- * Saves a matrix to a CSV file.
+ * Saves a matrix to a CSV file. The values are formatted like "%f" in blocks
+ * of rows that are split between the OpenMP threads and every block is
+ * written at once. Returns false if it cannot be written.
  * 
  * If the file argument is given as stdout, this will print it to the terminal.
  */
-void matrix_to_csv(FILE* file, const Matrix* M);
+bool matrix_to_csv(FILE* file, const Matrix* M);
 
 /**
  * Same as matrix_to_csv() but takes a file path instead.
@@ -117,6 +224,17 @@ Matrix* matrix_from_npy(FILE* file);
  */
 Matrix* matrix_from_npy_path(const char* path);
 
+// How matrix_from_npy_path_mapped() maps the file
+#define NPY_MAP_SHARED   1 // read-write, writes change the file (like matrix_from_npy())
+#define NPY_MAP_READONLY 2 // read-only, writing to the data crashes
+#define NPY_MAP_PRIVATE  3 // copy-on-write, writes only change the copy in memory
+
+/**
+ * Same as matrix_from_npy_path() but chooses how the file is mapped with one
+ * of the NPY_MAP_* modes. Only NPY_MAP_SHARED needs write access to the file.
+ */
+Matrix* matrix_from_npy_path_mapped(const char* path, int mode);
+
 /**
  * Saves a matrix to a NPY file. This is a file format used by the numpy
  * library. This will return false if the data cannot be written.
@@ -128,6 +246,99 @@ bool matrix_to_npy(FILE* file, const Matrix* M);
  */
 bool matrix_to_npy_path(const char* path, const Matrix* M);
 
+// Size of the header of the NPY files written by these functions, the data
+// starts right after it
+#define NPY_HEADER_SIZE 128
+
+/**
+ * Fills in the NPY_HEADER_SIZE byte header of a NPY file for a rows-by-cols
+ * matrix of doubles, for when the file is written some other way (such as
+ * MPI-IO by many processes).
+ */
+void matrix_npy_header(char* header, size_t rows, size_t cols);
+
+/**
+ * Creates a NPY file for a rows-by-cols matrix whose rows are appended one at
+ * a time. The header with the final shape is written immediately. The rows
+ * go through a ring of ring_rows pre-allocated rows (0 picks about
+ * NPY_WRITER_BUFFER bytes worth) and the data is fsync()ed to the disk every
+ * sync_rows rows (0 only syncs when the writer is closed).
+ * 
+ * If background is true the ring is drained to the file by a separate thread
+ * so writing overlaps with producing the next rows. When that thread falls
+ * behind npy_writer_row() waits for a free row instead of allocating more.
+ * 
+ * Returns NULL if the file cannot be created.
+ */
+NpyWriter* npy_writer_open(const char* path, size_t rows, size_t cols,
+                           size_t ring_rows, size_t sync_rows, bool background);
+
+/**
+ * Returns the space for the next row of a NPY writer. Once it is filled in
+ * with cols values npy_writer_push() must be called before asking for another
+ * row. Rows beyond the shape given when it was opened are discarded and make
+ * closing the writer fail.
+ */
+double* npy_writer_row(NpyWriter* W);
+
+/**
+ * Adds the row last returned by npy_writer_row() to the file.
+ */
+void npy_writer_push(NpyWriter* W);
+
+/**
+ * Same as npy_writer_open() but continues an existing NPY file of the same
+ * shape after its first written rows, which are kept. Anything after them is
+ * overwritten. Returns NULL if the file cannot be opened or is not a NPY file
+ * of that shape.
+ */
+NpyWriter* npy_writer_resume(const char* path, size_t rows, size_t cols,
+                             size_t written, size_t sync_rows, bool background);
+
+/**
+ * Waits for all of the pushed rows of a NPY file to be written and syncs them
+ * to the disk. Returns false if anything so far could not be written. This
+ * is not supported for chunked files since part of a row of chunks may still
+ * be in memory.
+ */
+bool npy_writer_sync(NpyWriter* W);
+
+/**
+ * Same as npy_writer_open() but creates a chunked matrix file. The matrix is
+ * split into chunk_rows-by-chunk_cols blocks (0 picks MATRIX_CHUNK_ROWS or
+ * MATRIX_CHUNK_COLS) which are compressed separately with one of the
+ * MATRIX_CHUNK_* encodings and an index of them is kept at the start of the
+ * file, so any block of the matrix can be read back with
+ * matrix_from_chunked_path() without reading the rest. A row of chunks is
+ * written once all of its rows are pushed.
+ */
+NpyWriter* npy_writer_open_chunked(const char* path, size_t rows, size_t cols,
+                                   size_t chunk_rows, size_t chunk_cols,
+                                   int encoding, size_t sync_rows,
+                                   bool background);
+
+/**
+ * Writes out any remaining rows of a NPY writer, syncs the file to the disk,
+ * closes it, and frees the writer. Returns false if anything could not be
+ * written or the number of rows does not match the shape.
+ */
+bool npy_writer_close(NpyWriter* W);
+
+
+/**
+ * Creates a new matrix from rows row_start..row_end-1 and columns
+ * col_start..col_end-1 of a chunked matrix file written by a NpyWriter. Ends
+ * past the shape of the file are cut to it, so the whole matrix can be read
+ * with ends of SIZE_MAX. Only the chunks that overlap the block are read and
+ * decoded.
+ * 
+ * This will return NULL if the file cannot be read, is not a chunked matrix
+ * file, the block is empty, or a chunk the block needs was never written.
+ */
+Matrix* matrix_from_chunked_path(const char* path,
+                                 size_t row_start, size_t row_end,
+                                 size_t col_start, size_t col_end);
+
 
 //////////////////// Matrix Comparison Functions //////////////////// 
 
@@ -252,12 +463,23 @@ Matrix* scalar_matrix_map(double a, const Matrix* B, binary_func func);
 /**
  * Apply a binary function to every elements and the previous return value,
  * reducing down to a single value. Useful for things like fmax().
+ *
+ * The reductions with add, multiply, fmin, fmax, and hypot (which gives the
+ * Euclidean norm) are vectorized and large matrices are split between the
+ * OpenMP threads. They are combined in a tree instead of in order, so the
+ * rounding is not the same as the function, but it is always the same for a
+ * given number of threads. The norm is the square root of the sum of squares
+ * so it overflows for values beyond about 1e154.
  */
 double matrix_reduce(const Matrix* A, binary_func func);
 
 /**
  * Apply a binary function to every elements and the previous return value,
  * reducing down to a single value for each row. Useful for things like fmax().
+ *
+ * The built-in reductions (see matrix_reduce()) are vectorized and the rows
+ * are split between the OpenMP threads. The results do not depend on the
+ * number of threads.
  */
 Matrix* matrix_reduce_rows(const Matrix* A, binary_func func);
 
@@ -265,20 +487,41 @@ Matrix* matrix_reduce_rows(const Matrix* A, binary_func func);
  * Apply a binary function to every elements and the previous return value,
  * reducing down to a single value for each column. Useful for things like
  * fmax().
+ *
+ * This sweeps the rows in order and keeps a value for every column. The
+ * built-in reductions (see matrix_reduce()) are vectorized across the columns
+ * and blocks of columns are split between the OpenMP threads. The results do
+ * not depend on the number of threads.
  */
 Matrix* matrix_reduce_cols(const Matrix* A, binary_func func);
 
+// The axes matrix_reduce_axis() can reduce along
+#define MATRIX_AXIS_ALL  0 // everything, gives a 1 by 1 matrix
+#define MATRIX_AXIS_ROWS 1 // each row, gives a column vector
+#define MATRIX_AXIS_COLS 2 // each column, gives a row vector
+
+/**
+ * Reduces a matrix along one of the MATRIX_AXIS_* axes with a binary function
+ * (see matrix_reduce(), matrix_reduce_rows(), and matrix_reduce_cols()).
+ * Returns NULL if the axis is not known or memory cannot be allocated.
+ */
+Matrix* matrix_reduce_axis(const Matrix* A, binary_func func, int axis);
+
 
 //////////////////// Unary and Binary Functions //////////////////// 
 // These are to be used with the *_apply() and *_map() functions like:
 //   M = matrix_map(A, sin)    // creates a new matrix where each value is the sin of the corresponding value in A
 //   matrix_apply(M, negative) // replaces all values in M with their negative
 //   C = matrix_matrix_map(A, B, subtract) // all values in C are the difference of values in A and B
+// The functions here and fabs are recognized by the *_apply() and *_map()
+// functions which then use vectorized (and for large matrices multithreaded)
+// loops instead of calling them for every element. Their external definitions
+// are in matrix.c so that they have the same address in every file.
 
 // Unary functions
-static inline double reciprocal(double a) { return 1 / a; }
-static inline double positive(double a) { return +a; }
-static inline double negative(double a) { return -a; }
+inline double reciprocal(double a) { return 1 / a; }
+inline double positive(double a) { return +a; }
+inline double negative(double a) { return -a; }
 // included in math.h:
 // fabs, exp, exp2, expm1, log, log10, log2, log1p, sqrt, cbrt
 // sin, cos, tan, asin, acos, atan, sinh, cosh, tanh, asinh, acosh, atanh
@@ -287,10 +530,10 @@ static inline double negative(double a) { return -a; }
 // and more
 
 // Binary functions
-static inline double add(double a, double b) { return a + b; }
-static inline double subtract(double a, double b) { return a - b; }
-static inline double multiply(double a, double b) { return a * b; }
-static inline double divide(double a, double b) { return a / b; }
+inline double add(double a, double b) { return a + b; }
+inline double subtract(double a, double b) { return a - b; }
+inline double multiply(double a, double b) { return a * b; }
+inline double divide(double a, double b) { return a / b; }
 // included in math.h:
 // fmod, remainder, fmin, fmax, fdim, pow, hypot, atan2
 
@@ -310,5 +553,180 @@ static inline double divide(double a, double b) { return a / b; }
  * Output is written to the third argument which must be the right size.
  * If the inner dimensions are not equal or output not the right size, this
  * returns false.
+ *
+ * This is a blocked and packed multiplication with a SIMD micro-kernel which
+ * is split between the OpenMP threads when it is compiled with -fopenmp (see
+ * matrix_multiplication_transposed()).
  */
 bool matrix_multiplication(const Matrix* A, const Matrix* B, Matrix* C);
+
+/**
+ * Matrix multiplication of A or its transpose (if trans_a) and B or its
+ * transpose (if trans_b) into C, without making the transposes. The output
+ * must not be either of the inputs. Returns false if the shapes do not match
+ * or the multiplication cannot allocate its packing buffers.
+ *
+ * The sums are accumulated in blocks so the rounding is not the same as
+ * adding the products in order. Large products use every OpenMP thread (when
+ * compiled with -fopenmp), small ones run on the calling thread.
+ */
+bool matrix_multiplication_transposed(const Matrix* A, bool trans_a,
+                                      const Matrix* B, bool trans_b, Matrix* C);
+
+
+//////////////////// Matrix Expressions ////////////////////
+// Chains of the *_map() functions create a new matrix at every step, like:
+//   C = matrix_scalar_map(matrix_matrix_map(A, B, subtract), 2.0, multiply)
+// An expression instead evaluates the whole chain for one block of elements
+// at a time, keeping the intermediate values in the cache:
+//   MatrixExpr* E = matrix_expr_create();
+//   const MatrixExprNode* d = matrix_expr_binary(E, subtract,
+//       matrix_expr_matrix(E, A), matrix_expr_matrix(E, B));
+//   C = matrix_expr_map(E, matrix_expr_binary(E, multiply, d, matrix_expr_scalar(E, 2.0)));
+// The node functions return NULL if any argument is NULL, the shapes do not
+// match, or the expression is full, and the evaluations fail if given NULL so
+// the errors only need to be checked at the end.
+
+/**
+ * Creates an empty matrix expression. Returns NULL if it cannot be allocated.
+ */
+MatrixExpr* matrix_expr_create();
+
+/**
+ * Frees a matrix expression and its temporaries. The matrices it refers to
+ * are not freed.
+ */
+void matrix_expr_free(MatrixExpr* E);
+
+/**
+ * Removes all of the nodes of an expression so it can be used for another
+ * one. Its temporaries are kept for reuse.
+ */
+void matrix_expr_clear(MatrixExpr* E);
+
+/**
+ * Adds a node with the values of a matrix. The matrix is only read when the
+ * expression is evaluated.
+ */
+const MatrixExprNode* matrix_expr_matrix(MatrixExpr* E, const Matrix* M);
+
+/**
+ * Adds a node with a single value for every element.
+ */
+const MatrixExprNode* matrix_expr_scalar(MatrixExpr* E, double value);
+
+/**
+ * Adds a node that applies a unary function to every element of another node.
+ * Functions of scalars are computed right away.
+ */
+const MatrixExprNode* matrix_expr_unary(MatrixExpr* E, unary_func func,
+                                        const MatrixExprNode* a);
+
+/**
+ * Adds a node that applies a binary function to every pair of elements of two
+ * other nodes, which must be the same shape unless one of them is a scalar.
+ * Functions of two scalars are computed right away.
+ */
+const MatrixExprNode* matrix_expr_binary(MatrixExpr* E, binary_func func,
+                                         const MatrixExprNode* a,
+                                         const MatrixExprNode* b);
+
+/**
+ * Evaluates an expression into out, which must be the same shape as root
+ * (unless root is a scalar). The output may be one of the matrices of the
+ * expression to evaluate it in-place but it must not partially overlap one.
+ * Only the nodes root depends on are evaluated. Returns false if root is NULL,
+ * the shape does not match, or the temporaries cannot be allocated.
+ *
+ * The built-in functions (see above) are vectorized and, if every function of
+ * the expression is one of them, large matrices are split between the OpenMP
+ * threads. Other functions are called on the calling thread.
+ */
+bool matrix_expr_eval(MatrixExpr* E, const MatrixExprNode* root, Matrix* out);
+
+/**
+ * Evaluates an expression into a new matrix the shape of root. Returns NULL if
+ * root is NULL or a scalar or if memory cannot be allocated.
+ */
+Matrix* matrix_expr_map(MatrixExpr* E, const MatrixExprNode* root);
+
+
+//////////////////// Matrix Views ////////////////////
+// Views select rows and columns of a matrix (every k-th one or a range of
+// them) without copying, like:
+//   MatrixView all = matrix_view(output), body;
+//   matrix_view_slice(&all, 0, output->rows, 1, 3*i, 3, 1, &body) // the 3 columns of body i
+//   Matrix* centroid = matrix_view_reduce_cols(&body, add)
+// The view functions are the same as the matrix ones, the built-in functions
+// are vectorized for views whose columns are contiguous (col_stride of 1).
+// Views of a memory-mapped matrix only read the pages they use.
+
+/**
+ * Gets the element at row i and column j of a view. Like MATRIX_AT() it can
+ * be used on either side of an =.
+ */
+#define MATRIX_VIEW_AT(V, i, j) ((V)->data[(i)*(V)->row_stride+(j)*(V)->col_stride])
+
+/**
+ * Makes a view of all of a matrix. Views can change the values of the matrix
+ * (see matrix_view_apply()) so the matrix cannot be const.
+ */
+MatrixView matrix_view(Matrix* M);
+
+/**
+ * Makes a view of every row_step-th row of rows rows starting at row and every
+ * col_step-th column of cols columns starting at col of another view (which
+ * can be the same as out). Returns false if the steps are 0 or any of it is
+ * outside the view.
+ */
+bool matrix_view_slice(const MatrixView* V, size_t row, size_t rows, size_t row_step,
+                       size_t col, size_t cols, size_t col_step, MatrixView* out);
+
+/**
+ * Makes a new matrix with a copy of the values of a view. Returns NULL if it
+ * cannot be allocated.
+ */
+Matrix* matrix_view_copy(const MatrixView* V);
+
+/**
+ * Checks if two views are equal to within a tolerance (see matrix_allclose()).
+ */
+bool matrix_view_allclose(const MatrixView* A, const MatrixView* B, double rtol, double atol);
+
+/**
+ * Apply a unary function to every element of a view, replacing the value in
+ * the matrix it is a view of (see matrix_apply()). The rows of the view must
+ * not overlap.
+ */
+void matrix_view_apply(const MatrixView* V, unary_func func);
+
+/**
+ * Apply a binary function to every elements of a view and the previous return
+ * value, reducing down to a single value (see matrix_reduce()). The built-in
+ * reductions are combined row by row in a tree and the result is always the
+ * same for a given number of threads.
+ */
+double matrix_view_reduce(const MatrixView* V, binary_func func);
+
+/**
+ * Reduces each row of a view down to a single value (see
+ * matrix_reduce_rows()).
+ */
+Matrix* matrix_view_reduce_rows(const MatrixView* V, binary_func func);
+
+/**
+ * Reduces each column of a view down to a single value (see
+ * matrix_reduce_cols()).
+ */
+Matrix* matrix_view_reduce_cols(const MatrixView* V, binary_func func);
+
+/**
+ * Saves the values of a view to a NPY file, it can be loaded as a matrix of
+ * the shape of the view. Returns false if the data cannot be written.
+ */
+bool matrix_view_to_npy(FILE* file, const MatrixView* V);
+
+/**
+ * Same as matrix_view_to_npy() but takes a file path instead.
+ */
+bool matrix_view_to_npy_path(const char* path, const MatrixView* V);
@@ -37,6 +37,126 @@ static inline void __read_csv_line(char* line, double* out, size_t count) {
     memset(out+i, 0, (count-i)*sizeof(double)); // zero-fill remainder
 }
 
+// The powers of ten that are exactly representable as doubles
+static const double __csv_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/**
+ * Parses the value in [tok, end) that is not NUL-terminated. Plain decimals
+ * with at most 15 significant digits use a fast path (which is exact since
+ * both the digits and the power of ten are exact doubles and there is a
+ * single rounding), everything else (more digits, inf, nan, and hex values)
+ * goes through strtod() and invalid values through __read_csv_val().
+ */
+static inline double __csv_parse_val(const char* tok, const char* end) {
+    const char* s = tok;
+    while (s < end && isspace(*s)) { s++; }
+    bool neg = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) { s++; }
+    uint64_t mant = 0;
+    int digits = 0, exp10 = 0;
+    bool any = false;
+    for (; s < end && isdigit(*s); s++, any = true) {
+        mant = mant*10 + (*s - '0');
+        if (mant) { digits++; }
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && isdigit(*s); s++, any = true) {
+            mant = mant*10 + (*s - '0');
+            if (mant) { digits++; }
+            exp10--;
+        }
+    }
+    if (any && s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        bool eneg = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+')) { e++; }
+        int x = 0;
+        bool eany = false;
+        for (; e < end && isdigit(*e); e++, eany = true) { if (x < 10000) { x = x*10 + (*e - '0'); } }
+        if (eany) { exp10 += eneg ? -x : x; s = e; } else { any = false; }
+    }
+    while (s < end && isspace(*s)) { s++; }
+    if (any && s == end && digits <= 15 && exp10 >= -22 && exp10 <= 22) {
+        double val = exp10 < 0 ? mant / __csv_pow10[-exp10] : mant * __csv_pow10[exp10];
+        return neg ? -val : val;
+    }
+
+    // strtod() needs a NUL-terminated copy
+    char buf[128], *copy = buf, *rest;
+    size_t len = end - tok;
+    if (len >= sizeof(buf) && !(copy = (char*)malloc(len + 1))) { return 0.0; }
+    memcpy(copy, tok, len);
+    copy[len] = 0;
+    double val = strtod(copy, &rest);
+    while (*rest && isspace(*rest)) { rest++; }
+    if (rest == copy || *rest) { val = __read_csv_val(copy); } // prints the warning
+    if (copy != buf) { free(copy); }
+    return val;
+}
+
+/**
+ * Counts the values of the line [s, end), like __read_csv_first_line() empty
+ * values are skipped.
+ */
+static inline size_t __csv_count_vals(const char* s, const char* end) {
+    size_t count = 0;
+    while (s < end) {
+        const char* comma = (const char*)memchr(s, ',', end - s);
+        if (!comma) { comma = end; }
+        if (comma > s) { count++; }
+        s = comma + 1;
+    }
+    return count;
+}
+
+/**
+ * Parses the line [s, end) into count values, like __read_csv_line() extra
+ * values are ignored, missing ones are 0, and empty values are skipped.
+ */
+static inline void __csv_parse_line(const char* s, const char* end,
+                                    double* out, size_t count) {
+    size_t i = 0;
+    while (s < end && i < count) {
+        const char* comma = (const char*)memchr(s, ',', end - s);
+        if (!comma) { comma = end; }
+        if (comma > s) { out[i++] = __csv_parse_val(s, comma); }
+        s = comma + 1;
+    }
+    memset(out+i, 0, (count-i)*sizeof(double)); // zero-fill remainder
+}
+
+
+////////// CSV File Writing //////////
+
+/**
+ * Formats rows [first, last) of a matrix as CSV, appending to the buffer
+ * which grows as needed. Returns the new length of the buffer or -1 if it
+ * cannot grow.
+ */
+static inline ssize_t __csv_format_rows(const Matrix* M, size_t first, size_t last,
+                                        char** buf, size_t* cap, size_t len) {
+    for (size_t i = first; i < last; i++) {
+        for (size_t j = 0; j < M->cols; j++) {
+            char sep = j + 1 == M->cols ? '\n' : ',';
+            int n;
+            while ((n = snprintf(*buf + len, *cap - len, "%f%c", MATRIX_AT(M, i, j), sep)) < 0 ||
+                   (size_t)n >= *cap - len) {
+                if (n < 0) { return -1; }
+                size_t size = *cap * 2 + n + 1;
+                char* bigger = (char*)realloc(*buf, size);
+                if (!bigger) { return -1; }
+                *buf = bigger;
+                *cap = size;
+            }
+            len += n;
+        }
+    }
+    return len;
+}
+
 
 ////////// NPY File Reading //////////
 
@@ -137,3 +257,142 @@ static inline bool __npy_read_header(FILE* file, size_t* sh, size_t* offset) {
     free(dict);
     return true;
 }
+
+
+////////// Chunked File Encoding //////////
+
+// A chunked matrix file starts with this header, then the index of the chunks
+// (an offset and a size for each chunk, row of chunks by row of chunks) and
+// then the encoded chunks themselves. A size of 0 means the chunk was never
+// written.
+#define CHUNK_MAGIC "\x93MCHUNK\x01"
+struct __ChunkHeader {
+    char magic[8];
+    uint64_t rows, cols;
+    uint32_t chunk_rows, chunk_cols;
+    uint32_t encoding, reserved;
+    uint64_t padding[2];
+};
+#define CHUNK_INDEX_ENTRY (2*sizeof(uint64_t))
+
+// Largest number of bytes the run-length encoding of len bytes can take
+#define RLE_BOUND(len) ((len) + (len)/128 + 1)
+
+/**
+ * Run-length encodes len bytes. Each control byte c below 128 is followed by
+ * c+1 literal bytes, otherwise the next byte is repeated c-125 times (3 to
+ * 130). Returns the number of bytes written to out.
+ */
+static inline size_t __rle_encode(const unsigned char* in, size_t len,
+                                  unsigned char* out) {
+    size_t o = 0, i = 0, lit = 0; // the literals not yet written start at lit
+    while (i <= len) {
+        size_t run = 1;
+        while (i < len && i + run < len && run < 130 && in[i+run] == in[i]) { run++; }
+        if (run >= 3 || i == len) {
+            while (lit < i) {
+                size_t count = i - lit < 128 ? i - lit : 128;
+                out[o++] = (unsigned char)(count - 1);
+                memcpy(out + o, in + lit, count);
+                o += count;
+                lit += count;
+            }
+            if (i == len) { break; }
+            out[o++] = (unsigned char)(run + 125);
+            out[o++] = in[i];
+            lit = i + run;
+        }
+        i += run;
+    }
+    return o;
+}
+
+/**
+ * Decodes the output of __rle_encode(), which must be exactly out_len bytes.
+ */
+static inline bool __rle_decode(const unsigned char* in, size_t len,
+                                unsigned char* out, size_t out_len) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        size_t c = in[i++];
+        if (c < 128) {
+            if (i + c + 1 > len || o + c + 1 > out_len) { return false; }
+            memcpy(out + o, in + i, c + 1);
+            i += c + 1; o += c + 1;
+        } else {
+            if (i >= len || o + c - 125 > out_len) { return false; }
+            memset(out + o, in[i++], c - 125);
+            o += c - 125;
+        }
+    }
+    return o == out_len;
+}
+
+/**
+ * Number of bytes that each value takes with the given encoding.
+ */
+static inline size_t __chunk_word_size(int encoding) {
+    return encoding == MATRIX_CHUNK_FLOAT32 ? sizeof(float) : sizeof(double);
+}
+
+/**
+ * Encodes an nr-by-nc block of values whose rows are stride values apart.
+ * Going down each column, the bits of every value are XORed with the ones of
+ * the value in the previous row so values that barely change become mostly 0
+ * bits. The bytes are then shuffled so that byte b of every value comes
+ * together (making long runs of 0s) and run-length encoded. scratch must have
+ * space for nr*nc doubles and out for RLE_BOUND() of that. Returns the number
+ * of bytes written to out.
+ */
+static inline size_t __chunk_encode(const double* data, size_t stride,
+                                    size_t nr, size_t nc, int encoding,
+                                    unsigned char* scratch, unsigned char* out) {
+    size_t w = __chunk_word_size(encoding), count = nr*nc, k = 0;
+    for (size_t c = 0; c < nc; c++) {
+        uint64_t prev = 0;
+        for (size_t r = 0; r < nr; r++, k++) {
+            uint64_t bits;
+            if (w == sizeof(float)) {
+                float f = (float)data[r*stride + c];
+                uint32_t b32;
+                memcpy(&b32, &f, sizeof(b32));
+                bits = b32;
+            } else {
+                memcpy(&bits, &data[r*stride + c], sizeof(bits));
+            }
+            uint64_t delta = bits ^ prev;
+            prev = bits;
+            for (size_t b = 0; b < w; b++) { scratch[b*count + k] = (unsigned char)(delta >> (8*b)); }
+        }
+    }
+    return __rle_encode(scratch, w*count, out);
+}
+
+/**
+ * Decodes the output of __chunk_encode() into an nr-by-nc row-major block.
+ * scratch must have space for nr*nc doubles. Returns false if the data is not
+ * valid.
+ */
+static inline bool __chunk_decode(const unsigned char* in, size_t len,
+                                  size_t nr, size_t nc, int encoding,
+                                  unsigned char* scratch, double* out) {
+    size_t w = __chunk_word_size(encoding), count = nr*nc, k = 0;
+    if (!__rle_decode(in, len, scratch, w*count)) { return false; }
+    for (size_t c = 0; c < nc; c++) {
+        uint64_t prev = 0;
+        for (size_t r = 0; r < nr; r++, k++) {
+            uint64_t delta = 0;
+            for (size_t b = 0; b < w; b++) { delta |= (uint64_t)scratch[b*count + k] << (8*b); }
+            prev ^= delta;
+            if (w == sizeof(float)) {
+                uint32_t b32 = (uint32_t)prev;
+                float f;
+                memcpy(&f, &b32, sizeof(f));
+                out[r*nc + c] = f;
+            } else {
+                memcpy(&out[r*nc + c], &prev, sizeof(double));
+            }
+        }
+    }
+    return true;
+}
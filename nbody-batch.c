@@ -0,0 +1,276 @@
+/**
+ * Runs many independent simulations of the n-body problem in 3D at once.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -pthread -O3 -march=native nbody-batch.c arena.c body.c integrator.c matrix.c topology.c util.c -o nbody-batch -lm
+ *
+ * To run the program:
+ *   ./nbody-batch [--integrator=name] [--compress=encoding] time-step total-time outputs-per-body manifest.txt [opt: num-threads]
+ * where:
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --compress writes every output as a chunked matrix file instead (read
+ *     them with matrix_from_chunked_path()) with the values stored as either
+ *     delta (exact) or float32
+ *   - time-step, total-time, and outputs-per-body are the defaults for the
+ *     simulations of the manifest (like nbody-s3)
+ *   - manifest.txt lists one simulation per line as
+ *       input.npy output.npy [time-step total-time outputs-per-body]
+ *     with the input and output files of nbody-s3 and optionally its own
+ *     steps, blank lines and lines starting with # are skipped
+ *   - last argument is an optional number of threads (by default one per
+ *     physical core)
+ *
+ * Every simulation is run start to finish by a single thread with the serial
+ * Newton's 3rd law kernel of nbody-s3 (and gives exactly the same output), so
+ * there is no synchronization between the threads while they run. The
+ * threads take the next simulation whenever they finish one, the longest
+ * ones (by n^2 times the number of steps) first so that the last ones to
+ * finish are short. For small systems this keeps every core busy where
+ * splitting each simulation over the cores would spend most of a step in the
+ * OpenMP barriers.
+ *
+ * A simulation that fails is reported and the rest still run, the exit
+ * status is then 1.
+ *
+ * The threads are pinned to the cores, filling one NUMA node at a time, unless
+ * OMP_PROC_BIND, OMP_PLACES, or GOMP_CPU_AFFINITY is set.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "body.h"
+#include "integrator.h"
+#include "topology.h"
+
+
+struct _Job {
+    // One simulation of the manifest
+    char *input, *output;
+    double time_step, total_time;
+    size_t num_outputs;
+    double cost;    // n^2 times the number of steps, for ordering the jobs
+    double seconds; // time taken to run it
+    bool ok;
+};
+typedef struct _Job Job;
+
+/**
+ * Orders the jobs by decreasing cost.
+ */
+static int __compare_cost(const void* a, const void* b) {
+    double x = ((const Job*)a)->cost, y = ((const Job*)b)->cost;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Frees the jobs of a manifest.
+ */
+static void __free_jobs(Job* jobs, size_t num_jobs) {
+    for (size_t j = 0; j < num_jobs; j++) { free(jobs[j].input); free(jobs[j].output); }
+    free(jobs);
+}
+
+/**
+ * Reads the jobs of a manifest into an array (to free with __free_jobs()),
+ * filling in the steps not given with the defaults. Returns NULL (after
+ * printing the problem) if the manifest cannot be read or has a bad line.
+ */
+static Job* __read_manifest(const char* path, const Job* defaults, size_t* num_jobs) {
+    FILE* f = fopen(path, "r");
+    if (!f) { perror("error reading manifest"); return NULL; }
+    Job* jobs = NULL;
+    size_t count = 0, capacity = 0, line_num = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        char input[4096], output[4096];
+        Job job = *defaults;
+        int fields = sscanf(line, "%4095s %4095s %lf %lf %zu", input, output,
+                            &job.time_step, &job.total_time, &job.num_outputs);
+        if (fields <= 0 || input[0] == '#') { continue; }
+        if ((fields != 2 && fields != 5) || job.time_step <= 0 || job.total_time <= 0 ||
+            job.time_step > job.total_time || job.num_outputs <= 0) {
+            fprintf(stderr, "%s:%zu: expected input.npy output.npy [time-step total-time outputs-per-body]\n", path, line_num);
+            __free_jobs(jobs, count);
+            fclose(f);
+            return NULL;
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            Job* grown = (Job*)realloc(jobs, capacity * sizeof(Job));
+            if (!grown) { perror("error reading manifest"); __free_jobs(jobs, count); fclose(f); return NULL; }
+            jobs = grown;
+        }
+        job.input = strdup(input);
+        job.output = strdup(output);
+        jobs[count++] = job;
+        if (!job.input || !job.output) { perror("error reading manifest"); __free_jobs(jobs, count); fclose(f); return NULL; }
+    }
+    fclose(f);
+    *num_jobs = count;
+    return jobs;
+}
+
+/**
+ * Runs the simulation of a job on the calling thread exactly like nbody-s3.
+ * Returns false (after printing the problem) if it fails.
+ */
+static bool __simulate(const Job* job, const Integrator* integrator, int encoding) {
+    Matrix* input = matrix_from_npy_path_mapped(job->input, NPY_MAP_READONLY);
+    if (input == NULL) { fprintf(stderr, "%s: error reading input: %s\n", job->input, strerror(errno)); return false; }
+    if (input->cols != 7 || input->rows == 0) { fprintf(stderr, "%s: input must have 7 columns and at least 1 row\n", job->input); matrix_free(input); return false; }
+    size_t n = input->rows, num_outputs = job->num_outputs;
+    double time_step = job->time_step;
+    size_t num_steps = (size_t)(job->total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // Create the bodies, the accelerations, and the output (written by this
+    // thread since a writer thread per simulation would compete with the
+    // others for the cores)
+    Bodies* B = bodies_from_input(input);
+    matrix_free(input);
+    double* ax = body_array_alloc(n);
+    double* ay = body_array_alloc(n);
+    double* az = body_array_alloc(n);
+    NpyWriter* output = NULL;
+    if (B && ax && ay && az) {
+        output = encoding ? npy_writer_open_chunked(job->output, num_outputs, 3*n, 0, 0, encoding, 0, false) :
+            npy_writer_open(job->output, num_outputs, 3*n, 0, 0, false);
+    }
+    bool ok = output != NULL;
+    if (!ok) { fprintf(stderr, "%s: error creating output: %s\n", job->output, strerror(errno)); }
+
+    // Save positions to row `0` of output
+    if (ok) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+
+    // Run simulation for each time step, running the kicks and drifts of the
+    // integrator and only recomputing the accelerations after the bodies moved
+    bool moved = true;
+    for (size_t t = 1; t < num_steps && ok; t++) {
+        for (size_t s = 0; s < integrator->num_ops; s++) {
+            const IntegratorOp* op = &integrator->ops[s];
+            if (op->type == OP_FORCE && moved) {
+                memset(ax, 0, n * sizeof(double));
+                memset(ay, 0, n * sizeof(double));
+                memset(az, 0, n * sizeof(double));
+                for (size_t i = 0; i < n; i++) {
+                    // Interactions with every body before i, applied to both bodies
+                    bodies_accumulate_accel_symmetric(B, i, 0, i, ax, ay, az);
+                }
+                moved = false;
+            } else if (op->type == OP_KICK) {
+                integrator_kick(B, 0, n, ax, ay, az, op->coef * time_step);
+            } else if (op->type == OP_DRIFT) {
+                integrator_drift(B, 0, n, op->coef * time_step);
+                moved = true;
+            }
+        }
+        if (t % output_steps == 0) {
+            // Save positions to row `t/output_steps` of output
+            bodies_save_position(npy_writer_row(output), B);
+            npy_writer_push(output);
+        }
+    }
+
+    // Save the final set of data if necessary and finish writing the results
+    if (ok && output->written < num_outputs) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+    if (output && !npy_writer_close(output) && ok) {
+        fprintf(stderr, "%s: error writing output: %s\n", job->output, strerror(errno));
+        ok = false;
+    }
+
+    // cleanup
+    if (B) { bodies_free(B); }
+    free(ax);
+    free(ay);
+    free(az);
+    return ok;
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    if ((argc != 5 && argc != 6) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--integrator=name] [--compress=encoding] time-step total-time outputs-per-body manifest.txt [num-threads]\n", argv[0]); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    Job defaults = {NULL, NULL, atof(argv[1]), atof(argv[2]), atoi(argv[3]), 0, 0, false};
+    if (defaults.time_step <= 0 || defaults.total_time <= 0 || defaults.time_step > defaults.total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
+    if (defaults.num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
+    size_t num_jobs;
+    Job* jobs = __read_manifest(argv[4], &defaults, &num_jobs);
+    if (jobs == NULL) { return 1; }
+    Topology* topo = topology_detect();
+    if (topo == NULL) { perror("error reading topology"); return 1; }
+    size_t num_threads = topology_default_threads(topo);
+    if (argc == 6 && !parse_count(argv[5], &num_threads)) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    if (num_threads > num_jobs) { num_threads = num_jobs ? num_jobs : 1; }
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Order the simulations by their cost, the sizes only need the headers
+    // of the inputs (a missing input is reported when it is run)
+    for (size_t j = 0; j < num_jobs; j++) {
+        Matrix* input = matrix_from_npy_path_mapped(jobs[j].input, NPY_MAP_READONLY);
+        double n = input ? input->rows : 0;
+        jobs[j].cost = n * n * (jobs[j].total_time / jobs[j].time_step);
+        if (input) { matrix_free(input); }
+    }
+    qsort(jobs, num_jobs, sizeof(Job), __compare_cost);
+
+    // Run every simulation on a single thread, each thread taking the next
+    // one in order when it is done with the last
+    bool pin = topology_should_pin(topo);
+    size_t failed = 0;
+    #pragma omp parallel default(none) shared(pin, topo, jobs, num_jobs, integrator, encoding) \
+    reduction(+: failed) num_threads(num_threads)
+    {
+        if (pin) { topology_pin(topo, omp_get_thread_num(), omp_get_num_threads()); }
+        #pragma omp for schedule(dynamic, 1)
+        for (size_t j = 0; j < num_jobs; j++) {
+            struct timespec job_start, job_end;
+            clock_gettime(CLOCK_MONOTONIC, &job_start);
+            jobs[j].ok = __simulate(&jobs[j], integrator, encoding);
+            clock_gettime(CLOCK_MONOTONIC, &job_end);
+            jobs[j].seconds = get_time_diff(&job_start, &job_end);
+            if (!jobs[j].ok) { failed++; }
+        }
+    }
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end), busy = 0;
+    for (size_t j = 0; j < num_jobs; j++) { busy += jobs[j].seconds; }
+    printf("%f secs\n", time);
+    printf("%zu simulations (%zu failed) on %zu threads, %.1f simulations/s, %.0f%% of the thread time busy\n",
+           num_jobs, failed, num_threads, num_jobs / time, time ? 100 * busy / (time * num_threads) : 0);
+
+    // cleanup
+    __free_jobs(jobs, num_jobs);
+    topology_free(topo);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,393 @@
+/**
+ * Benchmarks the four n-body simulations against each other on generated
+ * inputs.
+ *
+ * To compile the program (the simulations it runs are compiled as described in
+ * their own files):
+ *   gcc -Wall -O3 -march=native nbody-bench.c arena.c generate.c matrix.c util.c -o nbody-bench -lm -pthread
+ *
+ * To run the program:
+ *   ./nbody-bench [--sizes=n,...] [--threads=t,...] [--distribution=name] [--seed=s] [--steps=k] [--repeat=r] [--rtol=tol] [--bin=dir] [--dir=dir] [--baseline=results.csv] [--regression=fraction]
+ * where:
+ *   - --sizes are the numbers of bodies (default 100,1000,10000)
+ *   - --threads are the thread counts of nbody-p and nbody-p3 (default 1, 2,
+ *     4, ... up to the number of physical cores)
+ *   - --distribution is the generated input, one of uniform, plummer (the
+ *     default), disk, or binaries, and --seed picks its random numbers
+ *     (default 1)
+ *   - --steps is the number of time steps of every run (default 20), each a
+ *     thousandth of the shortest timescale of the input (see
+ *     generate_time_step())
+ *   - --repeat is the number of times each run is timed, the fastest time is
+ *     kept (default 3)
+ *   - --rtol is the relative tolerance of matrix_allclose() when comparing the
+ *     outputs of every run to the output of nbody-s (default 1e-6, positions
+ *     closer than rtol*GENERATE_RADIUS are always equal)
+ *   - --bin is where the compiled simulations are (default .)
+ *   - --dir is where the inputs, outputs, and results are written (default
+ *     bench), the results are in results.csv and results.json
+ *   - --baseline is the results.csv of an earlier run, a time that is more
+ *     than --regression (default 0.1) slower than the same run in it is
+ *     reported as a regression
+ *
+ * The CSV has a row per run with its time, its speedup over nbody-s, and its
+ * parallel efficiency (the speedup over the same program with one thread per
+ * thread). The JSON has the same rows along with the machine, an Amdahl's law
+ * fit of every parallel program and size, the crossover points where one
+ * program becomes faster than another, and the regressions. The exit status
+ * is 1 if any run failed, any output did not match, or anything regressed.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "generate.h"
+
+
+#define BENCH_MAX_LIST 64
+
+struct _BenchDriver {
+    const char* name;
+    bool parallel; // if it is run with every thread count
+};
+typedef struct _BenchDriver BenchDriver;
+
+static const BenchDriver drivers[] = {
+    {"nbody-s", false},
+    {"nbody-s3", false},
+    {"nbody-p", true},
+    {"nbody-p3", true},
+};
+#define NUM_DRIVERS (sizeof(drivers)/sizeof(drivers[0]))
+
+struct _BenchResult {
+    const BenchDriver* driver;
+    size_t n, threads;
+    double seconds;    // the fastest of the repeats (NAN if it failed)
+    bool match;        // if the output is allclose to the output of nbody-s
+    double speedup;    // over nbody-s with the same n
+    double efficiency; // speedup over the same driver with 1 thread / threads
+};
+typedef struct _BenchResult BenchResult;
+
+
+/**
+ * Parses a comma separated list of positive integers into values. Returns the
+ * number of values or 0 if the list is not valid.
+ */
+static size_t __parse_list(const char* str, size_t* values, size_t max) {
+    size_t count = 0;
+    while (*str && count < max) {
+        char* end;
+        long value = strtol(str, &end, 10);
+        if (end == str || value <= 0 || (*end != ',' && *end != '\0')) { return 0; }
+        values[count++] = value;
+        str = *end ? end + 1 : end;
+    }
+    return *str ? 0 : count;
+}
+
+/**
+ * Orders sizes from smallest to largest.
+ */
+static int __size_cmp(const void* a, const void* b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs a program with the arguments and gets the seconds it printed as its
+ * first line. Returns NAN if it could not be run or failed.
+ */
+static double __run(const char* path, const char* const* args) {
+    int fds[2];
+    if (pipe(fds) != 0) { return NAN; }
+    pid_t pid = fork();
+    if (pid < 0) { close(fds[0]); close(fds[1]); return NAN; }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]); close(fds[1]);
+        execv(path, (char* const*)args);
+        _exit(127);
+    }
+    close(fds[1]);
+    char out[4096];
+    size_t len = 0;
+    ssize_t got;
+    while ((got = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0) {
+        len += got;
+        if (len == sizeof(out) - 1) { char rest[4096]; while (read(fds[0], rest, sizeof(rest)) > 0) {} break; }
+    }
+    out[len] = '\0';
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) { return NAN; }
+    double seconds;
+    return sscanf(out, "%lf secs", &seconds) == 1 ? seconds : NAN;
+}
+
+/**
+ * Finds the result of a driver with n bodies and a number of threads (0 for
+ * the fastest of any number of threads). Returns NULL if there is none.
+ */
+static const BenchResult* __find(const BenchResult* results, size_t count, const char* driver,
+                                 size_t n, size_t threads) {
+    const BenchResult* best = NULL;
+    for (size_t i = 0; i < count; i++) {
+        const BenchResult* r = &results[i];
+        if (strcmp(r->driver->name, driver) != 0 || r->n != n || isnan(r->seconds)) { continue; }
+        if (threads && r->threads == threads) { return r; }
+        if (!threads && (!best || r->seconds < best->seconds)) { best = r; }
+    }
+    return best;
+}
+
+/**
+ * Fits Amdahl's law T(p) = T1*(f + (1-f)/p) to the times of a parallel driver
+ * with n bodies by least squares on T = a + b/p, giving the serial fraction f
+ * = a/(a+b). Returns false if there are fewer than 2 thread counts.
+ */
+static bool __amdahl(const BenchResult* results, size_t count, const char* driver, size_t n,
+                     double* serial) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    size_t k = 0;
+    for (size_t i = 0; i < count; i++) {
+        const BenchResult* r = &results[i];
+        if (strcmp(r->driver->name, driver) != 0 || r->n != n || isnan(r->seconds)) { continue; }
+        double x = 1.0 / r->threads, y = r->seconds;
+        sx += x; sy += y; sxx += x*x; sxy += x*y; k++;
+    }
+    double det = k * sxx - sx * sx;
+    if (k < 2 || det <= 0) { return false; }
+    double b = (k * sxy - sx * sy) / det, a = (sy - b * sx) / k;
+    if (a < 0) { a = 0; } // perfectly parallel within the noise
+    if (b < 0) { b = 0; }
+    *serial = a + b > 0 ? a / (a + b) : 1;
+    return true;
+}
+
+/**
+ * Gets the smallest of the sizes from which on the faster driver (at its best
+ * number of threads) is faster than the other one at every larger size.
+ * Returns 0 if it never is.
+ */
+static size_t __crossover(const BenchResult* results, size_t count, const size_t* sizes,
+                          size_t num_sizes, const char* faster, const char* other) {
+    size_t from = 0;
+    for (size_t s = 0; s < num_sizes; s++) {
+        const BenchResult* a = __find(results, count, faster, sizes[s], 0);
+        const BenchResult* b = __find(results, count, other, sizes[s], 0);
+        if (!a || !b) { continue; }
+        if (a->seconds < b->seconds) { if (!from) { from = sizes[s]; } } else { from = 0; }
+    }
+    return from;
+}
+
+/**
+ * Writes a JSON number, or null if it is not finite.
+ */
+static void __json_number(FILE* f, double x) {
+    if (isfinite(x)) { fprintf(f, "%.6g", x); } else { fprintf(f, "null"); }
+}
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* sizes_opt = get_option(&argc, argv, "sizes");
+    const char* threads_opt = get_option(&argc, argv, "threads");
+    const char* distribution_opt = get_option(&argc, argv, "distribution");
+    const char* seed_opt = get_option(&argc, argv, "seed");
+    const char* steps_opt = get_option(&argc, argv, "steps");
+    const char* repeat_opt = get_option(&argc, argv, "repeat");
+    const char* rtol_opt = get_option(&argc, argv, "rtol");
+    const char* bin_opt = get_option(&argc, argv, "bin");
+    const char* dir_opt = get_option(&argc, argv, "dir");
+    const char* baseline_opt = get_option(&argc, argv, "baseline");
+    const char* regression_opt = get_option(&argc, argv, "regression");
+    if (argc != 1 || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--sizes=n,...] [--threads=t,...] [--distribution=name] [--seed=s] [--steps=k] [--repeat=r] [--rtol=tol] [--bin=dir] [--dir=dir] [--baseline=results.csv] [--regression=fraction]\n", argv[0]); return 1; }
+    size_t sizes[BENCH_MAX_LIST], threads[BENCH_MAX_LIST];
+    size_t num_sizes = __parse_list(sizes_opt ? sizes_opt : "100,1000,10000", sizes, BENCH_MAX_LIST);
+    if (num_sizes == 0) { fprintf(stderr, "sizes must be a list of positive numbers\n"); return 1; }
+    qsort(sizes, num_sizes, sizeof(size_t), __size_cmp); // the crossovers need them in order
+    size_t num_threads = 0;
+    if (threads_opt) {
+        num_threads = __parse_list(threads_opt, threads, BENCH_MAX_LIST);
+        if (num_threads == 0) { fprintf(stderr, "threads must be a list of positive numbers\n"); return 1; }
+    } else {
+        size_t cores = get_num_physical_cores() ? get_num_physical_cores() : 1;
+        for (size_t t = 1; t < cores && num_threads < BENCH_MAX_LIST - 1; t *= 2) { threads[num_threads++] = t; }
+        threads[num_threads++] = cores;
+    }
+    const char* distribution = distribution_opt ? distribution_opt : "plummer";
+    const Generator* generator = generator_find(distribution);
+    if (generator == NULL) { fprintf(stderr, "distribution must be one of uniform, plummer, disk, or binaries\n"); return 1; }
+    uint64_t seed = seed_opt ? strtoull(seed_opt, NULL, 10) : 1;
+    long steps = steps_opt ? atol(steps_opt) : 20, repeat = repeat_opt ? atol(repeat_opt) : 3;
+    if (steps < 2 || repeat < 1) { fprintf(stderr, "steps must be at least 2 and repeat must be positive\n"); return 1; }
+    double rtol = rtol_opt ? atof(rtol_opt) : 1e-6;
+    double regression = regression_opt ? atof(regression_opt) : 0.1;
+    const char* bin = bin_opt ? bin_opt : ".";
+    const char* dir = dir_opt ? dir_opt : "bench";
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) { perror("error creating directory"); return 1; }
+
+    // run every driver on every size, the serial ones with a single thread
+    size_t max_results = num_sizes * NUM_DRIVERS * num_threads, count = 0;
+    BenchResult* results = (BenchResult*)calloc(max_results, sizeof(BenchResult));
+    if (results == NULL) { perror("error allocating results"); return 1; }
+    bool ok = true;
+    size_t outputs = steps < 10 ? steps : 10;
+    for (size_t s = 0; s < num_sizes; s++) {
+        size_t n = sizes[s];
+        char input_path[4096];
+        snprintf(input_path, sizeof(input_path), "%s/%s-%zu.npy", dir, distribution, n);
+        Matrix* input = generator->create(n, seed);
+        if (input == NULL || !matrix_to_npy_path(input_path, input)) { perror("error writing input"); return 1; }
+        matrix_free(input);
+
+        char time_step[64], total_time[64], num_outputs[64];
+        double dt = generate_time_step(generator, n);
+        snprintf(time_step, sizeof(time_step), "%.17g", dt);
+        snprintf(total_time, sizeof(total_time), "%.17g", dt * steps);
+        snprintf(num_outputs, sizeof(num_outputs), "%zu", outputs);
+
+        Matrix* reference = NULL;
+        for (size_t d = 0; d < NUM_DRIVERS; d++) {
+            const BenchDriver* driver = &drivers[d];
+            for (size_t k = 0; k < (driver->parallel ? num_threads : 1); k++) {
+                BenchResult* r = &results[count++];
+                r->driver = driver;
+                r->n = n;
+                r->threads = driver->parallel ? threads[k] : 1;
+
+                char path[4096], output_path[4096], thread_arg[64];
+                snprintf(path, sizeof(path), "%s/%s", bin, driver->name);
+                snprintf(output_path, sizeof(output_path), "%s/%s-%zu-%zu.npy", dir, driver->name, n, r->threads);
+                snprintf(thread_arg, sizeof(thread_arg), "%zu", r->threads);
+                const char* args[] = {path, time_step, total_time, num_outputs, input_path, output_path,
+                                      driver->parallel ? thread_arg : NULL, NULL};
+                r->seconds = NAN;
+                for (long i = 0; i < repeat; i++) {
+                    double seconds = __run(path, args);
+                    if (isnan(seconds)) { r->seconds = NAN; break; }
+                    if (i == 0 || seconds < r->seconds) { r->seconds = seconds; }
+                }
+                if (isnan(r->seconds)) {
+                    fprintf(stderr, "%s failed with %zu bodies and %zu threads\n", driver->name, n, r->threads);
+                    ok = false;
+                    continue;
+                }
+
+                // every output is compared to the one of nbody-s
+                Matrix* output = matrix_from_npy_path(output_path);
+                if (d == 0) { reference = output; output = NULL; }
+                r->match = reference && (d == 0 || (output && matrix_allclose(output, reference, rtol, rtol * GENERATE_RADIUS)));
+                if (!r->match) {
+                    fprintf(stderr, "%s output with %zu bodies and %zu threads does not match nbody-s\n", driver->name, n, r->threads);
+                    ok = false;
+                }
+                if (output) { matrix_free(output); }
+                printf("%-9s n=%-7zu threads=%-3zu ", driver->name, n, r->threads);
+                print_time(r->seconds);
+                printf("%s\n", r->match ? "" : " (MISMATCH)");
+                fflush(stdout);
+            }
+        }
+        if (reference) { matrix_free(reference); }
+    }
+
+    // speedups over nbody-s and over the same driver with 1 thread
+    for (size_t i = 0; i < count; i++) {
+        BenchResult* r = &results[i];
+        const BenchResult* serial = __find(results, count, "nbody-s", r->n, 1);
+        const BenchResult* one = __find(results, count, r->driver->name, r->n, 1);
+        r->speedup = serial && !isnan(r->seconds) ? serial->seconds / r->seconds : NAN;
+        r->efficiency = one && !isnan(r->seconds) ? one->seconds / r->seconds / r->threads : NAN;
+    }
+
+    // compare to the baseline
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/results.json", dir);
+    FILE* json = fopen(path, "w");
+    if (json == NULL) { perror("error writing results"); return 1; }
+    fprintf(json, "{\n  \"distribution\": \"%s\",\n  \"seed\": %llu,\n  \"steps\": %ld,\n  \"repeat\": %ld,\n  \"rtol\": %g,\n",
+            distribution, (unsigned long long)seed, steps, repeat, rtol);
+    fprintf(json, "  \"machine\": {\"physical_cores\": %zu, \"logical_cores\": %zu},\n  \"regressions\": [",
+            get_num_physical_cores(), get_num_logical_cores());
+    if (baseline_opt) {
+        FILE* f = fopen(baseline_opt, "r");
+        if (f == NULL) { perror("error reading baseline"); return 1; }
+        char line[1024], name[64], dist[64];
+        size_t n, t, regressions = 0;
+        double seconds;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%63[^,],%63[^,],%zu,%zu,%lf", name, dist, &n, &t, &seconds) != 5) { continue; }
+            const BenchResult* r = strcmp(dist, distribution) == 0 ? __find(results, count, name, n, t) : NULL;
+            if (!r || r->seconds <= seconds * (1 + regression)) { continue; }
+            fprintf(stderr, "%s with %zu bodies and %zu threads regressed from %f to %f secs\n", name, n, t, seconds, r->seconds);
+            fprintf(json, "%s\n    {\"driver\": \"%s\", \"n\": %zu, \"threads\": %zu, \"baseline_seconds\": %.6g, \"seconds\": %.6g}",
+                    regressions++ ? "," : "", name, n, t, seconds, r->seconds);
+            ok = false;
+        }
+        fclose(f);
+        if (regressions) { fprintf(json, "\n  "); }
+    }
+
+    // the rows as CSV and JSON
+    snprintf(path, sizeof(path), "%s/results.csv", dir);
+    FILE* csv = fopen(path, "w");
+    if (csv == NULL) { perror("error writing results"); return 1; }
+    fprintf(csv, "driver,distribution,n,threads,seconds,speedup,efficiency,match\n");
+    fprintf(json, "],\n  \"results\": [");
+    for (size_t i = 0; i < count; i++) {
+        const BenchResult* r = &results[i];
+        fprintf(csv, "%s,%s,%zu,%zu,%.6f,%.4f,%.4f,%d\n", r->driver->name, distribution, r->n, r->threads,
+                r->seconds, r->speedup, r->efficiency, r->match);
+        fprintf(json, "%s\n    {\"driver\": \"%s\", \"n\": %zu, \"threads\": %zu, \"seconds\": ", i ? "," : "",
+                r->driver->name, r->n, r->threads);
+        __json_number(json, r->seconds);
+        fprintf(json, ", \"speedup\": "); __json_number(json, r->speedup);
+        fprintf(json, ", \"efficiency\": "); __json_number(json, r->efficiency);
+        fprintf(json, ", \"match\": %s}", r->match ? "true" : "false");
+    }
+
+    // the Amdahl's law fits, the parallel fraction is what the analysis calls
+    // "percent parallel"
+    fprintf(json, "\n  ],\n  \"amdahl\": [");
+    size_t fits = 0;
+    for (size_t d = 0; d < NUM_DRIVERS; d++) {
+        if (!drivers[d].parallel) { continue; }
+        for (size_t s = 0; s < num_sizes; s++) {
+            double f;
+            if (!__amdahl(results, count, drivers[d].name, sizes[s], &f)) { continue; }
+            fprintf(json, "%s\n    {\"driver\": \"%s\", \"n\": %zu, \"serial_fraction\": %.4f, \"parallel_fraction\": %.4f, \"max_speedup\": ",
+                    fits++ ? "," : "", drivers[d].name, sizes[s], f, 1 - f);
+            __json_number(json, f > 0 ? 1 / f : INFINITY);
+            fprintf(json, "}");
+        }
+    }
+
+    // the crossover points, null when the first one is never faster
+    static const char* pairs[][2] = {
+        {"nbody-p", "nbody-s"}, {"nbody-p3", "nbody-s3"}, {"nbody-s3", "nbody-s"}, {"nbody-p3", "nbody-p"},
+    };
+    fprintf(json, "\n  ],\n  \"crossovers\": [");
+    for (size_t p = 0; p < sizeof(pairs)/sizeof(pairs[0]); p++) {
+        size_t from = __crossover(results, count, sizes, num_sizes, pairs[p][0], pairs[p][1]);
+        fprintf(json, "%s\n    {\"faster\": \"%s\", \"than\": \"%s\", \"from_n\": ", p ? "," : "", pairs[p][0], pairs[p][1]);
+        if (from) { fprintf(json, "%zu}", from); } else { fprintf(json, "null}"); }
+        if (from) { printf("%s is faster than %s from n=%zu\n", pairs[p][0], pairs[p][1], from); }
+    }
+    fprintf(json, "\n  ]\n}\n");
+    if (fclose(csv) != 0 || fclose(json) != 0) { perror("error writing results"); return 1; }
+
+    free(results);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,289 @@
+/**
+ * Runs a simulation of the n-body problem in 3D using the Barnes-Hut
+ * approximation.
+ * 
+ * To compile the program:
+ *   gcc -Wall -fopenmp -pthread -O3 -march=native nbody-bh.c arena.c body.c integrator.c octree.c matrix.c profile.c topology.c util.c -o nbody-bh -lm
+ * 
+ * To run the program:
+ *   ./nbody-bh [--theta=angle] [--integrator=name] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
+ * where:
+ *   - --theta is the opening angle, a node of the octree whose size divided by
+ *     its distance is less than this is treated as a single body (default 0.5,
+ *     0 gives the exact result)
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --profile times each phase of every thread (and reads the hardware
+ *     counters when perf_event allows it), prints a summary, and writes a
+ *     JSON report (by default output.npy.profile.json)
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below)
+ *   - output.npy is the output of the program (see below)
+ *   - --fsync=k syncs output.npy to the disk every k outputs instead of only
+ *     at the end (it is always written as the positions are produced)
+ *   - --compress writes output.npy as a chunked matrix file instead (read it
+ *     with matrix_from_chunked_path()) with the values stored as either delta
+ *     (exact) or float32
+ *   - --checkpoint=k saves the whole state to output.npy.ckpt every k steps and
+ *     --resume continues from that checkpoint, appending to output.npy
+ *   - last argument is an optional number of threads (by default one per
+ *     physical core)
+ * 
+ * input.npy has a n-by-7 matrix with one row per body and the columns:
+ *   - mass (in kg)
+ *   - initial x, y, z position (in m)
+ *   - initial x, y, z velocity (in m/s)
+ * 
+ * output.npy is generated and has a (outputs-per-body)-by-(3n) matrix with each
+ * row containing the x, y, and z positions of each of the n bodies after a
+ * given timestep.
+ * 
+ * The octree is rebuilt every step from the current positions and the bodies
+ * are integrated into a separate next state so the results match the exact
+ * drivers when theta is 0.
+ * 
+ * The threads are pinned to the cores, filling one NUMA node at a time, unless
+ * OMP_PROC_BIND, OMP_PLACES, or GOMP_CPU_AFFINITY is set.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "body.h"
+#include "integrator.h"
+#include "octree.h"
+#include "profile.h"
+#include "topology.h"
+
+// Default opening angle
+#define DEFAULT_THETA 0.5
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* theta_opt = get_option(&argc, argv, "theta");
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* fsync_opt = get_option(&argc, argv, "fsync");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    const char* checkpoint_opt = get_option(&argc, argv, "checkpoint");
+    bool resume = get_option(&argc, argv, "resume") != NULL;
+    const char* profile_opt = get_option(&argc, argv, "profile");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--theta=angle] [--integrator=name] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    double theta = theta_opt ? atof(theta_opt) : DEFAULT_THETA;
+    if (theta < 0) { fprintf(stderr, "theta must not be negative\n"); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    size_t sync_rows = 0; // only synced at the end unless given
+    if (fsync_opt && !parse_count(fsync_opt, &sync_rows)) { fprintf(stderr, "fsync must be a positive number of outputs\n"); return 1; }
+    size_t checkpoint_steps = 0;
+    if (checkpoint_opt && !parse_count(checkpoint_opt, &checkpoint_steps)) { fprintf(stderr, "checkpoint must be a positive number of steps\n"); return 1; }
+    if ((checkpoint_steps || resume) && encoding) { fprintf(stderr, "--checkpoint and --resume cannot be used with --compress\n"); return 1; }
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
+    Topology* topo = topology_detect();
+    if (topo == NULL) { perror("error reading topology"); return 1; }
+    size_t num_threads = topology_default_threads(topo);
+    if (argc == 7 && !parse_count(argv[6], &num_threads)) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
+    size_t n = input->rows;
+    if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    if (num_threads > n) { num_threads = n; }
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Profile* prof = profile_opt ? profile_create(num_threads, true) : NULL;
+    if (profile_opt && prof == NULL) { perror("error allocating profile"); return 1; }
+
+    // Create the position, velocity, and mass of each body, either from the
+    // input or from where the checkpoint next to the output left off
+    char checkpoint_path[4096];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", argv[5]);
+    Checkpoint info = {0, 0, time_step, false};
+    Matrix* checkpoint = resume ? matrix_from_npy_path_mapped(checkpoint_path, NPY_MAP_READONLY) : NULL;
+    if (resume && checkpoint == NULL) { perror("error reading checkpoint"); return 1; }
+    Bodies* B = resume ? bodies_from_checkpoint(checkpoint, &info) : bodies_create(n);
+    if (B == NULL) { perror("error allocating bodies"); return 1; }
+    if (resume && (B->n != n || info.time_step != time_step)) { fprintf(stderr, "checkpoint is not from this run\n"); return 1; }
+
+    // create the output file as num_outputs x 3*n (or continue the one the
+    // checkpoint belongs to), the rows are written to it by a background
+    // thread as they are produced
+    NpyWriter* output =
+        resume ? npy_writer_resume(argv[5], num_outputs, 3*n, info.outputs, sync_rows, true) :
+        encoding ? npy_writer_open_chunked(argv[5], num_outputs, 3*n, 0, 0, encoding, sync_rows, true) :
+        npy_writer_open(argv[5], num_outputs, 3*n, 0, sync_rows, true);
+    if (output == NULL) { perror("error creating output"); return 1; }
+
+    // Create the tree and the accelerations it computes
+    Octree* tree = octree_create(theta);
+    double* ax = body_array_alloc(n);
+    double* ay = body_array_alloc(n);
+    double* az = body_array_alloc(n);
+    if (tree == NULL || ax == NULL || ay == NULL || az == NULL) { perror("error allocating tree"); return 1; }
+
+    // Pin the threads (the output thread was started before so it is not) and
+    // have each one first touch the bodies and accelerations it computes by
+    // unpacking them with the same schedule as the steps, that way they are in
+    // memory local to it
+    bool pin = topology_should_pin(topo);
+    #pragma omp parallel default(none) shared(pin, topo, resume, B, input, n, ax, ay, az) num_threads(num_threads)
+    {
+        if (pin) { topology_pin(topo, omp_get_thread_num(), omp_get_num_threads()); }
+        if (!resume) {
+            #pragma omp for schedule(static)
+            for (size_t i = 0; i < n; i++) {
+                bodies_unpack(B, input, i, i+1);
+                ax[i] = ay[i] = az[i] = 0;
+            }
+        }
+    }
+    if (info.has_accel) { bodies_checkpoint_accel(checkpoint, ax, ay, az); }
+
+    // Save positions to row `0` of output
+    if (!resume) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+    bool ok = true;
+    profile_mark(prof, 0, PROFILE_SETUP);
+
+    // The tree walk ends at the barrier of octree_accel() so its waiting is
+    // part of the force time, the other loops end at explicit barriers
+    #pragma omp parallel default(none) \
+    shared(time_step, num_steps, output_steps, n) \
+    shared(info, checkpoint, checkpoint_steps, checkpoint_path) \
+    shared(B, output, tree, ax, ay, az, ok, integrator, prof) num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num();
+        profile_begin(prof, tid);
+        bool moved = !info.has_accel; // if the bodies moved since the accelerations were computed
+        for (size_t t = info.step + 1; t < num_steps && ok; t++) {
+            if (integrator->single_pass) {
+                // Rebuild the tree from the current positions
+                #pragma omp single nowait
+                ok = octree_build(tree, B);
+                PROFILE_BARRIER(prof, tid, PROFILE_TREE);
+                if (!ok) { break; }
+
+                // Compute the acceleration of every body
+                octree_accel(tree, ax, ay, az);
+                profile_mark(prof, tid, PROFILE_FORCE);
+
+                #pragma omp for schedule(static) nowait
+                for (size_t i = 0; i < n; i++) {
+                    bodies_integrate(B, i, ax[i], ay[i], az[i], time_step);
+                }
+                PROFILE_BARRIER(prof, tid, PROFILE_INTEGRATE);
+            } else {
+                // run the kicks and drifts of the integrator, only rebuilding
+                // the tree after the bodies have moved
+                for (size_t s = 0; s < integrator->num_ops && ok; s++) {
+                    const IntegratorOp* op = &integrator->ops[s];
+                    double h = op->coef * time_step;
+                    if (op->type == OP_FORCE && moved) {
+                        #pragma omp single nowait
+                        ok = octree_build(tree, B);
+                        PROFILE_BARRIER(prof, tid, PROFILE_TREE);
+                        if (!ok) { break; }
+                        octree_accel(tree, ax, ay, az);
+                        profile_mark(prof, tid, PROFILE_FORCE);
+                        moved = false;
+                    } else if (op->type == OP_KICK) {
+                        #pragma omp for schedule(static) nowait
+                        for (size_t i = 0; i < n; i++) { integrator_kick(B, i, i+1, ax, ay, az, h); }
+                        PROFILE_BARRIER(prof, tid, PROFILE_INTEGRATE);
+                    } else if (op->type == OP_DRIFT) {
+                        #pragma omp for schedule(static) nowait
+                        for (size_t i = 0; i < n; i++) { integrator_drift(B, i, i+1, h); }
+                        PROFILE_BARRIER(prof, tid, PROFILE_INTEGRATE);
+                        moved = true;
+                    }
+                }
+                if (!ok) { break; }
+            }
+
+            // Make the next state current and periodically copy the
+            // positions to the output data 
+            #pragma omp single nowait
+            {
+                if (integrator->single_pass) { bodies_swap(B); }
+                profile_mark(prof, tid, PROFILE_INTEGRATE);
+                if (t % output_steps == 0) {
+                    // Save positions to row `t/output_steps` of output
+                    bodies_save_position(npy_writer_row(output), B);
+                    npy_writer_push(output);
+                }
+                profile_mark(prof, tid, PROFILE_OUTPUT);
+                if (checkpoint_steps && t % checkpoint_steps == 0) {
+                    // Save everything needed to continue from here
+                    Checkpoint now = {t, output->written, time_step, !moved};
+                    if (!npy_writer_sync(output) || !bodies_save_checkpoint(checkpoint_path, B, ax, ay, az, &now)) {
+                        perror("error saving checkpoint");
+                    }
+                    profile_mark(prof, tid, PROFILE_CHECKPOINT);
+                }
+            }
+            PROFILE_BARRIER(prof, tid, PROFILE_OUTPUT);
+        }
+        profile_end(prof, tid);
+    }
+    if (!ok) { perror("error building tree"); return 1; }
+
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (output->written < num_outputs) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+    profile_mark(prof, 0, PROFILE_OUTPUT);
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end);
+    printf("%f secs\n", time);
+    if (prof) {
+        char profile_path[4096];
+        snprintf(profile_path, sizeof(profile_path), "%s.profile.json", argv[5]);
+        profile_print(prof, time);
+        if (!profile_write_json(prof, *profile_opt ? profile_opt : profile_path, "nbody-bh", n, num_steps, time)) {
+            perror("error writing profile");
+            return 1;
+        }
+    }
+
+    // finish writing the results
+    if (!npy_writer_close(output)) { perror("error writing output"); return 1; }
+
+    // cleanup
+    matrix_free(input);
+    topology_free(topo);
+    profile_free(prof);
+    if (checkpoint) { matrix_free(checkpoint); }
+    bodies_free(B);
+    octree_free(tree);
+    free(ax);
+    free(ay);
+    free(az);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * Generates a deterministic input for the n-body simulations.
+ *
+ * To compile the program:
+ *   gcc -Wall -O3 -march=native nbody-gen.c arena.c generate.c matrix.c util.c -o nbody-gen -lm -pthread
+ *
+ * To run the program:
+ *   ./nbody-gen [--seed=s] distribution n input.npy
+ * where:
+ *   - --seed picks the random numbers (default 1), the same seed always gives
+ *     the same input on every machine
+ *   - distribution is one of uniform, plummer, disk, or binaries (see
+ *     generate.h)
+ *   - n is the number of bodies
+ *   - input.npy is the n-by-7 input file to write (see nbody-s.c)
+ *
+ * The generated systems are about a parsec across with bodies of about a solar
+ * mass. A suggested time step is printed, a thousandth of the shortest
+ * timescale of the system (see generate_time_step()).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "generate.h"
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* seed_opt = get_option(&argc, argv, "seed");
+    if (argc != 4 || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--seed=s] distribution n input.npy\n", argv[0]); return 1; }
+    const Generator* generator = generator_find(argv[1]);
+    if (generator == NULL) { fprintf(stderr, "distribution must be one of uniform, plummer, disk, or binaries\n"); return 1; }
+    long n = atol(argv[2]);
+    if (n <= 0) { fprintf(stderr, "n must be positive\n"); return 1; }
+    uint64_t seed = seed_opt ? strtoull(seed_opt, NULL, 10) : 1;
+
+    // generate and save the bodies
+    Matrix* input = generator->create(n, seed);
+    if (input == NULL) { perror("error allocating input"); return 1; }
+    if (!matrix_to_npy_path(argv[3], input)) { perror("error writing input"); return 1; }
+    printf("suggested time-step: %g secs\n", generate_time_step(generator, n));
+    matrix_free(input);
+    return 0;
+}
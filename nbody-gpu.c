@@ -0,0 +1,214 @@
+/**
+ * Runs a simulation of the n-body problem in 3D on an offload device such as
+ * a GPU.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -pthread -O3 -march=native nbody-gpu.c arena.c body.c integrator.c matrix.c offload.c util.c -o nbody-gpu -lm
+ * (gcc offloads to the GPU when an offload compiler for it is installed, such
+ * as the gcc-offload-nvptx package, or add -foffload=nvptx-none or
+ * -foffload=amdgcn-amdhsa)
+ *
+ * To run the program:
+ *   ./nbody-gpu [--integrator=name] [--fsync=outputs] [--compress=encoding] time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
+ * where:
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below)
+ *   - output.npy is the output of the program (see below)
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --fsync=k syncs output.npy to the disk every k outputs instead of only
+ *     at the end (it is always written as the positions are produced)
+ *   - --compress writes output.npy as a chunked matrix file instead (read it
+ *     with matrix_from_chunked_path()) with the values stored as either delta
+ *     (exact) or float32
+ *   - last argument is an optional number of host threads used to load the
+ *     input (by default one per physical core)
+ *
+ * input.npy has a n-by-7 matrix with one row per body and the columns:
+ *   - mass (in kg)
+ *   - initial x, y, z position (in m)
+ *   - initial x, y, z velocity (in m/s)
+ *
+ * output.npy is generated and has a (outputs-per-body)-by-(3n) matrix with each
+ * row containing the x, y, and z positions of each of the n bodies after a
+ * given timestep.
+ *
+ * The bodies are copied to the device once and every step (the forces and the
+ * integration) runs there. Only the positions of the outputs are copied back,
+ * while the next steps run, and written by a background thread. Without an
+ * offload device everything runs on the host (slowly).
+ *
+ * See the PDF for implementation details and other requirements.
+ *
+ * AUTHORS:
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "body.h"
+#include "integrator.h"
+#include "offload.h"
+
+
+/**
+ * Adds the row of positions copied back from the device (if there is one) to
+ * the output.
+ */
+static void __push_position(NpyWriter* output, Offload* O) {
+    const double* row = offload_position(O);
+    if (row) {
+        memcpy(npy_writer_row(output), row, output->cols * sizeof(double));
+        npy_writer_push(output);
+    }
+}
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* fsync_opt = get_option(&argc, argv, "fsync");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--integrator=name] [--fsync=outputs] [--compress=encoding] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    size_t sync_rows = 0; // only synced at the end unless given
+    if (fsync_opt && !parse_count(fsync_opt, &sync_rows)) { fprintf(stderr, "fsync must be a positive number of outputs\n"); return 1; }
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
+    size_t num_threads = get_num_physical_cores();
+    if (argc == 7 && !parse_count(argv[6], &num_threads)) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
+    size_t n = input->rows;
+    if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+    if (!offload_available()) { fprintf(stderr, "warning: no offload device, running on the host\n"); }
+
+    // variables available now:
+    //   time_step    number of seconds between each time point
+    //   total_time   total number of seconds in the simulation
+    //   num_steps    number of time steps to simulate (more useful than total_time)
+    //   num_outputs  number of times the position will be output for all bodies
+    //   output_steps number of steps between each output of the position
+    //   num_threads  number of host threads to load the input with
+    //   input        n-by-7 Matrix of input data
+    //   n            number of bodies to simulate
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Create the position, velocity, and mass of each body
+    Bodies* B = bodies_create(n);
+    if (B == NULL) { perror("error allocating bodies"); return 1; }
+    #pragma omp parallel default(none) shared(B, input, n) num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        bodies_unpack(B, input, n * tid / nthreads, n * (tid+1) / nthreads);
+    }
+
+    // create the output file as num_outputs x 3*n, the rows are written to it
+    // by a background thread as they are produced
+    NpyWriter* output = encoding ?
+        npy_writer_open_chunked(argv[5], num_outputs, 3*n, 0, 0, encoding, sync_rows, true) :
+        npy_writer_open(argv[5], num_outputs, 3*n, 0, sync_rows, true);
+    if (output == NULL) { perror("error creating output"); return 1; }
+
+    // Save positions to row `0` of output
+    bodies_save_position(npy_writer_row(output), B);
+    npy_writer_push(output);
+
+    // Copy the bodies to the device, along with space for the accelerations
+    double* ax = body_array_alloc(n);
+    double* ay = body_array_alloc(n);
+    double* az = body_array_alloc(n);
+    if (!ax || !ay || !az) { perror("error allocating accelerations"); return 1; }
+    Offload* O = offload_create(B, ax, ay, az);
+    if (O == NULL) { perror("error copying bodies to the device"); return 1; }
+
+    // A single thread runs the steps while the other one picks up the copies
+    // of the positions back from the device as they are started
+    #pragma omp parallel default(none) \
+    shared(time_step, num_steps, output_steps, O, output, integrator) num_threads(2)
+    #pragma omp single
+    {
+        bool moved = true; // if the bodies moved since the accelerations were computed
+
+        // Run simulation for each time step
+        for (size_t t = 1; t < num_steps; t++) {
+            if (integrator->single_pass) {
+                // compute time step..
+                offload_accel(O);
+                offload_integrate(O, time_step);
+            } else {
+                // run the kicks and drifts of the integrator, only recomputing
+                // the accelerations after the bodies have moved
+                for (size_t s = 0; s < integrator->num_ops; s++) {
+                    const IntegratorOp* op = &integrator->ops[s];
+                    double h = op->coef * time_step;
+                    if (op->type == OP_FORCE && moved) {
+                        offload_accel(O);
+                        moved = false;
+                    } else if (op->type == OP_KICK) {
+                        offload_kick(O, h);
+                    } else if (op->type == OP_DRIFT) {
+                        offload_drift(O, h);
+                        moved = true;
+                    }
+                }
+            }
+
+            // Periodically copy the positions back to the output data (the
+            // copy started at the last output is done long before this one)
+            if (t % output_steps == 0) {
+                // Save positions to row `t/output_steps` of output
+                __push_position(output, O);
+                offload_save_position(O);
+            }
+        }
+        __push_position(output, O);
+    }
+
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (output->written < num_outputs) {
+        offload_save_position(O);
+        __push_position(output, O);
+    }
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end);
+    printf("%f secs\n", time);
+
+    // finish writing the results
+    if (!npy_writer_close(output)) { perror("error writing output"); return 1; }
+
+    // cleanup
+    offload_free(O);
+    matrix_free(input);
+    bodies_free(B);
+    free(ax);
+    free(ay);
+    free(az);
+
+    return 0;
+}
@@ -0,0 +1,458 @@
+/**
+ * Runs a simulation of the n-body problem in 3D across many processes.
+ *
+ * To compile the program:
+ *   mpicc -Wall -fopenmp -pthread -O3 -march=native nbody-mpi.c arena.c body.c force.c integrator.c matrix.c topology.c util.c -o nbody-mpi -lm
+ *
+ * To run the program:
+ *   mpirun -np ranks ./nbody-mpi [--integrator=name] [--huge-pages=mode] time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
+ * where:
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below)
+ *   - output.npy is the output of the program (see below)
+ *   - last argument is an optional number of threads per rank (by default one
+ *     per physical core that the rank may run on)
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --huge-pages is one of none, transparent (the default), or explicit (the
+ *     huge pages reserved in /proc/sys/vm/nr_hugepages) for the bodies and
+ *     the accelerations
+ *
+ * input.npy has a n-by-7 matrix with one row per body and the columns:
+ *   - mass (in kg)
+ *   - initial x, y, z position (in m)
+ *   - initial x, y, z velocity (in m/s)
+ *
+ * output.npy is generated and has a (outputs-per-body)-by-(3n) matrix with each
+ * row containing the x, y, and z positions of each of the n bodies after a
+ * given timestep. It is the same as the output of nbody-p3 (up to rounding).
+ *
+ * Every rank owns one contiguous block of the bodies. The blocks of positions
+ * travel around a ring of the ranks for half a turn, and each rank computes
+ * the interactions of its bodies with every block that passes through it
+ * only once (using Newton's 3rd law), sending the reactions back to the rank
+ * the block came from. The next block is received while the current one is
+ * computed. Inside a rank the work is split between OpenMP threads like
+ * nbody-p3. Every rank writes the columns of its bodies to output.npy with
+ * MPI-IO.
+ *
+ * Start one rank per node (or per NUMA node) and let each one use the cores
+ * it is bound to, e.g. with Open MPI:
+ *   mpirun -np 64 --map-by ppr:1:node --bind-to none ./nbody-mpi ...
+ * The threads are pinned to the cores, filling one NUMA node at a time, when
+ * a rank is alone on its node unless OMP_PROC_BIND, OMP_PLACES, or
+ * GOMP_CPU_AFFINITY is set.
+ *
+ * See the PDF for implementation details and other requirements.
+ *
+ * AUTHORS:
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <mpi.h>
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "body.h"
+#include "force.h"
+#include "integrator.h"
+#include "topology.h"
+
+
+// Prints an error from the first rank only and stops, for errors that every
+// rank runs into at the same time
+#define ARG_ERROR(...) { if (rank == 0) { fprintf(stderr, __VA_ARGS__); } MPI_Finalize(); return 1; }
+
+// Prints an error and stops every rank, for errors of a single rank
+#define RANK_ERROR(msg) { perror(msg); MPI_Abort(MPI_COMM_WORLD, 1); }
+
+// Tag of the messages with the blocks of positions, the reactions computed at
+// step s of the ring are tagged with s
+#define TAG_BLOCK 0
+
+struct _Ring {
+    // The state of the ring exchange of one rank. Rank r owns the bodies
+    // block_start(r) up to block_start(r+1). At step s (1 to steps) of a force
+    // calculation it has the block of rank r-s, which it forwards to rank r+1
+    // while computing it. With an even number of ranks the blocks at the last
+    // step are half a turn away in both directions so only the first half of
+    // the ranks compute them.
+    int rank, size, steps;
+    size_t n, max_block;    // all bodies and the most bodies of any rank
+    size_t tile;            // sources of a block applied to all targets at a time
+    double* blocks[2];      // x, y, z, and mass of a block, max_block apart
+    double* reactions;      // reactions on the block of each step, 3*max_block apart
+    double* returned;       // reactions on our bodies computed at each step
+    double **ax, **ay, **az; // accelerations of our bodies for every thread
+    double **rx, **ry, **rz; // reactions on the current block for every thread
+    MPI_Request send, recv;  // of the blocks
+    MPI_Request* requests;   // of the reactions, steps sent then steps received
+};
+typedef struct _Ring Ring;
+
+/**
+ * Gets the first body of a rank.
+ */
+static inline size_t __block_start(size_t n, int rank, int size) {
+    return (size_t)((unsigned long long)n * rank / size);
+}
+
+/**
+ * Gets the number of bodies of a rank.
+ */
+static inline size_t __block_count(size_t n, int rank, int size) {
+    return __block_start(n, rank+1, size) - __block_start(n, rank, size);
+}
+
+/**
+ * Checks if this rank computes the block it has at step s.
+ */
+static inline bool __ring_computes(const Ring* R, int rank, int s) {
+    return !(R->size % 2 == 0 && s == R->steps && rank >= R->size / 2);
+}
+
+/**
+ * Computes the accelerations of the bodies of this rank due to all n bodies
+ * into R->ax[0], R->ay[0], and R->az[0]. Must be called by every thread of
+ * the parallel region, the MPI calls are only made by the master thread. The
+ * splits between threads and ranks are fixed so the results are reproducible
+ * for a given number of ranks and threads.
+ */
+static void __ring_accel(Ring* R, const Bodies* B, size_t tid, size_t nthreads) {
+    const size_t nb = B->n, M = R->max_block;
+    const int rank = R->rank, size = R->size, left = (rank + size - 1) % size, right = (rank + 1) % size;
+    size_t first = force_symmetric_split(nb, tid, nthreads);
+    size_t last = force_symmetric_split(nb, tid+1, nthreads);
+    size_t lo = nb * tid / nthreads, hi = nb * (tid+1) / nthreads;
+
+    // Send our block around the ring and get ready for the reactions on it
+    #pragma omp master
+    if (R->steps) {
+        double* own = R->blocks[0];
+        memcpy(own, B->x, nb*sizeof(double));
+        memcpy(own+M, B->y, nb*sizeof(double));
+        memcpy(own+2*M, B->z, nb*sizeof(double));
+        memcpy(own+3*M, B->mass, nb*sizeof(double));
+        MPI_Irecv(R->blocks[1], 4*M, MPI_DOUBLE, left, TAG_BLOCK, MPI_COMM_WORLD, &R->recv);
+        MPI_Isend(own, 4*M, MPI_DOUBLE, right, TAG_BLOCK, MPI_COMM_WORLD, &R->send);
+        for (int s = 1; s <= R->steps; s++) {
+            R->requests[s-1] = R->requests[R->steps+s-1] = MPI_REQUEST_NULL;
+            int other = (rank + s) % size;
+            if (__ring_computes(R, other, s)) {
+                MPI_Irecv(R->returned + (s-1)*3*M, 3*M, MPI_DOUBLE, other, s,
+                          MPI_COMM_WORLD, &R->requests[R->steps+s-1]);
+            }
+        }
+    }
+
+    // Interactions between our own bodies
+    memset(R->ax[tid], 0, nb * sizeof(double));
+    memset(R->ay[tid], 0, nb * sizeof(double));
+    memset(R->az[tid], 0, nb * sizeof(double));
+    force_symmetric(B, first, last, R->ax[tid], R->ay[tid], R->az[tid]);
+
+    for (int s = 1; s <= R->steps; s++) {
+        int origin = (rank + size - s) % size;
+        size_t m = __block_count(R->n, origin, size);
+        const double* block = R->blocks[s % 2];
+
+        // Wait for the block of this step and pass it on while computing it
+        // (after the previous one has left the buffer it is received into)
+        #pragma omp master
+        {
+            MPI_Wait(&R->recv, MPI_STATUS_IGNORE);
+            MPI_Wait(&R->send, MPI_STATUS_IGNORE);
+            if (s < R->steps) {
+                MPI_Irecv(R->blocks[(s+1) % 2], 4*M, MPI_DOUBLE, left, TAG_BLOCK, MPI_COMM_WORLD, &R->recv);
+                MPI_Isend(block, 4*M, MPI_DOUBLE, right, TAG_BLOCK, MPI_COMM_WORLD, &R->send);
+            }
+            R->rx[0] = R->reactions + (s-1)*3*M;
+            R->ry[0] = R->rx[0] + M;
+            R->rz[0] = R->rx[0] + 2*M;
+        }
+        #pragma omp barrier
+        if (!__ring_computes(R, rank, s)) { continue; }
+
+        // Every thread applies the block to its range of our bodies, one tile
+        // of the block at a time, with its own reactions on the block
+        memset(R->rx[tid], 0, m * sizeof(double));
+        memset(R->ry[tid], 0, m * sizeof(double));
+        memset(R->rz[tid], 0, m * sizeof(double));
+        for (size_t j = 0; j < m; j += R->tile) {
+            size_t count = m - j < R->tile ? m - j : R->tile;
+            for (size_t i = lo; i < hi; i++) {
+                double acc[3] = {R->ax[tid][i], R->ay[tid][i], R->az[tid][i]};
+                accumulate_accel_symmetric(B->x[i], B->y[i], B->z[i], B->mass[i],
+                                           block+j, block+M+j, block+2*M+j, block+3*M+j, count,
+                                           R->rx[tid]+j, R->ry[tid]+j, R->rz[tid]+j, acc);
+                R->ax[tid][i] = acc[0]; R->ay[tid][i] = acc[1]; R->az[tid][i] = acc[2];
+            }
+        }
+
+        // Combine the reactions of every thread and send them back
+        #pragma omp barrier
+        force_reduce(R->rx, nthreads, m * tid / nthreads, m * (tid+1) / nthreads);
+        force_reduce(R->ry, nthreads, m * tid / nthreads, m * (tid+1) / nthreads);
+        force_reduce(R->rz, nthreads, m * tid / nthreads, m * (tid+1) / nthreads);
+        #pragma omp barrier
+        #pragma omp master
+        MPI_Isend(R->rx[0], 3*M, MPI_DOUBLE, origin, s, MPI_COMM_WORLD, &R->requests[s-1]);
+    }
+
+    // Combine the accelerations from every thread into ax[0] etc
+    #pragma omp barrier
+    force_reduce(R->ax, nthreads, lo, hi);
+    force_reduce(R->ay, nthreads, lo, hi);
+    force_reduce(R->az, nthreads, lo, hi);
+
+    // Add the reactions computed by the other ranks (always in the same order)
+    #pragma omp master
+    if (R->steps) {
+        MPI_Wait(&R->send, MPI_STATUS_IGNORE);
+        MPI_Waitall(2*R->steps, R->requests, MPI_STATUSES_IGNORE);
+    }
+    #pragma omp barrier
+    for (int s = 1; s <= R->steps; s++) {
+        if (!__ring_computes(R, (rank + s) % size, s)) { continue; }
+        const double* back = R->returned + (s-1)*3*M;
+        for (size_t i = lo; i < hi; i++) {
+            R->ax[0][i] += back[i];
+            R->ay[0][i] += back[M+i];
+            R->az[0][i] += back[2*M+i];
+        }
+    }
+    #pragma omp barrier
+}
+
+
+/**
+ * Writes the positions of the bodies of this rank (which start at body start)
+ * into the next row of the output once the write from the same one of the two
+ * output rows is done.
+ */
+static void __write_position(MPI_File output, const Bodies* B, size_t n, size_t start,
+                             double* rows[2], MPI_Request writes[2], size_t* written) {
+    size_t b = *written % 2;
+    MPI_Wait(&writes[b], MPI_STATUS_IGNORE);
+    bodies_save_position(rows[b], B);
+    MPI_Offset offset = NPY_HEADER_SIZE + (MPI_Offset)(*written * n + start) * 3 * sizeof(double);
+    MPI_File_iwrite_at(output, offset, rows[b], 3*B->n, MPI_DOUBLE, &writes[b]);
+    (*written)++;
+}
+
+
+int main(int argc, const char* argv[]) {
+    int provided, rank, size;
+    MPI_Init_thread(&argc, (char***)&argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (provided < MPI_THREAD_FUNNELED) ARG_ERROR("MPI does not support threads\n");
+
+    // parse arguments
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* huge_pages_opt = get_option(&argc, argv, "huge-pages");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) ARG_ERROR("usage: %s [--integrator=name] [--huge-pages=mode] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]);
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) ARG_ERROR("integrator must be one of euler, leapfrog, verlet, or yoshida\n");
+    int huge_pages = huge_pages_opt ? arena_huge_pages_find(huge_pages_opt) : HUGE_PAGES_TRANSPARENT;
+    if (huge_pages < 0) ARG_ERROR("huge-pages must be one of none, transparent, or explicit\n");
+    arena_set_huge_pages(huge_pages);
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) ARG_ERROR("time-step and total-time must be positive with total-time > time-step\n");
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) ARG_ERROR("outputs-per-body must be positive\n");
+    Topology* topo = topology_detect();
+    if (topo == NULL) RANK_ERROR("error reading topology");
+    size_t num_threads = topology_default_threads(topo);
+    if (argc == 7 && !parse_count(argv[6], &num_threads)) ARG_ERROR("num-threads must be positive\n");
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
+    if (input == NULL) RANK_ERROR("error reading input");
+    if (input->cols != 7) ARG_ERROR("input.npy must have 7 columns\n");
+    size_t n = input->rows;
+    if (n < (size_t)size) ARG_ERROR("input.npy must have at least 1 row per rank\n");
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // The bodies of this rank
+    size_t start = __block_start(n, rank, size), nb = __block_count(n, rank, size);
+    if (num_threads > nb) { num_threads = nb; }
+    Matrix* rows = matrix_borrow(nb, input->cols, input->data + start * input->cols);
+
+    // variables available now:
+    //   time_step    number of seconds between each time point
+    //   total_time   total number of seconds in the simulation
+    //   num_steps    number of time steps to simulate (more useful than total_time)
+    //   num_outputs  number of times the position will be output for all bodies
+    //   output_steps number of steps between each output of the position
+    //   num_threads  number of threads to use on this rank
+    //   input        n-by-7 Matrix of input data
+    //   n            number of bodies to simulate
+    //   rows         nb-by-7 Matrix of the input of the bodies of this rank
+
+    // start the clock
+    struct timespec start_time, end_time;
+    MPI_Barrier(MPI_COMM_WORLD);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // Create the position, velocity, and mass of each body of this rank
+    Bodies* B = bodies_create(nb);
+    if (B == NULL) RANK_ERROR("error allocating bodies");
+
+    // Create the output file as num_outputs x 3*n, every rank writes the
+    // columns of its bodies into every row (while the next steps run)
+    MPI_File output;
+    if (MPI_File_open(MPI_COMM_WORLD, argv[5], MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &output) != MPI_SUCCESS) ARG_ERROR("error creating output\n");
+    MPI_File_set_size(output, NPY_HEADER_SIZE + (MPI_Offset)num_outputs * 3 * n * sizeof(double));
+    char header[NPY_HEADER_SIZE];
+    if (rank == 0) {
+        matrix_npy_header(header, num_outputs, 3*n);
+        MPI_File_write_at(output, 0, header, NPY_HEADER_SIZE, MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+    double* output_rows[2] = {body_array_alloc(3*nb), body_array_alloc(3*nb)};
+    MPI_Request writes[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    size_t written = 0;
+    if (!output_rows[0] || !output_rows[1]) RANK_ERROR("error allocating output");
+
+    // The ring and the accelerations of every thread, all from one arena
+    int ranks_on_node;
+    MPI_Comm node;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_size(node, &ranks_on_node);
+    MPI_Comm_free(&node);
+    Ring ring = {.rank = rank, .size = size, .steps = size / 2, .n = n, .max_block = (n + size - 1) / size};
+    size_t target_block;
+    force_tile_sizes(&target_block, &ring.tile);
+    size_t M = ring.max_block;
+    ring.blocks[0] = body_array_alloc(4*M);
+    ring.blocks[1] = body_array_alloc(4*M);
+    ring.reactions = body_array_alloc(3*M*ring.steps);
+    ring.returned = body_array_alloc(3*M*ring.steps);
+    ring.requests = calloc(2*ring.steps + 1, sizeof(MPI_Request));
+    ring.send = ring.recv = MPI_REQUEST_NULL;
+    ring.ax = malloc(num_threads * sizeof(double*));
+    ring.ay = malloc(num_threads * sizeof(double*));
+    ring.az = malloc(num_threads * sizeof(double*));
+    ring.rx = malloc(num_threads * sizeof(double*));
+    ring.ry = malloc(num_threads * sizeof(double*));
+    ring.rz = malloc(num_threads * sizeof(double*));
+    Arena* scratch = arena_create(3 * num_threads * (body_array_bytes(nb) + body_array_bytes(M)));
+    if (!ring.blocks[0] || !ring.blocks[1] || !ring.reactions || !ring.returned || !ring.requests ||
+        !ring.ax || !ring.ay || !ring.az || !ring.rx || !ring.ry || !ring.rz || !scratch) RANK_ERROR("error allocating accelerations");
+
+    // Pin the threads when this rank has the node to itself and have each one
+    // unpack (and so first touch) the same block of bodies that it reduces
+    // and integrates, along with its accelerations
+    bool pin = ranks_on_node == 1 && topology_should_pin(topo);
+    #pragma omp parallel default(none) shared(pin, topo, B, rows, nb, M, ring, scratch) num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        if (pin) { topology_pin(topo, tid, nthreads); }
+        bodies_unpack(B, rows, nb * tid / nthreads, nb * (tid+1) / nthreads);
+        ring.ax[tid] = body_array_arena(scratch, nb);
+        ring.ay[tid] = body_array_arena(scratch, nb);
+        ring.az[tid] = body_array_arena(scratch, nb);
+        ring.rx[tid] = body_array_arena(scratch, M);
+        ring.ry[tid] = body_array_arena(scratch, M);
+        ring.rz[tid] = body_array_arena(scratch, M);
+    }
+
+    // Save positions to row `0` of output
+    __write_position(output, B, n, start, output_rows, writes, &written);
+
+    #pragma omp parallel default(none) \
+    shared(time_step, num_steps, output_steps, n, nb, start) \
+    shared(B, ring, integrator, output, output_rows, writes, written) num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        size_t lo = nb * tid / nthreads, hi = nb * (tid+1) / nthreads;
+        bool moved = true; // if the bodies moved since the accelerations were computed
+
+        // Run simulation for each time step
+        for (size_t t = 1; t < num_steps; t++) {
+            if (integrator->single_pass) {
+                // compute time step..
+                __ring_accel(&ring, B, tid, nthreads);
+
+                // Integrate this thread's bodies into the next state
+                for (size_t i = lo; i < hi; i++) {
+                    bodies_integrate(B, i, ring.ax[0][i], ring.ay[0][i], ring.az[0][i], time_step);
+                }
+                #pragma omp barrier
+            } else {
+                // run the kicks and drifts of the integrator on this thread's
+                // bodies, only recomputing the accelerations after the bodies
+                // have moved
+                for (size_t s = 0; s < integrator->num_ops; s++) {
+                    const IntegratorOp* op = &integrator->ops[s];
+                    double h = op->coef * time_step;
+                    if (op->type == OP_FORCE && moved) {
+                        // wait for all drifts and for all kicks to be done
+                        // with ax[0] etc before clearing them
+                        #pragma omp barrier
+                        __ring_accel(&ring, B, tid, nthreads);
+                        moved = false;
+                    } else if (op->type == OP_KICK) {
+                        integrator_kick(B, lo, hi, ring.ax[0], ring.ay[0], ring.az[0], h);
+                    } else if (op->type == OP_DRIFT) {
+                        integrator_drift(B, lo, hi, h);
+                        moved = true;
+                    }
+                }
+                #pragma omp barrier
+            }
+
+            // Make the next state current and periodically write the
+            // positions of this rank's bodies to the output
+            #pragma omp master
+            {
+                if (integrator->single_pass) { bodies_swap(B); }
+                if (t % output_steps == 0) {
+                    // Save positions to row `t/output_steps` of output
+                    __write_position(output, B, n, start, output_rows, writes, &written);
+                }
+            }
+            #pragma omp barrier
+        }
+    }
+
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (written < num_outputs) {
+        __write_position(output, B, n, start, output_rows, writes, &written);
+    }
+
+    // finish writing the results
+    MPI_Waitall(2, writes, MPI_STATUSES_IGNORE);
+    if (MPI_File_close(&output) != MPI_SUCCESS) RANK_ERROR("error writing output");
+
+    // get the end and computation time
+    MPI_Barrier(MPI_COMM_WORLD);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double time = get_time_diff(&start_time, &end_time);
+    if (rank == 0) { printf("%f secs\n", time); }
+
+    // cleanup
+    matrix_free(rows);
+    matrix_free(input);
+    topology_free(topo);
+    bodies_free(B);
+    arena_free(scratch);
+    free(output_rows[0]); free(output_rows[1]);
+    free(ring.blocks[0]); free(ring.blocks[1]);
+    free(ring.reactions); free(ring.returned); free(ring.requests);
+    free(ring.ax); free(ring.ay); free(ring.az);
+    free(ring.rx); free(ring.ry); free(ring.rz);
+
+    MPI_Finalize();
+    return 0;
+}
@@ -2,16 +2,40 @@
  * Runs a simulation of the n-body problem in 3D.
  * 
  * To compile the program:
- *   gcc -Wall -O3 -march=native nbody-s.c matrix.c util.c -o nbody-s -lm
+ *   gcc -Wall -pthread -O3 -march=native nbody-s.c arena.c body.c blockstep.c diagnostics.c force.c integrator.c matrix.c profile.c util.c -o nbody-s -lm
  * 
  * To run the program:
- *   ./nbody-s time-step total-time outputs-per-body input.npy output.npy
+ *   ./nbody-s [--tile[=bodies]] [--integrator=name] [--adaptive[=eta]] [--precision=mode] [--diagnostics[=path]] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy
  * where:
+ *   - --tile switches to the cache-blocked force engine, optionally with the
+ *     number of source bodies per tile (by default picked from the cache sizes)
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --adaptive switches to Hermite integration with per-body block time
+ *     steps of time-step/2^k picked from the ratio of each body's acceleration
+ *     to its jerk times eta (default 0.02), time-step is then the largest step
+ *   - --precision is double (the default) or mixed, which computes the pair
+ *     interactions in float32 with float64 sums and reports its error against
+ *     double precision at the final positions
+ *   - --diagnostics saves the total kinetic and potential energy, linear and
+ *     angular momentum, and centre of mass of the state of every output to a
+ *     NPY file (by default output.npy.diag) with the columns listed in
+ *     diagnostics.h
+ *   - --profile times each phase of every thread (and reads the hardware
+ *     counters when perf_event allows it), prints a summary with the pair
+ *     interaction throughput, and writes a JSON report (by default
+ *     output.npy.profile.json)
  *   - time-step is the amount of time between steps (Δt, in seconds)
  *   - total-time is the total amount of time to simulate (in seconds)
  *   - outputs-per-body is the number of positions to output per body
  *   - input.npy is the file describing the initial state of the system (below)
  *   - output.npy is the output of the program (see below)
+ *   - --fsync=k syncs output.npy to the disk every k outputs instead of only
+ *     at the end (it is always written as the positions are produced)
+ *   - --compress writes output.npy as a chunked matrix file instead (read it
+ *     with matrix_from_chunked_path()) with the values stored as either delta
+ *     (exact) or float32
+ *   - --checkpoint=k saves the whole state to output.npy.ckpt every k steps and
+ *     --resume continues from that checkpoint, appending to output.npy
  * 
  * input.npy has a n-by-7 matrix with one row per body and the columns:
  *   - mass (in kg)
@@ -35,23 +59,49 @@
 
 #include "matrix.h"
 #include "util.h"
-#include "helper_functions.h"
-
-// Gravitational Constant in N m^2 / kg^2 or m^3 / kg / s^2
-#define G 6.6743015e-11
-
-// Softening factor to reduce divide-by-near-zero effects
-#define SOFTENING 1e-9
+#include "body.h"
+#include "blockstep.h"
+#include "diagnostics.h"
+#include "force.h"
+#include "integrator.h"
+#include "profile.h"
 
 
 int main(int argc, const char* argv[]) {
     // parse arguments
-    if (argc != 6 && argc != 7) { fprintf(stderr, "usage: %s time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    const char* tile_opt = get_option(&argc, argv, "tile");
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* fsync_opt = get_option(&argc, argv, "fsync");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    const char* checkpoint_opt = get_option(&argc, argv, "checkpoint");
+    bool resume = get_option(&argc, argv, "resume") != NULL;
+    const char* adaptive_opt = get_option(&argc, argv, "adaptive");
+    const char* precision_opt = get_option(&argc, argv, "precision");
+    const char* diagnostics_opt = get_option(&argc, argv, "diagnostics");
+    const char* profile_opt = get_option(&argc, argv, "profile");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--tile[=bodies]] [--integrator=name] [--adaptive[=eta]] [--precision=mode] [--diagnostics[=path]] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    double eta = adaptive_opt && *adaptive_opt ? atof(adaptive_opt) : BLOCKSTEP_DEFAULT_ETA;
+    size_t source_tile = 0; // picked from the cache sizes unless given
+    if (tile_opt && *tile_opt && !parse_count(tile_opt, &source_tile)) { fprintf(stderr, "tile must be a positive number of bodies\n"); return 1; }
+    if (adaptive_opt && (eta <= 0 || tile_opt || integrator_opt)) { fprintf(stderr, "--adaptive needs a positive eta and cannot be used with --tile or --integrator\n"); return 1; }
+    bool mixed = precision_opt && strcmp(precision_opt, "mixed") == 0;
+    if (precision_opt && !mixed && strcmp(precision_opt, "double") != 0) { fprintf(stderr, "precision must be one of double or mixed\n"); return 1; }
+    if (mixed && (tile_opt || adaptive_opt)) { fprintf(stderr, "--precision=mixed cannot be used with --tile or --adaptive\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    size_t sync_rows = 0; // only synced at the end unless given
+    if (fsync_opt && !parse_count(fsync_opt, &sync_rows)) { fprintf(stderr, "fsync must be a positive number of outputs\n"); return 1; }
+    size_t checkpoint_steps = 0;
+    if (checkpoint_opt && !parse_count(checkpoint_opt, &checkpoint_steps)) { fprintf(stderr, "checkpoint must be a positive number of steps\n"); return 1; }
+    if ((checkpoint_steps || resume) && (encoding || adaptive_opt || mixed)) { fprintf(stderr, "--checkpoint and --resume cannot be used with --compress, --adaptive, or --precision=mixed\n"); return 1; }
     double time_step = atof(argv[1]), total_time = atof(argv[2]);
     if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
     size_t num_outputs = atoi(argv[3]);
     if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
-    Matrix* input = matrix_from_npy_path(argv[4]);
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
     if (input == NULL) { perror("error reading input"); return 1; }
     if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
     size_t n = input->rows;
@@ -79,88 +129,201 @@ int main(int argc, const char* argv[]) {
     // start the clock
     struct timespec start, end;
     clock_gettime(CLOCK_MONOTONIC, &start);
+    Profile* prof = profile_opt ? profile_create(1, true) : NULL;
+    if (profile_opt && prof == NULL) { perror("error allocating profile"); return 1; }
 
     // here's where we'll be writing code, copilot did a bad
-    // allocate output matrix as num_outputs x 3*n 
-    Matrix* output = matrix_create_raw(num_outputs, 3*n);
-    if (output == NULL) { perror("error allocating output"); return 1; }
-    
-    // Create simple variable for number of columns in input matrix
-    size_t icols = input->cols;
-    
-    // Create variables for position and velocity of each body
-    double* position = malloc(3 * n * sizeof(double));
-    double* velocity = malloc(3 * n * sizeof(double));
-    // double* force = malloc(3 * n * sizeof(double));
-    double* mass = malloc(n * sizeof(double));
-    for (size_t i = 0; i < n; i++) {
-        mass[i] = input->data[i*icols];
-        position[3*i] = input->data[i*icols + 1];
-        position[3*i+1] = input->data[i*icols + 2];
-        position[3*i+2] = input->data[i*icols + 3];
-        velocity[3*i] = input->data[i*icols + 4];
-        velocity[3*i+1] = input->data[i*icols + 5];
-        velocity[3*i+2] = input->data[i*icols + 6];
-    }
+    // Create the position, velocity, and mass of each body, either from the
+    // input or from where the checkpoint next to the output left off
+    char checkpoint_path[4096];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", argv[5]);
+    Checkpoint info = {0, 0, time_step, false};
+    Matrix* checkpoint = resume ? matrix_from_npy_path_mapped(checkpoint_path, NPY_MAP_READONLY) : NULL;
+    if (resume && checkpoint == NULL) { perror("error reading checkpoint"); return 1; }
+    Bodies* B = resume ? bodies_from_checkpoint(checkpoint, &info) : bodies_from_input(input);
+    if (B == NULL) { perror("error allocating bodies"); return 1; }
+    if (resume && (B->n != n || info.time_step != time_step)) { fprintf(stderr, "checkpoint is not from this run\n"); return 1; }
+
+    // create the output file as num_outputs x 3*n (or continue the one the
+    // checkpoint belongs to), the rows are written to it by a background
+    // thread as they are produced
+    NpyWriter* output =
+        resume ? npy_writer_resume(argv[5], num_outputs, 3*n, info.outputs, sync_rows, true) :
+        encoding ? npy_writer_open_chunked(argv[5], num_outputs, 3*n, 0, 0, encoding, sync_rows, true) :
+        npy_writer_open(argv[5], num_outputs, 3*n, 0, sync_rows, true);
+    if (output == NULL) { perror("error creating output"); return 1; }
 
     // Save positions to row `0` of output
-    save_position(output, position, 0, n);
+    if (!resume) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
 
+    // The mixed precision kernels use single precision copies of the bodies
+    if (mixed && !bodies_enable_mixed(B)) { perror("error allocating bodies"); return 1; }
+
+    // The adaptive integrator keeps the accelerations and jerks itself
+    BlockStep* stepper = NULL;
+    if (adaptive_opt) {
+        stepper = blockstep_create(B, time_step, eta);
+        if (stepper == NULL) { perror("error allocating block steps"); return 1; }
+    }
+
+    // The tiled engine computes the accelerations of a block before integrating it
+    bool tiled = tile_opt != NULL;
+    size_t target_block;
+    force_tile_sizes(&target_block, &source_tile);
+    bool need_accel = !stepper && (tiled || !integrator->single_pass);
+    double* ax = need_accel ? body_array_alloc(n) : NULL;
+    double* ay = need_accel ? body_array_alloc(n) : NULL;
+    double* az = need_accel ? body_array_alloc(n) : NULL;
+    if (info.has_accel && ax) { bodies_checkpoint_accel(checkpoint, ax, ay, az); }
+    bool moved = !info.has_accel; // if the bodies moved since the accelerations were computed
+
+    // The diagnostics of a state are gathered by the force calculation of the
+    // next step when that is a single pass of the naive engine, otherwise
+    // (and for the last state) they take a separate pass over the bodies
+    NpyWriter* diag = NULL;
+    bool fused_diag = diagnostics_opt && !stepper && integrator->single_pass && !tiled && !mixed;
+    double diag_row[DIAG_COLS] = {0};
+    if (diagnostics_opt) {
+        char diag_path[4096];
+        snprintf(diag_path, sizeof(diag_path), "%s.diag", argv[5]);
+        const char* path = *diagnostics_opt ? diagnostics_opt : diag_path;
+        // the diagnostics of the state of the checkpoint may still be pending
+        size_t diag_written = info.outputs - (fused_diag && info.step % output_steps == 0);
+        diag = resume ? npy_writer_resume(path, num_outputs, DIAG_COLS, diag_written, 0, false) :
+            npy_writer_open(path, num_outputs, DIAG_COLS, 0, 0, false);
+        if (diag == NULL) { perror("error creating diagnostics"); return 1; }
+        if (!resume && !fused_diag) {
+            diagnostics_add(diag_row, B, 0, n);
+            diagnostics_push(diag, diag_row, 0);
+        }
+    }
 
     // print the initial positions of the bodies to see if they are correct
     // for (size_t i = 0; i < n; i++) {
-    //     printf("Body %zu: %f, %f, %f\n", i, position[3*i], position[3*i+1], position[3*i+2]);
+    //     printf("Body %zu: %f, %f, %f\n", i, B->x[i], B->y[i], B->z[i]);
     // }
 
     // Run simulation for each time step 
-    for (size_t t = 1; t < num_steps; t++) { 
-        // compute time step...
-        for (size_t i = 0; i < n; i++) {
-            double x_force = 0;
-            double y_force = 0;
-            double z_force = 0;
-
-            for (size_t j = 0; j < n; j++) {
-                if (i == j) {
-                    continue;
+    profile_mark(prof, 0, PROFILE_SETUP);
+    profile_begin(prof, 0);
+    for (size_t t = info.step + 1; t < num_steps; t++) { 
+        if (stepper) {
+            // advance every body to the end of the time step, only computing
+            // the forces on the bodies whose own steps end at each substep
+            while (blockstep_next(stepper)) {
+                blockstep_predict(stepper, B, 0, n);
+                profile_mark(prof, 0, PROFILE_INTEGRATE);
+                blockstep_update(stepper, B, 0, stepper->num_active);
+                profile_add_pairs(prof, (double)stepper->num_active * n, PROFILE_HERMITE_PAIR_FLOPS);
+                profile_mark(prof, 0, PROFILE_FORCE);
+            }
+        } else if (integrator->single_pass) {
+            // compute time step from the current positions into the next state
+            bool diag_now = fused_diag && (t-1) % output_steps == 0;
+            profile_add_pairs(prof, (double)n * n, PROFILE_PAIR_FLOPS);
+            if (tiled) {
+                for (size_t i = 0; i < n; i += target_block) {
+                    size_t k = i + target_block < n ? i + target_block : n;
+                    force_tiled(B, i, k, source_tile, ax, ay, az);
+                    for (size_t j = i; j < k; j++) {
+                        bodies_integrate(B, j, ax[j], ay[j], az[j], time_step);
+                    }
+                }
+            } else {
+                if (mixed) { bodies_center_mixed(B); bodies_pack_mixed(B, 0, n); }
+                for (size_t i = 0; i < n; i++) {
+                    // Acceleration due to every body (body i itself contributes
+                    // nothing thanks to the softening)
+                    double accel[3] = {0, 0, 0};
+                    if (diag_now) {
+                        // along with the potential of the state being left
+                        double phi = 0;
+                        bodies_accumulate_accel_potential(B, i, 0, n, accel, &phi);
+                        diagnostics_add_body(diag_row, B, i, phi);
+                    } else if (mixed) {
+                        bodies_accumulate_accel_mixed(B, i, 0, n, accel);
+                    } else {
+                        bodies_accumulate_accel(B, i, 0, n, accel);
+                    }
+                    bodies_integrate(B, i, accel[0], accel[1], accel[2], time_step);
+                }
+            }
+            bodies_swap(B);
+            profile_mark(prof, 0, PROFILE_FORCE);
+            if (diag_now) {
+                diagnostics_push(diag, diag_row, (t-1) * time_step);
+                profile_mark(prof, 0, PROFILE_DIAGNOSTICS);
+            }
+        } else {
+            // run the kicks and drifts of the integrator, only recomputing the
+            // accelerations after the bodies have moved
+            for (size_t s = 0; s < integrator->num_ops; s++) {
+                const IntegratorOp* op = &integrator->ops[s];
+                if (op->type == OP_FORCE && moved) {
+                    if (tiled) {
+                        for (size_t i = 0; i < n; i += target_block) {
+                            size_t k = i + target_block < n ? i + target_block : n;
+                            force_tiled(B, i, k, source_tile, ax, ay, az);
+                        }
+                    } else if (mixed) {
+                        bodies_center_mixed(B);
+                        bodies_pack_mixed(B, 0, n);
+                        force_mixed(B, 0, n, ax, ay, az);
+                    } else {
+                        force_naive(B, 0, n, ax, ay, az);
+                    }
+                    profile_add_pairs(prof, (double)n * n, PROFILE_PAIR_FLOPS);
+                    profile_mark(prof, 0, PROFILE_FORCE);
+                    moved = false;
+                } else if (op->type == OP_KICK) {
+                    integrator_kick(B, 0, n, ax, ay, az, op->coef * time_step);
+                    profile_mark(prof, 0, PROFILE_INTEGRATE);
+                } else if (op->type == OP_DRIFT) {
+                    integrator_drift(B, 0, n, op->coef * time_step);
+                    profile_mark(prof, 0, PROFILE_INTEGRATE);
+                    moved = true;
                 }
-                double distance = euclidean_distance_sans_sqrt(&position[i*3], &position[j*3]);
-                double force = gravitation(mass[i], mass[j], &position[i*3], &position[j*3], distance);
-
-                double accel = force / sqrt(distance);
-                
-                x_force += accel * (position[j*3+0] - position[i*3+0]);
-                y_force += accel * (position[j*3+1] - position[i*3+1]);
-                z_force += accel * (position[j*3+2] - position[i*3+2]);
             }
-
-            double x_accel = get_acceleration(x_force, mass[i]);
-            double y_accel = get_acceleration(y_force, mass[i]);
-            double z_accel = get_acceleration(z_force, mass[i]);
-
-            // Numerically integrate acceleration to get velocity
-            velocity[3*i+0] += x_accel * time_step;
-            velocity[3*i+1] += y_accel * time_step;
-            velocity[3*i+2] += z_accel * time_step;
-
-            // Numerically integrate velocity to get position
-            position[3*i+0] += velocity[3*i+0] * time_step;
-            position[3*i+1] += velocity[3*i+1] * time_step;
-            position[3*i+2] += velocity[3*i+2] * time_step;
         }
     
         // Periodically copy the positions to the output data 
         if (t % output_steps == 0) { 
             // Save positions to row `t/output_steps` of output
-            size_t output_row = t / output_steps;
-            save_position(output, position, output_row, n);
+            bodies_save_position(npy_writer_row(output), B);
+            npy_writer_push(output);
+            profile_mark(prof, 0, PROFILE_OUTPUT);
+            if (diag && !fused_diag) {
+                diagnostics_add(diag_row, B, 0, n);
+                diagnostics_push(diag, diag_row, t * time_step);
+                profile_mark(prof, 0, PROFILE_DIAGNOSTICS);
+            }
+        }
+        if (checkpoint_steps && t % checkpoint_steps == 0) {
+            // Save everything needed to continue from here
+            Checkpoint now = {t, output->written, time_step, !moved};
+            if (!npy_writer_sync(output) || (diag && !npy_writer_sync(diag)) ||
+                !bodies_save_checkpoint(checkpoint_path, B, ax, ay, az, &now)) {
+                perror("error saving checkpoint");
+            }
+            profile_mark(prof, 0, PROFILE_CHECKPOINT);
         }
     } 
+    profile_end(prof, 0);
     
-    // Save the final set of data if necessary 
-    if (num_steps % output_steps != 0) { 
-        // TODO: save positions to row `num_outputs-1` of output 
-        save_position(output, position, num_outputs-1, n);
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (output->written < num_outputs) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+    profile_mark(prof, 0, PROFILE_OUTPUT);
+    if (diag && diag->written < num_outputs) {
+        diagnostics_add(diag_row, B, 0, n);
+        diagnostics_push(diag, diag_row, (num_steps-1) * time_step);
+        profile_mark(prof, 0, PROFILE_DIAGNOSTICS);
     }
 
 
@@ -168,16 +331,34 @@ int main(int argc, const char* argv[]) {
     clock_gettime(CLOCK_MONOTONIC, &end);
     double time = get_time_diff(&start, &end);
     printf("%f secs\n", time);
+    if (mixed) {
+        double max_err, rms_err;
+        force_mixed_error(B, FORCE_ERROR_SAMPLES, &max_err, &rms_err);
+        printf("mixed precision acceleration error: max %.3g, rms %.3g (relative to double)\n", max_err, rms_err);
+    }
+    if (prof) {
+        char profile_path[4096];
+        snprintf(profile_path, sizeof(profile_path), "%s.profile.json", argv[5]);
+        profile_print(prof, time);
+        if (!profile_write_json(prof, *profile_opt ? profile_opt : profile_path, "nbody-s", n, num_steps, time)) {
+            perror("error writing profile");
+            return 1;
+        }
+    }
 
-    // save results
-    matrix_to_npy_path(argv[5], output);
+    // finish writing the results
+    if (!npy_writer_close(output)) { perror("error writing output"); return 1; }
+    if (diag && !npy_writer_close(diag)) { perror("error writing diagnostics"); return 1; }
 
     // cleanup
-    matrix_free(output);
     matrix_free(input);
-    free(position);
-    free(velocity);
-    free(mass);
+    profile_free(prof);
+    if (checkpoint) { matrix_free(checkpoint); }
+    bodies_free(B);
+    if (stepper) { blockstep_free(stepper); }
+    free(ax);
+    free(ay);
+    free(az);
 
     return 0;
 }
@@ -2,16 +2,28 @@
  * Runs a simulation of the n-body problem in 3D.
  * 
  * To compile the program:
- *   gcc -Wall -O3 -march=native nbody-s3.c matrix.c util.c -o nbody-s3 -lm
+ *   gcc -Wall -pthread -O3 -march=native nbody-s3.c arena.c body.c integrator.c matrix.c profile.c util.c -o nbody-s3 -lm
  * 
  * To run the program:
- *   ./nbody-s3 time-step total-time outputs-per-body input.npy output.npy
+ *   ./nbody-s3 [--integrator=name] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy
  * where:
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --profile times each phase of every thread (and reads the hardware
+ *     counters when perf_event allows it), prints a summary with the pair
+ *     interaction throughput, and writes a JSON report (by default
+ *     output.npy.profile.json)
  *   - time-step is the amount of time between steps (Δt, in seconds)
  *   - total-time is the total amount of time to simulate (in seconds)
  *   - outputs-per-body is the number of positions to output per body
  *   - input.npy is the file describing the initial state of the system (below)
  *   - output.npy is the output of the program (see below)
+ *   - --fsync=k syncs output.npy to the disk every k outputs instead of only
+ *     at the end (it is always written as the positions are produced)
+ *   - --compress writes output.npy as a chunked matrix file instead (read it
+ *     with matrix_from_chunked_path()) with the values stored as either delta
+ *     (exact) or float32
+ *   - --checkpoint=k saves the whole state to output.npy.ckpt every k steps and
+ *     --resume continues from that checkpoint, appending to output.npy
  * 
  * input.npy has a n-by-7 matrix with one row per body and the columns:
  *   - mass (in kg)
@@ -35,23 +47,35 @@
 
 #include "matrix.h"
 #include "util.h"
-#include "helper_functions.h"
-
-// Gravitational Constant in N m^2 / kg^2 or m^3 / kg / s^2
-#define G 6.6743015e-11
-
-// Softening factor to reduce divide-by-near-zero effects
-#define SOFTENING 1e-9
+#include "body.h"
+#include "integrator.h"
+#include "profile.h"
 
 
 int main(int argc, const char* argv[]) {
     // parse arguments
-    if (argc != 6 && argc != 7) { fprintf(stderr, "usage: %s time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* fsync_opt = get_option(&argc, argv, "fsync");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    const char* checkpoint_opt = get_option(&argc, argv, "checkpoint");
+    bool resume = get_option(&argc, argv, "resume") != NULL;
+    const char* profile_opt = get_option(&argc, argv, "profile");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--integrator=name] [--profile[=path]] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    size_t sync_rows = 0; // only synced at the end unless given
+    if (fsync_opt && !parse_count(fsync_opt, &sync_rows)) { fprintf(stderr, "fsync must be a positive number of outputs\n"); return 1; }
+    size_t checkpoint_steps = 0;
+    if (checkpoint_opt && !parse_count(checkpoint_opt, &checkpoint_steps)) { fprintf(stderr, "checkpoint must be a positive number of steps\n"); return 1; }
+    if ((checkpoint_steps || resume) && encoding) { fprintf(stderr, "--checkpoint and --resume cannot be used with --compress\n"); return 1; }
     double time_step = atof(argv[1]), total_time = atof(argv[2]);
     if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
     size_t num_outputs = atoi(argv[3]);
     if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
-    Matrix* input = matrix_from_npy_path(argv[4]);
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
     if (input == NULL) { perror("error reading input"); return 1; }
     if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
     size_t n = input->rows;
@@ -73,112 +97,125 @@ int main(int argc, const char* argv[]) {
     // start the clock
     struct timespec start, end;
     clock_gettime(CLOCK_MONOTONIC, &start);
+    Profile* prof = profile_opt ? profile_create(1, true) : NULL;
+    if (profile_opt && prof == NULL) { perror("error allocating profile"); return 1; }
+
+    // Create the position, velocity, and mass of each body, either from the
+    // input or from where the checkpoint next to the output left off
+    char checkpoint_path[4096];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", argv[5]);
+    Checkpoint info = {0, 0, time_step, false};
+    Matrix* checkpoint = resume ? matrix_from_npy_path_mapped(checkpoint_path, NPY_MAP_READONLY) : NULL;
+    if (resume && checkpoint == NULL) { perror("error reading checkpoint"); return 1; }
+    Bodies* B = resume ? bodies_from_checkpoint(checkpoint, &info) : bodies_from_input(input);
+    if (B == NULL) { perror("error allocating bodies"); return 1; }
+    if (resume && (B->n != n || info.time_step != time_step)) { fprintf(stderr, "checkpoint is not from this run\n"); return 1; }
+
+    // create the output file as num_outputs x 3*n (or continue the one the
+    // checkpoint belongs to), the rows are written to it by a background
+    // thread as they are produced
+    NpyWriter* output =
+        resume ? npy_writer_resume(argv[5], num_outputs, 3*n, info.outputs, sync_rows, true) :
+        encoding ? npy_writer_open_chunked(argv[5], num_outputs, 3*n, 0, 0, encoding, sync_rows, true) :
+        npy_writer_open(argv[5], num_outputs, 3*n, 0, sync_rows, true);
+    if (output == NULL) { perror("error creating output"); return 1; }
 
-    // allocate output matrix as num_outputs x 3*n 
-    Matrix* output = matrix_create_raw(num_outputs, 3*n);
-    if (output == NULL) { perror("error allocating output"); return 1; }
-    
-    // Create simple variable for number of columns in input matrix
-    size_t icols = input->cols;
-    
-    // Create variables for position and velocity of each body
-    double* position = malloc(3 * n * sizeof(double));
-    double* velocity = malloc(3 * n * sizeof(double));
-    double* mass = malloc(n * sizeof(double));
-    for (size_t i = 0; i < n; i++) {
-        mass[i] = input->data[i*icols];
-        position[3*i] = input->data[i*icols + 1];
-        position[3*i+1] = input->data[i*icols + 2];
-        position[3*i+2] = input->data[i*icols + 3];
-        velocity[3*i] = input->data[i*icols + 4];
-        velocity[3*i+1] = input->data[i*icols + 5];
-        velocity[3*i+2] = input->data[i*icols + 6];
+    // Save positions to row `0` of output
+    if (!resume) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
     }
 
-    // Save positions to row `0` of output
-    save_position(output, position, 0, n);
-
-    // Creates arrays for net forces on each body
-    double* fx = malloc(n * sizeof(double));
-    double* fy = malloc(n * sizeof(double));
-    double* fz = malloc(n * sizeof(double));
-
-    // Run simulation for each time step 
-    for (size_t t = 1; t < num_steps; t++) { 
-        // Clear forces
-        memset(fx, 0, n * sizeof(double));
-        memset(fy, 0, n * sizeof(double));
-        memset(fz, 0, n * sizeof(double));
-
-        // compute time step...
-        for (size_t i = 0; i < n; i++) {
-            for (size_t j = 0; j < n; j++) {
-                if (j >= i) {
-                    continue;
+    // Creates arrays for net accelerations on each body
+    double* ax = body_array_alloc(n);
+    double* ay = body_array_alloc(n);
+    double* az = body_array_alloc(n);
+    if (info.has_accel && ax) { bodies_checkpoint_accel(checkpoint, ax, ay, az); }
+    bool moved = !info.has_accel; // if the bodies moved since the accelerations were computed
+
+    // Run simulation for each time step, running the kicks and drifts of the
+    // integrator and only recomputing the accelerations after the bodies moved
+    profile_mark(prof, 0, PROFILE_SETUP);
+    profile_begin(prof, 0);
+    for (size_t t = info.step + 1; t < num_steps; t++) { 
+        for (size_t s = 0; s < integrator->num_ops; s++) {
+            const IntegratorOp* op = &integrator->ops[s];
+            if (op->type == OP_FORCE && moved) {
+                // Clear accelerations
+                memset(ax, 0, n * sizeof(double));
+                memset(ay, 0, n * sizeof(double));
+                memset(az, 0, n * sizeof(double));
+
+                // compute time step...
+                for (size_t i = 0; i < n; i++) {
+                    // Interactions with every body before i, applied to both bodies
+                    bodies_accumulate_accel_symmetric(B, i, 0, i, ax, ay, az);
                 }
-                double distance = euclidean_distance_sans_sqrt(&position[i*3], &position[j*3]);
-                double force = gravitation(mass[i], mass[j], &position[i*3], &position[j*3], distance);
-
-                double accel = force / sqrt(distance);
-                
-                fx[i] += accel * (position[j*3+0] - position[i*3+0]);
-                fy[i] += accel * (position[j*3+1] - position[i*3+1]);
-                fz[i] += accel * (position[j*3+2] - position[i*3+2]);
-
-                fx[j] -= accel * (position[j*3+0] - position[i*3+0]);
-                fy[j] -= accel * (position[j*3+1] - position[i*3+1]);
-                fz[j] -= accel * (position[j*3+2] - position[i*3+2]);
+                profile_add_pairs(prof, (double)n * (n-1) / 2, PROFILE_SYMMETRIC_PAIR_FLOPS);
+                profile_mark(prof, 0, PROFILE_FORCE);
+                moved = false;
+            } else if (op->type == OP_KICK) {
+                integrator_kick(B, 0, n, ax, ay, az, op->coef * time_step);
+                profile_mark(prof, 0, PROFILE_INTEGRATE);
+            } else if (op->type == OP_DRIFT) {
+                integrator_drift(B, 0, n, op->coef * time_step);
+                profile_mark(prof, 0, PROFILE_INTEGRATE);
+                moved = true;
             }
         }
-
-        for (size_t i = 0; i < n; i++) {
-            double x_accel = get_acceleration(fx[i], mass[i]);
-            double y_accel = get_acceleration(fy[i], mass[i]);
-            double z_accel = get_acceleration(fz[i], mass[i]);
-
-            // Numerically integrate acceleration to get velocity
-            velocity[3*i+0] += x_accel * time_step;
-            velocity[3*i+1] += y_accel * time_step;
-            velocity[3*i+2] += z_accel * time_step;
-
-            // Numerically integrate velocity to get position
-            position[3*i+0] += velocity[3*i+0] * time_step;
-            position[3*i+1] += velocity[3*i+1] * time_step;
-            position[3*i+2] += velocity[3*i+2] * time_step;
-        }
     
         // Periodically copy the positions to the output data 
         if (t % output_steps == 0) { 
             // Save positions to row `t/output_steps` of output
-            size_t output_row = t / output_steps;
-            save_position(output, position, output_row, n);
+            bodies_save_position(npy_writer_row(output), B);
+            npy_writer_push(output);
+            profile_mark(prof, 0, PROFILE_OUTPUT);
+        }
+        if (checkpoint_steps && t % checkpoint_steps == 0) {
+            // Save everything needed to continue from here
+            Checkpoint now = {t, output->written, time_step, !moved};
+            if (!npy_writer_sync(output) || !bodies_save_checkpoint(checkpoint_path, B, ax, ay, az, &now)) {
+                perror("error saving checkpoint");
+            }
+            profile_mark(prof, 0, PROFILE_CHECKPOINT);
         }
     } 
+    profile_end(prof, 0);
     
-    // Save the final set of data if necessary 
-    if (num_steps % output_steps != 0) { 
-        // TODO: save positions to row `num_outputs-1` of output 
-        save_position(output, position, num_outputs-1, n);
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (output->written < num_outputs) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
     }
+    profile_mark(prof, 0, PROFILE_OUTPUT);
 
 
     // get the end and computation time
     clock_gettime(CLOCK_MONOTONIC, &end);
     double time = get_time_diff(&start, &end);
     printf("%f secs\n", time);
+    if (prof) {
+        char profile_path[4096];
+        snprintf(profile_path, sizeof(profile_path), "%s.profile.json", argv[5]);
+        profile_print(prof, time);
+        if (!profile_write_json(prof, *profile_opt ? profile_opt : profile_path, "nbody-s3", n, num_steps, time)) {
+            perror("error writing profile");
+            return 1;
+        }
+    }
 
-    // save results
-    matrix_to_npy_path(argv[5], output);
+    // finish writing the results
+    if (!npy_writer_close(output)) { perror("error writing output"); return 1; }
 
     // cleanup
-    matrix_free(output);
     matrix_free(input);
-    free(position);
-    free(velocity);
-    free(mass);
-    free(fx);
-    free(fy);
-    free(fz);
+    profile_free(prof);
+    if (checkpoint) { matrix_free(checkpoint); }
+    bodies_free(B);
+    free(ax);
+    free(ay);
+    free(az);
 
     return 0;
 }
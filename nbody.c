@@ -0,0 +1,360 @@
+/**
+ * Runs a simulation of the n-body problem in 3D with any of the force engines.
+ *
+ * To compile the program:
+ *   gcc -Wall -fopenmp -pthread -O3 -march=native nbody.c arena.c body.c diagnostics.c engine.c force.c integrator.c matrix.c octree.c offload.c order.c profile.c topology.c util.c -o nbody -lm
+ *
+ * To run the program:
+ *   ./nbody [--engine=name] [--tile=bodies] [--theta=angle] [--integrator=name] [--diagnostics[=path]] [--profile[=path]] [--threads=n] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] [--sort=steps] time-step total-time outputs-per-body input.npy output.npy [opt: num-threads]
+ * where:
+ *   - --engine is one of naive, tiled, symmetric, mixed, tree, offload (see
+ *     engine.h), or auto (the default) which times a few force calculations
+ *     of each of the exact engines (naive, tiled, symmetric, and offload when
+ *     there is an offload device) on the input with different numbers of
+ *     threads and runs with the fastest
+ *   - --tile is the number of source bodies per tile of the tiled engine (by
+ *     default picked from the cache sizes)
+ *   - --theta is the opening angle of the tree engine (default 0.5)
+ *   - --integrator is one of euler (the default), leapfrog, verlet, or yoshida
+ *   - --diagnostics saves the total kinetic and potential energy, linear and
+ *     angular momentum, and centre of mass of the state of every output to a
+ *     NPY file (by default output.npy.diag) with the columns listed in
+ *     diagnostics.h
+ *   - --profile times each phase of every thread (and reads the hardware
+ *     counters when perf_event allows it), prints a summary with the pair
+ *     interaction throughput, and writes a JSON report (by default
+ *     output.npy.profile.json)
+ *   - time-step is the amount of time between steps (Δt, in seconds)
+ *   - total-time is the total amount of time to simulate (in seconds)
+ *   - outputs-per-body is the number of positions to output per body
+ *   - input.npy is the file describing the initial state of the system (below)
+ *   - output.npy is the output of the program (see below)
+ *   - --fsync=k syncs output.npy to the disk every k outputs instead of only
+ *     at the end (it is always written as the positions are produced)
+ *   - --compress writes output.npy as a chunked matrix file instead (read it
+ *     with matrix_from_chunked_path()) with the values stored as either delta
+ *     (exact) or float32
+ *   - --checkpoint=k saves the whole state to output.npy.ckpt every k steps and
+ *     --resume continues from that checkpoint, appending to output.npy
+ *   - --sort=k reorders the bodies in memory along a space-filling curve at
+ *     the first step and every k steps after, so the bodies near each other
+ *     in space are near each other in memory (the output keeps the input
+ *     order and checkpoints keep the order in memory)
+ *   - the number of threads is given with --threads or the last argument (by
+ *     default one per physical core, with --engine=auto that is the most
+ *     that are tried and a given number is used as is)
+ *
+ * input.npy has a n-by-7 matrix with one row per body and the columns:
+ *   - mass (in kg)
+ *   - initial x, y, z position (in m)
+ *   - initial x, y, z velocity (in m/s)
+ *
+ * output.npy is generated and has a (outputs-per-body)-by-(3n) matrix with each
+ * row containing the x, y, and z positions of each of the n bodies after a
+ * given timestep.
+ *
+ * Every integrator is run as its kicks and drifts so the results of the naive
+ * engine match nbody-s and nbody-p. The per-body block time steps of
+ * --adaptive and the fused diagnostics are only in those drivers.
+ *
+ * The offload engine runs on a GPU when gcc has an offload compiler for it
+ * installed (such as the gcc-offload-nvptx package) or is given
+ * -foffload=nvptx-none or -foffload=amdgcn-amdhsa. nbody-gpu keeps the whole
+ * state on the device instead.
+ *
+ * The threads are pinned to the cores, filling one NUMA node at a time, unless
+ * OMP_PROC_BIND, OMP_PLACES, or GOMP_CPU_AFFINITY is set.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <omp.h>
+
+#include "matrix.h"
+#include "util.h"
+#include "body.h"
+#include "diagnostics.h"
+#include "engine.h"
+#include "integrator.h"
+#include "order.h"
+#include "profile.h"
+#include "topology.h"
+
+
+int main(int argc, const char* argv[]) {
+    // parse arguments
+    const char* engine_opt = get_option(&argc, argv, "engine");
+    const char* tile_opt = get_option(&argc, argv, "tile");
+    const char* theta_opt = get_option(&argc, argv, "theta");
+    const char* integrator_opt = get_option(&argc, argv, "integrator");
+    const char* fsync_opt = get_option(&argc, argv, "fsync");
+    const char* compress_opt = get_option(&argc, argv, "compress");
+    const char* checkpoint_opt = get_option(&argc, argv, "checkpoint");
+    bool resume = get_option(&argc, argv, "resume") != NULL;
+    const char* sort_opt = get_option(&argc, argv, "sort");
+    const char* diagnostics_opt = get_option(&argc, argv, "diagnostics");
+    const char* profile_opt = get_option(&argc, argv, "profile");
+    const char* threads_opt = get_option(&argc, argv, "threads");
+    if ((argc != 6 && argc != 7) || !check_no_options(argc, argv)) { fprintf(stderr, "usage: %s [--engine=name] [--tile=bodies] [--theta=angle] [--integrator=name] [--diagnostics[=path]] [--profile[=path]] [--threads=n] [--fsync=outputs] [--compress=encoding] [--checkpoint=steps] [--resume] [--sort=steps] time-step total-time outputs-per-body input.npy output.npy [num-threads]\n", argv[0]); return 1; }
+    bool autotune = !engine_opt || strcmp(engine_opt, "auto") == 0;
+    const Engine* engine = autotune ? NULL : engine_find(engine_opt);
+    if (!autotune && engine == NULL) { fprintf(stderr, "engine must be one of auto, naive, tiled, symmetric, mixed, tree, or offload\n"); return 1; }
+    EngineOptions options = {0, theta_opt ? atof(theta_opt) : ENGINE_DEFAULT_THETA};
+    if (tile_opt && *tile_opt && !parse_count(tile_opt, &options.tile)) { fprintf(stderr, "tile must be a positive number of bodies\n"); return 1; }
+    if (options.theta < 0) { fprintf(stderr, "theta must not be negative\n"); return 1; }
+    const Integrator* integrator = integrator_find(integrator_opt ? integrator_opt : "euler");
+    if (integrator == NULL) { fprintf(stderr, "integrator must be one of euler, leapfrog, verlet, or yoshida\n"); return 1; }
+    int encoding = !compress_opt ? 0 : strcmp(compress_opt, "delta") == 0 ? MATRIX_CHUNK_DELTA :
+        strcmp(compress_opt, "float32") == 0 ? MATRIX_CHUNK_FLOAT32 : -1;
+    if (encoding < 0) { fprintf(stderr, "compress must be one of delta or float32\n"); return 1; }
+    size_t sync_rows = 0; // only synced at the end unless given
+    if (fsync_opt && !parse_count(fsync_opt, &sync_rows)) { fprintf(stderr, "fsync must be a positive number of outputs\n"); return 1; }
+    size_t checkpoint_steps = 0;
+    if (checkpoint_opt && !parse_count(checkpoint_opt, &checkpoint_steps)) { fprintf(stderr, "checkpoint must be a positive number of steps\n"); return 1; }
+    bool mixed = engine && strcmp(engine->name, "mixed") == 0; // its box is not in the checkpoint
+    if ((checkpoint_steps || resume) && (encoding || mixed)) { fprintf(stderr, "--checkpoint and --resume cannot be used with --compress or --engine=mixed\n"); return 1; }
+    size_t sort_steps = 0;
+    if (sort_opt && !parse_count(sort_opt, &sort_steps)) { fprintf(stderr, "sort must be a positive number of steps\n"); return 1; }
+    double time_step = atof(argv[1]), total_time = atof(argv[2]);
+    if (time_step <= 0 || total_time <= 0 || time_step > total_time) { fprintf(stderr, "time-step and total-time must be positive with total-time > time-step\n"); return 1; }
+    size_t num_outputs = atoi(argv[3]);
+    if (num_outputs <= 0) { fprintf(stderr, "outputs-per-body must be positive\n"); return 1; }
+    Topology* topo = topology_detect();
+    if (topo == NULL) { perror("error reading topology"); return 1; }
+    bool fixed_threads = threads_opt || argc == 7;
+    size_t num_threads = topology_default_threads(topo);
+    const char* threads_arg = threads_opt ? threads_opt : argc == 7 ? argv[6] : NULL;
+    if (threads_arg && !parse_count(threads_arg, &num_threads)) { fprintf(stderr, "num-threads must be positive\n"); return 1; }
+    Matrix* input = matrix_from_npy_path_mapped(argv[4], NPY_MAP_READONLY);
+    if (input == NULL) { perror("error reading input"); return 1; }
+    if (input->cols != 7) { fprintf(stderr, "input.npy must have 7 columns\n"); return 1; }
+    size_t n = input->rows;
+    if (n == 0) { fprintf(stderr, "input.npy must have at least 1 row\n"); return 1; }
+    if (num_threads > n) { num_threads = n; }
+    size_t num_steps = (size_t)(total_time / time_step + 0.5);
+    if (num_steps < num_outputs) { num_outputs = 1; }
+    size_t output_steps = num_steps/num_outputs;
+    num_outputs = (num_steps+output_steps-1)/output_steps;
+
+    // variables available now:
+    //   time_step    number of seconds between each time point
+    //   total_time   total number of seconds in the simulation
+    //   num_steps    number of time steps to simulate (more useful than total_time)
+    //   num_outputs  number of times the position will be output for all bodies
+    //   output_steps number of steps between each output of the position
+    //   num_threads  number of threads to use (the most to try with auto)
+    //   input        n-by-7 Matrix of input data
+    //   n            number of bodies to simulate
+
+    // start the clock
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Create the position, velocity, and mass of each body, either from the
+    // input or from where the checkpoint next to the output left off. The
+    // threads are pinned and each one first touches the bodies it integrates.
+    char checkpoint_path[4096];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", argv[5]);
+    Checkpoint info = {0, 0, time_step, false};
+    Matrix* checkpoint = resume ? matrix_from_npy_path_mapped(checkpoint_path, NPY_MAP_READONLY) : NULL;
+    if (resume && checkpoint == NULL) { perror("error reading checkpoint"); return 1; }
+    Bodies* B = resume ? bodies_from_checkpoint(checkpoint, &info) : bodies_create(n);
+    if (B == NULL) { perror("error allocating bodies"); return 1; }
+    if (resume && (B->n != n || info.time_step != time_step)) { fprintf(stderr, "checkpoint is not from this run\n"); return 1; }
+    bool pin = topology_should_pin(topo);
+    #pragma omp parallel default(none) shared(pin, topo, resume, B, input, n) num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        if (pin) { topology_pin(topo, tid, nthreads); }
+        if (!resume) { bodies_unpack(B, input, n * tid / nthreads, n * (tid+1) / nthreads); }
+    }
+
+    // Pick the engine and number of threads by timing them on these bodies
+    if (autotune) {
+        double seconds;
+        printf("calibrating the engines:\n");
+        engine = engine_calibrate(B, &options, topo, num_threads, fixed_threads, true, &num_threads, &seconds);
+        if (engine == NULL) { perror("error calibrating engines"); return 1; }
+        printf("using the %s engine with %zu threads (", engine->name, num_threads);
+        print_time(seconds);
+        printf(" per force calculation)\n");
+    }
+    EngineState* S = engine_create(engine, B, num_threads, &options);
+    if (S == NULL) { perror("error allocating engine"); return 1; }
+    if (info.has_accel) { bodies_checkpoint_accel(checkpoint, S->ax, S->ay, S->az); }
+
+    // The bodies are reordered by the threads that run the steps, from the
+    // first step on (calibrating only uses the exact engines which do not
+    // care about the order)
+    BodyOrder* ord = sort_steps ? order_create(B, num_threads) : NULL;
+    if (sort_steps && ord == NULL) { perror("error allocating sort"); return 1; }
+
+    // The profile starts once the number of threads is known so the
+    // calibration is only part of the wall time
+    Profile* prof = profile_opt ? profile_create(num_threads, true) : NULL;
+    if (profile_opt && prof == NULL) { perror("error allocating profile"); return 1; }
+
+    // create the output file as num_outputs x 3*n (or continue the one the
+    // checkpoint belongs to), the rows are written to it by a background
+    // thread as they are produced
+    NpyWriter* output =
+        resume ? npy_writer_resume(argv[5], num_outputs, 3*n, info.outputs, sync_rows, true) :
+        encoding ? npy_writer_open_chunked(argv[5], num_outputs, 3*n, 0, 0, encoding, sync_rows, true) :
+        npy_writer_open(argv[5], num_outputs, 3*n, 0, sync_rows, true);
+    if (output == NULL) { perror("error creating output"); return 1; }
+
+    // Save positions to row `0` of output
+    if (!resume) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+
+    // The diagnostics of every output take a separate pass over the bodies
+    NpyWriter* diag = NULL;
+    double diag_row[DIAG_COLS] = {0};
+    if (diagnostics_opt) {
+        char diag_path[4096];
+        snprintf(diag_path, sizeof(diag_path), "%s.diag", argv[5]);
+        const char* path = *diagnostics_opt ? diagnostics_opt : diag_path;
+        diag = resume ? npy_writer_resume(path, num_outputs, DIAG_COLS, info.outputs, 0, false) :
+            npy_writer_open(path, num_outputs, DIAG_COLS, 0, 0, false);
+        if (diag == NULL) { perror("error creating diagnostics"); return 1; }
+    }
+    bool diag_first = diag && !resume; // the initial state is written before the loop
+    size_t chunk = S->chunk; // bodies per thread of the integration loops
+    profile_mark(prof, 0, PROFILE_SETUP);
+
+    // Run simulation for each time step, the loops end at explicit barriers
+    // so the waiting is timed apart and the engine ends at its own barrier
+    #pragma omp parallel default(none) \
+    shared(time_step, num_steps, output_steps, n, chunk) \
+    shared(info, checkpoint_steps, checkpoint_path, sort_steps, ord) \
+    shared(B, S, output, integrator, diag, diag_first, diag_row, prof) \
+    num_threads(num_threads)
+    {
+        size_t tid = omp_get_thread_num();
+        profile_begin(prof, tid);
+        bool moved = !info.has_accel; // if the bodies moved since the accelerations were computed
+        if (diag_first) {
+            #pragma omp for schedule(static, 1) reduction(+: diag_row[:DIAG_COLS]) nowait
+            for (size_t i = 0; i < n; i += chunk) { diagnostics_add(diag_row, B, i, i + chunk < n ? i + chunk : n); }
+            PROFILE_BARRIER(prof, tid, PROFILE_DIAGNOSTICS);
+            #pragma omp single nowait
+            diagnostics_push(diag, diag_row, 0);
+            PROFILE_BARRIER(prof, tid, PROFILE_DIAGNOSTICS);
+        }
+        for (size_t t = info.step + 1; t < num_steps && S->ok; t++) {
+            // reorder the bodies (and the accelerations that may be reused),
+            // on the same steps when resuming since the checkpoint keeps the
+            // order they were in
+            if (ord && (t - 1) % sort_steps == 0) {
+                order_sort(ord, B, S->ax, S->ay, S->az, tid); // ends at a barrier
+                profile_mark(prof, tid, PROFILE_SORT);
+            }
+
+            // run the kicks and drifts of the integrator, only recomputing the
+            // accelerations after the bodies have moved
+            for (size_t s = 0; s < integrator->num_ops; s++) {
+                const IntegratorOp* op = &integrator->ops[s];
+                double h = op->coef * time_step;
+                if (op->type == OP_FORCE && moved) {
+                    if (tid == 0) { profile_add_pairs(prof, engine_pairs(S), S->engine->pair_flops); }
+                    engine_accel(S, tid, prof);
+                    if (!S->ok) { break; }
+                    moved = false;
+                } else if (op->type == OP_KICK) {
+                    #pragma omp for schedule(static, 1) nowait
+                    for (size_t i = 0; i < n; i += chunk) { integrator_kick(B, i, i + chunk < n ? i + chunk : n, S->ax, S->ay, S->az, h); }
+                    PROFILE_BARRIER(prof, tid, PROFILE_INTEGRATE);
+                } else if (op->type == OP_DRIFT) {
+                    #pragma omp for schedule(static, 1) nowait
+                    for (size_t i = 0; i < n; i += chunk) { integrator_drift(B, i, i + chunk < n ? i + chunk : n, h); }
+                    PROFILE_BARRIER(prof, tid, PROFILE_INTEGRATE);
+                    moved = true;
+                }
+            }
+            if (!S->ok) { break; }
+
+            // Periodically copy the positions to the output data
+            if (t % output_steps == 0) {
+                #pragma omp single nowait
+                {
+                    // Save positions to row `t/output_steps` of output
+                    bodies_save_position(npy_writer_row(output), B);
+                    npy_writer_push(output);
+                }
+                PROFILE_BARRIER(prof, tid, PROFILE_OUTPUT);
+                if (diag) {
+                    #pragma omp for schedule(static, 1) reduction(+: diag_row[:DIAG_COLS]) nowait
+                    for (size_t i = 0; i < n; i += chunk) { diagnostics_add(diag_row, B, i, i + chunk < n ? i + chunk : n); }
+                    PROFILE_BARRIER(prof, tid, PROFILE_DIAGNOSTICS);
+                    #pragma omp single nowait
+                    diagnostics_push(diag, diag_row, t * time_step);
+                    PROFILE_BARRIER(prof, tid, PROFILE_DIAGNOSTICS);
+                }
+            }
+            if (checkpoint_steps && t % checkpoint_steps == 0) {
+                #pragma omp single nowait
+                {
+                    // Save everything needed to continue from here
+                    Checkpoint now = {t, output->written, time_step, !moved};
+                    if (!npy_writer_sync(output) || (diag && !npy_writer_sync(diag)) ||
+                        !bodies_save_checkpoint(checkpoint_path, B, S->ax, S->ay, S->az, &now)) {
+                        perror("error saving checkpoint");
+                    }
+                }
+                PROFILE_BARRIER(prof, tid, PROFILE_CHECKPOINT);
+            }
+        }
+        profile_end(prof, tid);
+    }
+    if (!S->ok) { perror("error building tree"); return 1; }
+
+    // Save the final set of data if necessary (the last row is normally
+    // written by the loop already)
+    if (output->written < num_outputs) {
+        bodies_save_position(npy_writer_row(output), B);
+        npy_writer_push(output);
+    }
+    profile_mark(prof, 0, PROFILE_OUTPUT);
+    if (diag && diag->written < num_outputs) {
+        #pragma omp parallel for schedule(static, 1) reduction(+: diag_row[:DIAG_COLS]) num_threads(num_threads)
+        for (size_t i = 0; i < n; i += chunk) { diagnostics_add(diag_row, B, i, i + chunk < n ? i + chunk : n); }
+        diagnostics_push(diag, diag_row, (num_steps-1) * time_step);
+        profile_mark(prof, 0, PROFILE_DIAGNOSTICS);
+    }
+
+
+    // get the end and computation time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double time = get_time_diff(&start, &end);
+    printf("%f secs\n", time);
+    if (prof) {
+        char profile_path[4096];
+        snprintf(profile_path, sizeof(profile_path), "%s.profile.json", argv[5]);
+        profile_print(prof, time);
+        if (!profile_write_json(prof, *profile_opt ? profile_opt : profile_path, "nbody", n, num_steps, time)) {
+            perror("error writing profile");
+            return 1;
+        }
+    }
+
+    // finish writing the results
+    if (!npy_writer_close(output)) { perror("error writing output"); return 1; }
+    if (diag && !npy_writer_close(diag)) { perror("error writing diagnostics"); return 1; }
+
+    // cleanup
+    matrix_free(input);
+    topology_free(topo);
+    profile_free(prof);
+    if (checkpoint) { matrix_free(checkpoint); }
+    if (ord) { order_free(ord); }
+    engine_free(S);
+    bodies_free(B);
+
+    return 0;
+}
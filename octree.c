@@ -0,0 +1,261 @@
+/**
+ * Barnes-Hut octree definitions
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "octree.h"
+#include "helper_functions.h"
+
+// Maximum depth of the tree, bodies that are still together at this depth
+// (i.e. practically on top of each other) share a leaf
+#define MAX_DEPTH 48
+
+// Subtrees with at most this many bodies are handled by a single task
+#define TASK_BODIES 128
+
+// Marks the end of the list of bodies in a leaf
+#define NO_BODY SIZE_MAX
+
+
+/**
+ * Creates an empty octree that uses the given opening angle. A theta of 0
+ * makes the force calculation exact.
+ */
+Octree* octree_create(double theta) {
+    Octree* T = (Octree*)malloc(sizeof(Octree));
+    if (!T) { return NULL; }
+    T->nodes = NULL;
+    T->count = T->capacity = 0;
+    T->next = NULL;
+    T->next_capacity = 0;
+    T->B = NULL;
+    T->theta = theta;
+    return T;
+}
+
+/**
+ * Frees an octree and its pool of nodes.
+ */
+void octree_free(Octree* T) {
+    free(T->nodes);
+    free(T->next);
+    free(T);
+}
+
+/**
+ * Gets the octant (index of the child) of a node that the point is in.
+ */
+static inline size_t __octant(const OctreeNode* N, double x, double y, double z) {
+    return (x >= N->center[0]) | (y >= N->center[1]) << 1 | (z >= N->center[2]) << 2;
+}
+
+/**
+ * Initializes a node as an empty leaf.
+ */
+static inline void __init_node(OctreeNode* N, double cx, double cy, double cz, double half) {
+    N->center[0] = cx; N->center[1] = cy; N->center[2] = cz;
+    N->half = half;
+    N->com[0] = N->com[1] = N->com[2] = N->mass = 0;
+    N->child = 0;
+    N->body = NO_BODY;
+    N->count = 0;
+}
+
+/**
+ * Takes 8 empty children for a node from the pool, growing the pool if needed.
+ * Returns the index of the first child or 0 if the pool cannot be grown.
+ */
+static size_t __alloc_children(Octree* T, size_t node) {
+    if (T->count + 8 > T->capacity) {
+        size_t capacity = T->capacity < 64 ? 64 : 2*T->capacity;
+        OctreeNode* nodes = (OctreeNode*)realloc(T->nodes, capacity*sizeof(OctreeNode));
+        if (!nodes) { return 0; }
+        T->nodes = nodes;
+        T->capacity = capacity;
+    }
+    const OctreeNode* P = &T->nodes[node];
+    size_t child = T->count;
+    double h = P->half / 2;
+    for (size_t o = 0; o < 8; o++) {
+        __init_node(&T->nodes[child + o],
+            P->center[0] + (o & 1 ? h : -h),
+            P->center[1] + (o & 2 ? h : -h),
+            P->center[2] + (o & 4 ? h : -h), h);
+    }
+    T->count += 8;
+    return child;
+}
+
+/**
+ * Adds the mass of a body to a node. The center of mass holds the
+ * mass-weighted sum of the positions until the tree is finished.
+ */
+static inline void __add_mass(OctreeNode* N, const Bodies* B, size_t b) {
+    double m = B->mass[b];
+    N->mass += m;
+    N->com[0] += m * B->x[b];
+    N->com[1] += m * B->y[b];
+    N->com[2] += m * B->z[b];
+    N->count++;
+}
+
+/**
+ * Inserts a single body into the tree, splitting leaves as needed.
+ */
+static bool __insert(Octree* T, size_t b) {
+    const Bodies* B = T->B;
+    double x = B->x[b], y = B->y[b], z = B->z[b];
+    size_t node = 0;
+    for (size_t depth = 0; ; depth++) {
+        OctreeNode* N = &T->nodes[node];
+        __add_mass(N, B, b);
+        if (N->child == 0) {
+            if (N->count == 1 || depth == MAX_DEPTH) {
+                // empty leaf (or one that cannot be split), add to its list
+                T->next[b] = N->body;
+                N->body = b;
+                return true;
+            }
+
+            // split the leaf and move its current body down a level
+            size_t other = N->body, child = __alloc_children(T, node);
+            if (child == 0) { return false; }
+            N = &T->nodes[node]; // the pool may have moved
+            N->child = child;
+            N->body = NO_BODY;
+            OctreeNode* C = &T->nodes[child + __octant(N, B->x[other], B->y[other], B->z[other])];
+            __add_mass(C, B, other);
+            C->body = other;
+            T->next[other] = NO_BODY;
+        }
+        node = N->child + __octant(N, x, y, z);
+    }
+}
+
+/**
+ * Rebuilds the octree from the current positions of the bodies, reusing the
+ * pool of nodes. Returns false if the pool cannot be grown.
+ */
+bool octree_build(Octree* T, const Bodies* B) {
+    size_t n = B->n;
+    T->B = B;
+    if (T->next_capacity < n) {
+        size_t* next = (size_t*)realloc(T->next, n*sizeof(size_t));
+        if (!next) { return false; }
+        T->next = next;
+        T->next_capacity = n;
+    }
+    if (T->capacity == 0) {
+        T->nodes = (OctreeNode*)malloc(64*sizeof(OctreeNode));
+        if (!T->nodes) { return false; }
+        T->capacity = 64;
+    }
+
+    // bounding cube of all of the bodies
+    double lo[3] = {B->x[0], B->y[0], B->z[0]}, hi[3] = {B->x[0], B->y[0], B->z[0]};
+    for (size_t i = 1; i < n; i++) {
+        lo[0] = fmin(lo[0], B->x[i]); hi[0] = fmax(hi[0], B->x[i]);
+        lo[1] = fmin(lo[1], B->y[i]); hi[1] = fmax(hi[1], B->y[i]);
+        lo[2] = fmin(lo[2], B->z[i]); hi[2] = fmax(hi[2], B->z[i]);
+    }
+    double half = fmax(hi[0]-lo[0], fmax(hi[1]-lo[1], hi[2]-lo[2])) / 2;
+    half = half > 0 ? half * (1 + 1e-9) : 1;
+    T->count = 1;
+    __init_node(&T->nodes[0], (lo[0]+hi[0])/2, (lo[1]+hi[1])/2, (lo[2]+hi[2])/2, half);
+
+    // insert every body then turn the mass-weighted sums into centers of mass
+    for (size_t i = 0; i < n; i++) {
+        if (!__insert(T, i)) { return false; }
+    }
+    for (size_t i = 0; i < T->count; i++) {
+        OctreeNode* N = &T->nodes[i];
+        if (N->mass > 0) {
+            N->com[0] /= N->mass; N->com[1] /= N->mass; N->com[2] /= N->mass;
+        } else {
+            N->com[0] = N->center[0]; N->com[1] = N->center[1]; N->com[2] = N->center[2];
+        }
+    }
+    return true;
+}
+
+/**
+ * Computes the acceleration of a single body by descending the tree.
+ */
+static void __accel_body(const Octree* T, size_t i, double* acc) {
+    const Bodies* B = T->B;
+    const double xi = B->x[i], yi = B->y[i], zi = B->z[i];
+    const double theta2 = T->theta * T->theta;
+    double sx = 0, sy = 0, sz = 0;
+    size_t stack[8*(MAX_DEPTH+1)], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const OctreeNode* N = &T->nodes[stack[--top]];
+        if (N->count == 0) { continue; }
+        if (N->child == 0) {
+            // leaves are summed directly, body i itself contributes nothing
+            for (size_t j = N->body; j != NO_BODY; j = T->next[j]) {
+                double dx = B->x[j] - xi, dy = B->y[j] - yi, dz = B->z[j] - zi;
+                double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+                double s = B->mass[j] / (r2 * sqrt(r2));
+                sx += s * dx; sy += s * dy; sz += s * dz;
+            }
+            continue;
+        }
+        double dx = N->com[0] - xi, dy = N->com[1] - yi, dz = N->com[2] - zi;
+        double d2 = dx*dx + dy*dy + dz*dz;
+        double side = 2 * N->half;
+        // the cube holding body i is always opened, its center of mass can
+        // be far enough away with a large theta but it includes body i
+        bool inside = fabs(xi - N->center[0]) <= N->half &&
+                      fabs(yi - N->center[1]) <= N->half &&
+                      fabs(zi - N->center[2]) <= N->half;
+        if (!inside && side * side < theta2 * d2) {
+            // far enough away to be a single point mass
+            double r2 = d2 + SOFTENING;
+            double s = N->mass / (r2 * sqrt(r2));
+            sx += s * dx; sy += s * dy; sz += s * dz;
+        } else {
+            for (size_t o = 0; o < 8; o++) { stack[top++] = N->child + o; }
+        }
+    }
+    acc[0] = G * sx;
+    acc[1] = G * sy;
+    acc[2] = G * sz;
+}
+
+/**
+ * Computes the acceleration of every body within a subtree.
+ */
+static void __accel_subtree(const Octree* T, size_t node,
+                            double* ax, double* ay, double* az) {
+    const OctreeNode* N = &T->nodes[node];
+    if (N->count == 0) { return; }
+    if (N->child == 0) {
+        for (size_t i = N->body; i != NO_BODY; i = T->next[i]) {
+            double acc[3];
+            __accel_body(T, i, acc);
+            ax[i] = acc[0]; ay[i] = acc[1]; az[i] = acc[2];
+        }
+    } else if (N->count <= TASK_BODIES) {
+        for (size_t o = 0; o < 8; o++) { __accel_subtree(T, N->child + o, ax, ay, az); }
+    } else {
+        for (size_t o = 0; o < 8; o++) {
+            #pragma omp task default(none) firstprivate(T, N, o, ax, ay, az)
+            __accel_subtree(T, N->child + o, ax, ay, az);
+        }
+    }
+}
+
+/**
+ * Computes the acceleration of every body using the octree, overwriting ax,
+ * ay, and az.
+ */
+void octree_accel(const Octree* T, double* ax, double* ay, double* az) {
+    // the barrier at the end of the single waits for all of the tasks
+    #pragma omp single
+    __accel_subtree(T, 0, ax, ay, az);
+}
@@ -0,0 +1,65 @@
+/**
+ * Declares the Barnes-Hut octree (which is defined in octree.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "body.h"
+
+
+struct _OctreeNode {
+    // A cube of space and the combined mass of all of the bodies within it
+    double center[3], half; // center and half of the side length of the cube
+    double com[3], mass;    // center of mass and total mass of the bodies
+    size_t child;           // index of the first of 8 children, 0 for leaves
+    size_t body;            // index of the first body in a leaf
+    size_t count;           // number of bodies within the cube
+};
+typedef struct _OctreeNode OctreeNode;
+
+struct _Octree {
+    // The nodes are allocated from a pool that is kept between rebuilds so
+    // that after the first step building the tree does not allocate. The root
+    // is always node 0.
+    OctreeNode* nodes;
+    size_t count, capacity;
+    size_t* next; // next body in the same leaf for each body (SIZE_MAX ends)
+    size_t next_capacity;
+    const Bodies* B; // the bodies the tree was last built from
+    double theta;    // opening angle
+};
+typedef struct _Octree Octree;
+
+
+/**
+ * Creates an empty octree that uses the given opening angle. A theta of 0
+ * makes the force calculation exact.
+ */
+Octree* octree_create(double theta);
+
+/**
+ * Frees an octree and its pool of nodes.
+ */
+void octree_free(Octree* T);
+
+/**
+ * Rebuilds the octree from the current positions of the bodies, reusing the
+ * pool of nodes. Returns false if the pool cannot be grown.
+ */
+bool octree_build(Octree* T, const Bodies* B);
+
+/**
+ * Computes the acceleration of every body using the octree, overwriting ax,
+ * ay, and az. A node is treated as a single point mass when its side length
+ * is less than theta times the distance to its center of mass and its cube
+ * does not contain the body (so a body never pulls on itself, whatever the
+ * theta).
+ * 
+ * This must be called by every thread of a parallel region (or outside of one
+ * entirely). The tree is descended with OpenMP tasks, one for each group of
+ * nearby bodies, so that each task works on bodies that visit similar nodes.
+ */
+void octree_accel(const Octree* T, double* ax, double* ay, double* az);
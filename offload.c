@@ -0,0 +1,205 @@
+/**
+ * Offload force engine and integration definitions
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <omp.h>
+
+#include "offload.h"
+#include "helper_functions.h"
+
+
+/**
+ * Checks if there is an offload device.
+ */
+bool offload_available(void) { return omp_get_num_devices() > 0; }
+
+/**
+ * Copies the bodies to the device and allocates their accelerations there.
+ * Returns NULL if the memory cannot be allocated.
+ */
+Offload* offload_create(Bodies* B, double* ax, double* ay, double* az) {
+    Offload* O = (Offload*)malloc(sizeof(Offload));
+    if (!O) { return NULL; }
+    O->row = body_array_alloc(3*B->n);
+    if (!O->row) { free(O); return NULL; }
+    O->B = B;
+    O->ax = ax; O->ay = ay; O->az = az;
+    O->pending = false;
+    #pragma omp target enter data \
+        map(to: B->x[0:B->n], B->y[0:B->n], B->z[0:B->n], B->mass[0:B->n]) \
+        map(to: B->vx[0:B->n], B->vy[0:B->n], B->vz[0:B->n]) \
+        map(alloc: B->next_x[0:B->n], B->next_y[0:B->n], B->next_z[0:B->n]) \
+        map(alloc: B->next_vx[0:B->n], B->next_vy[0:B->n], B->next_vz[0:B->n]) \
+        map(alloc: ax[0:B->n], ay[0:B->n], az[0:B->n], O->row[0:3*B->n])
+    return O;
+}
+
+/**
+ * Removes the bodies from the device and frees the offload state.
+ */
+void offload_free(Offload* O) {
+    offload_position(O);
+    #pragma omp target exit data \
+        map(release: O->B->x[0:O->B->n], O->B->y[0:O->B->n], O->B->z[0:O->B->n], O->B->mass[0:O->B->n]) \
+        map(release: O->B->vx[0:O->B->n], O->B->vy[0:O->B->n], O->B->vz[0:O->B->n]) \
+        map(release: O->B->next_x[0:O->B->n], O->B->next_y[0:O->B->n], O->B->next_z[0:O->B->n]) \
+        map(release: O->B->next_vx[0:O->B->n], O->B->next_vy[0:O->B->n], O->B->next_vz[0:O->B->n]) \
+        map(release: O->ax[0:O->B->n], O->ay[0:O->B->n], O->az[0:O->B->n], O->row[0:3*O->B->n])
+    free(O->row);
+    free(O);
+}
+
+/**
+ * Computes the acceleration of every body on the device, each team handling
+ * OFFLOAD_BLOCK targets with the sources loaded a tile at a time into the
+ * memory it shares.
+ */
+void offload_accel(Offload* O) {
+    const size_t n = O->B->n;
+    const double *x = O->B->x, *y = O->B->y, *z = O->B->z, *m = O->B->mass;
+    double *ax = O->ax, *ay = O->ay, *az = O->az;
+    #pragma omp target teams distribute thread_limit(OFFLOAD_BLOCK)
+    for (size_t b = 0; b < n; b += OFFLOAD_BLOCK) {
+        // declared outside of the parallel region so they are shared by the
+        // threads of the team (and put in the shared memory of a GPU)
+        double sx[OFFLOAD_BLOCK], sy[OFFLOAD_BLOCK], sz[OFFLOAD_BLOCK], sm[OFFLOAD_BLOCK];
+        double tx[OFFLOAD_BLOCK], ty[OFFLOAD_BLOCK], tz[OFFLOAD_BLOCK];
+        double accx[OFFLOAD_BLOCK], accy[OFFLOAD_BLOCK], accz[OFFLOAD_BLOCK];
+        const size_t k = n - b < OFFLOAD_BLOCK ? n - b : OFFLOAD_BLOCK;
+        // when it falls back to the host a team is a single thread
+        #pragma omp parallel num_threads(omp_is_initial_device() ? 1 : OFFLOAD_BLOCK)
+        {
+            #pragma omp for
+            for (size_t t = 0; t < k; t++) {
+                tx[t] = x[b+t]; ty[t] = y[b+t]; tz[t] = z[b+t];
+                accx[t] = accy[t] = accz[t] = 0;
+            }
+            for (size_t j = 0; j < n; j += OFFLOAD_BLOCK) {
+                // every thread loads part of the tile, the barriers at the
+                // end of the loops keep the tile whole while it is used
+                const size_t count = n - j < OFFLOAD_BLOCK ? n - j : OFFLOAD_BLOCK;
+                #pragma omp for
+                for (size_t s = 0; s < count; s++) {
+                    sx[s] = x[j+s]; sy[s] = y[j+s]; sz[s] = z[j+s]; sm[s] = m[j+s];
+                }
+                #pragma omp for
+                for (size_t t = 0; t < k; t++) {
+                    const double xi = tx[t], yi = ty[t], zi = tz[t];
+                    double ssx = accx[t], ssy = accy[t], ssz = accz[t];
+                    for (size_t s = 0; s < count; s++) {
+                        double dx = sx[s] - xi, dy = sy[s] - yi, dz = sz[s] - zi;
+                        double r2 = dx*dx + dy*dy + dz*dz + SOFTENING;
+                        double inv = sm[s] / (r2 * sqrt(r2));
+                        ssx += inv * dx; ssy += inv * dy; ssz += inv * dz;
+                    }
+                    accx[t] = ssx; accy[t] = ssy; accz[t] = ssz;
+                }
+            }
+            #pragma omp for
+            for (size_t t = 0; t < k; t++) {
+                ax[b+t] = G * accx[t]; ay[b+t] = G * accy[t]; az[b+t] = G * accz[t];
+            }
+        }
+    }
+}
+
+/**
+ * Numerically integrates every body over one time step on the device and makes
+ * the next state current.
+ */
+void offload_integrate(Offload* O, double time_step) {
+    Bodies* B = O->B;
+    const size_t n = B->n;
+    const double *x = B->x, *y = B->y, *z = B->z, *vx = B->vx, *vy = B->vy, *vz = B->vz;
+    const double *ax = O->ax, *ay = O->ay, *az = O->az;
+    double *nx = B->next_x, *ny = B->next_y, *nz = B->next_z;
+    double *nvx = B->next_vx, *nvy = B->next_vy, *nvz = B->next_vz;
+    #pragma omp target teams distribute parallel for
+    for (size_t i = 0; i < n; i++) {
+        double vxi = vx[i] + ax[i] * time_step;
+        double vyi = vy[i] + ay[i] * time_step;
+        double vzi = vz[i] + az[i] * time_step;
+        nvx[i] = vxi; nvy[i] = vyi; nvz[i] = vzi;
+        nx[i] = x[i] + vxi * time_step;
+        ny[i] = y[i] + vyi * time_step;
+        nz[i] = z[i] + vzi * time_step;
+    }
+    bodies_swap(B);
+}
+
+/**
+ * Advances the velocities of every body on the device by h times their
+ * accelerations.
+ */
+void offload_kick(Offload* O, double h) {
+    const size_t n = O->B->n;
+    double *vx = O->B->vx, *vy = O->B->vy, *vz = O->B->vz;
+    const double *ax = O->ax, *ay = O->ay, *az = O->az;
+    #pragma omp target teams distribute parallel for
+    for (size_t i = 0; i < n; i++) {
+        vx[i] += ax[i] * h;
+        vy[i] += ay[i] * h;
+        vz[i] += az[i] * h;
+    }
+}
+
+/**
+ * Advances the positions of every body on the device by h times their
+ * velocities.
+ */
+void offload_drift(Offload* O, double h) {
+    const size_t n = O->B->n;
+    double *x = O->B->x, *y = O->B->y, *z = O->B->z;
+    const double *vx = O->B->vx, *vy = O->B->vy, *vz = O->B->vz;
+    #pragma omp target teams distribute parallel for
+    for (size_t i = 0; i < n; i++) {
+        x[i] += vx[i] * h;
+        y[i] += vy[i] * h;
+        z[i] += vz[i] * h;
+    }
+}
+
+/**
+ * Copies the positions and masses of the host to the device.
+ */
+void offload_positions_to_device(Offload* O) {
+    #pragma omp target update to(O->B->x[0:O->B->n], O->B->y[0:O->B->n], O->B->z[0:O->B->n], O->B->mass[0:O->B->n])
+}
+
+/**
+ * Copies the accelerations of the device to the host.
+ */
+void offload_accel_to_host(Offload* O) {
+    #pragma omp target update from(O->ax[0:O->B->n], O->ay[0:O->B->n], O->az[0:O->B->n])
+}
+
+/**
+ * Starts copying the current positions of the device to O->row without
+ * waiting for it.
+ */
+void offload_save_position(Offload* O) {
+    const size_t n = O->B->n;
+    const double *x = O->B->x, *y = O->B->y, *z = O->B->z;
+    double* row = O->row;
+    // pack them on the device so a single contiguous copy comes back
+    #pragma omp target teams distribute parallel for
+    for (size_t i = 0; i < n; i++) {
+        row[3*i] = x[i]; row[3*i+1] = y[i]; row[3*i+2] = z[i];
+    }
+    #pragma omp target update from(row[0:3*n]) nowait
+    O->pending = true;
+}
+
+/**
+ * Waits for the copy started by offload_save_position() and gives the row of
+ * positions. Returns NULL if no copy was started.
+ */
+const double* offload_position(Offload* O) {
+    if (!O->pending) { return NULL; }
+    #pragma omp taskwait
+    O->pending = false;
+    return O->row;
+}
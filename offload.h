@@ -0,0 +1,101 @@
+/**
+ * Declares the force engine and integration steps that run on an OpenMP
+ * offload device such as a GPU (which are defined in offload.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "body.h"
+
+
+// Number of target bodies of every team (GPU thread block) and of source bodies
+// per tile loaded into the memory shared by the team
+#define OFFLOAD_BLOCK 256
+
+struct _Offload {
+    // The bodies and their accelerations kept on the device. Every array of
+    // the bodies (including the back buffers) is mapped once so the state
+    // stays on the device between steps and bodies_swap() still works. The
+    // host copies are only brought up to date when asked to.
+    Bodies* B;
+    double *ax, *ay, *az; // the acceleration of every body
+    double* row;          // the positions being copied back for an output, 3n values
+    bool pending;         // if a copy of the positions was started and not yet taken
+};
+typedef struct _Offload Offload;
+
+
+/**
+ * Checks if there is an offload device. Without one the offloaded code runs on
+ * the host instead.
+ */
+bool offload_available(void);
+
+/**
+ * Copies the bodies to the device and allocates their accelerations there
+ * (ax, ay, and az are the host copies). Returns NULL if the memory cannot be
+ * allocated.
+ */
+Offload* offload_create(Bodies* B, double* ax, double* ay, double* az);
+
+/**
+ * Removes the bodies from the device (without copying them back) and frees
+ * the offload state but not the bodies or the accelerations.
+ */
+void offload_free(Offload* O);
+
+/**
+ * Computes the acceleration of every body due to all of the bodies on the
+ * device from the positions there, leaving them on the device. Every team
+ * handles OFFLOAD_BLOCK targets and loads the sources a tile at a time into
+ * the memory it shares so each source is read from the device memory once per
+ * team instead of once per target.
+ */
+void offload_accel(Offload* O);
+
+/**
+ * Numerically integrates every body over one time step with the accelerations
+ * on the device (like bodies_integrate()) and makes the next state current.
+ */
+void offload_integrate(Offload* O, double time_step);
+
+/**
+ * Advances the velocities of every body on the device by h times their
+ * accelerations (like integrator_kick()).
+ */
+void offload_kick(Offload* O, double h);
+
+/**
+ * Advances the positions of every body on the device by h times their
+ * velocities (like integrator_drift()).
+ */
+void offload_drift(Offload* O, double h);
+
+/**
+ * Copies the positions and masses of the host to the device (the masses only
+ * change when the bodies are reordered, see order.h).
+ */
+void offload_positions_to_device(Offload* O);
+
+/**
+ * Copies the accelerations of the device to the host.
+ */
+void offload_accel_to_host(Offload* O);
+
+/**
+ * Starts copying the current positions of the device to O->row as x, y, z
+ * triples (like bodies_save_position()) without waiting for it. The copy is a
+ * deferred task so it runs alongside the following steps when another thread
+ * of the team can pick it up. A row started before must have been taken with
+ * offload_position() first.
+ */
+void offload_save_position(Offload* O);
+
+/**
+ * Waits for the copy started by offload_save_position() and gives the row of
+ * positions. Returns NULL if no copy was started.
+ */
+const double* offload_position(Offload* O);
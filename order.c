@@ -0,0 +1,171 @@
+/**
+ * Space-filling curve reordering of the bodies definitions
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <omp.h>
+
+#include "order.h"
+
+// Mask of the index in the low half of a sort key
+#define INDEX_MASK 0xFFFFFFFFull
+
+
+/**
+ * Creates the scratch space for reordering the bodies with at most
+ * num_threads threads and starts keeping the input order of the bodies.
+ * Returns NULL if the memory cannot be allocated or there are too many bodies.
+ */
+BodyOrder* order_create(Bodies* B, size_t num_threads) {
+    if ((uint64_t)B->n > INDEX_MASK) { errno = EINVAL; return NULL; }
+    if (!B->order) {
+        B->order = (size_t*)malloc(B->n * sizeof(size_t));
+        if (!B->order) { return NULL; }
+        for (size_t i = 0; i < B->n; i++) { B->order[i] = i; }
+    }
+    BodyOrder* O = (BodyOrder*)malloc(sizeof(BodyOrder));
+    if (!O) { return NULL; }
+    O->n = B->n;
+    O->num_threads = num_threads;
+    O->keys = (uint64_t*)arena_aligned_alloc(B->n * sizeof(uint64_t));
+    O->next = (uint64_t*)arena_aligned_alloc(B->n * sizeof(uint64_t));
+    O->counts = (size_t*)malloc(num_threads * ORDER_RADIX * sizeof(size_t));
+    O->bounds = (double*)malloc(num_threads * 6 * sizeof(double));
+    O->scratch = (double*)arena_aligned_alloc(4 * B->n * sizeof(double));
+    if (!O->keys || !O->next || !O->counts || !O->bounds || !O->scratch) {
+        order_free(O);
+        return NULL;
+    }
+    return O;
+}
+
+/**
+ * Frees the scratch space of a BodyOrder object.
+ */
+void order_free(BodyOrder* O) {
+    free(O->keys); free(O->next);
+    free(O->counts); free(O->bounds);
+    free(O->scratch);
+    free(O);
+}
+
+/**
+ * Spreads the low ORDER_BITS bits of v out to every third bit.
+ */
+static inline uint64_t __spread_bits(uint64_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x30000FF;
+    v = (v | (v << 8)) & 0x300F00F;
+    v = (v | (v << 4)) & 0x30C30C3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+/**
+ * Gets the grid cell of a coordinate along one axis of the bounding box.
+ */
+static inline uint64_t __cell(double v, double lo, double inv_size) {
+    double c = (v - lo) * inv_size;
+    return c >= (1 << ORDER_BITS) - 1 ? (1 << ORDER_BITS) - 1 : (uint64_t)c;
+}
+
+/**
+ * Reorders the bodies along the Morton curve through their bounding box,
+ * permuting the velocities, masses, order, and accelerations along with the
+ * positions. Must be called by every thread of a parallel region and ends at
+ * a barrier.
+ */
+void order_sort(BodyOrder* O, Bodies* B, double* ax, double* ay, double* az, size_t tid) {
+    const size_t n = O->n, nthreads = omp_get_num_threads();
+    const size_t lo = n * tid / nthreads, hi = n * (tid+1) / nthreads;
+    #pragma omp barrier // every thread must be done with the bodies
+
+    // the bounding box of all of the bodies, from the box of every thread
+    double* box = &O->bounds[6*tid];
+    box[0] = box[1] = box[2] = INFINITY;
+    box[3] = box[4] = box[5] = -INFINITY;
+    for (size_t i = lo; i < hi; i++) {
+        if (B->x[i] < box[0]) { box[0] = B->x[i]; }
+        if (B->y[i] < box[1]) { box[1] = B->y[i]; }
+        if (B->z[i] < box[2]) { box[2] = B->z[i]; }
+        if (B->x[i] > box[3]) { box[3] = B->x[i]; }
+        if (B->y[i] > box[4]) { box[4] = B->y[i]; }
+        if (B->z[i] > box[5]) { box[5] = B->z[i]; }
+    }
+    #pragma omp barrier
+    double min[3] = {INFINITY, INFINITY, INFINITY}, size = 0;
+    for (size_t t = 0; t < nthreads; t++) {
+        for (int d = 0; d < 3; d++) {
+            if (O->bounds[6*t+d] < min[d]) { min[d] = O->bounds[6*t+d]; }
+        }
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        for (int d = 0; d < 3; d++) {
+            if (O->bounds[6*t+3+d] - min[d] > size) { size = O->bounds[6*t+3+d] - min[d]; }
+        }
+    }
+
+    // the keys are the Morton code of the cell of the (cubic) grid over the
+    // box with the index of the body below it
+    double inv_size = size > 0 ? (1 << ORDER_BITS) / size : 0;
+    for (size_t i = lo; i < hi; i++) {
+        uint64_t code = __spread_bits(__cell(B->x[i], min[0], inv_size)) |
+                        __spread_bits(__cell(B->y[i], min[1], inv_size)) << 1 |
+                        __spread_bits(__cell(B->z[i], min[2], inv_size)) << 2;
+        O->keys[i] = code << 32 | i;
+    }
+    #pragma omp barrier
+
+    // sort the high half of the keys a digit at a time, every thread counts
+    // and then moves the keys of its part in order so the sort is stable
+    uint64_t *src = O->keys, *dst = O->next;
+    for (int shift = 32; shift < 64; shift += ORDER_RADIX_BITS) {
+        size_t* counts = &O->counts[tid*ORDER_RADIX];
+        memset(counts, 0, ORDER_RADIX * sizeof(size_t));
+        for (size_t i = lo; i < hi; i++) { counts[(src[i] >> shift) & (ORDER_RADIX-1)]++; }
+        #pragma omp barrier
+        #pragma omp single
+        {
+            // turn the counts into where the keys of each digit of each thread
+            // go, by digit and then by thread
+            size_t offset = 0;
+            for (size_t d = 0; d < ORDER_RADIX; d++) {
+                for (size_t t = 0; t < nthreads; t++) {
+                    size_t count = O->counts[t*ORDER_RADIX + d];
+                    O->counts[t*ORDER_RADIX + d] = offset;
+                    offset += count;
+                }
+            }
+        }
+        for (size_t i = lo; i < hi; i++) { dst[counts[(src[i] >> shift) & (ORDER_RADIX-1)]++] = src[i]; }
+        #pragma omp barrier
+        uint64_t* tmp = src; src = dst; dst = tmp;
+    }
+    // an even number of passes leaves the sorted keys in O->keys
+
+    // move every body to its place, the positions and velocities through the
+    // back buffers and everything else through the scratch space and O->next
+    double *m = O->scratch, *sx = m + n, *sy = sx + n, *sz = sy + n;
+    for (size_t i = lo; i < hi; i++) {
+        size_t j = (size_t)(O->keys[i] & INDEX_MASK);
+        B->next_x[i] = B->x[j]; B->next_y[i] = B->y[j]; B->next_z[i] = B->z[j];
+        B->next_vx[i] = B->vx[j]; B->next_vy[i] = B->vy[j]; B->next_vz[i] = B->vz[j];
+        m[i] = B->mass[j];
+        O->next[i] = B->order[j];
+        if (ax) { sx[i] = ax[j]; sy[i] = ay[j]; sz[i] = az[j]; }
+    }
+    #pragma omp barrier
+    #pragma omp single nowait
+    bodies_swap(B);
+    for (size_t i = lo; i < hi; i++) {
+        B->mass[i] = m[i];
+        B->order[i] = (size_t)O->next[i];
+        if (ax) { ax[i] = sx[i]; ay[i] = sy[i]; az[i] = sz[i]; }
+    }
+    #pragma omp barrier
+}
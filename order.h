@@ -0,0 +1,63 @@
+/**
+ * Declares the reordering of the bodies along a space-filling curve (which is
+ * defined in order.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "body.h"
+
+
+// Bits of each coordinate in the Morton code of a body, 3 of these make up the
+// high half of its sort key and its index the low half
+#define ORDER_BITS 10
+
+// Bits of the key sorted by each pass of the radix sort
+#define ORDER_RADIX_BITS 8
+#define ORDER_RADIX (1 << ORDER_RADIX_BITS)
+
+struct _BodyOrder {
+    // Scratch space for sorting the bodies, kept between sorts so that they
+    // do not allocate. The position of each body in the input is kept in the
+    // order of the bodies themselves.
+    size_t n, num_threads;  // number of bodies and the most threads that sort
+    uint64_t *keys, *next;  // sort keys of every body and the radix sort buffer
+    size_t* counts;         // digit counts of every thread, ORDER_RADIX each
+    double* bounds;         // bounding box of the bodies of every thread
+    double* scratch;        // the mass and acceleration being permuted, 4n values
+};
+typedef struct _BodyOrder BodyOrder;
+
+
+/**
+ * Creates the scratch space for reordering the bodies with at most
+ * num_threads threads and starts keeping the input order of the bodies (as
+ * the identity). Returns NULL if the memory cannot be allocated or there are
+ * too many bodies for the keys (2^32 or more, errno is then EINVAL).
+ */
+BodyOrder* order_create(Bodies* B, size_t num_threads);
+
+/**
+ * Frees the scratch space of a BodyOrder object but not the order kept in
+ * the bodies.
+ */
+void order_free(BodyOrder* O);
+
+/**
+ * Reorders the bodies along the Morton (Z-order) curve through their bounding
+ * box so that bodies near each other in space are near each other in memory.
+ * That makes the tiles and tree leaves reuse more of the cache and spreads a
+ * cluster of bodies over neighbouring chunks instead of a few threads. The
+ * keys are sorted with a parallel LSD radix sort that is stable, so bodies
+ * with the same code keep their relative order. The velocities, masses, the
+ * order of the bodies, and the accelerations ax, ay, and az (if not NULL) are
+ * permuted along with the positions, so nothing has to be recomputed.
+ *
+ * This must be called by every thread of a parallel region of at most
+ * num_threads threads (or outside of one entirely) with tid its thread number
+ * and ends at a barrier.
+ */
+void order_sort(BodyOrder* O, Bodies* B, double* ax, double* ay, double* az, size_t tid);
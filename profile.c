@@ -0,0 +1,248 @@
+/**
+ * Per-phase timers and hardware counters definitions
+ */
+
+#if defined(linux)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "profile.h"
+
+
+static const char* __phase_names[PROFILE_PHASES] = {
+    "setup", "force", "reduce", "tree", "integrate", "wait", "output",
+    "diagnostics", "checkpoint", "sort",
+};
+
+static const char* __counter_names[PROFILE_COUNTERS] = {
+    "cycles", "instructions", "cache_misses",
+};
+
+/**
+ * Opens the hardware counters of the calling thread into fds. A counter that
+ * cannot be opened is -1 in fds and its count is set to -1 (unavailable).
+ */
+static void __counters_open(int* fds, long long* counts);
+
+/**
+ * Reads and closes the hardware counters in fds, adding them to counts.
+ */
+static void __counters_close(int* fds, long long* counts);
+
+
+/**
+ * Creates the timers for num_threads threads, optionally with hardware
+ * counters. Every thread starts in PROFILE_SETUP at the time of the call.
+ * Returns NULL if the memory cannot be allocated.
+ *
+ * All of the profile functions accept a NULL profile and do nothing, so the
+ * drivers call them unconditionally.
+ */
+Profile* profile_create(size_t num_threads, bool counters) {
+    Profile* P = (Profile*)calloc(1, sizeof(Profile));
+    size_t bytes = (num_threads * sizeof(ProfileThread) + 63) / 64 * 64;
+    ProfileThread* threads = (ProfileThread*)aligned_alloc(64, bytes);
+    if (!P || !threads) { free(P); free(threads); return NULL; }
+    memset(threads, 0, bytes);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t t = 0; t < num_threads; t++) {
+        threads[t].mark = now;
+        for (int c = 0; c < PROFILE_COUNTERS; c++) {
+            threads[t].fds[c] = -1;
+            threads[t].counts[c] = counters ? 0 : -1;
+        }
+    }
+    P->num_threads = num_threads;
+    P->threads = threads;
+    P->counters = counters;
+    return P;
+}
+
+/**
+ * Frees a profile, closing any counters that are still open.
+ */
+void profile_free(Profile* P) {
+    if (!P) { return; }
+    for (size_t t = 0; t < P->num_threads; t++) {
+        __counters_close(P->threads[t].fds, P->threads[t].counts);
+    }
+    free(P->threads);
+    free(P);
+}
+
+/**
+ * Starts the timing of thread tid when it starts running (such as at the top
+ * of a parallel region) and opens its hardware counters.
+ */
+void profile_begin(Profile* P, size_t tid) {
+    if (!P) { return; }
+    ProfileThread* T = &P->threads[tid];
+    if (P->counters) { __counters_open(T->fds, T->counts); }
+    clock_gettime(CLOCK_MONOTONIC, &T->mark);
+}
+
+/**
+ * Stops the hardware counters of thread tid when it stops running (such as at
+ * the end of a parallel region), adding their counts to the thread.
+ */
+void profile_end(Profile* P, size_t tid) {
+    if (!P) { return; }
+    __counters_close(P->threads[tid].fds, P->threads[tid].counts);
+}
+
+/**
+ * Gets the total, mean, and largest time of a phase over the threads.
+ */
+static void __phase_stats(const Profile* P, int phase, double* total, double* mean, double* max) {
+    *total = 0; *max = 0;
+    for (size_t t = 0; t < P->num_threads; t++) {
+        double s = P->threads[t].seconds[phase];
+        *total += s;
+        if (s > *max) { *max = s; }
+    }
+    *mean = *total / P->num_threads;
+}
+
+/**
+ * Prints the time of each phase (of the slowest thread and the mean over the
+ * threads) and the interaction throughput given the wall time of the run.
+ */
+void profile_print(const Profile* P, double wall) {
+    if (!P) { return; }
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        double total, mean, max;
+        __phase_stats(P, p, &total, &mean, &max);
+        if (total == 0) { continue; }
+        printf("  %-12s ", __phase_names[p]);
+        print_time(max);
+        if (P->num_threads > 1) { printf(" (mean over the threads "); print_time(mean); printf(")"); }
+        printf("\n");
+    }
+    if (P->pairs > 0) {
+        printf("  %.3g pairs/s, %.3g GFLOP/s\n", P->pairs / wall, P->flops / wall / 1e9);
+    }
+}
+
+/**
+ * Writes a JSON number, or null if it is not finite.
+ */
+static void __json_number(FILE* f, double x) {
+    if (isfinite(x)) { fprintf(f, "%.9g", x); } else { fprintf(f, "null"); }
+}
+
+/**
+ * Writes the profile as a JSON report to path: the run, the totals and the
+ * spread over the threads of every phase, the interaction throughput, and
+ * the timers and counters of every thread. Counters that could not be read
+ * are null. Returns false if it cannot be written.
+ */
+bool profile_write_json(const Profile* P, const char* path, const char* driver,
+                        size_t n, size_t num_steps, double wall) {
+    if (!P) { return true; }
+    FILE* f = fopen(path, "w");
+    if (!f) { return false; }
+    fprintf(f, "{\n  \"driver\": \"%s\",\n  \"bodies\": %zu,\n  \"steps\": %zu,\n  \"threads\": %zu,\n",
+            driver, n, num_steps, P->num_threads);
+    fprintf(f, "  \"wall_seconds\": "); __json_number(f, wall);
+
+    // the spread of every phase over the threads, the imbalance is how much
+    // longer the slowest thread took than the mean
+    fprintf(f, ",\n  \"phases\": {");
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        double total, mean, max;
+        __phase_stats(P, p, &total, &mean, &max);
+        fprintf(f, "%s\n    \"%s\": {\"total_seconds\": ", p ? "," : "", __phase_names[p]);
+        __json_number(f, total);
+        fprintf(f, ", \"mean_seconds\": "); __json_number(f, mean);
+        fprintf(f, ", \"max_seconds\": "); __json_number(f, max);
+        fprintf(f, ", \"imbalance\": "); __json_number(f, mean > 0 ? max / mean : 1);
+        fprintf(f, "}");
+    }
+
+    // the throughput of the interactions over the run and over the force phase
+    double total, mean, max;
+    __phase_stats(P, PROFILE_FORCE, &total, &mean, &max);
+    bool counted = P->pairs > 0;
+    fprintf(f, "\n  },\n  \"pairs\": "); __json_number(f, counted ? P->pairs : NAN);
+    fprintf(f, ",\n  \"flops\": "); __json_number(f, counted ? P->flops : NAN);
+    fprintf(f, ",\n  \"pairs_per_second\": "); __json_number(f, counted ? P->pairs / wall : NAN);
+    fprintf(f, ",\n  \"gflops\": "); __json_number(f, counted ? P->flops / wall / 1e9 : NAN);
+    fprintf(f, ",\n  \"force_gflops\": "); __json_number(f, counted ? P->flops / max / 1e9 : NAN);
+
+    // every thread
+    fprintf(f, ",\n  \"per_thread\": [");
+    for (size_t t = 0; t < P->num_threads; t++) {
+        const ProfileThread* T = &P->threads[t];
+        fprintf(f, "%s\n    {\"seconds\": [", t ? "," : "");
+        for (int p = 0; p < PROFILE_PHASES; p++) {
+            if (p) { fprintf(f, ", "); }
+            __json_number(f, T->seconds[p]);
+        }
+        fprintf(f, "]");
+        for (int c = 0; c < PROFILE_COUNTERS; c++) {
+            fprintf(f, ", \"%s\": ", __counter_names[c]);
+            if (T->counts[c] >= 0) { fprintf(f, "%lld", T->counts[c]); } else { fprintf(f, "null"); }
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ],\n  \"phase_names\": [");
+    for (int p = 0; p < PROFILE_PHASES; p++) { fprintf(f, "%s\"%s\"", p ? ", " : "", __phase_names[p]); }
+    fprintf(f, "]\n}\n");
+    return fclose(f) == 0;
+}
+
+// __counters_open() and __counters_close() have to be specialized for each OS.
+#if defined(linux)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static void __counters_open(int* fds, long long* counts) {
+    static const unsigned long long configs[PROFILE_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    };
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        if (fds[c] >= 0) { continue; }
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[c];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // count only the calling thread on whichever CPU it runs
+        fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[c] < 0) { counts[c] = -1; }
+    }
+}
+
+static void __counters_close(int* fds, long long* counts) {
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        if (fds[c] < 0) { continue; }
+        long long value;
+        if (read(fds[c], &value, sizeof(value)) != sizeof(value)) {
+            counts[c] = -1;
+        } else if (counts[c] >= 0) {
+            counts[c] += value;
+        }
+        close(fds[c]);
+        fds[c] = -1;
+    }
+}
+
+#else
+// Other OSes have no counters
+
+static void __counters_open(int* fds, long long* counts) {
+    for (int c = 0; c < PROFILE_COUNTERS; c++) { counts[c] = -1; }
+}
+
+static void __counters_close(int* fds, long long* counts) {}
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * Declares the per-phase timers and hardware counters of the drivers (which
+ * are defined in profile.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "util.h"
+
+
+// The phases of a run that time is charged to. Each thread charges the time
+// since its last mark to the phase that just ended, so the phases of a thread
+// add up to the time it was running.
+#define PROFILE_SETUP       0 // reading the input, creating the bodies and the output
+#define PROFILE_FORCE       1 // computing accelerations (including fused integration)
+#define PROFILE_REDUCE      2 // combining the per-thread accelerations
+#define PROFILE_TREE        3 // building the Barnes-Hut tree
+#define PROFILE_INTEGRATE   4 // kicks, drifts, block step predictions, and swaps
+#define PROFILE_WAIT        5 // waiting at barriers for the other threads
+#define PROFILE_OUTPUT      6 // copying positions to the output
+#define PROFILE_DIAGNOSTICS 7 // gathering and writing diagnostics
+#define PROFILE_CHECKPOINT  8 // saving checkpoints
+#define PROFILE_SORT        9 // reordering the bodies along a space-filling curve
+#define PROFILE_PHASES      10
+
+// The hardware counters read through perf_event for every thread
+#define PROFILE_CYCLES       0
+#define PROFILE_INSTRUCTIONS 1
+#define PROFILE_CACHE_MISSES 2
+#define PROFILE_COUNTERS     3
+
+// Floating point operations of one pair interaction, counting the reciprocal
+// square root as one: 3 for the distance vector, 6 for the softened r^2, 2
+// for the inverse cube, 1 for m/r^3, and 6 for the three multiply-adds into
+// the acceleration. Newton's 3rd law engines spend 7 more on the reaction and
+// the Hermite integrator 21 more on the jerk.
+#define PROFILE_PAIR_FLOPS           20
+#define PROFILE_SYMMETRIC_PAIR_FLOPS 27
+#define PROFILE_HERMITE_PAIR_FLOPS   41
+
+
+struct _ProfileThread {
+    // The timers of one thread, aligned to a cache line so threads never
+    // write to the same line
+    _Alignas(64) double seconds[PROFILE_PHASES]; // time charged to each phase
+    struct timespec mark;                        // when the current phase started
+    int fds[PROFILE_COUNTERS];                   // open perf_event counters (or -1)
+    long long counts[PROFILE_COUNTERS];          // counts read so far (-1 if unavailable)
+};
+typedef struct _ProfileThread ProfileThread;
+
+struct _Profile {
+    size_t num_threads;
+    ProfileThread* threads;
+    bool counters;  // if the hardware counters are read
+    double pairs;   // pair interactions computed
+    double flops;   // floating point operations of those interactions
+};
+typedef struct _Profile Profile;
+
+
+/**
+ * Creates the timers for num_threads threads, optionally with hardware
+ * counters. Every thread starts in PROFILE_SETUP at the time of the call.
+ * Returns NULL if the memory cannot be allocated.
+ *
+ * All of the profile functions accept a NULL profile and do nothing, so the
+ * drivers call them unconditionally.
+ */
+Profile* profile_create(size_t num_threads, bool counters);
+
+/**
+ * Frees a profile, closing any counters that are still open.
+ */
+void profile_free(Profile* P);
+
+/**
+ * Charges the time since the last mark of thread tid to a phase and starts
+ * the next phase. This is only a clock read so it can be done every step.
+ */
+static inline void profile_mark(Profile* P, size_t tid, int phase) {
+    if (!P) { return; }
+    ProfileThread* T = &P->threads[tid];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    T->seconds[phase] += get_time_diff(&T->mark, &now);
+    T->mark = now;
+}
+
+/**
+ * Starts the timing of thread tid when it starts running (such as at the top
+ * of a parallel region) and opens its hardware counters.
+ */
+void profile_begin(Profile* P, size_t tid);
+
+/**
+ * Stops the hardware counters of thread tid when it stops running (such as at
+ * the end of a parallel region), adding their counts to the thread.
+ */
+void profile_end(Profile* P, size_t tid);
+
+/**
+ * Records pair interactions computed with flops_per_pair floating point
+ * operations each. Only call this from a single thread at a time.
+ */
+static inline void profile_add_pairs(Profile* P, double pairs, double flops_per_pair) {
+    if (!P) { return; }
+    P->pairs += pairs;
+    P->flops += pairs * flops_per_pair;
+}
+
+/**
+ * Prints the time of each phase (of the slowest thread and the mean over the
+ * threads) and the interaction throughput given the wall time of the run.
+ */
+void profile_print(const Profile* P, double wall);
+
+/**
+ * Writes the profile as a JSON report to path: the run, the totals and the
+ * spread over the threads of every phase, the interaction throughput, and
+ * the timers and counters of every thread. Counters that could not be read
+ * are null. Returns false if it cannot be written.
+ */
+bool profile_write_json(const Profile* P, const char* path, const char* driver,
+                        size_t n, size_t num_steps, double wall);
+
+#ifdef _OPENMP
+/**
+ * Ends a phase of the calling OpenMP thread at an explicit barrier, charging
+ * the time spent waiting for the other threads to PROFILE_WAIT. Put a nowait
+ * on the loop before it.
+ */
+#define PROFILE_BARRIER(P, tid, phase) do { \
+        profile_mark(P, tid, phase); \
+        _Pragma("omp barrier") \
+        profile_mark(P, tid, PROFILE_WAIT); \
+    } while (0)
+#endif
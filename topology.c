@@ -0,0 +1,229 @@
+/**
+ * Processor topology and thread placement definitions
+ */
+
+#if defined(linux)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "topology.h"
+#include "util.h"
+
+
+struct __CpuInfo {
+    // What is known about a CPU while sorting them into placement order
+    int cpu, node, package, core;
+    int rank; // which hardware thread of its core this is
+};
+
+
+/**
+ * Orders CPUs by node, then puts the first thread of every core before the
+ * second thread of any core, then by package, core, and CPU number.
+ */
+static int __cpu_info_cmp(const void* a, const void* b) {
+    const struct __CpuInfo* x = (const struct __CpuInfo*)a;
+    const struct __CpuInfo* y = (const struct __CpuInfo*)b;
+    if (x->node != y->node) { return x->node < y->node ? -1 : 1; }
+    if (x->rank != y->rank) { return x->rank < y->rank ? -1 : 1; }
+    if (x->package != y->package) { return x->package < y->package ? -1 : 1; }
+    if (x->core != y->core) { return x->core < y->core ? -1 : 1; }
+    return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+/**
+ * Gets the CPUs this process may run on (at most max of them) and the number
+ * of them.
+ */
+static size_t __affinity_cpus(int* cpus, size_t max);
+
+/**
+ * Fills in the node, package, and core of a CPU (each is -1 if unknown).
+ */
+static void __cpu_topology(struct __CpuInfo* info);
+
+
+/**
+ * Reads the topology of the CPUs this process may run on. If the topology
+ * cannot be read every CPU is treated as its own core on a single node.
+ * Returns NULL if the memory cannot be allocated.
+ */
+Topology* topology_detect() {
+    size_t max = get_num_logical_cores();
+    if (max < get_num_cores_affinity()) { max = get_num_cores_affinity(); }
+    if (max == 0) { max = 1; }
+    Topology* T = (Topology*)calloc(1, sizeof(Topology));
+    struct __CpuInfo* info = (struct __CpuInfo*)malloc(max * sizeof(struct __CpuInfo));
+    int* cpus = (int*)malloc(max * sizeof(int));
+    if (!T || !info || !cpus) { free(T); free(info); free(cpus); return NULL; }
+
+    // Read the sysfs information of every CPU
+    size_t n = __affinity_cpus(cpus, max);
+    if (n == 0) { cpus[0] = 0; n = 1; } // always at least run somewhere
+    for (size_t i = 0; i < n; i++) {
+        info[i].cpu = cpus[i];
+        __cpu_topology(&info[i]);
+        if (info[i].package < 0) { info[i].package = 0; }
+        if (info[i].core < 0) { info[i].core = cpus[i]; }
+        if (info[i].node < 0) { info[i].node = info[i].package; }
+        info[i].rank = 0;
+        for (size_t j = 0; j < i; j++) {
+            if (info[j].package == info[i].package && info[j].core == info[i].core) { info[i].rank++; }
+        }
+    }
+    qsort(info, n, sizeof(struct __CpuInfo), __cpu_info_cmp);
+
+    // Number the nodes consecutively and count their cores
+    size_t num_nodes = 1;
+    for (size_t i = 1; i < n; i++) { if (info[i].node != info[i-1].node) { num_nodes++; } }
+    T->num_cpus = n;
+    T->num_nodes = num_nodes;
+    T->cpus = cpus;
+    T->node_start = (size_t*)calloc(num_nodes + 1, sizeof(size_t));
+    T->node_cores = (size_t*)calloc(num_nodes, sizeof(size_t));
+    if (!T->node_start || !T->node_cores) { free(info); topology_free(T); return NULL; }
+    for (size_t i = 0, k = 0; i < n; i++) {
+        if (i > 0 && info[i].node != info[i-1].node) { T->node_start[++k] = i; }
+        cpus[i] = info[i].cpu;
+        if (info[i].rank == 0) { T->node_cores[k]++; T->num_cores++; }
+    }
+    T->node_start[num_nodes] = n;
+    free(info);
+    return T;
+}
+
+/**
+ * Frees a topology.
+ */
+void topology_free(Topology* T) {
+    free(T->cpus);
+    free(T->node_start);
+    free(T->node_cores);
+    free(T);
+}
+
+/**
+ * Gets the default number of threads for the parallel drivers, one per
+ * physical core that this process may run on.
+ */
+size_t topology_default_threads(const Topology* T) {
+    return T->num_cores > 0 ? T->num_cores : 1;
+}
+
+/**
+ * Gets the CPU that thread tid of num_threads is placed on. Consecutive
+ * threads are kept on the same node and the threads are split between the
+ * nodes in proportion to their number of cores, so with a static schedule
+ * each node works on one contiguous range of the bodies.
+ */
+int topology_cpu(const Topology* T, size_t tid, size_t num_threads) {
+    // node k gets threads num_threads*cores_before(k)/num_cores up to (but not
+    // including) num_threads*cores_before(k+1)/num_cores
+    size_t cores = 0, first = 0;
+    for (size_t k = 0; k < T->num_nodes; k++) {
+        cores += T->node_cores[k];
+        size_t last = num_threads * cores / T->num_cores;
+        if (tid < last || k == T->num_nodes - 1) {
+            size_t count = T->node_start[k+1] - T->node_start[k];
+            return T->cpus[T->node_start[k] + (tid - first) % count];
+        }
+        first = last;
+    }
+    return T->cpus[tid % T->num_cpus];
+}
+
+/**
+ * Checks if the threads should be pinned by topology_pin(). They are not when
+ * there is only one CPU or when the placement is already controlled through
+ * the OMP_PROC_BIND, OMP_PLACES, or GOMP_CPU_AFFINITY environment variables.
+ */
+bool topology_should_pin(const Topology* T) {
+    return T->num_cpus > 1 && !getenv("OMP_PROC_BIND") && !getenv("OMP_PLACES") &&
+        !getenv("GOMP_CPU_AFFINITY");
+}
+
+// __affinity_cpus(), __cpu_topology(), and topology_pin() have to be
+// specialized for each OS.
+#if defined(linux)
+#include <sched.h>
+#include <dirent.h>
+
+/**
+ * Reads a single integer from a sysfs file of a CPU, or -1 if it cannot be.
+ */
+static int __read_cpu_int(int cpu, const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, name);
+    FILE* f = fopen(path, "r");
+    if (!f) { return -1; }
+    int value;
+    if (fscanf(f, "%d", &value) != 1) { value = -1; }
+    fclose(f);
+    return value;
+}
+
+static size_t __affinity_cpus(int* cpus, size_t max) {
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    if (sched_getaffinity(0, sizeof(cs), &cs) != 0) { return 0; }
+    size_t n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &cs)) { cpus[n++] = cpu; }
+    }
+    return n;
+}
+
+static void __cpu_topology(struct __CpuInfo* info) {
+    info->package = __read_cpu_int(info->cpu, "topology/physical_package_id");
+    info->core = __read_cpu_int(info->cpu, "topology/core_id");
+
+    // the cpu directory has a nodeN link to the NUMA node it is on
+    info->node = -1;
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", info->cpu);
+    DIR* dir = opendir(path);
+    if (!dir) { return; }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) == 1) { info->node = node; break; }
+    }
+    closedir(dir);
+}
+
+/**
+ * Pins the calling thread to the CPU of thread tid of num_threads (see
+ * topology_cpu()). Returns false if the thread cannot be pinned.
+ */
+bool topology_pin(const Topology* T, size_t tid, size_t num_threads) {
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(topology_cpu(T, tid, num_threads), &cs);
+    return sched_setaffinity(0, sizeof(cs), &cs) == 0;
+}
+
+#else
+// Other OSes only get the counts and the threads are never pinned
+
+static size_t __affinity_cpus(int* cpus, size_t max) {
+    size_t n = get_num_cores_affinity();
+    if (n > max) { n = max; }
+    for (size_t i = 0; i < n; i++) { cpus[i] = (int)i; }
+    return n;
+}
+
+static void __cpu_topology(struct __CpuInfo* info) {
+    // pretend the hardware threads are paired up into cores
+    size_t per_core = get_num_logical_cores() / (get_num_physical_cores() ? get_num_physical_cores() : 1);
+    info->node = 0;
+    info->package = 0;
+    info->core = per_core > 1 ? info->cpu / (int)per_core : info->cpu;
+}
+
+bool topology_pin(const Topology* T, size_t tid, size_t num_threads) { return false; }
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * Declares the processor topology and thread placement functions (which are
+ * defined in topology.c).
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+
+struct _Topology {
+    // The CPUs this process may run on, read from sysfs on Linux. The CPUs are
+    // grouped by NUMA node (or socket when there is no NUMA information) and
+    // within a group the first hardware thread of every core comes before any
+    // of the other hardware threads, so placing threads in order fills the
+    // physical cores of a node before doubling up on them.
+    size_t num_cpus;     // logical CPUs in the affinity mask
+    size_t num_cores;    // physical cores with at least one of those CPUs
+    size_t num_nodes;    // NUMA nodes (or sockets) with at least one of those CPUs
+    int* cpus;           // the CPUs in placement order
+    size_t* node_start;  // the CPUs of node k are cpus[node_start[k]..node_start[k+1]-1]
+    size_t* node_cores;  // number of physical cores of each node
+};
+typedef struct _Topology Topology;
+
+
+/**
+ * Reads the topology of the CPUs this process may run on. If the topology
+ * cannot be read every CPU is treated as its own core on a single node.
+ * Returns NULL if the memory cannot be allocated.
+ */
+Topology* topology_detect();
+
+/**
+ * Frees a topology.
+ */
+void topology_free(Topology* T);
+
+/**
+ * Gets the default number of threads for the parallel drivers, one per
+ * physical core that this process may run on.
+ */
+size_t topology_default_threads(const Topology* T);
+
+/**
+ * Gets the CPU that thread tid of num_threads is placed on. Consecutive
+ * threads are kept on the same node and the threads are split between the
+ * nodes in proportion to their number of cores, so with a static schedule
+ * each node works on one contiguous range of the bodies.
+ */
+int topology_cpu(const Topology* T, size_t tid, size_t num_threads);
+
+/**
+ * Pins the calling thread to the CPU of thread tid of num_threads (see
+ * topology_cpu()). Returns false if the thread cannot be pinned.
+ */
+bool topology_pin(const Topology* T, size_t tid, size_t num_threads);
+
+/**
+ * Checks if the threads should be pinned by topology_pin(). They are not when
+ * there is only one CPU or when the placement is already controlled through
+ * the OMP_PROC_BIND, OMP_PLACES, or GOMP_CPU_AFFINITY environment variables.
+ */
+bool topology_should_pin(const Topology* T);
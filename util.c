@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "util.h"
@@ -53,6 +54,71 @@ double get_time_diff(struct timespec* start, struct timespec* end) {
     return diff;
 }
 
+/**
+ * Looks for the option --name or --name=value anywhere in the arguments. If it
+ * is found it is removed from argv (shifting the remaining arguments down and
+ * decrementing argc) and its value is returned ("" if no value was given).
+ * Returns NULL if the option was not given.
+ */
+const char* get_option(int* argc, const char* argv[], const char* name) {
+    size_t len = strlen(name);
+    for (int i = 1; i < *argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0 || strncmp(arg+2, name, len) != 0 ||
+            (arg[len+2] != '\0' && arg[len+2] != '=')) { continue; }
+        for (int j = i; j < *argc - 1; j++) { argv[j] = argv[j+1]; }
+        (*argc)--;
+        return arg[len+2] == '=' ? arg+len+3 : "";
+    }
+    return NULL;
+}
+
+/**
+ * Checks that none of the arguments left after the known options were taken
+ * out start with --.
+ */
+bool check_no_options(int argc, const char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) { return false; }
+    }
+    return true;
+}
+
+/**
+ * Parses a count given to an option. Returns false if it is not a positive
+ * whole number.
+ */
+bool parse_count(const char* str, size_t* count) {
+    char* end;
+    long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value <= 0) { return false; }
+    *count = (size_t)value;
+    return true;
+}
+
+/**
+ * Parses an OpenMP loop schedule of the form kind[,chunk] where kind is one of
+ * static, dynamic, or guided. The kind is returned as 1, 2, or 3 (the values
+ * of omp_sched_static, omp_sched_dynamic, and omp_sched_guided) and the chunk
+ * is 0 if it is not given. Returns false if the schedule is not recognized.
+ */
+bool parse_schedule(const char* str, int* kind, size_t* chunk) {
+    static const char* kinds[3] = {"static", "dynamic", "guided"};
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(kinds[i]);
+        if (strncmp(str, kinds[i], len) != 0) { continue; }
+        *kind = i + 1;
+        *chunk = 0;
+        if (str[len] == '\0') { return true; }
+        char* end;
+        long value = strtol(str + len + 1, &end, 10);
+        if (str[len] != ',' || *end != '\0' || value <= 0) { return false; }
+        *chunk = value;
+        return true;
+    }
+    return false;
+}
+
 // get_num_physical_cores() and get_num_logical_cores() have to be specialized
 // for each OS.
 #if defined(__APPLE__)
@@ -65,12 +131,56 @@ size_t __get_sysctl_size_t(const char* name) {
 size_t get_num_physical_cores() { return __get_sysctl_size_t("hw.physicalcpu"); }
 size_t get_num_logical_cores() { return __get_sysctl_size_t("hw.logicalcpu"); }
 size_t get_num_cores_affinity() { return get_num_logical_cores(); } // macOS doesn't really support affinity
+size_t get_cache_size(int level) {
+    static const char* names[3] = {"hw.l1dcachesize", "hw.l2cachesize", "hw.l3cachesize"};
+    return level >= 1 && level <= 3 ? __get_sysctl_size_t(names[level-1]) : 0;
+}
 #elif defined(linux)
 #include <unistd.h>
 #include <sched.h>
-size_t get_num_physical_cores() { return (sysconf(_SC_NPROCESSORS_ONLN) + 1) / 2; } // TODO: this assumes processor has 2 threads per core
+size_t get_num_physical_cores() {
+    // a core is counted by the first of its hardware threads, the sysfs list
+    // of a CPU's siblings (like "3,67" or "6-7") starts with the lowest one
+    size_t cores = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < cpus; cpu++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/topology/thread_siblings_list", cpu);
+        FILE* f = fopen(path, "r");
+        if (!f) { continue; } // offline
+        long first;
+        if (fscanf(f, "%ld", &first) == 1 && first == cpu) { cores++; }
+        fclose(f);
+    }
+    return cores > 0 ? cores : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+}
 size_t get_num_logical_cores() { return sysconf(_SC_NPROCESSORS_ONLN); }
 size_t get_num_cores_affinity() { cpu_set_t cs; CPU_ZERO(&cs); sched_getaffinity(0, sizeof(cs), &cs); return CPU_COUNT(&cs); }
+size_t get_cache_size(int level) {
+    long size = level == 1 ? sysconf(_SC_LEVEL1_DCACHE_SIZE) :
+                level == 2 ? sysconf(_SC_LEVEL2_CACHE_SIZE) :
+                level == 3 ? sysconf(_SC_LEVEL3_CACHE_SIZE) : 0;
+    if (size > 0) { return (size_t)size; }
+
+    // glibc may not know the caches (e.g. on ARM or in some VMs) but sysfs
+    // lists every cache of cpu0 with its level, type, and size (like "48K")
+    for (int index = 0; level >= 1 && level <= 3; index++) {
+        char path[128], type[32] = "";
+        int found_level = 0;
+        long kib = 0;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        FILE* f = fopen(path, "r");
+        if (!f) { break; }
+        if (fscanf(f, "%d", &found_level) != 1) { found_level = 0; }
+        fclose(f);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        if ((f = fopen(path, "r"))) { if (fscanf(f, "%31s", type) != 1) { type[0] = '\0'; } fclose(f); }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        if ((f = fopen(path, "r"))) { if (fscanf(f, "%ldK", &kib) != 1) { kib = 0; } fclose(f); }
+        if (found_level == level && strcmp(type, "Instruction") != 0 && kib > 0) { return (size_t)kib * 1024; }
+    }
+    return 0;
+}
 #else
 #error Unrecognized OS
 #endif
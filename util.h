@@ -5,6 +5,7 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <time.h>
 
 
@@ -32,7 +33,8 @@ void print_time(double seconds);
 double get_time_diff(struct timespec* start, struct timespec* end);
 
 /**
- * Get the number of physical cores on the machine.
+ * Get the number of physical cores on the machine (hardware threads of the
+ * same core are only counted once).
  */
 size_t get_num_physical_cores();
 
@@ -46,3 +48,38 @@ size_t get_num_logical_cores();
  * Get the number of cores dedicted to this process.
  */
 size_t get_num_cores_affinity();
+
+/**
+ * Get the size (in bytes) of the given level (1, 2, or 3) of data cache or 0
+ * if it cannot be determined.
+ */
+size_t get_cache_size(int level);
+
+/**
+ * Looks for the option --name or --name=value anywhere in the arguments. If it
+ * is found it is removed from argv (shifting the remaining arguments down and
+ * decrementing argc) and its value is returned ("" if no value was given).
+ * Returns NULL if the option was not given.
+ */
+const char* get_option(int* argc, const char* argv[], const char* name);
+
+/**
+ * Checks that none of the arguments left after taking out the known options
+ * with get_option() start with --, so an unknown option is reported as such
+ * instead of being taken as one of the other arguments.
+ */
+bool check_no_options(int argc, const char* argv[]);
+
+/**
+ * Parses a count given to an option, which must be a positive whole number.
+ * Returns false (leaving count as it is) if it is not.
+ */
+bool parse_count(const char* str, size_t* count);
+
+/**
+ * Parses an OpenMP loop schedule of the form kind[,chunk] where kind is one of
+ * static, dynamic, or guided. The kind is returned as 1, 2, or 3 (the values
+ * of omp_sched_static, omp_sched_dynamic, and omp_sched_guided) and the chunk
+ * is 0 if it is not given. Returns false if the schedule is not recognized.
+ */
+bool parse_schedule(const char* str, int* kind, size_t* chunk);